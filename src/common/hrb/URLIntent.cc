@@ -121,7 +121,7 @@ URLIntent::URLIntent(Action act) : m_action{act}, m_valid{act == Action::login |
 }
 
 URLIntent::URLIntent(Action act, std::string_view user, std::string_view coll, std::string_view name, std::string_view option) :
-	m_action{act}, m_user{trim(user)}, m_coll{trim(coll)}, m_filename{trim(name)}, m_option{option}
+	m_action{act}, m_user{trim(user, "/")}, m_coll{trim(coll, "/")}, m_filename{trim(name, "/")}, m_option{option}
 {
 	if (act == Action::api || act == Action::view)
 		m_valid = (m_filename.empty() || ObjectID::is_hex(m_filename));
@@ -183,7 +183,7 @@ void URLIntent::parse_field_from_right(std::string_view& target, hrb::URLIntent:
 	// collection must not contain '?' character, which denote the start of query string
 	else if (p == Parameter::collection && target.find('?') == target.npos)
 	{
-		m_coll = url_decode(trim(target));
+		m_coll = url_decode(trim(target, "/"));
 		target = std::string_view{};
 	}
 }
@@ -259,15 +259,6 @@ std::string URLIntent::str() const
 	return oss.str();
 }
 
-std::string_view URLIntent::trim(std::string_view s)
-{
-	while (!s.empty() && s.front() == '/')
-		s.remove_prefix(1);
-	while (!s.empty() && s.back() == '/')
-		s.remove_suffix(1);
-	return s;
-}
-
 URLIntent::Action URLIntent::parse_action(std::string_view str)
 {
 	// In the order of occurrence frequency
@@ -90,7 +90,6 @@ public:
 	explicit operator bool() const {return valid();}
 
 private:
-	static std::string_view trim(std::string_view s);
 	static Action parse_action(std::string_view str);
 	void parse_field_from_left(std::string_view& target, Parameter p);
 	void parse_field_from_right(std::string_view& target, Parameter p);
@@ -16,6 +16,12 @@
 
 #include <opencv2/imgcodecs.hpp>
 
+#include <boost/endian/buffers.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
 namespace hrb {
 
 cv::Mat load_image(BufferView raw)
@@ -26,6 +32,76 @@ cv::Mat load_image(BufferView raw)
 	);
 }
 
+cv::Mat load_image(BufferView raw, cv::Size fit, int flags)
+{
+	auto scale = 1;
+	if (auto size = jpeg_size(raw); size && fit.width > 0 && fit.height > 0)
+	{
+		// The EXIF orientation is applied after decoding, so the image may be rotated by 90
+		// degrees when it's resized. Use the ratio of whichever orientation is bigger.
+		auto ratio = std::max(
+			std::min(fit.width / static_cast<double>(size->width), fit.height / static_cast<double>(size->height)),
+			std::min(fit.width / static_cast<double>(size->height), fit.height / static_cast<double>(size->width))
+		);
+		while (scale < 8 && scale * 2 * ratio <= 1.0)
+			scale *= 2;
+	}
+
+	// The IMREAD_REDUCED_GRAYSCALE_* flags only contain the scale factor. Whether the
+	// image is decoded in color or not is still decided by the other flags.
+	switch (scale)
+	{
+		case 2: flags |= cv::IMREAD_REDUCED_GRAYSCALE_2; break;
+		case 4: flags |= cv::IMREAD_REDUCED_GRAYSCALE_4; break;
+		case 8: flags |= cv::IMREAD_REDUCED_GRAYSCALE_8; break;
+		default: break;
+	}
+
+	return cv::imdecode(
+		cv::Mat{1, static_cast<int>(raw.size()), CV_8U, const_cast<unsigned char*>(raw.data())},
+		flags
+	);
+}
+
+std::optional<cv::Size> jpeg_size(BufferView jpeg)
+{
+	// SOI marker
+	if (jpeg.size() < 4 || jpeg[0] != 0xFF || jpeg[1] != 0xD8)
+		return std::nullopt;
+
+	for (std::size_t pos = 2; pos + 4 <= jpeg.size(); )
+	{
+		if (jpeg[pos] != 0xFF)
+			return std::nullopt;
+
+		auto marker = jpeg[pos + 1];
+		pos += 2;
+
+		// fill bytes, and markers without length
+		if (marker == 0xFF)
+			pos--;
+		else if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD8))
+			continue;
+
+		// no SOF before EOI or SOS
+		else if (marker == 0xD9 || marker == 0xDA)
+			return std::nullopt;
+
+		// SOF0-SOF15, except DHT (0xC4), JPG (0xC8) and DAC (0xCC)
+		else if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC)
+		{
+			if (pos + 7 > jpeg.size())
+				return std::nullopt;
+
+			return cv::Size{jpeg[pos + 5] << 8 | jpeg[pos + 6], jpeg[pos + 3] << 8 | jpeg[pos + 4]};
+		}
+
+		// skip other segments, e.g. EXIF
+		else
+			pos += (jpeg[pos] << 8 | jpeg[pos + 1]);
+	}
+	return std::nullopt;
+}
 
 void to_json(nlohmann::json& dest, const ImageMeta& src)
 {
@@ -64,6 +140,68 @@ void from_json(const nlohmann::json& src, ImageMeta& dest)
 	}
 }
 
+namespace {
+
+// Increase it whenever the format or the way to deduce the meta data is changed, to make
+// the existing sidecar files stale.
+const std::uint32_t packed_meta_version = 1;
+const unsigned char packed_meta_magic[] = {'H', 'R', 'B', 'M'};
+
+enum PackedMetaFlags : unsigned char {has_phash = 1, has_original = 2};
+
+struct PackedMeta
+{
+	unsigned char                       magic[4];
+	boost::endian::little_uint32_buf_t  version;
+	boost::endian::little_uint64_buf_t  phash;
+	boost::endian::little_int64_buf_t   original;
+	boost::endian::little_int64_buf_t   uploaded;
+	boost::endian::little_uint16_buf_t  mime_size;
+	unsigned char                       flags;
+};
+static_assert(sizeof(PackedMeta) == 35);
+
+} // end of local namespace
+
+std::vector<unsigned char> ImageMeta::pack() const
+{
+	PackedMeta packed{};
+	std::memcpy(packed.magic, packed_meta_magic, sizeof(packed.magic));
+	packed.version   = packed_meta_version;
+	packed.phash     = m_phash ? m_phash->value() : 0;
+	packed.original  = m_original ? m_original->time_since_epoch().count() : 0;
+	packed.uploaded  = m_uploaded.time_since_epoch().count();
+	packed.mime_size = static_cast<std::uint16_t>(std::min<std::size_t>(m_mime.size(), std::numeric_limits<std::uint16_t>::max()));
+	packed.flags     = (m_phash ? has_phash : 0) | (m_original ? has_original : 0);
+
+	std::vector<unsigned char> result(sizeof(packed) + packed.mime_size.value());
+	std::memcpy(result.data(), &packed, sizeof(packed));
+	std::memcpy(result.data() + sizeof(packed), m_mime.data(), packed.mime_size.value());
+	return result;
+}
+
+std::optional<ImageMeta> ImageMeta::unpack(BufferView raw)
+{
+	PackedMeta packed{};
+	if (raw.size() < sizeof(packed))
+		return std::nullopt;
+
+	std::memcpy(&packed, raw.data(), sizeof(packed));
+	if (std::memcmp(packed.magic, packed_meta_magic, sizeof(packed.magic)) != 0 ||
+		packed.version.value() != packed_meta_version ||
+		raw.size() != sizeof(packed) + packed.mime_size.value())
+		return std::nullopt;
+
+	ImageMeta meta;
+	meta.m_mime.assign(reinterpret_cast<const char*>(raw.data() + sizeof(packed)), packed.mime_size.value());
+	if (packed.flags & has_phash)
+		meta.m_phash = PHash{packed.phash.value()};
+	if (packed.flags & has_original)
+		meta.m_original = Timestamp{Timestamp::duration{packed.original.value()}};
+	meta.m_uploaded = Timestamp{Timestamp::duration{packed.uploaded.value()}};
+	return meta;
+}
+
 ImageMeta::ImageMeta(BufferView master) :
 	m_mime{Magic::instance().mime(master)},
 	m_phash{std::invoke(
@@ -22,11 +22,21 @@
 #include <opencv2/core.hpp>
 
 #include <optional>
+#include <vector>
 
 namespace hrb {
 
 cv::Mat load_image(BufferView raw);
 
+/// Decode \a raw without copying it. JPEG images are decoded in reduced resolution by the
+/// largest DCT scale factor (2, 4 or 8) that still leaves the image big enough to be resized
+/// to fit in \a fit. Other images are decoded in full resolution. \a flags are the
+/// cv::ImreadModes except the IMREAD_REDUCED_* ones.
+cv::Mat load_image(BufferView raw, cv::Size fit, int flags);
+
+/// Width and height of a JPEG image from its SOF header, without decoding it.
+std::optional<cv::Size> jpeg_size(BufferView jpeg);
+
 class ImageMeta
 {
 public:
@@ -41,6 +51,11 @@ public:
 	friend void from_json(const nlohmann::json& src, ImageMeta& dest);
 	friend void to_json(nlohmann::json& dest, const ImageMeta& src);
 
+	/// Compact binary format of the meta data, e.g. for the sidecar file of the blob.
+	/// unpack() returns nullopt if \a raw is not packed by the same version of pack().
+	[[nodiscard]] std::vector<unsigned char> pack() const;
+	static std::optional<ImageMeta> unpack(BufferView raw);
+
 private:
 	std::string	                m_mime;			//!< Mime type of the master rendition
 	std::optional<PHash> 		m_phash;		//!< Phash of the master rendition (for images only)
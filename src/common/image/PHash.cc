@@ -11,6 +11,7 @@
 //
 
 #include "PHash.hh"
+#include "Image.hh"
 #include "util/MMap.hh"
 
 #include <opencv2/imgcodecs.hpp>
@@ -92,13 +93,13 @@ PHash phash(void *buf, std::size_t size)
 	if (size > static_cast<decltype(size)>(std::numeric_limits<int>::max()))
 		throw std::out_of_range("buffer too big");
 
-	auto input = imdecode(cv::Mat{1, static_cast<int>(size), CV_8U, buf}, cv::IMREAD_GRAYSCALE);
-	return input.data ? phash(input) : PHash{};
+	return phash(BufferView{static_cast<const unsigned char*>(buf), size});
 }
 
 PHash phash(BufferView image)
 {
-	auto input = imdecode(std::vector<unsigned char>(image.begin(), image.end()), cv::IMREAD_GRAYSCALE);
+	// The image is resized to 32x32 anyway, so there is no need to decode it in full resolution.
+	auto input = load_image(image, {32, 32}, cv::IMREAD_GRAYSCALE);
 	return input.data ? phash(input) : PHash{};
 }
 
@@ -0,0 +1,101 @@
+/*
+	Copyright © 2018 Wan Wai Ho <me@nestal.net>
+
+	This file is subject to the terms and conditions of the GNU General Public
+	License.  See the file COPYING in the main directory of the hearty_rabbit
+	distribution for more details.
+*/
+
+//
+// Created by nestal on 30/10/18.
+//
+
+#include "ByteRange.hh"
+#include "Escape.hh"
+
+#include <algorithm>
+#include <charconv>
+
+namespace hrb {
+
+namespace {
+
+// Clients seldom ask for more than a few ranges. Many small ranges cost more to send
+// than the whole resource.
+const std::size_t max_ranges = 16;
+
+std::optional<std::uint64_t> parse_number(std::string_view s)
+{
+	std::uint64_t result{};
+	auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), result);
+	if (s.empty() || ec != std::errc{} || end != s.data() + s.size())
+		return std::nullopt;
+	return result;
+}
+
+} // end of local namespace
+
+std::optional<std::vector<ByteRange>> parse_byte_ranges(std::string_view header, std::uint64_t size)
+{
+	std::string_view unit{"bytes="};
+	header = trim(header);
+	if (header.substr(0, unit.size()) != unit)
+		return std::nullopt;
+	header.remove_prefix(unit.size());
+
+	std::vector<ByteRange> result;
+	std::size_t count = 0;
+	while (!header.empty())
+	{
+		auto comma = header.find(',');
+		auto spec  = trim(header.substr(0, comma));
+		header.remove_prefix(comma == header.npos ? header.size() : comma + 1);
+
+		// empty list elements are allowed
+		if (spec.empty())
+			continue;
+		if (++count > max_ranges)
+			return std::nullopt;
+
+		auto dash = spec.find('-');
+		if (dash == spec.npos)
+			return std::nullopt;
+
+		// suffix-byte-range-spec, i.e. the last N bytes
+		if (dash == 0)
+		{
+			auto suffix = parse_number(spec.substr(1));
+			if (!suffix)
+				return std::nullopt;
+			if (*suffix > 0 && size > 0)
+				result.push_back({size - std::min(*suffix, size), std::min(*suffix, size)});
+			continue;
+		}
+
+		auto first = parse_number(spec.substr(0, dash));
+		auto last  = dash + 1 == spec.size() ? std::optional<std::uint64_t>{size - 1} : parse_number(spec.substr(dash + 1));
+		if (!first || !last || (dash + 1 < spec.size() && *last < *first))
+			return std::nullopt;
+
+		if (*first < size)
+			result.push_back({*first, std::min(*last, size - 1) - *first + 1});
+	}
+
+	if (count == 0)
+		return std::nullopt;
+
+	std::sort(result.begin(), result.end(), [](auto& r1, auto& r2){return r1.offset < r2.offset;});
+
+	// merge the overlapping or adjacent ranges
+	std::vector<ByteRange> merged;
+	for (auto&& range : result)
+	{
+		if (!merged.empty() && range.offset <= merged.back().last() + 1)
+			merged.back().length = std::max(merged.back().last(), range.last()) - merged.back().offset + 1;
+		else
+			merged.push_back(range);
+	}
+	return merged;
+}
+
+} // end of namespace hrb
@@ -0,0 +1,40 @@
+/*
+	Copyright © 2018 Wan Wai Ho <me@nestal.net>
+
+	This file is subject to the terms and conditions of the GNU General Public
+	License.  See the file COPYING in the main directory of the hearty_rabbit
+	distribution for more details.
+*/
+
+//
+// Created by nestal on 30/10/18.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+namespace hrb {
+
+/// \brief  A range of bytes in a resource requested by the Range HTTP header
+struct ByteRange
+{
+	std::uint64_t   offset;
+	std::uint64_t   length;
+
+	[[nodiscard]] std::uint64_t last() const {return offset + length - 1;}
+	bool operator==(const ByteRange&) const = default;
+};
+
+/// Parse the Range header for a resource of \a size bytes. See RFC7233 section 2.1.
+///
+/// The ranges are sorted, and overlapping or adjacent ones are merged. Ranges that start
+/// beyond the end of the resource are dropped, so an empty vector means none of them
+/// can be satisfied. std::nullopt means the header is invalid and should be ignored,
+/// e.g. other units than bytes or too many ranges.
+std::optional<std::vector<ByteRange>> parse_byte_ranges(std::string_view header, std::uint64_t size);
+
+} // end of namespace hrb
@@ -161,6 +161,15 @@ std::tuple<std::string_view, char> split_right(std::string_view& in, std::string
 	return std::make_tuple(result, match);
 }
 
+std::string_view trim(std::string_view in, std::string_view chars)
+{
+	auto first = in.find_first_not_of(chars);
+	if (first == in.npos)
+		return {};
+
+	return in.substr(first, in.find_last_not_of(chars) - first + 1);
+}
+
 std::string_view split_front_substring(std::string_view& in, std::string_view substring)
 {
 	// substr() will not throw even if "in" is empty and location==npos
@@ -62,6 +62,10 @@ std::tuple<std::string_view, char> split_left(std::string_view& in, std::string_
 std::tuple<std::string_view, char> split_right(std::string_view& in, std::string_view value);
 std::string_view split_front_substring(std::string_view& in, std::string_view substring);
 
+/// Remove the characters in \a chars from both ends of \a in. By default, they are the
+/// optional whitespaces (OWS) around a value in an HTTP header. See RFC7230 section 3.2.3.
+std::string_view trim(std::string_view in, std::string_view chars = " \t");
+
 template <std::size_t index, typename ResultTuple>
 void parse_token(std::string_view& remain, std::string_view value, ResultTuple& tuple)
 {
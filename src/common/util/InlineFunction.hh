@@ -0,0 +1,180 @@
+/*
+	Copyright © 2018 Wan Wai Ho <me@nestal.net>
+
+	This file is subject to the terms and conditions of the GNU General Public
+	License.  See the file COPYING in the main directory of the hearty_rabbit
+	distribution for more details.
+*/
+
+//
+// Created by nestal on 25/10/18.
+//
+
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace hrb {
+
+template <typename Signature, std::size_t Capacity = 128>
+class InlineFunction;
+
+/// \brief Move-only function wrapper with a large small-object buffer
+/// Like std::function, but function objects up to \a Capacity bytes are stored inside
+/// the wrapper instead of the heap. libstdc++'s std::function only stores two pointers
+/// inline, which is too small for most of the lambdas used as completion routines.
+/// Larger function objects are still supported by allocating them in the heap.
+/// The function objects do not need to be copyable.
+template <typename R, typename... Args, std::size_t Capacity>
+class InlineFunction<R(Args...), Capacity>
+{
+public:
+	/// Function objects of type \a F are stored inline.
+	template <typename F>
+	static constexpr bool is_inline_v =
+		sizeof(F) <= Capacity &&
+		alignof(F) <= alignof(std::max_align_t) &&
+		std::is_nothrow_move_constructible_v<F>;
+
+public:
+	InlineFunction() noexcept = default;
+	InlineFunction(std::nullptr_t) noexcept {}
+
+	template <
+		typename F,
+		typename = std::enable_if_t<
+			!std::is_same_v<std::decay_t<F>, InlineFunction> &&
+			std::is_invocable_r_v<R, std::decay_t<F>&, Args...>
+		>
+	>
+	InlineFunction(F&& func)
+	{
+		using Functor = std::decay_t<F>;
+		if constexpr (is_inline_v<Functor>)
+		{
+			::new (static_cast<void*>(&m_storage)) Functor(std::forward<F>(func));
+			m_ops = &inline_ops<Functor>;
+		}
+		else
+		{
+			::new (static_cast<void*>(&m_storage)) Functor*(new Functor(std::forward<F>(func)));
+			m_ops = &heap_ops<Functor>;
+		}
+	}
+
+	InlineFunction(InlineFunction&& other) noexcept
+	{
+		take(other);
+	}
+
+	InlineFunction(const InlineFunction&) = delete;
+	~InlineFunction() {reset();}
+
+	InlineFunction& operator=(InlineFunction&& other) noexcept
+	{
+		if (this != &other)
+		{
+			reset();
+			take(other);
+		}
+		return *this;
+	}
+
+	InlineFunction& operator=(std::nullptr_t) noexcept
+	{
+		reset();
+		return *this;
+	}
+
+	InlineFunction& operator=(const InlineFunction&) = delete;
+
+	R operator()(Args... args)
+	{
+		assert(m_ops);
+		return m_ops->invoke(&m_storage, std::forward<Args>(args)...);
+	}
+
+	explicit operator bool() const noexcept {return m_ops != nullptr;}
+
+	/// Whether the function object is stored inline, i.e. without allocating memory.
+	[[nodiscard]] bool is_inline() const noexcept {return m_ops && m_ops->is_inline;}
+
+	void swap(InlineFunction& other) noexcept
+	{
+		InlineFunction tmp{std::move(other)};
+		other = std::move(*this);
+		*this = std::move(tmp);
+	}
+
+private:
+	struct Ops
+	{
+		R (*invoke)(void *storage, Args&&... args);
+		void (*move)(void *src, void *dest) noexcept;   //!< move-construct to dest and destroy src
+		void (*destroy)(void *storage) noexcept;
+		bool is_inline;
+	};
+
+	template <typename Functor>
+	static constexpr Ops inline_ops{
+		[](void *storage, Args&&... args) -> R
+		{
+			return std::invoke(*static_cast<Functor*>(storage), std::forward<Args>(args)...);
+		},
+		[](void *src, void *dest) noexcept
+		{
+			auto func = static_cast<Functor*>(src);
+			::new (dest) Functor(std::move(*func));
+			func->~Functor();
+		},
+		[](void *storage) noexcept
+		{
+			static_cast<Functor*>(storage)->~Functor();
+		},
+		true
+	};
+
+	// The storage contains a pointer to the function object in the heap.
+	template <typename Functor>
+	static constexpr Ops heap_ops{
+		[](void *storage, Args&&... args) -> R
+		{
+			return std::invoke(**static_cast<Functor**>(storage), std::forward<Args>(args)...);
+		},
+		[](void *src, void *dest) noexcept
+		{
+			::new (dest) Functor*(*static_cast<Functor**>(src));
+		},
+		[](void *storage) noexcept
+		{
+			delete *static_cast<Functor**>(storage);
+		},
+		false
+	};
+
+	void reset() noexcept
+	{
+		if (m_ops)
+			std::exchange(m_ops, nullptr)->destroy(&m_storage);
+	}
+
+	void take(InlineFunction& other) noexcept
+	{
+		if (other.m_ops)
+		{
+			other.m_ops->move(&other.m_storage, &m_storage);
+			m_ops = std::exchange(other.m_ops, nullptr);
+		}
+	}
+
+private:
+	const Ops *m_ops{};
+	alignas(std::max_align_t) std::byte m_storage[Capacity];
+};
+
+} // end of namespace hrb
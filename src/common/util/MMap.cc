@@ -25,6 +25,7 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <unistd.h>
 
 namespace hrb {
 
@@ -70,10 +71,25 @@ MMap MMap::open(const fs::path& path, std::error_code& ec)
 	return result;
 }
 
-void MMap::mmap(int fd, std::size_t size, int prot, int flags, std::error_code& ec)
+MMap MMap::open(int fd, std::uint64_t offset, std::size_t size, std::error_code& ec)
+{
+	assert(offset % page_size() == 0);
+
+	MMap result;
+	result.mmap(fd, size, PROT_READ, MAP_SHARED, ec, offset);
+	return result;
+}
+
+std::size_t MMap::page_size()
+{
+	static const auto size = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+	return size;
+}
+
+void MMap::mmap(int fd, std::size_t size, int prot, int flags, std::error_code& ec, std::uint64_t offset)
 {
 	assert(!is_opened());
-	auto addr = ::mmap(nullptr, size, prot, flags, fd, 0);
+	auto addr = ::mmap(nullptr, size, prot, flags, fd, static_cast<off_t>(offset));
 	if (addr == MAP_FAILED)
 	{
 		m_mmap = nullptr;
@@ -18,6 +18,7 @@
 #include <boost/asio/buffer.hpp>
 
 #include <cstddef>
+#include <cstdint>
 #include <system_error>
 
 namespace hrb {
@@ -35,6 +36,9 @@ public:
 
 	static MMap open(int fd, std::error_code& ec);
 	static MMap open(const fs::path& path, std::error_code& ec);
+
+	/// Map \a size bytes of the file from \a offset, which must be a multiple of page_size().
+	static MMap open(int fd, std::uint64_t offset, std::size_t size, std::error_code& ec);
 	static MMap create(int fd, const void *data, std::size_t size, std::error_code& ec);
 	static MMap allocate(std::size_t size, std::error_code& ec);
 
@@ -51,8 +55,10 @@ public:
 	void swap(MMap& target) noexcept ;
 	void cache() const;
 
+	static std::size_t page_size();
+
 private:
-	void mmap(int fd, std::size_t size, int prot, int flags, std::error_code& ec);
+	void mmap(int fd, std::size_t size, int prot, int flags, std::error_code& ec, std::uint64_t offset = 0);
 
 private:
 	void *m_mmap{};         //!< Pointer to memory mapped file
@@ -0,0 +1,180 @@
+/*
+	Copyright © 2018 Wan Wai Ho <me@nestal.net>
+
+	This file is subject to the terms and conditions of the GNU General Public
+	License.  See the file COPYING in the main directory of the hearty_rabbit
+	distribution for more details.
+*/
+
+//
+// Created by nestal on 25/10/18.
+//
+
+#pragma once
+
+#include <boost/iterator/iterator_facade.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+namespace hrb {
+
+/// \brief FIFO queue in a circular buffer
+/// Unlike std::deque, which allocates and frees a block of elements from time to time as
+/// the elements are pushed and popped, the ring buffer only allocates when it is full.
+/// It grows by doubling its capacity and never shrinks, so a long-lived queue stops
+/// allocating memory after it has grown to its working size.
+///
+/// Growing moves the elements, so pushing an element invalidates all references to the
+/// other elements. Move an element out of the queue before calling anything that may
+/// push to it.
+template <typename T>
+class RingBuffer
+{
+private:
+	template <typename Value>
+	class Iterator : public boost::iterator_facade<
+		Iterator<Value>,
+		Value,
+		boost::random_access_traversal_tag
+	>
+	{
+	public:
+		Iterator() = default;
+		Iterator(RingBuffer *parent, std::size_t index) : m_parent{parent}, m_index{index} {}
+
+	private:
+		friend class boost::iterator_core_access;
+		[[nodiscard]] Value& dereference() const {return (*m_parent)[m_index];}
+		[[nodiscard]] bool equal(const Iterator& other) const {return m_index == other.m_index;}
+		void increment() {m_index++;}
+		void decrement() {m_index--;}
+		void advance(std::ptrdiff_t n) {m_index += n;}
+		[[nodiscard]] std::ptrdiff_t distance_to(const Iterator& other) const
+		{
+			return static_cast<std::ptrdiff_t>(other.m_index) - static_cast<std::ptrdiff_t>(m_index);
+		}
+
+	private:
+		RingBuffer  *m_parent{};
+		std::size_t m_index{};      //!< index relative to the front of the queue
+	};
+
+public:
+	using value_type = T;
+	using iterator = Iterator<T>;
+
+	RingBuffer() = default;
+	RingBuffer(RingBuffer&& other) noexcept :
+		m_data{std::exchange(other.m_data, nullptr)},
+		m_capacity{std::exchange(other.m_capacity, 0)},
+		m_head{std::exchange(other.m_head, 0)},
+		m_size{std::exchange(other.m_size, 0)}
+	{
+	}
+	RingBuffer(const RingBuffer&) = delete;
+	~RingBuffer()
+	{
+		clear();
+		std::allocator<T>{}.deallocate(m_data, m_capacity);
+	}
+
+	RingBuffer& operator=(RingBuffer&& other) noexcept
+	{
+		RingBuffer tmp{std::move(other)};
+		swap(tmp);
+		return *this;
+	}
+	RingBuffer& operator=(const RingBuffer&) = delete;
+
+	void swap(RingBuffer& other) noexcept
+	{
+		std::swap(m_data, other.m_data);
+		std::swap(m_capacity, other.m_capacity);
+		std::swap(m_head, other.m_head);
+		std::swap(m_size, other.m_size);
+	}
+
+	template <typename... Args>
+	T& emplace_back(Args&&... args)
+	{
+		if (m_size == m_capacity)
+			reserve(std::max<std::size_t>(m_capacity * 2, 8));
+
+		auto& back = *std::construct_at(slot(m_size), std::forward<Args>(args)...);
+		m_size++;
+		return back;
+	}
+
+	void push_back(T&& value) {emplace_back(std::move(value));}
+
+	void pop_front()
+	{
+		assert(!empty());
+		std::destroy_at(slot(0));
+		m_head = (m_head + 1) & (m_capacity - 1);
+		m_size--;
+	}
+
+	void clear() noexcept
+	{
+		while (m_size > 0)
+		{
+			std::destroy_at(slot(m_size - 1));
+			m_size--;
+		}
+		m_head = 0;
+	}
+
+	/// Make room for at least \a capacity elements. The capacity is always a power of 2.
+	void reserve(std::size_t capacity)
+	{
+		if (capacity <= m_capacity)
+			return;
+
+		auto new_capacity = std::max<std::size_t>(m_capacity, 1);
+		while (new_capacity < capacity)
+			new_capacity *= 2;
+
+		std::allocator<T> alloc;
+		auto data = alloc.allocate(new_capacity);
+		for (std::size_t i = 0; i < m_size; i++)
+		{
+			std::construct_at(data + i, std::move(*slot(i)));
+			std::destroy_at(slot(i));
+		}
+
+		alloc.deallocate(m_data, m_capacity);
+		m_data     = data;
+		m_capacity = new_capacity;
+		m_head     = 0;
+	}
+
+	[[nodiscard]] T& operator[](std::size_t index) {return *slot(index);}
+	[[nodiscard]] T& front() {assert(!empty()); return *slot(0);}
+	[[nodiscard]] T& back() {assert(!empty()); return *slot(m_size - 1);}
+
+	[[nodiscard]] iterator begin() {return {this, 0};}
+	[[nodiscard]] iterator end() {return {this, m_size};}
+
+	[[nodiscard]] std::size_t size() const noexcept {return m_size;}
+	[[nodiscard]] std::size_t capacity() const noexcept {return m_capacity;}
+	[[nodiscard]] bool empty() const noexcept {return m_size == 0;}
+
+private:
+	[[nodiscard]] T* slot(std::size_t index) const
+	{
+		return m_data + ((m_head + index) & (m_capacity - 1));
+	}
+
+private:
+	T           *m_data{};
+	std::size_t m_capacity{};   //!< always 0 or a power of 2
+	std::size_t m_head{};       //!< index of the front element in m_data
+	std::size_t m_size{};
+};
+
+} // end of namespace hrb
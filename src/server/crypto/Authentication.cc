@@ -17,6 +17,7 @@
 #include "util/Cookie.hh"
 #include "crypto/Random.hh"
 #include "net/Redis.hh"
+#include "net/ShardedPool.hh"
 #include "util/Error.hh"
 #include "util/Log.hh"
 
@@ -47,6 +48,40 @@ Salt random_salt()
 	return tmp.salt;
 }
 
+// Sessions are routed to the shards by their cookies
+std::string_view routing_key(const UserID::SessionID& cookie)
+{
+	return {reinterpret_cast<const char*>(cookie.data()), cookie.size()};
+}
+
+std::string session_key(const UserID::SessionID& cookie)
+{
+	std::string key{"session:"};
+	key.append(reinterpret_cast<const char*>(cookie.data()), cookie.size());
+	return key;
+}
+
+const redis::Script verify_session_script{"return {redis.call('GET', KEYS[1]), redis.call('TTL', KEYS[1])}"};
+
+// Check if the old session is already renewed and renew it atomically.
+
+// If the value of the old session key start with an underscore
+// that means it has not been renewed.
+
+// When renewing, expire the old session cookie in 30 seconds.
+// This is to avoid session error for the pending requests in the
+// pipeline. These requests should still be using the old session.
+const redis::Script renew_session_script{R"__(
+	if string.sub(redis.call('GET', KEYS[1]), 1, 1) == '_'
+	then
+		redis.call('SET', KEYS[1], '#' .. ARGV[1], 'EX', 30)
+		redis.call('SET', KEYS[2], '_' .. ARGV[1], 'EX', ARGV[2])
+		return 1
+	else
+		return 0
+	end
+)__"};
+
 const int min_iteration = 5000;
 const std::string default_hash_algorithm = "sha512";
 
@@ -74,7 +109,7 @@ template <typename Completion>
 void create_session(
 	Completion&& completion,
 	const std::string& username,
-	redis::Connection& db,
+	redis::ShardedConnection& db,
 	std::chrono::seconds session_length
 )
 {
@@ -82,7 +117,7 @@ void create_session(
 	// Session ID must be generated by cryptographically secure random number generator.
 	// Need more testing on Blake2x before using it.
 	UserID auth{secure_random<UserID::SessionID>(), username};
-	db.command(
+	db.at(routing_key(auth.session())).command(
 		[
 			auth,
 			completion = std::forward<Completion>(completion)
@@ -111,7 +146,7 @@ Authentication::Authentication(UserID::SessionID cookie, std::string_view user,
 void Authentication::add_user(
 	std::string_view username_mixed_case,
 	const Password& password,
-	redis::Connection& db,
+	redis::ShardedConnection& db,
 	std::function<void(std::error_code)> completion
 )
 {
@@ -122,7 +157,7 @@ void Authentication::add_user(
 	std::string username{username_mixed_case};
 	boost::algorithm::to_lower(username);
 
-	db.command(
+	db.at(username).command(
 		[completion=std::move(completion)](auto reply, auto&& ec)
 		{
 			if (!reply)
@@ -141,14 +176,15 @@ void Authentication::add_user(
 
 void Authentication::verify_session(
 	const UserID::SessionID& cookie,
-	redis::Connection& db,
+	redis::ShardedConnection& db,
 	std::chrono::seconds session_length,
 	std::function<void(std::error_code, UserID&&)>&& completion
 )
 {
-	static const char lua[] = "return {redis.call('GET', KEYS[1]), redis.call('TTL', KEYS[1])}";
-
-	db.command([
+	// The session may be cached for a while, so the TTL may be a bit longer than it actually
+	// is. It only delays renewing the session. The cached session will be dropped when it
+	// expires or is destroyed.
+	db.at(routing_key(cookie)).cached([
 			db=db.shared_from_this(),
 			comp=std::move(completion),
 			cookie, session_length
@@ -172,14 +208,15 @@ void Authentication::verify_session(
 				comp(ec, UserID{auth.m_uid});
 			}
 		},
-		"EVAL %s 1 session:%b", lua, cookie.data(), cookie.size()
+		{session_key(cookie)},
+		redis::CommandString{verify_session_script, "1 session:%b", cookie.data(), cookie.size()}
 	);
 }
 
 void Authentication::verify_user(
 	std::string_view username_mixed_case,
 	Password&& password,
-	redis::Connection& db,
+	redis::ShardedConnection& db,
 	std::chrono::seconds session_length,
 	std::function<void(std::error_code, UserID&&)> completion
 )
@@ -188,7 +225,8 @@ void Authentication::verify_user(
 	std::string username{username_mixed_case};
 	boost::algorithm::to_lower(username);
 
-	db.command(
+	// Users are seldom changed, so they can be read from replicas
+	db.read(username).command(
 		[
 			db=db.shared_from_this(),
 			username, session_length,
@@ -213,11 +251,13 @@ void Authentication::verify_user(
 }
 
 void Authentication::destroy_session(
-	redis::Connection& db,
+	redis::ShardedConnection& db,
 	std::function<void(std::error_code)>&& completion
 ) const
 {
-	db.command(
+	auto& shard = db.at(routing_key(id().session()));
+	shard.invalidate(session_key(id().session()));
+	shard.command(
 		[comp=std::move(completion)](redis::Reply&&, auto ec) mutable
 		{
 			comp(ec);
@@ -232,32 +272,20 @@ bool Authentication::valid() const
 }
 
 void Authentication::renew_session(
-	redis::Connection& db,
+	redis::ShardedConnection& db,
 	std::chrono::seconds session_length,
 	std::function<void(std::error_code, UserID&&)>&& completion
 ) const
 {
+	// The script changes both the old and the new session, so the new cookie must be
+	// in the same shard as the old one.
+	auto& shard = db.at(routing_key(id().session()));
 	auto new_cookie = secure_random<UserID::SessionID>();
+	while (db.find(routing_key(new_cookie)) != db.find(routing_key(id().session())))
+		new_cookie = secure_random<UserID::SessionID>();
 
-	// Check if the old session is already renewed and renew it atomically.
-
-	// If the value of the old session key start with an underscore
-	// that means it has not been renewed.
-
-	// When renewing, expire the old session cookie in 30 seconds.
-	// This is to avoid session error for the pending requests in the
-	// pipeline. These requests should still be using the old session.
-	static const char lua[] = R"__(
-		if string.sub(redis.call('GET', KEYS[1]), 1, 1) == '_'
-		then
-			redis.call('SET', KEYS[1], '#' .. ARGV[1], 'EX', 30)
-			redis.call('SET', KEYS[2], '_' .. ARGV[1], 'EX', ARGV[2])
-			return 1
-		else
-			return 0
-		end
-	)__";
-	db.command(
+	shard.invalidate(session_key(id().session()));
+	shard.command(
 		[comp=std::move(completion), *this, new_cookie](auto&& reply, auto ec)
 		{
 			// if error occurs or session already renewed, use the old session
@@ -272,12 +300,13 @@ void Authentication::renew_session(
 				comp(ec, UserID{new_cookie, id().username()});
 			}
 		},
-		"EVAL %s 2 session:%b session:%b %b %d",
-		lua,
-		id().session().data(), id().session().size(), // KEYS[1]: old session cookie
-		new_cookie.data(), new_cookie.size(),         // KEYS[2]: new session cookie
-		id().username().data(), id().username().size(),       // ARGV[1]: username
-		session_length                                // ARGV[2]: session length
+		redis::CommandString{
+			renew_session_script, "2 session:%b session:%b %b %d",
+			id().session().data(), id().session().size(), // KEYS[1]: old session cookie
+			new_cookie.data(), new_cookie.size(),         // KEYS[2]: new session cookie
+			id().username().data(), id().username().size(),       // ARGV[1]: username
+			session_length                                // ARGV[2]: session length
+		}
 	);
 }
 
@@ -23,11 +23,14 @@
 namespace hrb {
 
 namespace redis {
-class Connection;
+class ShardedConnection;
 }
 
 class Password;
 
+/// The keys of a user, e.g. "user:" and "shared_auth:", are stored in the shard of the
+/// user. Sessions are stored in the shard of their cookies, because the user is not
+/// known before reading the session.
 class Authentication
 {
 public:
@@ -46,21 +49,21 @@ public:
 	static void add_user(
 		std::string_view username_mixed_case,
 		const Password& password,
-		redis::Connection& db,
+		redis::ShardedConnection& db,
 		std::function<void(std::error_code)> completion
 	);
 
 	static void verify_user(
 		std::string_view username_mixed_case,
 		Password&& password,
-		redis::Connection& db,
+		redis::ShardedConnection& db,
 		std::chrono::seconds session_length,
 		std::function<void(std::error_code, UserID&&)> completion
 	);
 
 	static void verify_session(
 		const UserID::SessionID& cookie,
-		redis::Connection& db,
+		redis::ShardedConnection& db,
 		std::chrono::seconds session_length,
 		std::function<void(std::error_code, UserID&&)>&& completion
 	);
@@ -70,14 +73,14 @@ public:
 		std::string_view owner,
 		std::string_view resource,
 		Duration valid_period,
-		redis::Connection& db,
+		redis::ShardedConnection& db,
 		Complete&& comp
 	);
 
 	template <typename Complete>
 	void is_shared_resource(
 		std::string_view resource,
-		redis::Connection& db,
+		redis::ShardedConnection& db,
 		Complete&& comp
 	);
 
@@ -85,15 +88,56 @@ public:
 	static void list_guests(
 		std::string_view owner,
 		std::string_view resource,
-		redis::Connection& db,
+		redis::ShardedConnection& db,
 		Complete&& comp
 	);
 
 	void destroy_session(
-		redis::Connection& db,
+		redis::ShardedConnection& db,
 		std::function<void(std::error_code)>&& completion
 	) const;
 
+	// Awaitable versions of the functions above for coroutines. The result of co_await
+	// is the argument of the completion routine, or a tuple of them if there is more
+	// than one.
+	[[nodiscard]] static auto async_add_user(
+		std::string_view username_mixed_case,
+		const Password& password,
+		redis::ShardedConnection& db
+	);
+
+	[[nodiscard]] static auto async_verify_user(
+		std::string_view username_mixed_case,
+		Password&& password,
+		redis::ShardedConnection& db,
+		std::chrono::seconds session_length
+	);
+
+	[[nodiscard]] static auto async_verify_session(
+		const UserID::SessionID& cookie,
+		redis::ShardedConnection& db,
+		std::chrono::seconds session_length
+	);
+
+	template <typename Duration>
+	[[nodiscard]] static auto async_share_resource(
+		std::string_view owner,
+		std::string_view resource,
+		Duration valid_period,
+		redis::ShardedConnection& db
+	);
+
+	[[nodiscard]] auto async_is_shared_resource(std::string_view resource, redis::ShardedConnection& db);
+
+	/// The guests are returned in a vector, because the reply is gone after co_await.
+	[[nodiscard]] static auto async_list_guests(
+		std::string_view owner,
+		std::string_view resource,
+		redis::ShardedConnection& db
+	);
+
+	[[nodiscard]] auto async_destroy_session(redis::ShardedConnection& db) const;
+
 	const UserID& id() const {return m_uid;}
 
 	bool operator==(const Authentication& rhs) const {return m_uid == rhs.m_uid;}
@@ -101,7 +145,7 @@ public:
 
 private:
 	void renew_session(
-		redis::Connection& db,
+		redis::ShardedConnection& db,
 		std::chrono::seconds session_length,
 		std::function<void(std::error_code, UserID&&)>&& completion
 	) const;
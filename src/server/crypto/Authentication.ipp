@@ -13,9 +13,12 @@
 #pragma once
 
 #include "Authentication.hh"
+#include "crypto/Password.hh"
 #include "crypto/Random.hh"
 
 #include "net/Redis.hh"
+#include "net/ShardedPool.hh"
+#include "util/Coroutine.hh"
 #include "util/Log.hh"
 
 #include <boost/range/adaptor/filtered.hpp>
@@ -25,6 +28,9 @@
 #include <ctime>
 #include <limits>
 #include <chrono>
+#include <string>
+#include <tuple>
+#include <vector>
 
 namespace hrb {
 
@@ -33,14 +39,14 @@ void Authentication::share_resource(
 	std::string_view owner,
 	std::string_view resource,
 	Duration valid_period,
-	redis::Connection& db,
+	redis::ShardedConnection& db,
 	Complete&& comp
 )
 {
 	auto auth = insecure_random<UserID::SessionID>();
 	auto expired = std::chrono::system_clock::now() + valid_period;
 
-	db.command(
+	db.at(owner).command(
 		[
 			comp=std::forward<Complete>(comp),
 			owner=std::string{owner},
@@ -61,11 +67,11 @@ void Authentication::share_resource(
 template <typename Complete>
 void Authentication::is_shared_resource(
 	std::string_view resource,
-	redis::Connection& db,
+	redis::ShardedConnection& db,
 	Complete&& comp
 )
 {
-	db.command(
+	db.at(id().username()).command(
 		[comp=std::forward<Complete>(comp)](auto&& reply, auto ec)
 		{
 			comp(reply.to_int() > std::time(0), ec);
@@ -82,11 +88,11 @@ template <typename Complete>
 void Authentication::list_guests(
 	std::string_view owner,
 	std::string_view resource,
-	redis::Connection& db,
+	redis::ShardedConnection& db,
 	Complete&& comp
 )
 {
-	db.command(
+	db.at(owner).command(
 		[
 			comp=std::forward<Complete>(comp),
 			owner=std::string{owner}
@@ -117,4 +123,130 @@ void Authentication::list_guests(
 	);
 }
 
+inline auto Authentication::async_add_user(
+	std::string_view username_mixed_case,
+	const Password& password,
+	redis::ShardedConnection& db
+)
+{
+	return await_callback<std::error_code>(
+		[username=std::string{username_mixed_case}, &password, &db](auto&& complete)
+		{
+			add_user(username, password, db, std::forward<decltype(complete)>(complete));
+		}
+	);
+}
+
+inline auto Authentication::async_verify_user(
+	std::string_view username_mixed_case,
+	Password&& password,
+	redis::ShardedConnection& db,
+	std::chrono::seconds session_length
+)
+{
+	return await_callback<std::error_code, UserID>(
+		[
+			username=std::string{username_mixed_case}, password=std::move(password),
+			&db, session_length
+		](auto&& complete) mutable
+		{
+			verify_user(username, std::move(password), db, session_length, std::forward<decltype(complete)>(complete));
+		}
+	);
+}
+
+inline auto Authentication::async_verify_session(
+	const UserID::SessionID& cookie,
+	redis::ShardedConnection& db,
+	std::chrono::seconds session_length
+)
+{
+	return await_callback<std::error_code, UserID>([cookie, &db, session_length](auto&& complete)
+	{
+		verify_session(cookie, db, session_length, std::forward<decltype(complete)>(complete));
+	});
+}
+
+template <typename Duration>
+auto Authentication::async_share_resource(
+	std::string_view owner,
+	std::string_view resource,
+	Duration valid_period,
+	redis::ShardedConnection& db
+)
+{
+	auto auth = insecure_random<UserID::SessionID>();
+	auto expired = std::chrono::system_clock::now() + valid_period;
+
+	return db.at(owner).async_command(
+		redis::CommandString{
+			"HSET %b%b:%b %b %ld",
+			m_shared_auth_prefix.data(), m_shared_auth_prefix.size(),
+			owner.data(), owner.size(),
+			resource.data(), resource.size(),
+			auth.data(), auth.size(),
+			std::chrono::duration_cast<std::chrono::seconds>(expired.time_since_epoch()).count()
+		},
+		[owner=std::string{owner}, auth](redis::Reply&&, std::error_code ec)
+		{
+			return std::make_tuple(Authentication{auth, owner, true}, ec);
+		}
+	);
+}
+
+inline auto Authentication::async_is_shared_resource(std::string_view resource, redis::ShardedConnection& db)
+{
+	return db.at(id().username()).async_command(
+		redis::CommandString{
+			"HGET %b%b:%b %b",
+			m_shared_auth_prefix.data(), m_shared_auth_prefix.size(),
+			id().username().data(), id().username().size(),
+			resource.data(), resource.size(),
+			id().session().data(), id().session().size()
+		},
+		[](redis::Reply&& reply, std::error_code ec)
+		{
+			return std::make_tuple(reply.to_int() > std::time(0), ec);
+		}
+	);
+}
+
+inline auto Authentication::async_list_guests(
+	std::string_view owner,
+	std::string_view resource,
+	redis::ShardedConnection& db
+)
+{
+	return db.at(owner).async_command(
+		redis::CommandString{
+			"HGETALL %b%b:%b",
+			m_shared_auth_prefix.data(), m_shared_auth_prefix.size(),
+			owner.data(), owner.size(),
+			resource.data(), resource.size()
+		},
+		[owner=std::string{owner}](redis::Reply&& reply, std::error_code ec)
+		{
+			std::vector<Authentication> guests;
+			for (auto&& kv : reply.kv_pairs())
+			{
+				UserID::SessionID c{};
+				if (auto s = kv.key(); s.size() == c.size())
+				{
+					std::copy(s.begin(), s.end(), c.begin());
+					guests.emplace_back(c, owner, true);
+				}
+			}
+			return std::make_tuple(std::move(guests), ec);
+		}
+	);
+}
+
+inline auto Authentication::async_destroy_session(redis::ShardedConnection& db) const
+{
+	return await_callback<std::error_code>([*this, &db](auto&& complete)
+	{
+		destroy_session(db, std::forward<decltype(complete)>(complete));
+	});
+}
+
 } // end of namespace
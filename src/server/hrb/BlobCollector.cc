@@ -0,0 +1,290 @@
+/*
+	Copyright © 2018 Wan Wai Ho <me@nestal.net>
+
+	This file is subject to the terms and conditions of the GNU General Public
+	License.  See the file COPYING in the main directory of the hearty_rabbit
+	distribution for more details.
+*/
+
+//
+// Created by nestal on 2/12/18.
+//
+
+#include "BlobCollector.hh"
+#include "BlobVolumes.hh"
+#include "PackStore.hh"
+
+#include "util/Escape.hh"
+#include "util/Log.hh"
+
+#include <boost/asio/post.hpp>
+
+#include <algorithm>
+#include <cstring>
+
+namespace hrb {
+
+namespace {
+
+const std::size_t hash_count = 7;
+const std::size_t bits_per_blob = 10;
+
+struct Usage
+{
+	std::uint64_t       size{};
+	fs::file_time_type  modified{};
+};
+
+// Renditions are added to the blob directory after uploading, so the latest modification
+// time of all files is used instead of the master's.
+Usage usage(const fs::path& dir)
+{
+	std::error_code ec;
+	Usage result{0, last_write_time(dir, ec)};
+	for (auto&& file : fs::directory_iterator{dir, ec})
+	{
+		std::error_code ignore;
+		if (auto size = file.file_size(ignore); !ignore)
+			result.size += size;
+		if (auto modified = file.last_write_time(ignore); !ignore)
+			result.modified = std::max(result.modified, modified);
+	}
+	return result;
+}
+
+} // end of local namespace
+
+BlobCollector::LiveSet::LiveSet(std::size_t expected) :
+	m_bits(std::max<std::size_t>(1, (expected * bits_per_blob + 63) / 64))
+{
+}
+
+// Double hashing: the i-th bit is h1 + i * h2, where h1 and h2 are taken from the ID.
+template <typename Func>
+void BlobCollector::LiveSet::probe(const ObjectID& id, Func&& func) const
+{
+	std::uint64_t h1{}, h2{};
+	std::memcpy(&h1, id.data(), sizeof(h1));
+	std::memcpy(&h2, id.data() + sizeof(h1), sizeof(h2));
+	h2 |= 1;
+
+	for (std::size_t i = 0; i < hash_count; i++)
+	{
+		auto bit = (h1 + i * h2) % bits();
+		if (!func(bit / 64, std::uint64_t{1} << (bit % 64)))
+			break;
+	}
+}
+
+void BlobCollector::LiveSet::insert(const ObjectID& id)
+{
+	probe(id, [this](std::size_t word, std::uint64_t mask)
+	{
+		m_bits[word] |= mask;
+		return true;
+	});
+	m_count++;
+}
+
+bool BlobCollector::LiveSet::may_contain(const ObjectID& id) const
+{
+	bool result = true;
+	probe(id, [this, &result](std::size_t word, std::uint64_t mask)
+	{
+		return result = (m_bits[word] & mask) != 0;
+	});
+	return result;
+}
+
+BlobCollector::BlobCollector(
+	const BlobVolumes& volumes,
+	PackStore *pack,
+	std::chrono::seconds grace,
+	std::size_t rate,
+	bool dry_run
+) :
+	m_volumes{volumes},
+	m_pack{pack},
+	m_grace{grace},
+	m_rate{rate},
+	m_dry_run{dry_run}
+{
+}
+
+BlobCollector::~BlobCollector()
+{
+	{
+		std::unique_lock lock{m_mutex};
+		m_stopping = true;
+	}
+	m_stop.notify_all();
+	m_thread.join();
+}
+
+fs::file_time_type BlobCollector::cutoff(fs::file_time_type marked) const
+{
+	return marked - m_grace;
+}
+
+std::vector<BlobCollector::Candidate> BlobCollector::sweep(const LiveSet& live, fs::file_time_type marked)
+{
+	auto before = cutoff(marked);
+
+	std::vector<Candidate> result;
+	for (std::size_t volume = 0; volume < m_volumes.size() && !m_stopping; volume++)
+	{
+		std::error_code ec;
+		m_volumes.for_each_blob(volume, [this, &live, before, &result](auto& dir, auto& id)
+		{
+			m_scanned++;
+			if (!live.may_contain(id))
+			{
+				if (auto [size, modified] = usage(dir); modified < before)
+					result.push_back(Candidate{id, dir, size});
+			}
+			return !m_stopping;
+		}, ec);
+		if (ec)
+			Log(LOG_WARNING, "cannot sweep volume %1% (%2% %3%)", m_volumes.path(volume), ec, ec.message());
+	}
+
+	m_candidates += result.size();
+	return result;
+}
+
+std::size_t BlobCollector::remove(const std::vector<Candidate>& candidates, fs::file_time_type marked)
+{
+	auto before = cutoff(marked);
+
+	std::size_t count = 0;
+	std::vector<ObjectID> deleted;
+	for (auto&& blob : candidates)
+	{
+		if (m_stopping)
+			break;
+
+		if (m_dry_run)
+		{
+			Log(LOG_NOTICE, "blob %1% in %2% (%3% bytes) is not owned by anyone", to_hex(blob.id), blob.dir, blob.size);
+			count++;
+			m_bytes += blob.size;
+			continue;
+		}
+
+		throttle();
+		if (m_stopping)
+			break;
+
+		std::error_code ec;
+		if (remove(blob, before, ec))
+		{
+			deleted.push_back(blob.id);
+			count++;
+			m_bytes += blob.size;
+		}
+		else if (ec)
+			Log(LOG_WARNING, "cannot delete blob %1% (%2% %3%)", blob.dir, ec, ec.message());
+	}
+
+	if (m_pack && !deleted.empty())
+	{
+		std::error_code ec;
+		m_bytes += m_pack->remove_blobs(std::move(deleted), ec);
+		if (ec)
+			Log(LOG_WARNING, "cannot delete packed files of unowned blobs (%1% %2%)", ec, ec.message());
+	}
+
+	m_deleted += count;
+	m_passes++;
+	return count;
+}
+
+// The blob directory is renamed before deleting, so that it can be checked again without
+// racing with uploads. If the same blob is uploaded again after sweep(), it is moved into
+// the renamed directory or fails to find the directory. Either way it is not deleted.
+bool BlobCollector::remove(const Candidate& blob, fs::file_time_type before, std::error_code& ec)
+{
+	auto trash = fs::path{blob.dir.string() + ".gc"};
+	fs::rename(blob.dir, trash, ec);
+
+	// The blob may be moved to another volume by the rebalancer
+	if (ec == std::errc::no_such_file_or_directory)
+	{
+		ec.clear();
+		return false;
+	}
+	if (ec)
+		return false;
+
+	if (usage(trash).modified >= before)
+	{
+		Log(LOG_INFO, "blob %1% is uploaded again and will not be deleted", to_hex(blob.id));
+
+		// If the directory is created again by another upload, it will have the same blob
+		fs::rename(trash, blob.dir, ec);
+		if (ec)
+		{
+			ec.clear();
+			fs::remove_all(trash, ec);
+		}
+		return false;
+	}
+
+	fs::remove_all(trash, ec);
+	return !ec;
+}
+
+void BlobCollector::async_sweep(
+	LiveSet&& live,
+	fs::file_time_type marked,
+	const boost::asio::any_io_executor& executor,
+	SweepCompletion&& complete
+)
+{
+	boost::asio::post(m_thread, [
+		this, live=std::move(live), marked, executor, complete=std::move(complete)
+	]() mutable
+	{
+		boost::asio::post(executor, [result=sweep(live, marked), complete=std::move(complete)]() mutable
+		{
+			complete(std::move(result));
+		});
+	});
+}
+
+void BlobCollector::async_remove(
+	std::vector<Candidate>&& candidates,
+	fs::file_time_type marked,
+	const boost::asio::any_io_executor& executor,
+	RemoveCompletion&& complete
+)
+{
+	boost::asio::post(m_thread, [
+		this, candidates=std::move(candidates), marked, executor, complete=std::move(complete)
+	]() mutable
+	{
+		boost::asio::post(executor, [count=remove(candidates, marked), complete=std::move(complete)]() mutable
+		{
+			complete(count);
+		});
+	});
+}
+
+void BlobCollector::throttle()
+{
+	if (m_rate == 0)
+		return;
+
+	using namespace std::chrono;
+	m_next_delete = std::max(m_next_delete, steady_clock::now()) + duration_cast<steady_clock::duration>(seconds{1}) / m_rate;
+
+	std::unique_lock lock{m_mutex};
+	m_stop.wait_until(lock, m_next_delete, [this]{return m_stopping.load();});
+}
+
+BlobCollector::Stats BlobCollector::stats() const
+{
+	return {m_passes, m_scanned, m_candidates, m_deleted, m_bytes};
+}
+
+} // end of namespace hrb
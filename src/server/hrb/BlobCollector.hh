@@ -0,0 +1,154 @@
+/*
+	Copyright © 2018 Wan Wai Ho <me@nestal.net>
+
+	This file is subject to the terms and conditions of the GNU General Public
+	License.  See the file COPYING in the main directory of the hearty_rabbit
+	distribution for more details.
+*/
+
+//
+// Created by nestal on 2/12/18.
+//
+
+#pragma once
+
+#include "hrb/ObjectID.hh"
+#include "util/FS.hh"
+#include "util/InlineFunction.hh"
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/thread_pool.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace hrb {
+
+class BlobVolumes;
+class PackStore;
+
+/// \brief Deletes the blobs that are not owned by any user
+/// Garbage collection is done by mark and sweep. The caller marks the owned blobs by
+/// inserting the IDs in the \c blob-owners:* keys of all redis shards to a LiveSet. The
+/// collector then sweeps the volumes for the blobs that are not in the LiveSet. Blobs
+/// modified within \a grace before marking started are kept, because they may be uploaded
+/// but not yet added to a collection.
+///
+/// The LiveSet is a Bloom filter, so a few garbage blobs may be kept until the next pass,
+/// but owned blobs are never swept. The caller should still check the candidates in redis
+/// again before calling remove(), because the blobs may be owned after they are marked.
+class BlobCollector
+{
+public:
+	/// \brief Bloom filter of blob IDs
+	/// The blob IDs are hashes already, so the bits are indexed by the ID bytes directly.
+	class LiveSet
+	{
+	public:
+		/// About 10 bits per blob, i.e. 1% of false positives for \a expected blobs.
+		explicit LiveSet(std::size_t expected);
+
+		void insert(const ObjectID& id);
+		[[nodiscard]] bool may_contain(const ObjectID& id) const;
+		[[nodiscard]] std::size_t size() const {return m_count;}
+		[[nodiscard]] std::size_t bits() const {return m_bits.size() * 64;}
+
+	private:
+		template <typename Func>
+		void probe(const ObjectID& id, Func&& func) const;
+
+	private:
+		std::vector<std::uint64_t>  m_bits;
+		std::size_t                 m_count{};
+	};
+
+	struct Candidate
+	{
+		ObjectID        id;
+		fs::path        dir;
+		std::uint64_t   size;           //!< of all files in the blob directory
+	};
+
+	struct Stats
+	{
+		std::uint64_t   passes;
+		std::uint64_t   scanned;        //!< blobs in the volumes
+		std::uint64_t   candidates;     //!< blobs not in the LiveSet
+		std::uint64_t   deleted;        //!< or would be deleted in dry runs
+		std::uint64_t   bytes;          //!< of the deleted blobs
+	};
+
+	using SweepCompletion = InlineFunction<void(std::vector<Candidate>)>;
+	using RemoveCompletion = InlineFunction<void(std::size_t)>;
+
+public:
+	/// Delete at most \a rate blobs per second, or unlimited if it is 0. Only log the
+	/// blobs to be deleted if \a dry_run is true.
+	BlobCollector(
+		const BlobVolumes& volumes,
+		PackStore *pack,
+		std::chrono::seconds grace,
+		std::size_t rate,
+		bool dry_run
+	);
+	BlobCollector(BlobCollector&&) = delete;
+	BlobCollector(const BlobCollector&) = delete;
+	~BlobCollector();
+	BlobCollector& operator=(BlobCollector&&) = delete;
+	BlobCollector& operator=(const BlobCollector&) = delete;
+
+	/// The blobs not in \a live, and not modified within the grace period before \a marked,
+	/// i.e. the time marking started.
+	[[nodiscard]] std::vector<Candidate> sweep(const LiveSet& live, fs::file_time_type marked);
+
+	/// Delete the \a candidates, unless they are modified after sweep(). Returns the number
+	/// of blobs deleted.
+	std::size_t remove(const std::vector<Candidate>& candidates, fs::file_time_type marked);
+
+	/// Call sweep() in a background thread. \a complete is called by \a executor.
+	void async_sweep(
+		LiveSet&& live,
+		fs::file_time_type marked,
+		const boost::asio::any_io_executor& executor,
+		SweepCompletion&& complete
+	);
+
+	/// Call remove() in a background thread. \a complete is called by \a executor.
+	void async_remove(
+		std::vector<Candidate>&& candidates,
+		fs::file_time_type marked,
+		const boost::asio::any_io_executor& executor,
+		RemoveCompletion&& complete
+	);
+
+	[[nodiscard]] bool dry_run() const {return m_dry_run;}
+	[[nodiscard]] Stats stats() const;
+
+private:
+	[[nodiscard]] fs::file_time_type cutoff(fs::file_time_type marked) const;
+	bool remove(const Candidate& blob, fs::file_time_type before, std::error_code& ec);
+	void throttle();
+
+private:
+	const BlobVolumes&  m_volumes;
+	PackStore          *m_pack;
+	const std::chrono::seconds  m_grace;
+	const std::size_t   m_rate;
+	const bool          m_dry_run;
+
+	std::chrono::steady_clock::time_point m_next_delete{};
+
+	std::atomic<std::uint64_t> m_passes{}, m_scanned{}, m_candidates{}, m_deleted{}, m_bytes{};
+
+	std::atomic<bool>       m_stopping{false};
+	std::mutex              m_mutex;
+	std::condition_variable m_stop;
+
+	boost::asio::thread_pool    m_thread{1};
+};
+
+} // end of namespace hrb
@@ -24,49 +24,171 @@
 #include "util/Log.hh"
 #include "util/Magic.hh"
 
+#include <boost/asio/post.hpp>
+
+#include <algorithm>
+#include <chrono>
+
 namespace hrb {
 
-BlobDatabase::BlobDatabase(const Configuration& cfg) : m_cfg{cfg}
+BlobDatabase::BlobDatabase(const Configuration& cfg) :
+	m_cfg{cfg},
+	m_volumes{cfg.blob_volumes(), cfg.blob_path()},
+	m_meta_cache{cfg.meta_cache_entries()},
+	m_mmap_cache{cfg.mmap_cache_bytes()},
+	m_worker{cfg}
 {
 	if (exists(m_cfg.blob_path()) && !is_directory(m_cfg.blob_path()))
 		throw std::system_error(std::make_error_code(std::errc::file_exists));
 
 	if (!exists(m_cfg.blob_path()))
 		create_directories(m_cfg.blob_path());
+
+	if (m_cfg.rebalance_volumes() && m_volumes.size() > 1)
+		m_volumes.start_rebalance();
+
+	if (m_cfg.pack_threshold() > 0)
+	{
+		m_pack.emplace(m_cfg.blob_path()/"pack", m_cfg.pack_threshold());
+		auto stats = m_pack->stats();
+		Log(LOG_INFO, "%1% small files in %2% pack segments", stats.files, stats.segments);
+	}
+
+	if (m_cfg.scrub_rate() > 0)
+	{
+		m_scrubber.emplace(
+			m_volumes,
+			m_cfg.blob_path()/"scrub-cursor",
+			m_cfg.scrub_rate(),
+			m_cfg.scrub_interval(),
+			m_cfg.scrub_quarantine(),
+			[this](const ObjectID& id, std::string_view file){invalidate(id, file);}
+		);
+		m_scrubber->start();
+	}
+
+	if (m_cfg.gc_interval().count() > 0)
+		m_collector.emplace(
+			m_volumes,
+			m_pack ? &*m_pack : nullptr,
+			m_cfg.gc_grace(),
+			m_cfg.gc_rate(),
+			m_cfg.gc_dry_run()
+		);
+
+	if (m_cfg.async_blob_read())
+	{
+		m_reader.emplace(m_cfg.blob_read_threads());
+		Log(LOG_INFO, "reading blobs by %1%", AsyncFileReader::io_uring() ? "io_uring" : "thread pool");
+	}
+}
+
+std::optional<BlobScrubber::Stats> BlobDatabase::scrub_stats() const
+{
+	return m_scrubber ? std::make_optional(m_scrubber->stats()) : std::nullopt;
+}
+
+// Called by BlobScrubber after it deletes a corrupted file of the blob, or moves the
+// whole blob away if \a file is empty.
+void BlobDatabase::invalidate(const ObjectID& id, std::string_view file)
+{
+	if (file.empty())
+	{
+		m_mmap_cache.invalidate(id);
+		m_meta_cache.invalidate(id);
+	}
+	else if (file == "meta.json")
+		m_meta_cache.invalidate(id);
+	else
+		m_mmap_cache.invalidate(id, file);
+}
+
+void BlobDatabase::log_stats() const
+{
+	using namespace std::chrono;
+	for (auto&& volume : volume_stats())
+		Log(
+			LOG_NOTICE, "volume %1%: %2% reads, latency %3%us average %4%us max, %5%/%6% MB available",
+			volume.path, volume.reads,
+			duration_cast<microseconds>(volume.average_latency).count(),
+			duration_cast<microseconds>(volume.max_latency).count(),
+			volume.available / 1024 / 1024, volume.capacity / 1024 / 1024
+		);
+
+	auto mmap = mmap_cache_stats();
+	auto meta = meta_cache_stats();
+	Log(
+		LOG_NOTICE, "mmap cache: %1% hits %2% misses, meta cache: %3% hits %4% misses, %5% renditions pending",
+		mmap.hits, mmap.misses, meta.hits, meta.misses, rendition_backlog()
+	);
+
+	if (auto scrub = scrub_stats())
+		Log(
+			LOG_NOTICE, "scrubber: %1% passes, %2% blobs %3% MB checked, %4% corrupted, %5% repaired",
+			scrub->passes, scrub->blobs, scrub->bytes / 1024 / 1024, scrub->corrupted, scrub->repaired
+		);
+
+	if (m_collector)
+	{
+		auto gc = m_collector->stats();
+		Log(
+			LOG_NOTICE, "garbage collector: %1% passes, %2% blobs scanned, %3% candidates, %4% deleted (%5% MB)",
+			gc.passes, gc.scanned, gc.candidates, gc.deleted, gc.bytes / 1024 / 1024
+		);
+	}
 }
 
 void BlobDatabase::prepare_upload(UploadFile& result, std::error_code& ec) const
 {
 	boost::system::error_code err;
 
-	result.open(m_cfg.blob_path().string().c_str(), err);
+	result.open(m_cfg.blob_path().string().c_str(), err, &m_hasher);
 	if (err)
 		ec.assign(err.value(), err.category());
 }
 
 BlobFile BlobDatabase::save(UploadFile&& tmp, std::error_code& ec)
 {
-	return BlobFile{std::move(tmp), dest(tmp.ID()), ec};
+	boost::system::error_code err;
+	tmp.flush(err);
+	if (err)
+	{
+		ec.assign(err.value(), err.category());
+		return {};
+	}
+
+	auto id = tmp.ID();
+	return BlobFile{std::move(tmp), dest(id), ec, &m_meta_cache, m_pack ? &*m_pack : nullptr};
+}
+
+void BlobDatabase::generate_renditions(const BlobFile& blob)
+{
+	std::vector<std::string> renditions;
+	for (auto&& rendition : m_cfg.renditions().eager_renditions())
+	{
+		if (blob.need_generate(rendition, m_cfg.renditions()))
+			renditions.push_back(rendition);
+	}
+
+	if (!renditions.empty())
+		m_worker.generate_all(blob, renditions);
 }
 
 fs::path BlobDatabase::dest(const ObjectID& id, std::string_view) const
 {
-	auto hex = to_hex(id);
-	assert(hex.size() > 2);
-
-	return m_cfg.blob_path() / hex.substr(0, 2) / hex;
+	return m_volumes.dest(id);
 }
 
 BlobDatabase::BlobResponse BlobDatabase::meta(const ObjectID& id, unsigned version) const
 {
-	BlobFile blob_obj{dest(id), id};
+	auto blob_obj = find(id);
 	auto mmap = blob_obj.load_meta();
 	if (!mmap.is_opened())
 		return BlobResponse{http::status::not_found, version};
 
 	BlobResponse res{
 		std::piecewise_construct,
-		std::make_tuple(std::move(mmap)),
+		std::make_tuple(std::make_shared<const MMap>(std::move(mmap)), fs::path{}),
 		std::make_tuple(http::status::ok, version)
 	};
 	res.set(http::field::content_type, "application/json");
@@ -74,53 +196,160 @@ BlobDatabase::BlobResponse BlobDatabase::meta(const ObjectID& id, unsigned versi
 	return res;
 }
 
-BlobDatabase::BlobResponse BlobDatabase::response(
+void BlobDatabase::response(
 	const ObjectID& id,
 	unsigned version,
-	std::string_view etag,
-	std::string_view rendition
-) const
+	std::string_view rendition,
+	std::string_view accept,
+	const boost::asio::any_io_executor& executor,
+	ResponseCompletion&& complete
+)
 {
-	// validate rendition string
-	auto invalid = std::find_if(rendition.begin(), rendition.end(), [](char c)
+	if (!is_valid_rendition(rendition))
+		return complete(BlobResponse{http::status::bad_request, version});
+
+	// A cached rendition must have been generated already, so there is no need to check
+	// the file system.
+	auto name = rendition_file(rendition, accept);
+	if (auto cached = m_mmap_cache.find(id, name))
+		return complete(rendition_response(id, version, name, cached));
+
+	auto blob_obj = find(id);
+	if (!blob_obj.need_generate(name, m_cfg.renditions()))
+		return complete(rendition_response(id, version, name, open_rendition(id, name)));
+
+	m_worker.generate(blob_obj, name, [
+		this, id, version, name=std::string{name}, executor,
+		complete=std::move(complete)
+	](std::error_code) mutable
+	{
+		// The master rendition may be cached in place of the rendition before it was
+		// generated.
+		m_mmap_cache.invalidate(id, name);
+
+		// Don't try to generate the rendition again if it failed. The master rendition
+		// will be sent instead.
+		boost::asio::post(executor, [
+			this, id, version, name=std::move(name), complete=std::move(complete)
+		]() mutable
+		{
+			complete(rendition_response(id, version, name, open_rendition(id, name)));
+		});
+	});
+}
+
+// The name of the file that stores the rendition in the format negotiated with the client.
+// Formats that OpenCV cannot encode are ignored.
+std::string BlobDatabase::rendition_file(std::string_view rendition, std::string_view accept) const
+{
+	auto& cfg = m_cfg.renditions();
+	auto name = BlobFile::rendition_name(rendition, cfg);
+
+	// The master rendition is always sent as is
+	auto format = cfg.valid(name) ? cfg.negotiate(name, accept) : std::nullopt;
+	if (format && !BlobFile::can_encode(*format))
+		format.reset();
+
+	return RenditionSetting::file_name(name, format);
+}
+
+bool BlobDatabase::is_valid_rendition(std::string_view rendition)
+{
+	return std::all_of(rendition.begin(), rendition.end(), [](char c)
 	{
-		return !std::isalpha(c) && !std::isdigit(c);
+		return std::isalpha(c) || std::isdigit(c);
 	});
-	if (invalid != rendition.end())
-		return http::response<MMapResponseBody>{http::status::bad_request, version};
+}
 
+// Map an existing rendition, or the master rendition if it does not exist, and keep it
+// in the cache.
+std::optional<MMapCache::Entry> BlobDatabase::open_rendition(const ObjectID& id, std::string_view rendition) const
+{
 	std::error_code ec;
-	BlobFile blob_obj{dest(id), id};
-	auto mmap = blob_obj.rendition(rendition, m_cfg.renditions(), m_cfg.haar_path(), ec);
+	auto blob = find(id);
+	auto path = blob.rendition_path(rendition, m_cfg.renditions());
+
+	// Renditions in the pack store have no path of their own
+	auto start = std::chrono::steady_clock::now();
+	auto mmap = path.empty() ? blob.load_rendition(rendition, m_cfg.renditions(), ec) : MMap::open(path, ec);
 	if (ec)
-		return BlobResponse{http::status::not_found, version};
+		return std::nullopt;
 
 	// the mime type of the rendition may not be the same as the master rendition
 	// (which is stored in the meta data), so we need to deduce it again here.
+	// The mapping is lazy, so it is the first read of the file.
 	auto mime = Magic::instance().mime(mmap.blob());
+	if (!path.empty())
+		m_volumes.record_read(path, std::chrono::steady_clock::now() - start);
 
 	// Advice the kernel that we only read the memory in one pass
 	mmap.cache();
 
+	MMapCache::Entry entry{std::make_shared<const MMap>(std::move(mmap)), std::string{mime}, std::move(path)};
+	m_mmap_cache.store(id, rendition, entry);
+	return entry;
+}
+
+BlobDatabase::BlobResponse BlobDatabase::rendition_response(
+	const ObjectID& id,
+	unsigned version,
+	std::string_view rendition,
+	const std::optional<MMapCache::Entry>& entry
+) const
+{
+	if (!entry)
+		return BlobResponse{http::status::not_found, version};
+
+	// The master is sent in place of the renditions that cannot be generated, e.g. for
+	// blobs that are not images. It has the same ETag as other renditions in its format.
+	auto format = RenditionSetting::split(rendition).second;
+	if (format && entry->mime != RenditionSetting::mime(*format))
+		format.reset();
+
 	BlobResponse res{
 		std::piecewise_construct,
-		std::make_tuple(std::move(mmap)),
+		std::make_tuple(entry->mmap, entry->path),
 		std::make_tuple(http::status::ok, version)
 	};
-	res.set(http::field::content_type, mime);
-	set_cache_control(res, id);
+	res.body().reader = m_reader ? &*m_reader : nullptr;
+	res.set(http::field::content_type, entry->mime);
+	set_cache_control(res, id, format);
+
+	// Tell the browsers that the same URL may be sent in other formats
+	if (m_cfg.renditions().valid(rendition) && !m_cfg.renditions().find(rendition).formats.empty())
+		res.set(http::field::vary, "Accept");
 	return res;
 }
 
-void BlobDatabase::set_cache_control(BlobResponse& res, const ObjectID& id)
+void BlobDatabase::set_cache_control(BlobResponse& res, const ObjectID& id, std::optional<ImageFormat> format)
 {
 	res.set(http::field::cache_control, "private, max-age=31536000, immutable");
-	res.set(http::field::etag, to_quoted_hex(id));
+	res.set(http::field::etag, etag(id, format));
+}
+
+std::string BlobDatabase::etag(const ObjectID& id, std::optional<ImageFormat> format)
+{
+	return format ?
+		"\"" + to_hex(id) + "." + std::string{RenditionSetting::extension(*format)} + "\"" :
+		to_quoted_hex(id);
+}
+
+bool BlobDatabase::is_etag_of(std::string_view etag, const ObjectID& id)
+{
+	auto quoted = to_quoted_hex(id);
+	if (etag == quoted)
+		return true;
+
+	// "<blob ID>.<extension>"
+	quoted.pop_back();
+	quoted.push_back('.');
+	return etag.size() > quoted.size() + 1 && etag.starts_with(quoted) && etag.ends_with('"') &&
+		RenditionSetting::parse_format(etag.substr(quoted.size(), etag.size() - quoted.size() - 1));
 }
 
 BlobFile BlobDatabase::find(const ObjectID& id) const
 {
-	return {dest(id), id};
+	return {m_volumes.locate(id), id, &m_meta_cache, m_pack ? &*m_pack : nullptr};
 }
 
 double BlobDatabase::compare(const ObjectID& id1, const ObjectID& id2) const
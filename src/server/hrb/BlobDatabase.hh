@@ -12,10 +12,22 @@
 
 #pragma once
 
+#include "BlobCollector.hh"
+#include "BlobMetaCache.hh"
+#include "BlobScrubber.hh"
+#include "BlobVolumes.hh"
+#include "MMapCache.hh"
+#include "PackStore.hh"
+#include "RenditionWorker.hh"
+
 #include "hrb/ObjectID.hh"
+#include "net/AsyncFileReader.hh"
 #include "util/FS.hh"
+#include "util/InlineFunction.hh"
 #include "util/Size2D.hh"
 
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/thread_pool.hpp>
 #include <boost/beast/http/message.hpp>
 
 #include <optional>
@@ -28,12 +40,14 @@ class Configuration;
 class MMapResponseBody;
 class Magic;
 class UploadFile;
+enum class ImageFormat;
 
 /// \brief  On-disk database that stores the blobs in files and directories
 class BlobDatabase
 {
 public:
 	using BlobResponse = boost::beast::http::response<MMapResponseBody>;
+	using ResponseCompletion = InlineFunction<void(BlobResponse&&)>;
 
 public:
 	explicit BlobDatabase(const Configuration& cfg);
@@ -42,16 +56,40 @@ public:
 	BlobFile save(UploadFile&& tmp, std::error_code& ec);
 	[[nodiscard]] BlobFile find(const ObjectID& id) const;
 
+	/// Generate the eager renditions of a newly uploaded blob in the background.
+	void generate_renditions(const BlobFile& blob);
+	[[nodiscard]] std::size_t rendition_backlog() const {return m_worker.backlog();}
+	[[nodiscard]] auto meta_cache_stats() const {return m_meta_cache.stats();}
+	[[nodiscard]] auto mmap_cache_stats() const {return m_mmap_cache.stats();}
+	[[nodiscard]] auto volume_stats() const {return m_volumes.stats();}
+	[[nodiscard]] std::optional<BlobScrubber::Stats> scrub_stats() const;
+
+	/// Log the stats of the volumes, the caches, the scrubber and the garbage collector
+	void log_stats() const;
+
+	/// The garbage collector of the blobs, or nullptr if gc_interval_hours is not set
+	[[nodiscard]] BlobCollector* collector() {return m_collector ? &*m_collector : nullptr;}
+
 	[[nodiscard]] fs::path dest(const ObjectID& id, std::string_view rendition = {}) const;
 
-	[[nodiscard]] BlobResponse response(
+	/// The rendition is sent in another format if it is configured for the rendition and
+	/// the client accepts it, according to the \a accept header. It is generated by the
+	/// rendition worker if it does not exist. \a complete is called by \a executor in that
+	/// case. Otherwise it is called before this function returns.
+	void response(
 		const ObjectID& id,
 		unsigned version,
-		std::string_view etag,
-		std::string_view rendition = {}
-	) const;
+		std::string_view rendition,
+		std::string_view accept,
+		const boost::asio::any_io_executor& executor,
+		ResponseCompletion&& complete
+	);
 	[[nodiscard]] BlobResponse meta(const ObjectID& id, unsigned version) const;
 
+	/// The ETag of the blob, or the renditions of the blob in \a format
+	[[nodiscard]] static std::string etag(const ObjectID& id, std::optional<ImageFormat> format = {});
+	[[nodiscard]] static bool is_etag_of(std::string_view etag, const ObjectID& id);
+
 	template <class FwdIt>
 	auto find_similar(FwdIt first, FwdIt last, double threshold)
 	{
@@ -71,11 +109,43 @@ public:
 	}
 
 private:
-	static void set_cache_control(BlobResponse& res, const ObjectID& id);
+	static void set_cache_control(BlobResponse& res, const ObjectID& id, std::optional<ImageFormat> format = {});
+	static bool is_valid_rendition(std::string_view rendition);
+	[[nodiscard]] std::string rendition_file(std::string_view rendition, std::string_view accept) const;
+	[[nodiscard]] std::optional<MMapCache::Entry> open_rendition(const ObjectID& id, std::string_view rendition) const;
+	void invalidate(const ObjectID& id, std::string_view file);
+	[[nodiscard]] BlobResponse rendition_response(
+		const ObjectID& id,
+		unsigned version,
+		std::string_view rendition,
+		const std::optional<MMapCache::Entry>& entry
+	) const;
 	[[nodiscard]] double compare(const ObjectID& id1, const ObjectID& id2) const;
 
 private:
 	const Configuration&    m_cfg;
+	mutable BlobVolumes     m_volumes;
+
+	// The BlobFiles returned by find() refer to the cache, which is thread-safe.
+	mutable BlobMetaCache   m_meta_cache;
+	mutable MMapCache       m_mmap_cache;
+
+	// Only if pack_threshold_kb is set. It must outlive the rendition worker.
+	mutable std::optional<PackStore>    m_pack;
+
+	RenditionWorker         m_worker;
+
+	// Only if async_blob_read is enabled
+	mutable std::optional<AsyncFileReader>  m_reader;
+
+	// Hash the uploading blobs while they are being received
+	mutable boost::asio::thread_pool        m_hasher{2};
+
+	// Only if scrub_rate_mb is set. It must be destroyed before m_volumes.
+	std::optional<BlobScrubber>             m_scrubber;
+
+	// Only if gc_interval_hours is set. It must be destroyed before m_volumes and m_pack.
+	std::optional<BlobCollector>            m_collector;
 };
 
 } // end of namespace hrb
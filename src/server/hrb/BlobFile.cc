@@ -11,6 +11,8 @@
 //
 
 #include "BlobFile.hh"
+#include "BlobMetaCache.hh"
+#include "PackStore.hh"
 #include "UploadFile.hh"
 
 // HeartyRabbit headers
@@ -31,6 +33,11 @@
 #include <opencv2/imgcodecs.hpp>
 #include <opencv2/imgproc.hpp>
 
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <array>
+#include <cstdlib>
 #include <limits>
 #include <fstream>
 
@@ -39,6 +46,9 @@ namespace hrb {
 namespace {
 const std::string master_rendition = "master";
 
+// Binary meta data packed by ImageMeta::pack(). meta.json is only for the clients.
+const std::string meta_sidecar = "meta.bin";
+
 cv::Mat square_crop(const cv::Mat& image, const fs::path& haar_path)
 {
 	try
@@ -67,21 +77,50 @@ cv::Mat square_crop(const cv::Mat& image, const fs::path& haar_path)
 	return image(roi).clone();
 }
 
+std::string encoder_extension(ImageFormat format)
+{
+	return "." + std::string{RenditionSetting::extension(format)};
+}
+
+std::vector<int> encoder_params(ImageFormat format, int quality)
+{
+	switch (format)
+	{
+		case ImageFormat::webp: return {cv::IMWRITE_WEBP_QUALITY, quality};
+#if CV_VERSION_MAJOR > 4 || (CV_VERSION_MAJOR == 4 && CV_VERSION_MINOR >= 9)
+		case ImageFormat::avif: return {cv::IMWRITE_AVIF_QUALITY, quality};
+#endif
+		default: return {cv::IMWRITE_JPEG_QUALITY, quality};
+	}
+}
+
 } // end of local namespace
 
 /// \brief Open an existing blob in its directory
-BlobFile::BlobFile(const fs::path& dir, const ObjectID& id) : m_id{id}, m_dir{dir}
+BlobFile::BlobFile(const fs::path& dir, const ObjectID& id, BlobMetaCache *cache, PackStore *pack) :
+	m_id{id}, m_dir{dir}, m_cache{cache}, m_pack{pack}
 {
 }
 
 /// \brief Creates a new blob from a uploaded file
-BlobFile::BlobFile(UploadFile&& tmp, const fs::path& dir, std::error_code& ec)  : m_id{tmp.ID()}, m_dir{dir}
+BlobFile::BlobFile(UploadFile&& tmp, const fs::path& dir, std::error_code& ec, BlobMetaCache *cache, PackStore *pack) :
+	m_dir{dir}, m_cache{cache}, m_pack{pack}
 {
 	assert(!ec);
 	assert(tmp.is_open());
 
 	assert(tmp.native_handle() > 0);
 
+	boost::system::error_code bec;
+	tmp.flush(bec);
+	if (bec)
+	{
+		ec.assign(bec.value(), bec.category());
+		Log(LOG_WARNING, "BlobFile::upload(): cannot write temporary file %1% %2%", ec, ec.message());
+		return;
+	}
+	m_id = tmp.ID();
+
 	// Note: closing the file before munmap() is OK: the mapped memory will still be there.
 	// Details: http://pubs.opengroup.org/onlinepubs/7908799/xsh/mmap.html
 	auto master = MMap::open(tmp.native_handle(), ec);
@@ -112,74 +151,237 @@ BlobFile::BlobFile(UploadFile&& tmp, const fs::path& dir, std::error_code& ec)
 	}
 }
 
+// Write to a temporary file in the same directory and rename it to dest afterwards,
+// so that nobody can see a partially written rendition.
 template <typename Blob>
 void save_blob(const Blob& blob, const fs::path& dest, std::error_code& ec)
 {
 	assert(blob.data());
 	assert(blob.size() > 0);
 
-	boost::system::error_code bec;
-	boost::beast::file file;
-	file.open(dest.string().c_str(), boost::beast::file_mode::write, bec);
-	if (bec)
+	auto tmp = dest.string() + ".XXXXXX";
+	auto fd = ::mkstemp(tmp.data());
+	if (fd < 0)
 	{
-		Log(LOG_WARNING, "save_blob(): cannot open file %1% (%2% %3%)", dest, bec, bec.message());
+		ec.assign(errno, std::system_category());
+		Log(LOG_WARNING, "save_blob(): cannot create temp file for %1% (%2% %3%)", dest, ec, ec.message());
+		return;
 	}
+
+	// mkstemp() creates the file with 0600 permission, but renditions are readable like other files
+	::fchmod(fd, 0644);
+
+	boost::system::error_code bec;
+	boost::beast::file file;
+	file.native_handle(fd);
 	file.write(blob.data(), blob.size(), bec);
+	if (!bec)
+		file.close(bec);
+
 	if (bec)
 	{
-		Log(LOG_WARNING, "save_blob(): cannot write to file %1% (%2% %3%)", dest, bec, bec.message());
+		Log(LOG_WARNING, "save_blob(): cannot write to file %1% (%2% %3%)", tmp, bec, bec.message());
 		ec.assign(bec.value(), bec.category());
 	}
 	else
-		ec.assign(0, ec.category());
+		fs::rename(tmp, dest, ec);
+
+	// don't leave the temp file behind if anything failed
+	if (ec)
+	{
+		std::error_code remove_ec;
+		fs::remove(tmp, remove_ec);
+	}
+}
+
+std::string_view BlobFile::rendition_name(std::string_view rendition, const RenditionSetting& cfg)
+{
+	// check if rendition is allowed by config
+	return rendition == hrb::master_rendition || cfg.valid(rendition) ? rendition : cfg.default_rendition();
 }
 
 MMap BlobFile::rendition(std::string_view rendition, const RenditionSetting& cfg, const fs::path& haar_path, std::error_code& ec) const
 {
+	// generate the rendition if it doesn't exist
+	if (need_generate(rendition, cfg))
+		generate_rendition(rendition, cfg, haar_path, ec);
+
+	return load_rendition(rendition, cfg, ec);
+}
+
+MMap BlobFile::load_rendition(std::string_view rendition, const RenditionSetting& cfg, std::error_code& ec) const
+{
+	rendition = rendition_name(rendition, cfg);
+	if (rendition != hrb::master_rendition)
+	{
+		auto mmap = load_file(rendition, ec);
+		if (!ec)
+			return mmap;
+
+		// fall back to the master rendition
+		ec.clear();
+	}
+	return load_master(ec);
+}
+
+fs::path BlobFile::rendition_path(std::string_view rendition, const RenditionSetting& cfg) const
+{
+	rendition = rendition_name(rendition, cfg);
 	if (rendition == hrb::master_rendition)
-		return load_master(ec);
+		return m_dir/hrb::master_rendition;
 
-	// check if rendition is allowed by config
-	if (!cfg.valid(rendition))
-		rendition = cfg.default_rendition();
+	if (m_pack && m_pack->contains(m_id, rendition))
+		return {};
 
 	auto rend_path = m_dir/std::string{rendition};
+	return exists(rend_path) ? rend_path : m_dir/hrb::master_rendition;
+}
 
-	// generate the rendition if it doesn't exist
-	if (!exists(rend_path) && is_image())
-		generate_image_rendition(cfg.find(rendition), rend_path, haar_path, ec);
+bool BlobFile::need_generate(std::string_view rendition, const RenditionSetting& cfg) const
+{
+	rendition = rendition_name(rendition, cfg);
+	return rendition != hrb::master_rendition && !has_file(rendition) && is_image();
+}
 
-	return exists(rend_path) ? MMap::open(rend_path, ec) : load_master(ec);
+void BlobFile::generate_rendition(std::string_view rendition, const RenditionSetting& cfg, const fs::path& haar_path, std::error_code& ec) const
+{
+	generate_renditions({std::string{rendition}}, cfg, haar_path, [&ec](auto, auto err)
+	{
+		ec = err;
+	});
 }
 
-void BlobFile::generate_image_rendition(const JPEGRenditionSetting& cfg, const fs::path& dest, const fs::path& haar_path, std::error_code& ec) const
+void BlobFile::generate_renditions(
+	std::vector<std::string> renditions,
+	const RenditionSetting& cfg,
+	const fs::path& haar_path,
+	const RenditionDone& done
+) const
 {
-	auto jpeg = cv::imread((m_dir/hrb::master_rendition).string(), cv::IMREAD_ANYCOLOR);
-	if (!jpeg.empty())
+	for (auto&& rendition : renditions)
+	{
+		rendition = std::string{rendition_name(rendition, cfg)};
+		assert(rendition != hrb::master_rendition);
+	}
+
+	if (renditions.empty())
+		return;
+
+	// Generate the bigger renditions first, so the smaller ones can be resized from them
+	// instead of the master.
+	std::sort(renditions.begin(), renditions.end(), [&cfg](auto& rend1, auto& rend2)
+	{
+		return cfg.dimension(rend1).area() > cfg.dimension(rend2).area();
+	});
+
+	// Decode the master from the memory map without reading it into another buffer. It
+	// only needs to be big enough for the biggest rendition.
+	std::error_code ec;
+	auto mmap = load_master(ec);
+	auto biggest = cfg.dimension(renditions.front());
+	auto master = ec ? cv::Mat{} : load_image(mmap.buffer(), {biggest.width(), biggest.height()}, cv::IMREAD_ANYCOLOR);
+	if (master.empty())
+	{
+		Log(LOG_WARNING, "BlobFile::generate_renditions(): Cannot open master rendition at %1%", m_dir);
+		for (auto&& rendition : renditions)
+			done(rendition, ec ? ec : std::make_error_code(std::errc::io_error));
+		return;
+	}
+
+	std::vector<cv::Mat> resized{master};
+	for (auto&& rendition : renditions)
 	{
-		auto ratio = std::min(
-			cfg.dim.width() / static_cast<double>(jpeg.cols),
-			cfg.dim.height() / static_cast<double>(jpeg.rows)
-		);
+		auto& setting = cfg.find(rendition);
+		auto ratio = std::min({
+			setting.dim.width() / static_cast<double>(master.cols),
+			setting.dim.height() / static_cast<double>(master.rows),
+			1.0
+		});
+		cv::Size size{
+			std::max(static_cast<int>(master.cols * ratio + 0.5), 1),
+			std::max(static_cast<int>(master.rows * ratio + 0.5), 1)
+		};
+
+		// The smallest image that is not smaller than the rendition. The master is always one.
+		auto src = std::find_if(resized.rbegin(), resized.rend(), [size](auto& image)
+		{
+			return image.cols >= size.width && image.rows >= size.height;
+		});
+		assert(src != resized.rend());
 
 		cv::Mat out;
-		if (ratio < 1.0)
-			cv::resize(jpeg, out, {}, ratio, ratio, cv::INTER_LINEAR);
+		if (src->cols > size.width || src->rows > size.height)
+		{
+			cv::resize(*src, out, size, 0, 0, cv::INTER_LINEAR);
+			resized.push_back(out);
+		}
 		else
-			out = jpeg;
+			out = *src;
 
-		if (cfg.square_crop)
-			out = square_crop(out, haar_path);
+		std::error_code ec;
+		save_rendition(out, setting, rendition, haar_path, ec);
+		done(rendition, ec);
+	}
+}
 
-		std::vector<unsigned char> out_buf;
-		cv::imencode(mime() == "image/png" ? ".png" : ".jpg", out, out_buf, {cv::IMWRITE_JPEG_QUALITY, cfg.quality});
-		save_blob(out_buf, dest, ec);
+void BlobFile::save_rendition(cv::Mat image, const ImageRenditionSetting& cfg, std::string_view rendition, const fs::path& haar_path, std::error_code& ec) const
+{
+	// The format is the extension of the rendition file, if any. Otherwise PNG masters
+	// are kept in PNG, and others are converted to JPEG.
+	auto format = RenditionSetting::split(rendition).second;
+	if (format && !can_encode(*format))
+	{
+		ec = std::make_error_code(std::errc::not_supported);
+		return;
 	}
+
+	if (cfg.square_crop)
+		image = square_crop(image, haar_path);
+
+	std::vector<unsigned char> out_buf;
+	if (format)
+		cv::imencode(encoder_extension(*format), image, out_buf, encoder_params(*format, cfg.quality));
+	else
+		cv::imencode(mime() == "image/png" ? ".png" : ".jpg", image, out_buf, {cv::IMWRITE_JPEG_QUALITY, cfg.quality});
+	save_file(rendition, {out_buf.data(), out_buf.size()}, ec);
+}
+
+bool BlobFile::can_encode(ImageFormat format)
+{
+	static const std::array<bool, 3> supported{
+		cv::haveImageWriter(encoder_extension(ImageFormat::jpeg)),
+		cv::haveImageWriter(encoder_extension(ImageFormat::webp)),
+		cv::haveImageWriter(encoder_extension(ImageFormat::avif))
+	};
+	auto index = static_cast<std::size_t>(format);
+	return index < supported.size() && supported[index];
+}
+
+// Small files go to the pack store if there is one. Others are saved in the blob directory.
+void BlobFile::save_file(std::string_view name, BufferView data, std::error_code& ec) const
+{
+	if (m_pack && m_pack->accept(name, data.size()))
+		m_pack->store(m_id, name, data, ec);
 	else
+		save_blob(data, m_dir/std::string{name}, ec);
+}
+
+// Files saved before the pack store is enabled are still in the blob directory.
+MMap BlobFile::load_file(std::string_view name, std::error_code& ec) const
+{
+	if (m_pack)
 	{
-		Log(LOG_WARNING, "BlobFile::generate_image_rendition(): Cannot open master rendition at %1%", m_dir);
+		auto mmap = m_pack->load(m_id, name, ec);
+		if (!ec)
+			return mmap;
+		ec.clear();
 	}
+	return MMap::open(m_dir/std::string{name}, ec);
+}
+
+bool BlobFile::has_file(std::string_view name) const
+{
+	return (m_pack && m_pack->contains(m_id, name)) || exists(m_dir/std::string{name});
 }
 
 MMap BlobFile::load_master(std::error_code& ec) const
@@ -187,6 +389,11 @@ MMap BlobFile::load_master(std::error_code& ec) const
 	return MMap::open(m_dir/hrb::master_rendition, ec);
 }
 
+bool BlobFile::has_master() const
+{
+	return exists(m_dir/hrb::master_rendition);
+}
+
 bool BlobFile::is_image(std::string_view mime)
 {
 	std::string_view image{"image"};
@@ -220,11 +427,25 @@ nlohmann::json BlobFile::meta_json() const
 
 void BlobFile::update_meta() const
 {
+	if (m_meta.has_value())
+		return;
+
+	// Most of the time it's in the cache, without touching the file system
+	if (m_cache)
+		m_meta = m_cache->find(m_id);
+
+	// Then the sidecar file. It will be deduced again if it's written by an older version.
+	std::error_code ec;
 	if (!m_meta.has_value())
+		if (auto sidecar = load_file(meta_sidecar, ec); !ec)
+			m_meta = ImageMeta::unpack(sidecar.buffer());
+
+	// Blobs uploaded by older versions only have meta.json. Some of them have no phash
+	// or original datetime, which are deduced from the master below.
+	if (!m_meta.has_value() && !has_file(meta_sidecar))
 	{
 		try
 		{
-			// try to load it from meta.json
 			std::ifstream meta_file{m_dir/"meta.json"};
 			nlohmann::json meta;
 
@@ -232,16 +453,26 @@ void BlobFile::update_meta() const
 				meta_file >> meta;
 
 			if (meta_file && meta.is_object())
-				m_meta.emplace(meta.get<ImageMeta>());
+			{
+				auto legacy = meta.get<ImageMeta>();
+				if (legacy.phash().has_value() && legacy.original_timestamp().has_value())
+				{
+					m_meta.emplace(std::move(legacy));
+					save_meta();
+				}
+			}
 		}
 		catch (nlohmann::json::exception& e)
 		{
 			Log(LOG_WARNING, "json parse error @ file %1%: %2%", m_dir, e.what());
 		}
+	}
 
-		// some meta field is still missing, we need to deduce the meta
+	if (!m_meta.has_value())
 		deduce_meta({});
-	}
+
+	else if (m_cache)
+		m_cache->store(m_id, *m_meta);
 }
 
 MMap BlobFile::deduce_meta(MMap&& master) const
@@ -251,14 +482,31 @@ MMap BlobFile::deduce_meta(MMap&& master) const
 
 	// emplace() will destroy the original object if any
 	m_meta.emplace(master.buffer());
+	save_meta();
 
-	// save the meta data to file
-	std::ofstream meta_file{(m_dir/"meta.json").string()};
-	meta_file << nlohmann::json(*m_meta);
+	if (m_cache)
+		m_cache->store(m_id, *m_meta);
 
 	return std::move(master);
 }
 
+// Save the meta data to the sidecar file, and meta.json for the clients.
+void BlobFile::save_meta() const
+{
+	assert(m_meta.has_value());
+
+	std::error_code ec;
+	auto packed = m_meta->pack();
+	save_file(meta_sidecar, {packed.data(), packed.size()}, ec);
+	if (ec)
+		Log(LOG_WARNING, "cannot save meta data of %1% (%2% %3%)", to_hex(m_id), ec, ec.message());
+
+	auto json = nlohmann::json(*m_meta).dump();
+	save_file("meta.json", {reinterpret_cast<const unsigned char*>(json.data()), json.size()}, ec);
+	if (ec)
+		Log(LOG_WARNING, "cannot save meta.json of %1% (%2% %3%)", to_hex(m_id), ec, ec.message());
+}
+
 Timestamp BlobFile::original_datetime() const
 {
 	update_meta();
@@ -288,11 +536,13 @@ MMap BlobFile::master(MMap&& master) const
 MMap BlobFile::load_meta() const
 {
 	std::error_code ec;
-	auto mmap = MMap::open(m_dir/"meta.json", ec);
+	auto mmap = load_file("meta.json", ec);
 	if (ec)
 	{
-		deduce_meta({});
-		mmap = MMap::open(m_dir/"meta.json", ec);
+		ec.clear();
+		update_meta();
+		save_meta();
+		mmap = load_file("meta.json", ec);
 	}
 
 	// log error because we are going to ignore it
@@ -14,6 +14,7 @@
 
 #include "hrb/ObjectID.hh"
 #include "util/Timestamp.hh"
+#include "util/BufferView.hh"
 
 #include "image/Image.hh"
 #include "util/Size2D.hh"
@@ -21,13 +22,21 @@
 #include "util/MMap.hh"
 
 #include <nlohmann/json.hpp>
+#include <opencv2/core.hpp>
+
 #include <system_error>
 #include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
 
 namespace hrb {
 
+class BlobMetaCache;
+class PackStore;
 class RenditionSetting;
-class JPEGRenditionSetting;
+struct ImageRenditionSetting;
+enum class ImageFormat;
 class UploadFile;
 
 /// \brief  On-disk representation of a blob
@@ -40,17 +49,41 @@ class UploadFile;
 /// is responsible for managing this directory. It generates the renditions when they
 /// are required and save them in the directory.
 ///
+/// Small renditions and meta data are stored in the PackStore instead of the directory,
+/// if one is given and the file is small enough.
+///
 /// BlobDatabase is responsible for assigning different directories to different blobs.
 class BlobFile
 {
 public:
 	BlobFile() = default;
-	BlobFile(const fs::path& dir, const ObjectID& id);
-	BlobFile(UploadFile&& tmp, const fs::path& dir, std::error_code& ec);
+	BlobFile(const fs::path& dir, const ObjectID& id, BlobMetaCache *cache = nullptr, PackStore *pack = nullptr);
+	BlobFile(UploadFile&& tmp, const fs::path& dir, std::error_code& ec, BlobMetaCache *cache = nullptr, PackStore *pack = nullptr);
 
 	// if the rendition does not exists but it's a valid one, it will be generated dynamically
 	MMap rendition(std::string_view rendition, const RenditionSetting& cfg, const fs::path& haar_path, std::error_code& ec) const;
+
+	// same as rendition(), but return the master rendition instead of generating it
+	MMap load_rendition(std::string_view rendition, const RenditionSetting& cfg, std::error_code& ec) const;
+
+	// path of the file that load_rendition() will load, or empty if it is in the PackStore
+	fs::path rendition_path(std::string_view rendition, const RenditionSetting& cfg) const;
+	bool need_generate(std::string_view rendition, const RenditionSetting& cfg) const;
+	void generate_rendition(std::string_view rendition, const RenditionSetting& cfg, const fs::path& haar_path, std::error_code& ec) const;
+
+	// decode the master rendition once and generate all \a renditions from it. \a done is called after each of them is saved,
+	// or with std::errc::io_error if the master cannot be decoded.
+	using RenditionDone = std::function<void(std::string_view rendition, std::error_code ec)>;
+	void generate_renditions(std::vector<std::string> renditions, const RenditionSetting& cfg, const fs::path& haar_path, const RenditionDone& done) const;
+
+	// the rendition that will be loaded for the requested one, i.e. the default rendition if it is invalid
+	static std::string_view rendition_name(std::string_view rendition, const RenditionSetting& cfg);
+
+	// whether OpenCV is built with the encoder of \a format
+	static bool can_encode(ImageFormat format);
+
 	MMap load_master(std::error_code& ec) const;
+	bool has_master() const;
 
 	const ObjectID& ID() const {return m_id;}
 	std::string_view mime() const;
@@ -67,9 +100,13 @@ public:
 
 private:
 	static bool is_image(std::string_view mime);
-	void generate_image_rendition(const JPEGRenditionSetting& cfg, const fs::path& dest, const fs::path& haar_path, std::error_code& ec) const;
+	void save_rendition(cv::Mat image, const ImageRenditionSetting& cfg, std::string_view rendition, const fs::path& haar_path, std::error_code& ec) const;
+	void save_file(std::string_view name, BufferView data, std::error_code& ec) const;
+	MMap load_file(std::string_view name, std::error_code& ec) const;
+	bool has_file(std::string_view name) const;
 	void update_meta() const;
 	MMap deduce_meta(MMap&& master) const;
+	void save_meta() const;
 	MMap master(MMap&& master) const;
 
 private:
@@ -77,6 +114,8 @@ private:
 	fs::path    m_dir;				//!< The directory in file system that stores all renditions of the blob
 
 	mutable std::optional<ImageMeta>	m_meta;
+	BlobMetaCache                       *m_cache{};     //!< optional
+	PackStore                           *m_pack{};      //!< optional
 };
 
 } // end of namespace hrb
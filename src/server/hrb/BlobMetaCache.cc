@@ -0,0 +1,99 @@
+/*
+	Copyright © 2018 Wan Wai Ho <me@nestal.net>
+
+	This file is subject to the terms and conditions of the GNU General Public
+	License.  See the file COPYING in the main directory of the hearty_rabbit
+	distribution for more details.
+*/
+
+//
+// Created by nestal on 27/10/18.
+//
+
+#include "BlobMetaCache.hh"
+
+#include <algorithm>
+
+namespace hrb {
+
+BlobMetaCache::BlobMetaCache(std::size_t max_entries) :
+	m_max_per_shard{std::max<std::size_t>(max_entries / shard_count, 1)}
+{
+}
+
+BlobMetaCache::Shard& BlobMetaCache::shard(const ObjectID& id)
+{
+	// The blob IDs are hashes, so any byte of them is evenly distributed. Use one that
+	// is not used by std::hash<ObjectID> to pick the bucket inside the shard.
+	return m_shards[id.back() % shard_count];
+}
+
+std::optional<ImageMeta> BlobMetaCache::find(const ObjectID& id)
+{
+	auto& s = shard(id);
+	std::unique_lock lock{s.mx};
+
+	auto it = s.index.find(id);
+	if (it == s.index.end())
+	{
+		m_misses++;
+		return std::nullopt;
+	}
+
+	// move to front
+	s.lru.splice(s.lru.begin(), s.lru, it->second);
+	m_hits++;
+	return it->second->second;
+}
+
+void BlobMetaCache::store(const ObjectID& id, const ImageMeta& meta)
+{
+	auto& s = shard(id);
+	std::unique_lock lock{s.mx};
+
+	if (auto it = s.index.find(id); it != s.index.end())
+	{
+		it->second->second = meta;
+		s.lru.splice(s.lru.begin(), s.lru, it->second);
+		return;
+	}
+
+	if (s.lru.size() >= m_max_per_shard)
+	{
+		s.index.erase(s.lru.back().first);
+		s.lru.pop_back();
+	}
+
+	s.lru.emplace_front(id, meta);
+	s.index.emplace(id, s.lru.begin());
+}
+
+void BlobMetaCache::invalidate(const ObjectID& id)
+{
+	auto& s = shard(id);
+	std::unique_lock lock{s.mx};
+
+	if (auto it = s.index.find(id); it != s.index.end())
+	{
+		s.lru.erase(it->second);
+		s.index.erase(it);
+	}
+}
+
+std::size_t BlobMetaCache::size() const
+{
+	std::size_t result = 0;
+	for (auto&& s : m_shards)
+	{
+		std::unique_lock lock{s.mx};
+		result += s.lru.size();
+	}
+	return result;
+}
+
+BlobMetaCache::Stats BlobMetaCache::stats() const
+{
+	return {m_hits.load(), m_misses.load()};
+}
+
+} // end of namespace hrb
@@ -0,0 +1,81 @@
+/*
+	Copyright © 2018 Wan Wai Ho <me@nestal.net>
+
+	This file is subject to the terms and conditions of the GNU General Public
+	License.  See the file COPYING in the main directory of the hearty_rabbit
+	distribution for more details.
+*/
+
+//
+// Created by nestal on 27/10/18.
+//
+
+#pragma once
+
+#include "hrb/ObjectID.hh"
+#include "image/Image.hh"
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+
+namespace hrb {
+
+/// \brief In-process LRU cache of the meta data of the blobs
+/// Almost every request of a blob needs its meta data, e.g. the mime type. The cache keeps
+/// the most recently used ones in memory, so that BlobFile does not need to read its
+/// sidecar file for every request.
+///
+/// The entries are divided into a number of shards by their ID. Each shard has its own
+/// mutex to reduce the contention between threads.
+class BlobMetaCache
+{
+public:
+	explicit BlobMetaCache(std::size_t max_entries);
+	BlobMetaCache(BlobMetaCache&&) = delete;
+	BlobMetaCache(const BlobMetaCache&) = delete;
+	~BlobMetaCache() = default;
+	BlobMetaCache& operator=(BlobMetaCache&&) = delete;
+	BlobMetaCache& operator=(const BlobMetaCache&) = delete;
+
+	[[nodiscard]] std::optional<ImageMeta> find(const ObjectID& id);
+	void store(const ObjectID& id, const ImageMeta& meta);
+
+	/// Called when the meta data of the blob is removed.
+	void invalidate(const ObjectID& id);
+
+	[[nodiscard]] std::size_t size() const;
+
+	struct Stats
+	{
+		std::uint64_t   hits;
+		std::uint64_t   misses;
+	};
+	[[nodiscard]] Stats stats() const;
+
+private:
+	struct Shard
+	{
+		using LRU = std::list<std::pair<ObjectID, ImageMeta>>;
+
+		mutable std::mutex                              mx;
+		LRU                                             lru;    //!< most recently used in front
+		std::unordered_map<ObjectID, LRU::iterator>     index;
+	};
+
+	Shard& shard(const ObjectID& id);
+
+private:
+	static const std::size_t shard_count = 16;
+
+	const std::size_t                   m_max_per_shard;
+	std::array<Shard, shard_count>      m_shards;
+	std::atomic<std::uint64_t>          m_hits{}, m_misses{};
+};
+
+} // end of namespace hrb
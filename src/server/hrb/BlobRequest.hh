@@ -27,7 +27,9 @@ class BlobRequest
 public:
 	template <typename Request>
 	BlobRequest(Request&& req, URLIntent&& intent) :
-		m_url{std::move(intent)}, m_version{req.version()}, m_etag{req[http::field::if_none_match]}
+		m_url{std::move(intent)}, m_version{req.version()}, m_etag{req[http::field::if_none_match]},
+		m_accept{req[http::field::accept]},
+		m_range{req[http::field::range]}, m_if_range{req[http::field::if_range]}
 	{
 		if constexpr (std::is_same<std::remove_reference_t<Request>, StringRequest>::value)
 		{
@@ -45,6 +47,9 @@ public:
 	std::string_view collection() const     {return m_url.collection();}
 	std::string_view option() const         {return m_url.option();}
 	std::string_view etag() const           {return m_etag;}
+	std::string_view accept() const         {return m_accept;}
+	std::string_view range() const          {return m_range;}
+	std::string_view if_range() const       {return m_if_range;}
 	unsigned version() const                {return m_version;}
 
 	bool request_by_owner(const UserID& requester) const;
@@ -58,6 +63,8 @@ private:
 	unsigned    m_version;
 
 	std::string m_etag;
+	std::string m_accept;
+	std::string m_range, m_if_range;
 	std::string m_body;
 };
 
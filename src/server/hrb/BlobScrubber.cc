@@ -0,0 +1,410 @@
+/*
+	Copyright © 2018 Wan Wai Ho <me@nestal.net>
+
+	This file is subject to the terms and conditions of the GNU General Public
+	License.  See the file COPYING in the main directory of the hearty_rabbit
+	distribution for more details.
+*/
+
+//
+// Created by nestal on 2/11/18.
+//
+
+#include "BlobScrubber.hh"
+#include "BlobVolumes.hh"
+
+#include "crypto/Blake2.hh"
+#include "util/Configuration.hh"
+#include "util/Escape.hh"
+#include "util/Log.hh"
+#include "util/MMap.hh"
+
+#include <boost/asio/post.hpp>
+#include <boost/beast/core/file_posix.hpp>
+
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace hrb {
+
+namespace {
+
+const std::size_t read_size = 1024 * 1024;
+
+// From linux/ioprio.h, which is not installed everywhere
+const int ioprio_class_idle  = 3;
+const int ioprio_class_shift = 13;
+const int ioprio_who_process = 1;
+
+// Whether any page of the file is in the page cache. Those files are probably read by
+// the clients recently, so the scrubber should not drop them from the page cache.
+bool is_cached(int fd)
+{
+	std::error_code ec;
+	auto mmap = MMap::open(fd, ec);
+	if (ec || mmap.size() == 0)
+		return false;
+
+	std::vector<unsigned char> pages((mmap.size() + MMap::page_size() - 1) / MMap::page_size());
+	if (::mincore(mmap.data(), mmap.size(), pages.data()) != 0)
+		return false;
+
+	return std::any_of(pages.begin(), pages.end(), [](auto page){return (page & 1) != 0;});
+}
+
+bool ends_with(BufferView data, std::string_view suffix)
+{
+	return data.size() >= suffix.size() &&
+		std::equal(suffix.begin(), suffix.end(), data.end() - static_cast<std::ptrdiff_t>(suffix.size()),
+			[](char c, unsigned char d){return static_cast<unsigned char>(c) == d;});
+}
+
+std::uint32_t read_le32(const unsigned char *p)
+{
+	return std::uint32_t{p[0]} | std::uint32_t{p[1]} << 8 | std::uint32_t{p[2]} << 16 | std::uint32_t{p[3]} << 24;
+}
+
+std::uint32_t read_be32(const unsigned char *p)
+{
+	return std::uint32_t{p[0]} << 24 | std::uint32_t{p[1]} << 16 | std::uint32_t{p[2]} << 8 | std::uint32_t{p[3]};
+}
+
+} // end of local namespace
+
+BlobScrubber::BlobScrubber(
+	const BlobVolumes& volumes,
+	fs::path cursor_file,
+	std::uint64_t bytes_per_sec,
+	std::chrono::seconds interval,
+	bool quarantine,
+	Invalidate invalidate
+) :
+	m_volumes{volumes},
+	m_cursor_file{std::move(cursor_file)},
+	m_bytes_per_sec{bytes_per_sec},
+	m_interval{interval},
+	m_quarantine{quarantine},
+	m_invalidate{std::move(invalidate)}
+{
+}
+
+BlobScrubber::~BlobScrubber()
+{
+	{
+		std::unique_lock lock{m_mutex};
+		m_stopping = true;
+	}
+	m_stop.notify_all();
+	m_thread.join();
+}
+
+void BlobScrubber::start()
+{
+	boost::asio::post(m_thread, [this]
+	{
+		// Let other threads read the disks first
+		if (::syscall(SYS_ioprio_set, ioprio_who_process, 0, ioprio_class_idle << ioprio_class_shift) != 0)
+			Log(LOG_NOTICE, "cannot set I/O priority of the scrubber: %1%", std::strerror(errno));
+
+		load_cursor();
+		while (!m_stopping)
+		{
+			auto started = std::chrono::steady_clock::now();
+			if (run_pass())
+			{
+				auto s = stats();
+				Log(LOG_INFO, "scrubbed %1% blobs: %2% corrupted, %3% repaired", s.blobs, s.corrupted, s.repaired);
+			}
+			sleep_until(started + m_interval);
+		}
+	});
+}
+
+bool BlobScrubber::run_pass()
+{
+	std::size_t count = 0;
+	for (auto volume = m_cursor_volume; volume < m_volumes.size() && !m_stopping; volume++)
+	{
+		// Skip the checked blobs
+		std::error_code ec;
+		auto after = volume == m_cursor_volume ? m_cursor_id : std::string{};
+		m_volumes.for_each_blob(volume, [this, volume, &count](auto& dir, auto& id)
+		{
+			scrub(volume, dir, id);
+
+			// The blob will be checked again if the scrubber is stopped in the middle
+			if (m_stopping)
+				return false;
+
+			{
+				std::unique_lock lock{m_mutex};
+				m_cursor_volume = volume;
+				m_cursor_id     = dir.filename().string();
+			}
+			if (++count % 64 == 0)
+				save_cursor();
+			return true;
+		}, ec, after);
+
+		if (m_stopping)
+		{
+			save_cursor();
+			return false;
+		}
+		if (ec)
+			Log(LOG_WARNING, "cannot scrub volume %1% (%2% %3%)", m_volumes.path(volume), ec, ec.message());
+
+		std::unique_lock lock{m_mutex};
+		m_cursor_volume = volume + 1;
+		m_cursor_id.clear();
+	}
+
+	if (m_stopping)
+		return false;
+
+	// Start from the beginning next time
+	{
+		std::unique_lock lock{m_mutex};
+		m_cursor_volume = 0;
+		m_cursor_id.clear();
+	}
+	save_cursor();
+	m_passes++;
+	return true;
+}
+
+bool BlobScrubber::scrub(std::size_t volume, const fs::path& dir, const ObjectID& id)
+{
+	auto ok = verify_master(dir/"master", id);
+	if (m_stopping)
+		return ok;
+
+	m_blobs++;
+	if (!ok)
+	{
+		m_corrupted++;
+		Log(LOG_CRIT, "master of blob %1% in %2% does not match its ID", to_hex(id), dir);
+		quarantine(volume, dir, id);
+	}
+	else
+		verify_derived(dir, id);
+
+	return ok;
+}
+
+bool BlobScrubber::verify_master(const fs::path& master, const ObjectID& id)
+{
+	// The blob may be moved to another volume or still being uploaded
+	auto fd = ::open(master.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		if (errno != ENOENT)
+			Log(LOG_WARNING, "cannot open %1% to scrub: %2%", master, std::strerror(errno));
+		return true;
+	}
+
+	boost::beast::file_posix file;
+	file.native_handle(fd);
+
+	::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	auto cached = is_cached(fd);
+
+	Blake2 hash;
+	std::vector<unsigned char> buf(read_size);
+	for (off_t offset = 0; !m_stopping; )
+	{
+		auto count = ::pread(fd, buf.data(), buf.size(), offset);
+		if (count < 0 && errno == EINTR)
+			continue;
+		if (count < 0)
+		{
+			Log(LOG_WARNING, "cannot read %1% to scrub: %2%", master, std::strerror(errno));
+			return false;
+		}
+		if (count == 0)
+			break;
+
+		hash.update(buf.data(), static_cast<std::size_t>(count));
+		if (!cached)
+			::posix_fadvise(fd, offset, count, POSIX_FADV_DONTNEED);
+
+		offset  += count;
+		m_bytes += static_cast<std::uint64_t>(count);
+		throttle(static_cast<std::size_t>(count));
+	}
+
+	return m_stopping || ObjectID{hash.finalize()} == id;
+}
+
+// The other files in the blob directory are generated from the master. There is no
+// hash to check them, so only look for truncated or unparsable files.
+void BlobScrubber::verify_derived(const fs::path& dir, const ObjectID& id)
+{
+	std::error_code ec;
+	for (auto&& entry : fs::directory_iterator{dir, ec})
+	{
+		auto name = entry.path().filename().string();
+
+		// Temporary files and meta.bin, which is checked when it is unpacked, are skipped.
+		// Renditions in other formats have the extension of the format.
+		auto is_temp = name.find('.') != name.npos && !RenditionSetting::split(name).second;
+		if (name == "master" || name == "meta.bin" || (name != "meta.json" && is_temp))
+			continue;
+
+		auto mmap = MMap::open(dir/name, ec);
+		if (ec)
+		{
+			ec.clear();
+			continue;
+		}
+		throttle(mmap.size());
+
+		auto valid = name == "meta.json" ?
+			nlohmann::json::parse(mmap.string(), nullptr, false).is_object() :
+			is_complete_image(mmap.buffer());
+
+		if (!valid)
+		{
+			Log(LOG_WARNING, "%1% is corrupted. It will be generated again.", dir/name);
+			fs::remove(dir/name, ec);
+			if (!ec)
+			{
+				m_repaired++;
+				if (m_invalidate)
+					m_invalidate(id, name);
+			}
+			ec.clear();
+		}
+	}
+}
+
+bool BlobScrubber::is_complete_image(BufferView image)
+{
+	// JPEG starts with the SOI marker and ends with the EOI marker
+	if (image.size() >= 2 && image[0] == 0xFF && image[1] == 0xD8)
+		return ends_with(image, "\xFF\xD9");
+
+	// PNG ends with the IEND chunk, including its CRC
+	if (image.size() >= 8 && ends_with(image.substr(0, 8), "\x89PNG\r\n\x1A\n"))
+		return ends_with(image, std::string_view{"\0\0\0\0IEND\xAE\x42\x60\x82", 12});
+
+	// WebP is a RIFF file, which records its size after the "RIFF" tag
+	if (image.size() >= 12 && ends_with(image.substr(0, 4), "RIFF") && ends_with(image.substr(8, 4), "WEBP"))
+		return read_le32(image.data() + 4) + 8 == image.size();
+
+	// AVIF is an ISO base media file, which is a sequence of boxes starting with "ftyp"
+	if (image.size() >= 8 && ends_with(image.substr(4, 4), "ftyp"))
+	{
+		std::uint64_t offset = 0;
+		while (offset + 8 <= image.size())
+		{
+			std::uint64_t size = read_be32(image.data() + offset);
+			if (size == 1 && offset + 16 <= image.size())
+				size = (std::uint64_t{read_be32(image.data() + offset + 8)} << 32) | read_be32(image.data() + offset + 12);
+			else if (size == 0)
+				return true;    // the last box extends to the end of the file
+
+			if (size < 8)
+				return false;
+			offset += size;
+		}
+		return offset == image.size();
+	}
+
+	return true;
+}
+
+// The quarantine directory is in the same volume as the blob, so that it can be moved
+// by renaming.
+void BlobScrubber::quarantine(std::size_t volume, const fs::path& dir, const ObjectID& id)
+{
+	if (!m_quarantine)
+		return;
+
+	std::error_code ec;
+	auto dest = m_volumes.path(volume)/"quarantine";
+	create_directories(dest, ec);
+	if (!ec)
+		fs::rename(dir, dest/to_hex(id), ec);
+
+	if (ec)
+		return Log(LOG_WARNING, "cannot quarantine %1% (%2% %3%)", dir, ec, ec.message());
+
+	Log(LOG_NOTICE, "blob %1% is moved to %2%", to_hex(id), dest);
+	if (m_invalidate)
+		m_invalidate(id, {});
+}
+
+void BlobScrubber::throttle(std::size_t bytes)
+{
+	if (m_bytes_per_sec == 0)
+		return;
+
+	using namespace std::chrono;
+	auto cost = duration<double>{static_cast<double>(bytes) / static_cast<double>(m_bytes_per_sec)};
+	m_next_read = std::max(m_next_read, steady_clock::now()) + duration_cast<steady_clock::duration>(cost);
+	sleep_until(m_next_read);
+}
+
+// Returns false if stopped before the time is reached
+bool BlobScrubber::sleep_until(std::chrono::steady_clock::time_point until)
+{
+	std::unique_lock lock{m_mutex};
+	return !m_stop.wait_until(lock, until, [this]{return m_stopping.load();});
+}
+
+BlobScrubber::Stats BlobScrubber::stats() const
+{
+	return {m_blobs, m_bytes, m_corrupted, m_repaired, m_passes};
+}
+
+std::string BlobScrubber::cursor() const
+{
+	std::unique_lock lock{m_mutex};
+	return std::to_string(m_cursor_volume) + ":" + m_cursor_id;
+}
+
+void BlobScrubber::load_cursor()
+{
+	std::ifstream file{m_cursor_file};
+	std::size_t volume{};
+	char colon{};
+	std::string id;
+	if (file >> volume >> colon && colon == ':')
+	{
+		std::getline(file, id);
+
+		std::unique_lock lock{m_mutex};
+		m_cursor_volume = volume;
+		m_cursor_id     = ObjectID::is_hex(id) ? id : std::string{};
+	}
+}
+
+// Write to a temporary file and rename it, so the cursor is never half written
+void BlobScrubber::save_cursor()
+{
+	auto tmp = fs::path{m_cursor_file.string() + ".tmp"};
+	{
+		std::ofstream file{tmp, std::ios::out | std::ios::trunc};
+		file << cursor() << "\n";
+		if (!file)
+			return Log(LOG_WARNING, "cannot save scrubber cursor to %1%", m_cursor_file);
+	}
+
+	std::error_code ec;
+	fs::rename(tmp, m_cursor_file, ec);
+	if (ec)
+		Log(LOG_WARNING, "cannot save scrubber cursor to %1% (%2% %3%)", m_cursor_file, ec, ec.message());
+}
+
+} // end of namespace hrb
@@ -0,0 +1,124 @@
+/*
+	Copyright © 2018 Wan Wai Ho <me@nestal.net>
+
+	This file is subject to the terms and conditions of the GNU General Public
+	License.  See the file COPYING in the main directory of the hearty_rabbit
+	distribution for more details.
+*/
+
+//
+// Created by nestal on 2/11/18.
+//
+
+#pragma once
+
+#include "hrb/ObjectID.hh"
+#include "util/BufferView.hh"
+#include "util/FS.hh"
+
+#include <boost/asio/thread_pool.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+namespace hrb {
+
+class BlobVolumes;
+
+/// \brief Verifies the blobs in the background
+/// The ID of a blob is the hash of its master rendition, so the master can be verified
+/// by hashing it again. BlobScrubber walks all volumes slowly in the order of the blob IDs.
+/// It reads at most \a bytes_per_sec with idle I/O priority, and drops the pages it has
+/// read from the page cache unless they were already there. Its position is saved in
+/// \a cursor_file, so it continues where it stopped after restarting.
+///
+/// A corrupted master is logged, and the blob is moved to the "quarantine" directory of
+/// its volume if \a quarantine is true. Other files in the blob directory are generated
+/// from the master, so they are deleted when they are corrupted. They will be generated
+/// again when requested. \a invalidate is called for the deleted or moved files, so that
+/// the caches stop serving them.
+class BlobScrubber
+{
+public:
+	struct Stats
+	{
+		std::uint64_t   blobs;          //!< checked
+		std::uint64_t   bytes;          //!< of the masters read
+		std::uint64_t   corrupted;      //!< masters
+		std::uint64_t   repaired;       //!< deleted renditions and meta data
+		std::uint64_t   passes;         //!< completed
+	};
+
+	/// Called after \a file of blob \a id is deleted, or after the whole blob is moved
+	/// if \a file is empty.
+	using Invalidate = std::function<void(const ObjectID& id, std::string_view file)>;
+
+public:
+	BlobScrubber(
+		const BlobVolumes& volumes,
+		fs::path cursor_file,
+		std::uint64_t bytes_per_sec,
+		std::chrono::seconds interval,
+		bool quarantine = false,
+		Invalidate invalidate = {}
+	);
+	BlobScrubber(BlobScrubber&&) = delete;
+	BlobScrubber(const BlobScrubber&) = delete;
+	~BlobScrubber();
+	BlobScrubber& operator=(BlobScrubber&&) = delete;
+	BlobScrubber& operator=(const BlobScrubber&) = delete;
+
+	/// Scrub all volumes in a background thread, and again after each \a interval
+	void start();
+
+	/// Scrub the blobs after the cursor until all of them are checked or stopped. Returns
+	/// true if all of them are checked, and the cursor is reset.
+	bool run_pass();
+
+	/// Check the blob in \a dir of \a volume. Returns false if the master is corrupted.
+	bool scrub(std::size_t volume, const fs::path& dir, const ObjectID& id);
+
+	[[nodiscard]] Stats stats() const;
+	[[nodiscard]] std::string cursor() const;
+
+	/// Whether \a image ends like a complete JPEG, PNG, WebP or AVIF file
+	[[nodiscard]] static bool is_complete_image(BufferView image);
+
+private:
+	bool verify_master(const fs::path& master, const ObjectID& id);
+	void verify_derived(const fs::path& dir, const ObjectID& id);
+	void quarantine(std::size_t volume, const fs::path& dir, const ObjectID& id);
+	void throttle(std::size_t bytes);
+	bool sleep_until(std::chrono::steady_clock::time_point until);
+	void load_cursor();
+	void save_cursor();
+
+private:
+	const BlobVolumes&  m_volumes;
+	const fs::path      m_cursor_file;
+	const std::uint64_t m_bytes_per_sec;
+	const std::chrono::seconds m_interval;
+	const bool          m_quarantine;
+	const Invalidate    m_invalidate;
+
+	// "<volume>:<blob ID>" of the last checked blob. Written by the scrubbing thread with m_mutex locked.
+	std::size_t         m_cursor_volume{};
+	std::string         m_cursor_id;
+	std::chrono::steady_clock::time_point m_next_read{};
+
+	std::atomic<std::uint64_t> m_blobs{}, m_bytes{}, m_corrupted{}, m_repaired{}, m_passes{};
+
+	std::atomic<bool>       m_stopping{false};
+	mutable std::mutex      m_mutex;
+	std::condition_variable m_stop;
+
+	boost::asio::thread_pool    m_thread{1};
+};
+
+} // end of namespace hrb
@@ -0,0 +1,299 @@
+/*
+	Copyright © 2018 Wan Wai Ho <me@nestal.net>
+
+	This file is subject to the terms and conditions of the GNU General Public
+	License.  See the file COPYING in the main directory of the hearty_rabbit
+	distribution for more details.
+*/
+
+//
+// Created by nestal on 1/11/18.
+//
+
+#include "BlobVolumes.hh"
+
+#include "util/Configuration.hh"
+#include "util/Escape.hh"
+#include "util/Log.hh"
+
+#include <boost/asio/post.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <numeric>
+
+#include <sys/statvfs.h>
+
+namespace hrb {
+
+namespace {
+
+// Finalizer of splitmix64
+std::uint64_t mix(std::uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
+
+// FNV-1a. Unlike std::hash, it is the same in all builds, so the blobs stay where they are
+// after upgrading.
+std::uint64_t hash_path(const fs::path& path)
+{
+	std::uint64_t hash = 0xcbf29ce484222325ULL;
+	for (unsigned char c : path.string())
+	{
+		hash ^= c;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+std::vector<std::string> sorted_names(const fs::path& dir, std::error_code& ec)
+{
+	std::vector<std::string> result;
+	for (auto&& entry : fs::directory_iterator{dir, ec})
+		result.push_back(entry.path().filename().string());
+
+	std::sort(result.begin(), result.end());
+	return result;
+}
+
+bool is_in(const fs::path& path, const fs::path& dir)
+{
+	return std::mismatch(dir.begin(), dir.end(), path.begin(), path.end()).first == dir.end();
+}
+
+} // end of local namespace
+
+BlobVolumes::Volume::Volume(fs::path path_, double weight_) :
+	path{std::move(path_)}, weight{weight_}, seed{hash_path(path)}
+{
+}
+
+BlobVolumes::BlobVolumes(const std::vector<BlobVolume>& volumes, const fs::path& default_volume)
+{
+	for (auto&& volume : volumes)
+		m_volumes.emplace_back(volume.path, volume.weight);
+
+	if (m_volumes.empty())
+		m_volumes.emplace_back(default_volume, 1.0);
+
+	for (auto&& volume : m_volumes)
+	{
+		if (exists(volume.path) && !is_directory(volume.path))
+			throw std::system_error(std::make_error_code(std::errc::file_exists));
+
+		create_directories(volume.path);
+	}
+}
+
+BlobVolumes::~BlobVolumes()
+{
+	m_stopping = true;
+	m_rebalancer.join();
+}
+
+fs::path BlobVolumes::blob_dir(const fs::path& volume, const ObjectID& id)
+{
+	auto hex = to_hex(id);
+	assert(hex.size() > 2);
+
+	return volume / hex.substr(0, 2) / hex;
+}
+
+std::size_t BlobVolumes::place(const ObjectID& id) const
+{
+	if (m_volumes.size() == 1)
+		return 0;
+
+	std::uint64_t key{};
+	std::memcpy(&key, id.data(), sizeof(key));
+
+	// Weighted rendezvous hashing: the score is weight / -ln(u), where u is uniformly
+	// distributed in (0, 1).
+	std::size_t result = 0;
+	double max_score = 0;
+	for (std::size_t i = 0; i < m_volumes.size(); i++)
+	{
+		auto u = (static_cast<double>(mix(m_volumes[i].seed ^ key) >> 11) + 0.5) / 9007199254740992.0;
+		auto score = m_volumes[i].weight / -std::log(u);
+		if (score > max_score)
+		{
+			max_score = score;
+			result = i;
+		}
+	}
+	return result;
+}
+
+fs::path BlobVolumes::dest(const ObjectID& id) const
+{
+	return blob_dir(m_volumes[place(id)].path, id);
+}
+
+// The volume where the blob should be stored first, then the others
+std::vector<std::size_t> BlobVolumes::ranked(const ObjectID& id) const
+{
+	std::vector<std::size_t> result(m_volumes.size());
+	std::iota(result.begin(), result.end(), 0);
+	std::swap(result.front(), result[place(id)]);
+	return result;
+}
+
+fs::path BlobVolumes::locate(const ObjectID& id) const
+{
+	if (m_volumes.size() == 1)
+		return dest(id);
+
+	for (auto volume : ranked(id))
+	{
+		auto dir = blob_dir(m_volumes[volume].path, id);
+		if (exists(dir))
+			return dir;
+	}
+	return dest(id);
+}
+
+// The names of the directories are listed before visiting them, so the visitor can move
+// or delete the blobs.
+void BlobVolumes::for_each_blob(std::size_t volume, const BlobVisitor& visit, std::error_code& ec, std::string_view after) const
+{
+	auto& root = path(volume);
+	for (auto&& prefix : sorted_names(root, ec))
+	{
+		// Skip the files and directories that are not blobs, e.g. the pack store
+		if (prefix.size() != 2 || prefix < after.substr(0, 2) || !is_directory(root/prefix))
+			continue;
+
+		for (auto&& hex : sorted_names(root/prefix, ec))
+		{
+			// Blobs being moved or deleted have a suffix after the ID
+			auto id = ObjectID::from_hex(hex);
+			if (hex <= after || !id)
+				continue;
+
+			if (!visit(root/prefix/hex, *id))
+				return;
+		}
+		if (ec)
+			return;
+	}
+}
+
+std::size_t BlobVolumes::rebalance(std::error_code& ec)
+{
+	std::size_t moved = 0;
+	for (std::size_t volume = 0; volume < m_volumes.size() && !m_stopping && !ec; volume++)
+	{
+		for_each_blob(volume, [this, volume, &moved](auto& dir, auto& id)
+		{
+			if (place(id) != volume)
+			{
+				std::error_code ec;
+				move_blob(dir, dest(id), ec);
+				if (ec)
+					Log(LOG_WARNING, "cannot move blob %1% to %2% (%3% %4%)", dir, dest(id), ec, ec.message());
+				else
+					moved++;
+			}
+			return !m_stopping;
+		}, ec);
+	}
+	return moved;
+}
+
+void BlobVolumes::start_rebalance()
+{
+	boost::asio::post(m_rebalancer, [this]
+	{
+		std::error_code ec;
+		auto moved = rebalance(ec);
+		if (ec)
+			Log(LOG_WARNING, "cannot rebalance blob volumes (%1% %2%)", ec, ec.message());
+		Log(LOG_INFO, "%1% blobs are moved to other volumes", moved);
+	});
+}
+
+// Move the blob directory to another volume. The blob is copied to a temporary directory
+// in the destination volume first, so that it never appears partially copied.
+void BlobVolumes::move_blob(const fs::path& src, const fs::path& dest, std::error_code& ec)
+{
+	create_directories(dest.parent_path(), ec);
+	if (ec)
+		return;
+
+	// The same blob may be uploaded again after the volumes are changed. Blobs with
+	// the same ID have the same content.
+	std::error_code ignore;
+	if (exists(dest))
+	{
+		fs::remove_all(src, ec);
+		return;
+	}
+
+	// Volumes in the same file system
+	fs::rename(src, dest, ec);
+	if (ec != std::errc::cross_device_link)
+		return;
+
+	ec.clear();
+	auto tmp = fs::path{dest.string() + ".moving"};
+	fs::remove_all(tmp, ignore);
+	fs::copy(src, tmp, fs::copy_options::recursive, ec);
+	if (!ec)
+		fs::rename(tmp, dest, ec);
+
+	if (ec)
+		fs::remove_all(tmp, ignore);
+	else
+		fs::remove_all(src, ec);
+}
+
+void BlobVolumes::record_read(const fs::path& path, std::chrono::nanoseconds elapsed)
+{
+	auto it = std::find_if(m_volumes.begin(), m_volumes.end(), [&path](auto& volume)
+	{
+		return is_in(path, volume.path);
+	});
+	if (it == m_volumes.end())
+		return;
+
+	auto ns = static_cast<std::uint64_t>(elapsed.count());
+	it->reads++;
+	it->total_ns += ns;
+
+	auto max = it->max_ns.load();
+	while (ns > max && !it->max_ns.compare_exchange_weak(max, ns))
+		;
+}
+
+std::vector<BlobVolumes::Stats> BlobVolumes::stats() const
+{
+	std::vector<Stats> result;
+	for (auto&& volume : m_volumes)
+	{
+		struct statvfs info{};
+		if (::statvfs(volume.path.c_str(), &info) != 0)
+			info = {};
+
+		auto reads = volume.reads.load();
+		result.push_back(Stats{
+			volume.path,
+			volume.weight,
+			static_cast<std::uint64_t>(info.f_blocks) * info.f_frsize,
+			static_cast<std::uint64_t>(info.f_bavail) * info.f_frsize,
+			reads,
+			std::chrono::nanoseconds{reads > 0 ? volume.total_ns.load() / reads : 0},
+			std::chrono::nanoseconds{volume.max_ns.load()}
+		});
+	}
+	return result;
+}
+
+} // end of namespace hrb
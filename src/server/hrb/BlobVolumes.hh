@@ -0,0 +1,118 @@
+/*
+	Copyright © 2018 Wan Wai Ho <me@nestal.net>
+
+	This file is subject to the terms and conditions of the GNU General Public
+	License.  See the file COPYING in the main directory of the hearty_rabbit
+	distribution for more details.
+*/
+
+//
+// Created by nestal on 1/11/18.
+//
+
+#pragma once
+
+#include "hrb/ObjectID.hh"
+#include "util/FS.hh"
+
+#include <boost/asio/thread_pool.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+namespace hrb {
+
+struct BlobVolume;
+
+/// \brief Places the blobs in several directories, usually on different disks
+/// The volume of a blob is chosen by weighted rendezvous hashing of its ID: each volume
+/// gets a score from the hash of the ID and the path of the volume, and the blob goes to
+/// the one with the highest score. Adding a volume only moves the blobs that the new
+/// volume wins, and removing one only moves the blobs in it.
+///
+/// Blobs that were placed before the volumes changed can still be found in the other
+/// volumes. rebalance() moves them to where they belong.
+class BlobVolumes
+{
+public:
+	struct Stats
+	{
+		fs::path        path;
+		double          weight;
+		std::uint64_t   capacity;       //!< in bytes
+		std::uint64_t   available;      //!< in bytes
+		std::uint64_t   reads;
+		std::chrono::nanoseconds    average_latency;
+		std::chrono::nanoseconds    max_latency;
+	};
+
+public:
+	BlobVolumes(const std::vector<BlobVolume>& volumes, const fs::path& default_volume);
+	BlobVolumes(BlobVolumes&&) = delete;
+	BlobVolumes(const BlobVolumes&) = delete;
+	~BlobVolumes();
+	BlobVolumes& operator=(BlobVolumes&&) = delete;
+	BlobVolumes& operator=(const BlobVolumes&) = delete;
+
+	[[nodiscard]] std::size_t size() const {return m_volumes.size();}
+	[[nodiscard]] const fs::path& path(std::size_t volume) const {return m_volumes.at(volume).path;}
+
+	/// The index of the volume where the blob should be stored
+	[[nodiscard]] std::size_t place(const ObjectID& id) const;
+
+	/// The directory of the blob in the volume where it should be stored
+	[[nodiscard]] fs::path dest(const ObjectID& id) const;
+
+	/// The directory of an existing blob. The volume where it should be stored is probed
+	/// first. Same as dest() if it is not found in any volume.
+	[[nodiscard]] fs::path locate(const ObjectID& id) const;
+
+	/// Call \a visit with the directory and the ID of each blob in \a volume, in the order
+	/// of the hex IDs, starting from the one after \a after. Stops when \a visit returns
+	/// false or an error occurs.
+	using BlobVisitor = std::function<bool(const fs::path& dir, const ObjectID& id)>;
+	void for_each_blob(std::size_t volume, const BlobVisitor& visit, std::error_code& ec, std::string_view after = {}) const;
+
+	/// Move the blobs that are not in the volumes they should be. Returns the number of
+	/// blobs moved. It stops early when the object is being destroyed.
+	std::size_t rebalance(std::error_code& ec);
+
+	/// Call rebalance() in a background thread
+	void start_rebalance();
+
+	/// Record the time to open and read a file in \a path, which is in one of the volumes
+	void record_read(const fs::path& path, std::chrono::nanoseconds elapsed);
+
+	[[nodiscard]] std::vector<Stats> stats() const;
+
+private:
+	struct Volume
+	{
+		Volume(fs::path path, double weight);
+
+		fs::path        path;
+		double          weight;
+		std::uint64_t   seed;       //!< hash of the path
+
+		std::atomic<std::uint64_t>  reads{};
+		std::atomic<std::uint64_t>  total_ns{};
+		std::atomic<std::uint64_t>  max_ns{};
+	};
+
+	[[nodiscard]] static fs::path blob_dir(const fs::path& volume, const ObjectID& id);
+	[[nodiscard]] std::vector<std::size_t> ranked(const ObjectID& id) const;
+	void move_blob(const fs::path& src, const fs::path& dest, std::error_code& ec);
+
+private:
+	std::deque<Volume>          m_volumes;
+	std::atomic<bool>           m_stopping{false};
+	boost::asio::thread_pool    m_rebalancer{1};
+};
+
+} // end of namespace hrb
@@ -0,0 +1,136 @@
+/*
+	Copyright © 2018 Wan Wai Ho <me@nestal.net>
+
+	This file is subject to the terms and conditions of the GNU General Public
+	License.  See the file COPYING in the main directory of the hearty_rabbit
+	distribution for more details.
+*/
+
+//
+// Created by nestal on 28/10/18.
+//
+
+#include "MMapCache.hh"
+
+#include "util/Escape.hh"
+
+namespace hrb {
+
+MMapCache::MMapCache(std::size_t max_bytes) : m_max_bytes{max_bytes}
+{
+}
+
+std::string MMapCache::key(const ObjectID& id, std::string_view rendition)
+{
+	return to_hex(id) + "/" + std::string{rendition};
+}
+
+std::optional<MMapCache::Entry> MMapCache::find(const ObjectID& id, std::string_view rendition)
+{
+	auto k = key(id, rendition);
+
+	std::unique_lock lock{m_mutex};
+	auto it = m_index.find(k);
+	if (it == m_index.end())
+	{
+		m_misses++;
+		return std::nullopt;
+	}
+
+	// move to front
+	m_lru.splice(m_lru.begin(), m_lru, it->second);
+	m_hits++;
+	return it->second->second;
+}
+
+void MMapCache::store(const ObjectID& id, std::string_view rendition, const Entry& entry)
+{
+	if (!entry.mmap)
+		return;
+
+	auto size = entry.mmap->size();
+	if (m_max_bytes == 0 || size > m_max_bytes / 16)
+		return;
+
+	auto k = key(id, rendition);
+
+	std::unique_lock lock{m_mutex};
+	if (auto it = m_index.find(k); it != m_index.end())
+	{
+		auto node = it->second;
+		m_bytes -= node->second.mmap->size();
+		m_index.erase(it);
+		m_lru.erase(node);
+	}
+
+	evict(size);
+
+	m_lru.emplace_front(std::move(k), entry);
+	m_index.emplace(m_lru.front().first, m_lru.begin());
+	m_bytes += size;
+}
+
+void MMapCache::invalidate(const ObjectID& id, std::string_view rendition)
+{
+	auto k = key(id, rendition);
+
+	std::unique_lock lock{m_mutex};
+	if (auto it = m_index.find(k); it != m_index.end())
+	{
+		auto node = it->second;
+		m_bytes -= node->second.mmap->size();
+		m_index.erase(it);
+		m_lru.erase(node);
+	}
+}
+
+// The keys of the renditions of a blob start with its ID, so they are not indexed separately.
+// It only happens when a blob is moved away, which is rare.
+void MMapCache::invalidate(const ObjectID& id)
+{
+	auto prefix = key(id, {});
+
+	std::unique_lock lock{m_mutex};
+	for (auto node = m_lru.begin(); node != m_lru.end(); )
+	{
+		if (node->first.starts_with(prefix))
+		{
+			m_bytes -= node->second.mmap->size();
+			m_index.erase(node->first);
+			node = m_lru.erase(node);
+		}
+		else
+			++node;
+	}
+}
+
+// Remove the least recently used entries until there is room for \a incoming bytes.
+// The mapping is not removed until the responses sending it are done.
+void MMapCache::evict(std::size_t incoming)
+{
+	while (!m_lru.empty() && m_bytes + incoming > m_max_bytes)
+	{
+		m_bytes -= m_lru.back().second.mmap->size();
+		m_index.erase(m_lru.back().first);
+		m_lru.pop_back();
+	}
+}
+
+std::size_t MMapCache::size() const
+{
+	std::unique_lock lock{m_mutex};
+	return m_lru.size();
+}
+
+std::size_t MMapCache::bytes() const
+{
+	std::unique_lock lock{m_mutex};
+	return m_bytes;
+}
+
+MMapCache::Stats MMapCache::stats() const
+{
+	return {m_hits.load(), m_misses.load()};
+}
+
+} // end of namespace hrb
@@ -0,0 +1,94 @@
+/*
+	Copyright © 2018 Wan Wai Ho <me@nestal.net>
+
+	This file is subject to the terms and conditions of the GNU General Public
+	License.  See the file COPYING in the main directory of the hearty_rabbit
+	distribution for more details.
+*/
+
+//
+// Created by nestal on 28/10/18.
+//
+
+#pragma once
+
+#include "hrb/ObjectID.hh"
+#include "util/FS.hh"
+#include "util/MMap.hh"
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace hrb {
+
+/// \brief LRU cache of memory mapped renditions and their mime types
+/// Sending a rendition needs to open and map its file, and deduce its mime type by libmagic.
+/// The cache keeps the most recently sent ones mapped, so that they can be sent again by
+/// sharing the same MMap. A rendition is unmapped when it is evicted from the cache and
+/// all responses sending it are done.
+///
+/// The cache is limited by the total size of the mapped renditions. Renditions larger than
+/// 1/16 of the limit, e.g. most master renditions, are not cached to avoid evicting many
+/// thumbnails for one of them.
+class MMapCache
+{
+public:
+	struct Entry
+	{
+		std::shared_ptr<const MMap> mmap;
+		std::string                 mime;
+		fs::path                    path;   //!< the file that is mapped
+	};
+
+public:
+	explicit MMapCache(std::size_t max_bytes);
+	MMapCache(MMapCache&&) = delete;
+	MMapCache(const MMapCache&) = delete;
+	~MMapCache() = default;
+	MMapCache& operator=(MMapCache&&) = delete;
+	MMapCache& operator=(const MMapCache&) = delete;
+
+	[[nodiscard]] std::optional<Entry> find(const ObjectID& id, std::string_view rendition);
+	void store(const ObjectID& id, std::string_view rendition, const Entry& entry);
+
+	/// Called when the file of the rendition is replaced.
+	void invalidate(const ObjectID& id, std::string_view rendition);
+
+	/// Called when all renditions of the blob are removed.
+	void invalidate(const ObjectID& id);
+
+	[[nodiscard]] std::size_t size() const;
+	[[nodiscard]] std::size_t bytes() const;
+
+	struct Stats
+	{
+		std::uint64_t   hits;
+		std::uint64_t   misses;
+	};
+	[[nodiscard]] Stats stats() const;
+
+private:
+	[[nodiscard]] static std::string key(const ObjectID& id, std::string_view rendition);
+	void evict(std::size_t incoming);
+
+private:
+	using LRU = std::list<std::pair<std::string, Entry>>;
+
+	const std::size_t   m_max_bytes;
+
+	mutable std::mutex  m_mutex;
+	LRU                 m_lru;      //!< most recently used in front
+	std::unordered_map<std::string_view, LRU::iterator> m_index;   //!< refers to the keys in m_lru
+	std::size_t         m_bytes{};
+
+	std::atomic<std::uint64_t>  m_hits{}, m_misses{};
+};
+
+} // end of namespace hrb
@@ -14,11 +14,237 @@
 #include "Ownership.ipp"
 #include "RedisKeys.hh"
 
+#include "net/Redis.hh"
+#include "net/ShardedPool.hh"
 #include "util/Escape.hh"
 
 #include <nlohmann/json.hpp>
 
+#include <algorithm>
+#include <tuple>
+
 namespace hrb {
+namespace {
+
+const redis::Script link_script{R"__(
+	local blob_ref, blob_owner, blob_meta, coll_key, coll_list = KEYS[1], KEYS[2], KEYS[3], KEYS[4], KEYS[5]
+	local user, coll, blob, cover, entry, filename = ARGV[1], ARGV[2], ARGV[3], ARGV[4], ARGV[5], ARGV[6]
+
+	redis.call('SADD',   blob_ref,   coll)
+	redis.call('SADD',   blob_owner, user)
+
+	if entry ~= nil and entry ~= '' then
+		redis.call('HSETNX', blob_meta,  blob, entry)
+	end
+
+	redis.call('HSET',   coll_key,  blob, filename)
+	redis.call('HSETNX', coll_list, coll, cjson.encode({cover=cover}))
+)__"};
+
+const redis::Script move_script{R"__(
+	local blob_ref, src_key, dest_key, coll_list = KEYS[1], KEYS[2], KEYS[3], KEYS[4]
+	local src_coll, dest_coll, blob, cover = ARGV[1], ARGV[2], ARGV[3], ARGV[4]
+
+	redis.call('SADD',   blob_ref,   dest_coll)
+	redis.call('SREM',   blob_ref,   src_coll)
+
+	local filename = redis.call('HGET', src_key, blob)
+
+	redis.call('HSET',   dest_key,   blob,  filename)
+	redis.call('HDEL',   src_key,    blob)
+
+	redis.call('HSETNX', coll_list, dest_coll, cjson.encode({cover=cover}))
+)__"};
+
+const redis::Script unlink_script{R"__(
+	-- convert binary to lowercase hex string
+	local tohex = function(str)
+		return (str:gsub('.', function (c)
+			return string.format('%02x', string.byte(c))
+		end))
+	end
+
+	local blob_ref, blob_owner, blob_meta, coll_hash, coll_list, pub_list = KEYS[1], KEYS[2], KEYS[3], KEYS[4], KEYS[5], KEYS[6]
+	local user, coll, blob = ARGV[1], ARGV[2], ARGV[3]
+
+	-- delete the link from blob-refs
+	redis.call('SREM', blob_ref, coll)
+
+	-- if there is no more links to this blob to other collections, we can remove the blob
+	-- for this user and remove the blob from the public list
+	if redis.call('EXISTS', blob_ref) == 0 then
+		redis.call('SREM', blob_owner, user)
+		redis.call('HDEL', blob_meta, blob)
+		redis.call('LREM', pub_list, 0, cmsgpack.pack(user, blob))
+	end
+
+	-- delete the blob in the collection hash
+	redis.call('HDEL', coll_hash, blob)
+
+	-- if the collection has no more entries, delete the collection in the
+	-- user's list of collections
+	if redis.call('EXISTS', coll_hash) == 0 then
+		redis.call('HDEL', coll_list, coll)
+
+	-- if the collection still exists, check if the blob we are removing
+	-- is the cover of the collection
+	else
+		local album = cjson.decode(redis.call('HGET', coll_list, coll))
+
+		-- The intent here is to select a random image as the cover
+		-- as the original cover is removed.
+		-- However, we can't use SRANDMEMBER to select a random image
+		-- in the album because it is not deterministic, and non-deter-
+		-- ministic commands may break replication. We have no choice
+		-- but to use the slower SMEMBERS and take the first element.
+		if album['cover'] == tohex(blob) then
+			album['cover'] = tohex(redis.call('HKEYS', coll_hash)[1])
+			redis.call('HSET', coll_list, coll, cjson.encode(album))
+		end
+	end
+)__"};
+
+const redis::Script scan_collection_script{R"__(
+	local coll_hash, coll_list, blob_meta = KEYS[1], KEYS[2], KEYS[3]
+	local coll = ARGV[1]
+	local dirs = {}
+	for i, v in ipairs(redis.call('HGETALL', coll_hash)) do
+		if i % 2 == 1 then
+			-- v is the blob ID
+			table.insert(dirs, v)
+			table.insert(dirs, redis.call('HGET', blob_meta, v))
+		else
+			-- v is the filename
+			table.insert(dirs, v)
+		end
+	end
+	return {dirs, redis.call('HGET', coll_list, coll)}
+)__"};
+
+const redis::Script set_permission_script{R"__(
+	local user, blob, perm = ARGV[1], ARGV[2], ARGV[3]
+
+	local original = redis.call('HGET', KEYS[2], blob)
+	local updated  = perm .. string.sub(original, 2, -1)
+	redis.call('HSET', KEYS[2], blob, updated)
+
+	local msgpack = cmsgpack.pack(user, blob)
+	if perm == '*' then
+		redis.call('LREM', KEYS[1], 0, msgpack)
+		if redis.call('RPUSH', KEYS[1], msgpack) > 100 then
+			redis.call('LPOP', KEYS[1])
+		end
+	else
+		redis.call('LREM', KEYS[1], 0, msgpack)
+	end
+)__"};
+
+// set the cover of the collection
+// only set the cover if the collection is already in the dirs:<user> hash
+// and only if the cover blob is already in the collection (i.e. dir:<user>:<collection> hash)
+const redis::Script set_cover_script{R"__(
+	local coll_list, coll_hash = KEYS[1], KEYS[2]
+	local coll, cover_hex, cover = ARGV[1], ARGV[2], ARGV[3]
+
+	local json    = redis.call('HGET', coll_list, coll)
+	local in_coll = redis.call('HEXISTS', coll_hash, cover)
+	if json and in_coll == 1 then
+		local album = cjson.decode(json)
+		album['cover'] = cover_hex
+		redis.call('HSET', coll_list, coll, cjson.encode(album))
+
+		return 1
+	else
+		return 0
+	end
+)__"};
+
+// Look up the blobs in the public list of a shard. The public list only contains the
+// user and the blob ID, so the keys of the blobs are passed as KEYS instead of being
+// built inside the script, i.e. the script only touches the keys it is given.
+// KEYS[2i-1], KEYS[2i]: blob-refs:<user>:<blob> and blob-inodes:<user> of the i-th blob
+// ARGV[2i-1], ARGV[2i]: the user and the blob ID of the i-th blob
+const redis::Script public_blob_script{R"__(
+	local elements = {}
+	for i = 1, #ARGV, 2 do
+		table.insert(elements, {
+			ARGV[i], ARGV[i+1],
+			redis.call('SRANDMEMBER', KEYS[i]),
+			redis.call('HGET', KEYS[i+1], ARGV[i+1])
+		})
+	end
+	return elements
+)__"};
+
+const redis::Script get_blob_script{R"__(
+	if redis.call('HEXISTS', KEYS[1], ARGV[1]) == 1 then
+		return {redis.call('HGET', KEYS[2], ARGV[1]), redis.call('HGET', KEYS[1], ARGV[1])}
+	else
+		return false
+	end
+)__"};
+
+const redis::Script query_blob_script{R"__(
+	local dirs = {}
+	for k, coll in ipairs(redis.call('SMEMBERS', KEYS[1])) do
+		table.insert(dirs, coll)
+		table.insert(dirs, redis.call('HGET', KEYS[2], ARGV[1]))
+	end
+	return dirs
+)__"};
+
+// Unpack a string packed by cmsgpack.pack() in the scripts, and remove it from \a packed.
+std::optional<std::string_view> unpack_string(std::string_view& packed)
+{
+	if (packed.empty())
+		return std::nullopt;
+
+	auto tag = static_cast<unsigned char>(packed.front());
+	std::size_t header = 1, size = 0;
+	if ((tag & 0xe0) == 0xa0)               // fixstr
+		size = tag & 0x1f;
+	else if (tag == 0xd9 || tag == 0xc4)    // str 8 or bin 8
+		header = 2;
+	else if (tag == 0xda || tag == 0xc5)    // str 16 or bin 16
+		header = 3;
+	else if (tag == 0xdb || tag == 0xc6)    // str 32 or bin 32
+		header = 5;
+	else
+		return std::nullopt;
+
+	if (packed.size() < header)
+		return std::nullopt;
+	for (auto i = 1U; i < header; i++)
+		size = (size << 8) | static_cast<unsigned char>(packed[i]);
+	if (packed.size() < header + size)
+		return std::nullopt;
+
+	auto result = packed.substr(header, size);
+	packed.remove_prefix(header + size);
+	return result;
+}
+
+std::optional<Blob> public_blob_from_reply(const redis::Reply& row)
+{
+	std::error_code err;
+	auto [owner, blob, coll, entry_str] = row.as_tuple<4>(err);
+
+	std::optional<Blob> result;
+	if (auto blob_id = ObjectID::from_raw(blob.as_string()); !err && blob_id.has_value())
+	{
+		BlobInodeDB inode{entry_str.as_string()};
+		if (auto fields = inode.fields(); fields.has_value())
+			result.emplace(
+				std::string{owner.as_string()},
+				std::string{coll.as_string()},
+				*blob_id,
+				*fields
+			);
+	}
+	return result;
+}
+
+} // end of local namespace
 
 Ownership::Ownership(std::string_view name) : m_user{name}
 {
@@ -66,6 +292,38 @@ Collection Ownership::from_reply(
 	return result;
 }
 
+Collection Ownership::collection_from_reply(
+	const redis::Reply& reply,
+	std::string_view coll,
+	const Authentication& requester,
+	std::error_code& ec
+) const
+{
+	if (!reply || ec)
+		Log(LOG_WARNING, "Ownership::find_collection() script reply %1% %2%", reply.as_error(), ec);
+
+	// This should never happen unless the redis server has bugs.
+	if (reply.array_size() != 2)
+	{
+		ec = hrb::make_error_code(Error::redis_command_error);
+		return {};
+	}
+
+	// in some error cases created by unit tests, the string is not valid JSON
+	// in the database
+	auto meta = nlohmann::json::parse(reply[1].as_string(), nullptr, false);
+	if (meta.is_discarded())
+		meta = nlohmann::json::object();
+
+	if (!meta.is_object())
+	{
+		Log(LOG_WARNING, "invalid meta data for collection %1%: %2%", coll, reply[1].as_string());
+		meta = nlohmann::json::object();
+	}
+
+	return from_reply(reply[0], coll, requester, std::move(meta));
+}
+
 void Ownership::update_blob(redis::Connection& db, const ObjectID& blobid, const BlobInode& entry)
 {
 	// assume the blob is already in the collection, so there is no need to update
@@ -82,9 +340,18 @@ void Ownership::update_blob(redis::Connection& db, const ObjectID& blobid, const
 	update(db, blobid, BlobInodeDB{en_str});
 }
 
+void Ownership::invalidate(redis::Connection& db, std::initializer_list<std::string_view> colls) const
+{
+	db.invalidate(key::blob_inode(m_user));
+	db.invalidate(key::collection_list(m_user));
+	for (auto coll : colls)
+		db.invalidate(key::collection(m_user, coll));
+}
+
 void Ownership::update(redis::Connection& db, const ObjectID& blob, const BlobInodeDB& entry)
 {
 	auto blob_meta  = key::blob_inode(m_user);
+	invalidate(db);
 	db.command(
 		"HSET %b %b %b",
 		blob_meta.data(), blob_meta.size(),
@@ -105,22 +372,8 @@ redis::CommandString Ownership::link_command(std::string_view coll, const Object
 
 	auto filename = coll_entry.filename.empty() ? "hello" : coll_entry.filename;
 
-	static const char lua[] = R"__(
-		local blob_ref, blob_owner, blob_meta, coll_key, coll_list = KEYS[1], KEYS[2], KEYS[3], KEYS[4], KEYS[5]
-		local user, coll, blob, cover, entry, filename = ARGV[1], ARGV[2], ARGV[3], ARGV[4], ARGV[5], ARGV[6]
-
-		redis.call('SADD',   blob_ref,   coll)
-		redis.call('SADD',   blob_owner, user)
-
-		if entry ~= nil and entry ~= '' then
-			redis.call('HSETNX', blob_meta,  blob, entry)
-		end
-
-		redis.call('HSET',   coll_key,  blob, filename)
-		redis.call('HSETNX', coll_list, coll, cjson.encode({cover=cover}))
-	)__";
 	return redis::CommandString{
-		"EVAL %s 5 %b %b %b %b %b   %b %b %b %b %b %b", lua,
+		link_script, "5 %b %b %b %b %b   %b %b %b %b %b %b",
 
 		blob_ref.data(), blob_ref.size(),
 		blob_owner.data(), blob_owner.size(),
@@ -145,22 +398,8 @@ redis::CommandString Ownership::move_command(std::string_view src, std::string_v
 	auto coll_list  = key::collection_list(m_user);
 	auto hex = to_hex(blob);
 
-	static const char lua[] = R"__(
-		local blob_ref, src_key, dest_key, coll_list = KEYS[1], KEYS[2], KEYS[3], KEYS[4]
-		local src_coll, dest_coll, blob, cover = ARGV[1], ARGV[2], ARGV[3], ARGV[4]
-
-		redis.call('SADD',   blob_ref,   dest_coll)
-		redis.call('SREM',   blob_ref,   src_coll)
-
-		local filename = redis.call('HGET', src_key, blob)
-
-		redis.call('HSET',   dest_key,   blob,  filename)
-		redis.call('HDEL',   src_key,    blob)
-
-		redis.call('HSETNX', coll_list, dest_coll, cjson.encode({cover=cover}))
-	)__";
 	return redis::CommandString{
-		"EVAL %s 4 %b %b %b %b   %b %b %b %b", lua,
+		move_script, "4 %b %b %b %b   %b %b %b %b",
 
 		blob_ref.data(), blob_ref.size(),
 		src_key.data(), src_key.size(),
@@ -183,55 +422,8 @@ redis::CommandString Ownership::unlink_command(std::string_view coll, const Obje
 	auto coll_list  = key::collection_list(m_user);
 	auto public_blobs = key::public_blobs();
 
-	static const char lua[] = R"__(
-		-- convert binary to lowercase hex string
-		local tohex = function(str)
-			return (str:gsub('.', function (c)
-				return string.format('%02x', string.byte(c))
-			end))
-		end
-
-		local blob_ref, blob_owner, blob_meta, coll_hash, coll_list, pub_list = KEYS[1], KEYS[2], KEYS[3], KEYS[4], KEYS[5], KEYS[6]
-		local user, coll, blob = ARGV[1], ARGV[2], ARGV[3]
-
-		-- delete the link from blob-refs
-		redis.call('SREM', blob_ref, coll)
-
-		-- if there is no more links to this blob to other collections, we can remove the blob
-		-- for this user and remove the blob from the public list
-		if redis.call('EXISTS', blob_ref) == 0 then
-			redis.call('SREM', blob_owner, user)
-			redis.call('HDEL', blob_meta, blob)
-			redis.call('LREM', pub_list, 0, cmsgpack.pack(user, blob))
-		end
-
-		-- delete the blob in the collection hash
-		redis.call('HDEL', coll_hash, blob)
-
-		-- if the collection has no more entries, delete the collection in the
-		-- user's list of collections
-		if redis.call('EXISTS', coll_hash) == 0 then
-			redis.call('HDEL', coll_list, coll)
-
-		-- if the collection still exists, check if the blob we are removing
-		-- is the cover of the collection
-		else
-			local album = cjson.decode(redis.call('HGET', coll_list, coll))
-
-			-- The intent here is to select a random image as the cover
-			-- as the original cover is removed.
-			-- However, we can't use SRANDMEMBER to select a random image
-			-- in the album because it is not deterministic, and non-deter-
-			-- ministic commands may break replication. We have no choice
-			-- but to use the slower SMEMBERS and take the first element.
-			if album['cover'] == tohex(blob) then
-				album['cover'] = tohex(redis.call('HKEYS', coll_hash)[1])
-				redis.call('HSET', coll_list, coll, cjson.encode(album))
-			end
-		end
-	)__";
 	return redis::CommandString{
-		"EVAL %s 6 %b %b %b %b %b %b   %b %b %b", lua,
+		unlink_script, "6 %b %b %b %b %b %b   %b %b %b",
 
 		blob_ref.data(), blob_ref.size(),
 		blob_owner.data(), blob_owner.size(),
@@ -252,24 +444,8 @@ redis::CommandString Ownership::scan_collection_command(std::string_view coll) c
 	auto coll_list = key::collection_list(m_user);
 	auto blob_meta = key::blob_inode(m_user);
 
-	static const char lua[] = R"__(
-		local coll_hash, coll_list, blob_meta = KEYS[1], KEYS[2], KEYS[3]
-		local coll = ARGV[1]
-		local dirs = {}
-		for i, v in ipairs(redis.call('HGETALL', coll_hash)) do
-			if i % 2 == 1 then
-				-- v is the blob ID
-				table.insert(dirs, v)
-				table.insert(dirs, redis.call('HGET', blob_meta, v))
-			else
-				-- v is the filename
-				table.insert(dirs, v)
-			end
-		end
-		return {dirs, redis.call('HGET', coll_list, coll)}
-	)__";
 	return redis::CommandString{
-		"EVAL %s 3 %b %b %b   %b", lua,
+		scan_collection_script, "3 %b %b %b   %b",
 		coll_hash.data(), coll_hash.size(),
 		coll_list.data(), coll_list.size(),
 		blob_meta.data(), blob_meta.size(),
@@ -283,25 +459,8 @@ redis::CommandString Ownership::set_permission_command(const ObjectID& blobid, P
 	auto blob_meta = key::blob_inode(m_user);
 	auto pub_list  = key::public_blobs();
 
-	static const char lua[] = R"__(
-		local user, blob, perm = ARGV[1], ARGV[2], ARGV[3]
-
-		local original = redis.call('HGET', KEYS[2], blob)
-		local updated  = perm .. string.sub(original, 2, -1)
-		redis.call('HSET', KEYS[2], blob, updated)
-
-		local msgpack = cmsgpack.pack(user, blob)
-		if perm == '*' then
-			redis.call('LREM', KEYS[1], 0, msgpack)
-			if redis.call('RPUSH', KEYS[1], msgpack) > 100 then
-				redis.call('LPOP', KEYS[1])
-			end
-		else
-			redis.call('LREM', KEYS[1], 0, msgpack)
-		end
-	)__";
 	return redis::CommandString{
-		"EVAL %s 2 %b %b  %b %b %b", lua,
+		set_permission_script, "2 %b %b  %b %b %b",
 		pub_list.data(), pub_list.size(),   // KEYS[1]: list of public blob IDs
 		blob_meta.data(), blob_meta.size(), // KEYS[2]: blob inode
 
@@ -317,27 +476,8 @@ redis::CommandString Ownership::set_cover_command(std::string_view coll, const O
 	auto coll_hash = key::collection(m_user, coll);
 	auto cover_hex = to_hex(cover);
 
-	// set the cover of the collection
-	// only set the cover if the collection is already in the dirs:<user> hash
-	// and only if the cover blob is already in the collection (i.e. dir:<user>:<collection> hash)
-	static const char lua[] = R"__(
-		local coll_list, coll_hash = KEYS[1], KEYS[2]
-		local coll, cover_hex, cover = ARGV[1], ARGV[2], ARGV[3]
-
-		local json    = redis.call('HGET', coll_list, coll)
-		local in_coll = redis.call('HEXISTS', coll_hash, cover)
-		if json and in_coll == 1 then
-			local album = cjson.decode(json)
-			album['cover'] = cover_hex
-			redis.call('HSET', coll_list, coll, cjson.encode(album))
-
-			return 1
-		else
-			return 0
-		end
-	)__";
 	return redis::CommandString{
-	"EVAL %s 2 %b %b    %b %b %b", lua,
+	set_cover_script, "2 %b %b    %b %b %b",
 		coll_list.data(), coll_list.size(),
 		coll_hash.data(), coll_hash.size(),
 
@@ -347,28 +487,136 @@ redis::CommandString Ownership::set_cover_command(std::string_view coll, const O
 	};
 }
 
-redis::CommandString Ownership::list_public_blob_command() const
+redis::CommandString Ownership::get_blob_command(std::string_view coll, const ObjectID& blob) const
 {
-		static const char lua[] = R"__(
-		local elements = {}
-		local pub_list = redis.call('LRANGE', KEYS[1], 0, -1)
-		for i, msgpack in ipairs(pub_list) do
-			local user, blob = cmsgpack.unpack(msgpack)
-			if user and blob then
-				table.insert(elements, {
-					user, blob,
-					redis.call('SRANDMEMBER', 'blob-refs:' .. user .. ':' .. blob),
-					redis.call('HGET', 'blob-inodes:' .. user, blob)
-				})
-			end
-		end
-		return elements
-	)__";
+	auto coll_hash = key::collection(m_user, coll);
+	auto blob_meta = key::blob_inode(m_user);
+
 	return redis::CommandString{
-		"EVAL %s 1 %b",
-		lua,
-		key::public_blobs().data(), key::public_blobs().size()
+		get_blob_script, "2 %b %b %b",
+		coll_hash.data(), coll_hash.size(),
+		blob_meta.data(), blob_meta.size(),
+		blob.data(), blob.size()
+	};
+}
+
+redis::CommandString Ownership::query_blob_command(const ObjectID& blob) const
+{
+	auto blob_ref   = key::blob_refs(m_user, blob);
+	auto blob_meta  = key::blob_inode(m_user);
+
+	return redis::CommandString{
+		query_blob_script, "2 %b %b  %b",
+		blob_ref.data(),  blob_ref.size(),      // KEYS[1]
+		blob_meta.data(), blob_meta.size(),     // KEYS[2]
+		blob.data(), blob.size()
 	};
 }
 
+redis::CommandString Ownership::public_blob_command(const std::vector<std::string_view>& user_blobs)
+{
+	assert(user_blobs.size() % 2 == 0);
+
+	std::vector<std::string> keys;
+	std::vector<std::string_view> args;
+	for (auto i = 0U; i+1 < user_blobs.size(); i += 2)
+	{
+		if (auto blob = ObjectID::from_raw(user_blobs[i+1]); blob.has_value())
+		{
+			keys.push_back(key::blob_refs(user_blobs[i], *blob));
+			keys.push_back(key::blob_inode(std::string{user_blobs[i]}));
+			args.push_back(user_blobs[i]);
+			args.push_back(user_blobs[i+1]);
+		}
+	}
+
+	// KEYS go before ARGV
+	args.insert(args.begin(), keys.begin(), keys.end());
+	return redis::CommandString{public_blob_script, keys.size(), args};
+}
+
+void Ownership::find_public_blobs(
+	redis::ShardedConnection& db,
+	std::function<void(std::vector<Blob>&&, std::error_code)>&& complete
+)
+{
+	// Each shard keeps the public blobs of its own users. Read the public lists of all
+	// shards, and then the blobs from the shards of their owners. The replies come in any
+	// order, so the blobs are sorted by their timestamps after all of them are received.
+	struct Result
+	{
+		std::vector<Blob>   blobs;
+		std::error_code     ec;
+		std::size_t         pending;
+		std::function<void(std::vector<Blob>&&, std::error_code)> complete;
+
+		void done()
+		{
+			if (--pending > 0)
+				return;
+
+			std::sort(blobs.begin(), blobs.end(), [](const Blob& a, const Blob& b)
+			{
+				return std::tie(a.info().timestamp, a.owner(), a.id()) <
+					std::tie(b.info().timestamp, b.owner(), b.id());
+			});
+			complete(std::move(blobs), ec);
+		}
+	};
+	auto result = std::make_shared<Result>(Result{{}, {}, db.size(), std::move(complete)});
+
+	auto on_blobs = [result](redis::Reply&& reply, std::error_code ec)
+	{
+		if (!reply)
+			Log(LOG_WARNING, "list_public_blobs() script return %1%", reply.as_error());
+		if (ec)
+			result->ec = ec;
+
+		for (auto&& row : reply)
+			if (auto blob = public_blob_from_reply(row); blob.has_value())
+				result->blobs.push_back(std::move(*blob));
+
+		result->done();
+	};
+
+	for (auto i = 0U; i < db.size(); i++)
+	{
+		db.read_shard(i).command(
+			[result, on_blobs, db=db.shared_from_this()](redis::Reply&& list, std::error_code ec)
+			{
+				if (ec)
+					result->ec = ec;
+
+				// The users in the public list should be in this shard, unless they are
+				// moved to a new shard. Look up the blobs in the shards of their owners anyway.
+				std::vector<std::vector<std::string_view>> user_blobs(db->size());
+				for (auto&& entry : list)
+				{
+					auto packed = entry.as_string();
+					auto user = unpack_string(packed);
+					auto blob = unpack_string(packed);
+					if (user && blob)
+					{
+						auto& shard = user_blobs[db->find(*user)];
+						shard.push_back(*user);
+						shard.push_back(*blob);
+					}
+				}
+
+				for (auto shard = 0U; shard < user_blobs.size(); shard++)
+				{
+					if (!user_blobs[shard].empty())
+					{
+						result->pending++;
+						db->read_shard(shard).command(on_blobs, public_blob_command(user_blobs[shard]));
+					}
+				}
+
+				result->done();
+			},
+			"LRANGE %b 0 -1", key::public_blobs().data(), key::public_blobs().size()
+		);
+	}
+}
+
 } // end of namespace hrb
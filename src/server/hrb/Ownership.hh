@@ -17,10 +17,13 @@
 
 #include <string_view>
 #include <functional>
+#include <system_error>
+#include <vector>
 
 namespace hrb {
 namespace redis {
 class Connection;
+class ShardedConnection;
 class CommandString;
 class Reply;
 }
@@ -28,10 +31,15 @@ class Reply;
 class Authentication;
 class Permission;
 class BlobInode;
+class Blob;
 class Collection;
 class CollectionList;
 
 /// Encapsulate all blobs owned by a user.
+/// All keys of a user are stored in the same shard, so the scripts never touch the keys
+/// of another user. The connections passed to the member functions must be the one to
+/// the shard of the user, i.e. ShardedConnection::at(user). The functions that only read,
+/// e.g. get_collection() and get_blob(), can use ShardedConnection::read(user) instead.
 class Ownership
 {
 private:
@@ -41,8 +49,18 @@ private:
 	[[nodiscard]] redis::CommandString scan_collection_command(std::string_view coll) const;
 	[[nodiscard]] redis::CommandString set_permission_command(const ObjectID& blobid, Permission perm) const;
 	[[nodiscard]] redis::CommandString set_cover_command(std::string_view coll, const ObjectID& cover) const;
-	[[nodiscard]] redis::CommandString list_public_blob_command() const;
+	[[nodiscard]] static redis::CommandString public_blob_command(const std::vector<std::string_view>& user_blobs);
+	[[nodiscard]] redis::CommandString get_blob_command(std::string_view coll, const ObjectID& blob) const;
+	[[nodiscard]] redis::CommandString query_blob_command(const ObjectID& blob) const;
 	void update(redis::Connection& db, const ObjectID& blobid, const BlobInodeDB& entry);
+	static void find_public_blobs(
+		redis::ShardedConnection& db,
+		std::function<void(std::vector<Blob>&&, std::error_code)>&& complete
+	);
+
+	// Drop the cached blob inodes and collection list of the user, and the cached
+	// collections in \a colls, before changing them.
+	void invalidate(redis::Connection& db, std::initializer_list<std::string_view> colls = {}) const;
 
 	[[nodiscard]] Collection from_reply(
 		const redis::Reply& hash_getall_reply,
@@ -51,6 +69,14 @@ private:
 		nlohmann::json&& meta
 	) const;
 
+	// Convert the reply of scan_collection_command(). \a ec is set if the reply is invalid.
+	[[nodiscard]] Collection collection_from_reply(
+		const redis::Reply& reply,
+		std::string_view coll,
+		const Authentication& requester,
+		std::error_code& ec
+	) const;
+
 public:
 	explicit Ownership(std::string_view name);
 
@@ -164,9 +190,10 @@ public:
 		Complete&& complete
 	) const;
 
+	/// Public blobs of all users in all shards
 	template <typename Complete>
 	void list_public_blobs(
-		redis::Connection& db,
+		redis::ShardedConnection& db,
 		Complete&& complete
 	);
 
@@ -177,6 +204,44 @@ public:
 		Complete&& complete
 	);
 
+	// Awaitable versions of the functions above for coroutines, see redis::CommandAwaiter.
+	// The result of co_await is the argument of the completion routine, or a tuple of
+	// them if there is more than one. Unlike the arguments of the completion routines,
+	// the results do not refer to the redis reply.
+	[[nodiscard]] auto async_link_blob(
+		redis::Connection& db,
+		std::string_view coll,
+		const ObjectID& blobid,
+		const BlobInode& entry
+	);
+	[[nodiscard]] auto async_unlink_blob(redis::Connection& db, std::string_view coll, const ObjectID& blobid);
+	[[nodiscard]] auto async_rename_blob(
+		redis::Connection& db,
+		std::string_view coll,
+		const ObjectID& blobid,
+		std::string_view filename
+	);
+	[[nodiscard]] auto async_set_permission(redis::Connection& db, const ObjectID& blobid, Permission perm);
+	[[nodiscard]] auto async_move_blob(
+		redis::Connection& db,
+		std::string_view src_coll,
+		std::string_view dest_coll,
+		const ObjectID& blobid
+	);
+	[[nodiscard]] auto async_get_collection(
+		redis::Connection& db,
+		const Authentication& requester,
+		std::string_view coll
+	) const;
+	[[nodiscard]] auto async_get_blob(redis::Connection& db, std::string_view coll, const ObjectID& blob) const;
+	[[nodiscard]] auto async_get_blob(redis::Connection& db, const Authentication& requester, const ObjectID& blob) const;
+	[[nodiscard]] auto async_set_cover(redis::Connection& db, std::string_view coll, const ObjectID& blob) const;
+	[[nodiscard]] auto async_query_blob(redis::Connection& db, const ObjectID& blob) const;
+
+	/// Scan one page of the collections of the user and add them to \a colls. The result
+	/// of co_await is the cursor of the next page, which is 0 after the last page.
+	[[nodiscard]] auto async_scan_collections(redis::Connection& db, long cursor, CollectionList& colls) const;
+
 	[[nodiscard]] auto& user() const {return m_user;}
 
 private:
@@ -30,6 +30,7 @@
 #include <boost/range/adaptor/filtered.hpp>
 #include <boost/range/adaptor/transformed.hpp>
 
+#include <tuple>
 #include <vector>
 
 #pragma once
@@ -45,6 +46,7 @@ void Ownership::link_blob(
 	Complete&& complete
 )
 {
+	invalidate(db, {coll});
 	db.command(
 		[comp=std::forward<Complete>(complete)](auto&& r, std::error_code ec)
 		{
@@ -62,6 +64,7 @@ void Ownership::unlink_blob(
 	Complete&& complete
 )
 {
+	invalidate(db, {coll});
 	db.do_write(
 		unlink_command(coll, blobid),
 		[comp=std::forward<Complete>(complete)](auto&& reply, std::error_code ec)
@@ -81,36 +84,16 @@ void Ownership::get_collection(
 	Complete&& complete
 ) const
 {
-	db.command(
+	db.cached(
 		[
 			comp=std::forward<Complete>(complete), *this,
 			requester, coll=std::string{coll}
 		](auto&& reply, std::error_code&& ec) mutable
 		{
-			if (!reply || ec)
-				Log(LOG_WARNING, "Ownership::find_collection() script reply %1% %2%", reply.as_error(), ec);
-
-			if (reply.array_size() == 2)
-			{
-				// in some error cases created by unit tests, the string is not valid JSON
-				// in the database
-				auto meta = nlohmann::json::parse(reply[1].as_string(), nullptr, false);
-				if (meta.is_discarded())
-					meta = nlohmann::json::object();
-
-				if (!meta.is_object())
-				{
-					Log(LOG_WARNING, "invalid meta data for collection %1%: %2%", coll, reply[1].as_string());
-					meta = nlohmann::json::object();
-				}
-
-				comp(from_reply(reply[0], coll, requester, std::move(meta)), ec);
-			}
-
-			// This should never happen unless the redis server has bugs.
-			else
-				comp(Collection{}, hrb::make_error_code(Error::redis_command_error));
+			auto result = collection_from_reply(reply, coll, requester, ec);
+			comp(std::move(result), ec);
 		},
+		{key::collection(m_user, coll), key::collection_list(m_user), key::blob_inode(m_user)},
 		scan_collection_command(coll)
 	);
 
@@ -126,6 +109,7 @@ void Ownership::rename_blob(
 )
 {
 	auto coll_hash = key::collection(m_user, coll);
+	db.invalidate(coll_hash);
 	db.command([comp=std::forward<Complete>(complete)](auto&&, std::error_code ec)
 		{
 			comp(ec);
@@ -145,16 +129,7 @@ void Ownership::get_blob(
 	Complete&& complete
 ) const
 {
-	auto coll_hash = key::collection(m_user, coll);
-	auto blob_meta = key::blob_inode(m_user);
-	static const char lua[] = R"__(
-		if redis.call('HEXISTS', KEYS[1], ARGV[1]) == 1 then
-			return {redis.call('HGET', KEYS[2], ARGV[1]), redis.call('HGET', KEYS[1], ARGV[1])}
-		else
-			return false
-		end
-	)__";
-	db.command(
+	db.cached(
 		[
 			comp=std::forward<Complete>(complete)
 		](auto&& entry, std::error_code ec) mutable
@@ -164,10 +139,8 @@ void Ownership::get_blob(
 			else
 				comp(BlobInodeDB{}, "", make_error_code(Error::object_not_exist));
 		},
-		"EVAL %s 2 %b %b %b", lua,
-		coll_hash.data(), coll_hash.size(),
-		blob_meta.data(), blob_meta.size(),
-		blob.data(), blob.size()
+		{key::collection(m_user, coll), key::blob_inode(m_user)},
+		get_blob_command(coll, blob)
 	);
 }
 
@@ -179,8 +152,15 @@ void Ownership::get_blob(
 	Complete&& complete
 ) const
 {
+	// Most requests of the blobs are permission checks like this one, e.g. when showing
+	// the thumbnails of a collection. They can be served by the cache without asking redis.
 	auto blob_inode = key::blob_inode(m_user);
-	db.command(
+	redis::CommandString hget{
+		"HGET %b %b",
+		blob_inode.data(), blob_inode.size(),
+		blob.data(), blob.size()
+	};
+	db.cached(
 		[comp=std::forward<Complete>(complete), requester, *this](redis::Reply&& reply, std::error_code ec) mutable
 		{
 			if (ec || !reply.is_string())
@@ -193,9 +173,8 @@ void Ownership::get_blob(
 					comp(BlobInodeDB{}, make_error_code(Error::object_not_exist));
 			}
 		},
-		"HGET %b %b",
-		blob_inode.data(), blob_inode.size(),
-		blob.data(), blob.size()
+		{std::move(blob_inode)},
+		std::move(hget)
 	);
 }
 
@@ -208,7 +187,8 @@ void Ownership::scan_collections(
 ) const
 {
 	auto coll_list = key::collection_list(m_user);
-	db.command(
+	redis::CommandString hscan{"HSCAN %b %d", coll_list.data(), coll_list.size(), cursor};
+	db.cached(
 		[
 			comp=std::forward<Complete>(complete),
 			callback=std::forward<CollectionCallback>(callback),
@@ -239,9 +219,8 @@ void Ownership::scan_collections(
 
 			comp(0, ec);
 		},
-		"HSCAN %b %d",
-		coll_list.data(), coll_list.size(),
-		cursor
+		{std::move(coll_list)},
+		std::move(hscan)
 	);
 }
 
@@ -275,6 +254,7 @@ void Ownership::set_permission(
 	Complete&& complete
 )
 {
+	invalidate(db);
 	db.command(
 		[comp=std::forward<Complete>(complete)](auto&& reply, auto ec) mutable
 		{
@@ -295,6 +275,7 @@ void Ownership::move_blob(
 	Complete&& complete
 )
 {
+	invalidate(db, {src_coll, dest_coll});
 	db.command(
 		[
 			comp=std::forward<Complete>(complete),
@@ -311,64 +292,22 @@ void Ownership::move_blob(
 
 template <typename Complete>
 void Ownership::list_public_blobs(
-	redis::Connection& db,
+	redis::ShardedConnection& db,
 	Complete&& complete
 )
 {
-	db.command(
-		[comp=std::forward<Complete>(complete)](auto&& reply, auto ec) mutable
-		{
-			if (!reply)
-				Log(LOG_WARNING, "list_public_blobs() script return %1%", reply.as_error());
-
-			using namespace boost::adaptors;
-			comp(
-				reply |
-				transformed([](const redis::Reply& row)
-				{
-					std::error_code err;
-					auto [owner, blob, coll, entry_str] = row.as_tuple<4>(err);
-
-					std::optional<Blob> result;
-					if (auto blob_id = ObjectID::from_raw(blob.as_string()); !err && blob_id.has_value())
-					{
-						BlobInodeDB inode{entry_str.as_string()};
-						if (auto fields = inode.fields(); fields.has_value())
-							result.emplace(
-								std::string{owner.as_string()},
-								std::string{coll.as_string()},
-								*blob_id,
-								*fields
-							);
-					}
-
-					return result;
-				}) |
-				filtered([](auto&& opt){return opt.has_value();}) |
-				transformed([](auto&& opt){return *opt;}),
-				ec
-			);
-		},
-		list_public_blob_command()
-	);
+	// std::function requires the completion routine to be copyable
+	find_public_blobs(db, [
+		comp=std::make_shared<std::decay_t<Complete>>(std::forward<Complete>(complete))
+	](std::vector<Blob>&& blobs, std::error_code ec)
+	{
+		(*comp)(std::move(blobs), ec);
+	});
 }
 
-
 template <typename Complete>
 void Ownership::query_blob(redis::Connection& db, const ObjectID& blob, Complete&& complete)
 {
-	auto blob_ref   = key::blob_refs(m_user, blob);
-	auto blob_meta  = key::blob_inode(m_user);
-
-	static const char lua[] = R"__(
-		local dirs = {}
-		for k, coll in ipairs(redis.call('SMEMBERS', KEYS[1])) do
-			table.insert(dirs, coll)
-			table.insert(dirs, redis.call('HGET', KEYS[2], ARGV[1]))
-		end
-		return dirs
-	)__";
-
 	db.command(
 		[*this, blob, comp=std::forward<Complete>(complete)](auto&& reply, auto ec)
 		{
@@ -390,17 +329,14 @@ void Ownership::query_blob(redis::Connection& db, const ObjectID& blob, Complete
 				ec
 			);
 		},
-		"EVAL %s 2 %b %b  %b",
-		lua,
-		blob_ref.data(),  blob_ref.size(),      // KEYS[1]
-		blob_meta.data(), blob_meta.size(),     // KEYS[2]
-		blob.data(), blob.size()
+		query_blob_command(blob)
 	);
 }
 
 template <typename Complete, typename>
 void Ownership::set_cover(redis::Connection& db, std::string_view coll, const ObjectID& blob, Complete&& complete) const
 {
+	invalidate(db);
 	db.command(
 		[comp=std::forward<Complete>(complete)](auto&& reply, auto ec)
 		{
@@ -413,4 +349,190 @@ void Ownership::set_cover(redis::Connection& db, std::string_view coll, const Ob
 	);
 }
 
+inline auto Ownership::async_link_blob(
+	redis::Connection& db,
+	std::string_view coll,
+	const ObjectID& blobid,
+	const BlobInode& entry
+)
+{
+	invalidate(db, {coll});
+	return db.async_command(link_command(coll, blobid, entry), [](redis::Reply&&, std::error_code ec)
+	{
+		return ec;
+	});
+}
+
+inline auto Ownership::async_unlink_blob(redis::Connection& db, std::string_view coll, const ObjectID& blobid)
+{
+	invalidate(db, {coll});
+	return db.async_command(unlink_command(coll, blobid), [](redis::Reply&& reply, std::error_code ec)
+	{
+		if (!reply || ec)
+			Log(LOG_WARNING, "Ownership::unlink() script reply %1% %2%", reply.as_error(), ec);
+		return ec;
+	});
+}
+
+inline auto Ownership::async_rename_blob(
+	redis::Connection& db,
+	std::string_view coll,
+	const ObjectID& blobid,
+	std::string_view filename
+)
+{
+	auto coll_hash = key::collection(m_user, coll);
+	db.invalidate(coll_hash);
+	return db.async_command(
+		redis::CommandString{
+			"HSET %b %b %b",
+			coll_hash.data(), coll_hash.size(),
+			blobid.data(), blobid.size(),
+			filename.data(), filename.size()
+		},
+		[](redis::Reply&&, std::error_code ec)
+		{
+			return ec;
+		}
+	);
+}
+
+inline auto Ownership::async_set_permission(redis::Connection& db, const ObjectID& blobid, Permission perm)
+{
+	invalidate(db);
+	return db.async_command(set_permission_command(blobid, perm), [](redis::Reply&& reply, std::error_code ec)
+	{
+		if (!reply)
+			Log(LOG_WARNING, "Collection::set_permission(): script error: %1%", reply.as_error());
+		return ec;
+	});
+}
+
+inline auto Ownership::async_move_blob(
+	redis::Connection& db,
+	std::string_view src_coll,
+	std::string_view dest_coll,
+	const ObjectID& blobid
+)
+{
+	invalidate(db, {src_coll, dest_coll});
+	return db.async_command(move_command(src_coll, dest_coll, blobid), [](redis::Reply&& reply, std::error_code ec)
+	{
+		if (!reply)
+			Log(LOG_WARNING, "Collection::move_blob(): script error: %1%", reply.as_error());
+		return ec;
+	});
+}
+
+inline auto Ownership::async_get_collection(
+	redis::Connection& db,
+	const Authentication& requester,
+	std::string_view coll
+) const
+{
+	return db.async_cached(
+		{key::collection(m_user, coll), key::collection_list(m_user), key::blob_inode(m_user)},
+		scan_collection_command(coll),
+		[*this, requester, coll=std::string{coll}](redis::Reply&& reply, std::error_code ec)
+		{
+			auto result = collection_from_reply(reply, coll, requester, ec);
+			return std::make_tuple(std::move(result), ec);
+		}
+	);
+}
+
+inline auto Ownership::async_get_blob(redis::Connection& db, std::string_view coll, const ObjectID& blob) const
+{
+	return db.async_cached(
+		{key::collection(m_user, coll), key::blob_inode(m_user)},
+		get_blob_command(coll, blob),
+		[](redis::Reply&& entry, std::error_code ec)
+		{
+			if (!ec && entry.array_size() == 2)
+				return std::make_tuple(BlobInodeDB{entry[0].as_string()}, std::string{entry[1].as_string()}, ec);
+			else
+				return std::make_tuple(BlobInodeDB{}, std::string{}, make_error_code(Error::object_not_exist));
+		}
+	);
+}
+
+inline auto Ownership::async_get_blob(redis::Connection& db, const Authentication& requester, const ObjectID& blob) const
+{
+	auto blob_inode = key::blob_inode(m_user);
+	redis::CommandString hget{
+		"HGET %b %b",
+		blob_inode.data(), blob_inode.size(),
+		blob.data(), blob.size()
+	};
+	return db.async_cached(
+		{std::move(blob_inode)},
+		std::move(hget),
+		[requester, user=m_user](redis::Reply&& reply, std::error_code ec)
+		{
+			if (!ec && reply.is_string())
+			{
+				if (BlobInodeDB entry{reply.as_string()}; entry.permission().allow(requester.id(), user))
+					return std::make_tuple(std::move(entry), ec);
+			}
+			return std::make_tuple(BlobInodeDB{}, make_error_code(Error::object_not_exist));
+		}
+	);
+}
+
+inline auto Ownership::async_set_cover(redis::Connection& db, std::string_view coll, const ObjectID& blob) const
+{
+	invalidate(db);
+	return db.async_command(set_cover_command(coll, blob), [](redis::Reply&& reply, std::error_code ec)
+	{
+		if (!reply || ec)
+			Log(LOG_WARNING, "set_cover(): reply %1% %2%", reply.as_error(), ec);
+
+		return std::make_tuple(reply.as_int() == 1, ec);
+	});
+}
+
+inline auto Ownership::async_query_blob(redis::Connection& db, const ObjectID& blob) const
+{
+	return db.async_command(query_blob_command(blob), [user=m_user, blob](redis::Reply&& reply, std::error_code ec)
+	{
+		if (!reply)
+			Log(LOG_WARNING, "query_blob() script reply: %1%", reply.as_error());
+
+		std::vector<Blob> result;
+		for (auto&& kv : reply.kv_pairs())
+		{
+			BlobInodeDB inode{kv.value().as_string()};
+			if (auto fields = inode.fields(); fields.has_value())
+				result.emplace_back(user, std::string{kv.key()}, blob, *fields);
+		}
+		return std::make_tuple(std::move(result), ec);
+	});
+}
+
+inline auto Ownership::async_scan_collections(redis::Connection& db, long cursor, CollectionList& colls) const
+{
+	auto coll_list = key::collection_list(m_user);
+	redis::CommandString hscan{"HSCAN %b %d", coll_list.data(), coll_list.size(), cursor};
+	return db.async_cached(
+		{std::move(coll_list)},
+		std::move(hscan),
+		[&colls, user=m_user](redis::Reply&& reply, std::error_code ec)
+		{
+			auto next = 0L;
+			if (!ec)
+			{
+				auto [cursor_reply, dirs] = reply.as_tuple<2>(ec);
+				if (!ec)
+				{
+					next = cursor_reply.to_int();
+					for (auto&& p : dirs.kv_pairs())
+						if (auto sv = p.value().as_string(); !sv.empty())
+							colls.add(user, p.key(), nlohmann::json::parse(sv));
+				}
+			}
+			return std::make_tuple(next, ec);
+		}
+	);
+}
+
 } // end of namespace
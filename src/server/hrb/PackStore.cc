@@ -0,0 +1,580 @@
+/*
+	Copyright © 2018 Wan Wai Ho <me@nestal.net>
+
+	This file is subject to the terms and conditions of the GNU General Public
+	License.  See the file COPYING in the main directory of the hearty_rabbit
+	distribution for more details.
+*/
+
+//
+// Created by nestal on 31/10/18.
+//
+
+#include "PackStore.hh"
+
+#include "util/Log.hh"
+
+#include <boost/asio/post.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <charconv>
+#include <cstring>
+#include <mutex>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace hrb {
+
+namespace {
+
+const std::string_view segment_prefix{"segment-"};
+
+std::uint64_t align_page(std::uint64_t offset)
+{
+	auto page = MMap::page_size();
+	return (offset + page - 1) / page * page;
+}
+
+int open_file(const fs::path& path, int flags, std::error_code& ec)
+{
+	auto fd = ::open(path.c_str(), flags | O_CLOEXEC, 0644);
+	if (fd < 0)
+		ec.assign(errno, std::generic_category());
+	return fd;
+}
+
+std::uint64_t file_size(int fd, std::error_code& ec)
+{
+	struct stat st{};
+	if (::fstat(fd, &st) != 0)
+	{
+		ec.assign(errno, std::generic_category());
+		return 0;
+	}
+	return static_cast<std::uint64_t>(st.st_size);
+}
+
+void write_all(int fd, const void *data, std::size_t size, std::uint64_t offset, std::error_code& ec)
+{
+	auto src = static_cast<const char*>(data);
+	while (size > 0)
+	{
+		auto result = ::pwrite(fd, src, size, static_cast<off_t>(offset));
+		if (result < 0 && errno == EINTR)
+			continue;
+		if (result <= 0)
+			return ec.assign(errno ? errno : EIO, std::generic_category());
+
+		src    += result;
+		size   -= static_cast<std::size_t>(result);
+		offset += static_cast<std::uint64_t>(result);
+	}
+}
+
+void read_all(int fd, void *data, std::size_t size, std::uint64_t offset, std::error_code& ec)
+{
+	auto dest = static_cast<char*>(data);
+	while (size > 0)
+	{
+		auto result = ::pread(fd, dest, size, static_cast<off_t>(offset));
+		if (result < 0 && errno == EINTR)
+			continue;
+		if (result <= 0)
+			return ec.assign(result == 0 ? EIO : errno, std::generic_category());
+
+		dest   += result;
+		size   -= static_cast<std::size_t>(result);
+		offset += static_cast<std::uint64_t>(result);
+	}
+}
+
+void sync_data(int fd, std::error_code& ec)
+{
+	if (::fdatasync(fd) != 0)
+		ec.assign(errno, std::generic_category());
+}
+
+} // end of local namespace
+
+PackStore::PackStore(const fs::path& dir, std::size_t threshold, std::uint64_t segment_size) :
+	m_dir{dir}, m_threshold{threshold}, m_segment_size{segment_size}
+{
+	std::error_code ec;
+	create_directories(m_dir, ec);
+	if (!ec)
+		load_index(ec);
+	if (ec)
+		throw std::system_error(ec);
+
+	boost::asio::post(m_thread, [this]
+	{
+		while (wait_for_compaction())
+		{
+			std::error_code compact_ec;
+			compact(0.5, compact_ec);
+			if (compact_ec)
+				Log(LOG_WARNING, "cannot compact pack store %1% (%2% %3%)", m_dir, compact_ec, compact_ec.message());
+		}
+	});
+}
+
+PackStore::~PackStore()
+{
+	{
+		std::unique_lock lock{m_worker_mutex};
+		m_stopping = true;
+	}
+	m_wake.notify_all();
+	m_thread.join();
+}
+
+void PackStore::schedule_compaction()
+{
+	{
+		std::unique_lock lock{m_worker_mutex};
+		m_compact_pending = true;
+	}
+	m_wake.notify_all();
+}
+
+// Returns false if the store is being destroyed
+bool PackStore::wait_for_compaction()
+{
+	std::unique_lock lock{m_worker_mutex};
+	m_wake.wait(lock, [this]{return m_compact_pending || m_stopping;});
+	m_compact_pending = false;
+	return !m_stopping;
+}
+
+bool PackStore::accept(std::string_view name, std::size_t size) const
+{
+	return size > 0 && size < m_threshold && name.size() < sizeof(Record::name);
+}
+
+std::string PackStore::key(const ObjectID& id, std::string_view name)
+{
+	std::string result{id.begin(), id.end()};
+	result.append(name);
+	return result;
+}
+
+fs::path PackStore::segment_path(std::uint32_t segment) const
+{
+	char hex[9]{};
+	std::snprintf(hex, sizeof(hex), "%08x", segment);
+	return m_dir / (std::string{segment_prefix} + hex);
+}
+
+void PackStore::load_index(std::error_code& ec)
+{
+	// Open all segments. The last one is the current segment.
+	for (auto&& entry : fs::directory_iterator{m_dir, ec})
+	{
+		auto filename = entry.path().filename().string();
+		if (filename.size() <= segment_prefix.size() || filename.substr(0, segment_prefix.size()) != segment_prefix)
+			continue;
+
+		std::uint32_t segment{};
+		auto hex = filename.substr(segment_prefix.size());
+		if (std::from_chars(hex.data(), hex.data() + hex.size(), segment, 16).ec != std::errc{})
+			continue;
+
+		open_segment(segment, ec);
+		if (ec)
+			return;
+		m_current = std::max(m_current, segment);
+	}
+	if (ec)
+		return;
+
+	// Replay the index file. A record that is not completely written before a crash is dropped.
+	auto fd = open_file(m_dir/"index", O_RDWR | O_CREAT | O_APPEND, ec);
+	if (ec)
+		return;
+	m_index_file.native_handle(fd);
+
+	auto size = file_size(fd, ec);
+	if (ec)
+		return;
+
+	auto count = size / sizeof(Record);
+	if (count * sizeof(Record) != size && ::ftruncate(fd, static_cast<off_t>(count * sizeof(Record))) != 0)
+		return ec.assign(errno, std::generic_category());
+
+	if (count > 0)
+	{
+		auto index = MMap::open(fd, 0, count * sizeof(Record), ec);
+		if (ec)
+			return;
+
+		for (std::size_t i = 0; i < count; i++)
+		{
+			Record rec{};
+			std::memcpy(&rec, static_cast<const char*>(index.data()) + i * sizeof(rec), sizeof(rec));
+
+			auto k = key(rec.id, {rec.name, ::strnlen(rec.name, sizeof(rec.name))});
+			if (rec.size == 0)
+				m_index.erase(k);
+			else
+				m_index.insert_or_assign(std::move(k), Location{rec.segment, rec.size, rec.offset});
+		}
+	}
+
+	for (auto it = m_index.begin(); it != m_index.end(); )
+	{
+		if (auto seg = m_segments.find(it->second.segment); seg != m_segments.end())
+		{
+			seg->second.live += it->second.size;
+			++it;
+		}
+		else
+		{
+			Log(LOG_WARNING, "segment %1% of pack store %2% is missing", it->second.segment, m_dir);
+			it = m_index.erase(it);
+		}
+	}
+
+	open_segment(m_current, ec);
+}
+
+PackStore::Segment& PackStore::open_segment(std::uint32_t segment, std::error_code& ec)
+{
+	auto [it, inserted] = m_segments.try_emplace(segment);
+	if (!inserted)
+		return it->second;
+
+	auto fd = open_file(segment_path(segment), O_RDWR | O_CREAT, ec);
+	if (!ec)
+	{
+		it->second.file.native_handle(fd);
+		it->second.tail = align_page(file_size(fd, ec));
+	}
+	return it->second;
+}
+
+void PackStore::store(const ObjectID& id, std::string_view name, BufferView data, std::error_code& ec)
+{
+	assert(accept(name, data.size()));
+
+	Location loc{};
+	int fd{};
+	bool started_segment{};
+	{
+		std::unique_lock lock{m_mutex};
+		auto current = m_current;
+		loc = reserve(data.size(), ec);
+		if (ec)
+			return;
+
+		// The segment is not compacted until the file is in the index
+		auto& seg = m_segments.at(loc.segment);
+		seg.writing++;
+		fd = seg.file.native_handle();
+		started_segment = current != m_current;
+	}
+
+	// Write the file without locking the store. It must be on disk before its record,
+	// otherwise the record may point to garbage after a crash.
+	write_all(fd, data.data(), data.size(), loc.offset, ec);
+	if (!ec)
+		sync_data(fd, ec);
+
+	{
+		std::unique_lock lock{m_mutex};
+		if (!ec)
+			record(key(id, name), loc, ec);
+
+		// The reserved space becomes garbage
+		auto& seg = m_segments.at(loc.segment);
+		seg.writing--;
+		if (ec)
+			seg.live -= loc.size;
+	}
+
+	// Reclaim the space of the full segments when starting a new one
+	if (started_segment)
+		schedule_compaction();
+}
+
+// Allocate space for a file in the current segment, or in a new segment if it is full.
+// The file is counted as live data even before it is written.
+PackStore::Location PackStore::reserve(std::size_t size, std::error_code& ec)
+{
+	auto seg = &open_segment(m_current, ec);
+	if (!ec && seg->tail > 0 && seg->tail + size > m_segment_size)
+		seg = &open_segment(++m_current, ec);
+	if (ec)
+		return {};
+
+	Location loc{m_current, static_cast<std::uint32_t>(size), seg->tail};
+	seg->tail = align_page(seg->tail + size);
+	seg->live += size;
+	return loc;
+}
+
+PackStore::Record PackStore::make_record(const std::string& key, const Location& loc)
+{
+	assert(key.size() >= ObjectID{}.size());
+
+	Record rec{};
+	std::memcpy(rec.id.data(), key.data(), rec.id.size());
+	key.copy(rec.name, sizeof(rec.name) - 1, rec.id.size());
+	rec.segment = loc.segment;
+	rec.size    = loc.size;
+	rec.offset  = loc.offset;
+	return rec;
+}
+
+void PackStore::record(const std::string& key, const Location& loc, std::error_code& ec)
+{
+	auto rec = make_record(key, loc);
+	if (::write(m_index_file.native_handle(), &rec, sizeof(rec)) != sizeof(rec))
+		return ec.assign(errno ? errno : EIO, std::generic_category());
+
+	if (auto it = m_index.find(key); it != m_index.end())
+	{
+		if (auto seg = m_segments.find(it->second.segment); seg != m_segments.end())
+			seg->second.live -= it->second.size;
+
+		if (loc.size == 0)
+			m_index.erase(it);
+		else
+			it->second = loc;
+	}
+	else if (loc.size > 0)
+		m_index.emplace(key, loc);
+}
+
+MMap PackStore::load(const ObjectID& id, std::string_view name, std::error_code& ec) const
+{
+	std::shared_lock lock{m_mutex};
+	auto it = m_index.find(key(id, name));
+	if (it == m_index.end())
+	{
+		ec = std::make_error_code(std::errc::no_such_file_or_directory);
+		return {};
+	}
+
+	auto& seg = m_segments.at(it->second.segment);
+	return MMap::open(seg.file.native_handle(), it->second.offset, it->second.size, ec);
+}
+
+bool PackStore::contains(const ObjectID& id, std::string_view name) const
+{
+	std::shared_lock lock{m_mutex};
+	return m_index.find(key(id, name)) != m_index.end();
+}
+
+void PackStore::remove(const ObjectID& id, std::string_view name, std::error_code& ec)
+{
+	std::unique_lock lock{m_mutex};
+	auto k = key(id, name);
+	if (m_index.find(k) != m_index.end())
+		record(k, {}, ec);
+}
+
+// The names of the files are not known, so look for them in the whole index
+std::uint64_t PackStore::remove_blobs(std::vector<ObjectID> ids, std::error_code& ec)
+{
+	std::sort(ids.begin(), ids.end());
+
+	std::unique_lock lock{m_mutex};
+	std::vector<std::string> keys;
+	std::uint64_t bytes = 0;
+	for (auto&& [k, loc] : m_index)
+	{
+		auto id = ObjectID::from_raw(std::string_view{k}.substr(0, ObjectID{}.size()));
+		if (id && std::binary_search(ids.begin(), ids.end(), *id))
+		{
+			keys.push_back(k);
+			bytes += loc.size;
+		}
+	}
+
+	for (auto&& k : keys)
+	{
+		record(k, {}, ec);
+		if (ec)
+			break;
+	}
+	return bytes;
+}
+
+void PackStore::compact(double garbage_ratio, std::error_code& ec)
+{
+	std::unique_lock compacting{m_compact_mutex};
+	compact_segments(garbage_ratio, ec);
+}
+
+// Compaction locks the store only to reserve space for the live files, and to point the
+// index to the copies. The files may be replaced or removed while they are copied, in
+// which case their copies become garbage.
+void PackStore::compact_segments(double garbage_ratio, std::error_code& ec)
+{
+	struct Move
+	{
+		std::string key;
+		Location    from, to;
+		int         src, dest;  //!< file descriptors of the segments
+	};
+
+	std::vector<std::uint32_t> victims;
+	std::vector<Move> moves;
+	{
+		std::unique_lock lock{m_mutex};
+		for (auto&& [segment, seg] : m_segments)
+			if (segment != m_current && seg.writing == 0 && seg.tail - seg.live >= garbage_ratio * static_cast<double>(seg.tail))
+				victims.push_back(segment);
+
+		for (auto&& [k, loc] : m_index)
+		{
+			if (std::find(victims.begin(), victims.end(), loc.segment) == victims.end())
+				continue;
+
+			auto dest = reserve(loc.size, ec);
+			if (ec)
+				break;
+
+			moves.push_back({k, loc, dest,
+				m_segments.at(loc.segment).file.native_handle(),
+				m_segments.at(dest.segment).file.native_handle()
+			});
+		}
+
+		// Only compaction deletes segments, so the segments are not closed after unlocking.
+		if (ec)
+		{
+			for (auto&& move : moves)
+				m_segments.at(move.to.segment).live -= move.to.size;
+			return;
+		}
+	}
+
+	if (victims.empty())
+		return;
+
+	// Copy the live files without locking. The old segments are not touched.
+	std::vector<int> dests;
+	for (auto&& move : moves)
+	{
+		auto src = MMap::open(move.src, move.from.offset, move.from.size, ec);
+		if (!ec)
+			write_all(move.dest, src.data(), src.size(), move.to.offset, ec);
+		if (ec)
+			break;
+
+		if (std::find(dests.begin(), dests.end(), move.dest) == dests.end())
+			dests.push_back(move.dest);
+	}
+
+	// The copies must be on disk before the records pointing to them
+	for (auto fd : dests)
+		if (!ec)
+			sync_data(fd, ec);
+
+	{
+		std::unique_lock lock{m_mutex};
+		for (auto&& move : moves)
+		{
+			auto it = m_index.find(move.key);
+			auto unchanged = it != m_index.end() &&
+				it->second.segment == move.from.segment &&
+				it->second.offset  == move.from.offset;
+
+			if (!ec && unchanged)
+				record(move.key, move.to, ec);
+			else
+				m_segments.at(move.to.segment).live -= move.to.size;
+		}
+		if (ec)
+			return;
+
+		// The index has records of the copies, so the old segments can be deleted
+		for (auto segment : victims)
+		{
+			assert(m_segments.at(segment).live == 0);
+
+			std::error_code remove_ec;
+			m_segments.erase(segment);
+			fs::remove(segment_path(segment), remove_ec);
+			Log(LOG_INFO, "compacted segment %1% of pack store %2%", segment, m_dir);
+		}
+	}
+
+	// Drop the records of the old segments from the index file
+	rewrite_index(ec);
+}
+
+// Write all the live files to a new index file, which replaces the current one. The
+// records written to the current index file in the meantime are copied to the new one
+// before replacing it.
+void PackStore::rewrite_index(std::error_code& ec)
+{
+	std::vector<Record> records;
+	std::uint64_t logged{};
+	{
+		std::shared_lock lock{m_mutex};
+		records.reserve(m_index.size());
+		for (auto&& [k, loc] : m_index)
+			records.push_back(make_record(k, loc));
+
+		logged = file_size(m_index_file.native_handle(), ec);
+		if (ec)
+			return;
+	}
+
+	auto tmp = m_dir/"index.tmp";
+	boost::beast::file_posix file;
+	file.native_handle(open_file(tmp, O_RDWR | O_CREAT | O_TRUNC, ec));
+	if (!ec)
+		write_all(file.native_handle(), records.data(), records.size() * sizeof(Record), 0, ec);
+
+	if (!ec)
+	{
+		std::unique_lock lock{m_mutex};
+		auto size = file_size(m_index_file.native_handle(), ec);
+		if (!ec && size > logged)
+		{
+			std::vector<char> recent(size - logged);
+			read_all(m_index_file.native_handle(), recent.data(), recent.size(), logged, ec);
+			if (!ec)
+				write_all(file.native_handle(), recent.data(), recent.size(), records.size() * sizeof(Record), ec);
+		}
+
+		if (!ec)
+			sync_data(file.native_handle(), ec);
+
+		// record() appends to the index file
+		if (!ec && ::fcntl(file.native_handle(), F_SETFL, O_APPEND) != 0)
+			ec.assign(errno, std::generic_category());
+		if (!ec)
+			fs::rename(tmp, m_dir/"index", ec);
+		if (!ec)
+			std::swap(file, m_index_file);
+	}
+
+	// Keep the old index if anything failed
+	if (ec)
+	{
+		std::error_code remove_ec;
+		fs::remove(tmp, remove_ec);
+	}
+}
+
+PackStore::Stats PackStore::stats() const
+{
+	std::shared_lock lock{m_mutex};
+
+	Stats result{m_segments.size(), m_index.size(), 0, 0};
+	for (auto&& [segment, seg] : m_segments)
+	{
+		result.live_bytes    += seg.live;
+		result.garbage_bytes += seg.tail - seg.live;
+	}
+	return result;
+}
+
+} // end of namespace hrb
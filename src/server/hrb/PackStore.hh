@@ -0,0 +1,157 @@
+/*
+	Copyright © 2018 Wan Wai Ho <me@nestal.net>
+
+	This file is subject to the terms and conditions of the GNU General Public
+	License.  See the file COPYING in the main directory of the hearty_rabbit
+	distribution for more details.
+*/
+
+//
+// Created by nestal on 31/10/18.
+//
+
+#pragma once
+
+#include "hrb/ObjectID.hh"
+#include "util/BufferView.hh"
+#include "util/FS.hh"
+#include "util/MMap.hh"
+
+#include <boost/asio/thread_pool.hpp>
+#include <boost/beast/core/file_posix.hpp>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+
+namespace hrb {
+
+/// \brief Append-only store of the small files of the blobs
+/// Storing each rendition and meta data of the blobs in its own file means millions of
+/// tiny files and inodes. PackStore appends them to a few large segment files instead.
+/// Each file starts at a page boundary, so it can be mapped alone without reading the
+/// rest of the segment.
+///
+/// The location of the files are recorded in an index file, which is a log of fixed size
+/// records. It is mapped and loaded into a hash table when the store is opened. A file
+/// is flushed to disk before its record is appended, so the records never point to data
+/// lost in a crash.
+///
+/// Replacing or removing a file leaves garbage in the segment. When a new segment is
+/// started, a background thread compacts the segments with more garbage than live data,
+/// i.e. their live files are copied to the new segment and the old segment is deleted.
+/// The files are copied, and the index is rewritten, without locking the store, so
+/// storing and loading files is not blocked by compaction.
+class PackStore
+{
+public:
+	/// Files of \a threshold bytes or more are not accepted.
+	PackStore(const fs::path& dir, std::size_t threshold, std::uint64_t segment_size = 64 * 1024 * 1024);
+	PackStore(PackStore&&) = delete;
+	PackStore(const PackStore&) = delete;
+	~PackStore();
+	PackStore& operator=(PackStore&&) = delete;
+	PackStore& operator=(const PackStore&) = delete;
+
+	/// Whether a file of \a size bytes named \a name should be stored in the pack
+	[[nodiscard]] bool accept(std::string_view name, std::size_t size) const;
+
+	void store(const ObjectID& id, std::string_view name, BufferView data, std::error_code& ec);
+	[[nodiscard]] MMap load(const ObjectID& id, std::string_view name, std::error_code& ec) const;
+	[[nodiscard]] bool contains(const ObjectID& id, std::string_view name) const;
+	void remove(const ObjectID& id, std::string_view name, std::error_code& ec);
+
+	/// Remove all files of the blobs in \a ids. Returns the number of bytes freed.
+	std::uint64_t remove_blobs(std::vector<ObjectID> ids, std::error_code& ec);
+
+	/// Copy the live files in the segments that have at least \a garbage_ratio of garbage
+	/// to the current segment, and delete them. Waits for other compactions to finish.
+	void compact(double garbage_ratio, std::error_code& ec);
+
+	struct Stats
+	{
+		std::size_t     segments;
+		std::size_t     files;
+		std::uint64_t   live_bytes;
+		std::uint64_t   garbage_bytes;
+	};
+	[[nodiscard]] Stats stats() const;
+
+private:
+	// One record in the index file. The file is removed if size is 0.
+	struct Record
+	{
+		ObjectID        id;
+		char            name[28];
+		std::uint32_t   segment;
+		std::uint32_t   size;
+		std::uint64_t   offset;
+	};
+	static_assert(sizeof(Record) == 64);
+
+	struct Location
+	{
+		std::uint32_t   segment;
+		std::uint32_t   size;
+		std::uint64_t   offset;
+	};
+
+	struct Segment
+	{
+		boost::beast::file_posix    file;
+		std::uint64_t               tail{};     //!< where the next file will be written
+		std::uint64_t               live{};     //!< bytes of the files still in the index
+		std::uint32_t               writing{};  //!< files being written, which are not in the index yet
+	};
+
+	static std::string key(const ObjectID& id, std::string_view name);
+	static Record make_record(const std::string& key, const Location& loc);
+	fs::path segment_path(std::uint32_t segment) const;
+
+	// These functions must be called with m_mutex locked
+	void load_index(std::error_code& ec);
+	Segment& open_segment(std::uint32_t segment, std::error_code& ec);
+	Location reserve(std::size_t size, std::error_code& ec);
+	void record(const std::string& key, const Location& loc, std::error_code& ec);
+
+	// These functions must be called with m_compact_mutex locked, and lock m_mutex by themselves
+	void compact_segments(double garbage_ratio, std::error_code& ec);
+	void rewrite_index(std::error_code& ec);
+
+	// Wake up the background thread to compact the segments
+	void schedule_compaction();
+	bool wait_for_compaction();
+
+private:
+	const fs::path          m_dir;
+	const std::size_t       m_threshold;
+	const std::uint64_t     m_segment_size;
+
+	mutable std::shared_mutex   m_mutex;
+
+	// Only one compaction at a time. Held while copying without m_mutex.
+	std::mutex                  m_compact_mutex;
+
+	// key is the blob ID followed by the file name
+	std::unordered_map<std::string, Location>   m_index;
+	std::map<std::uint32_t, Segment>            m_segments;
+	std::uint32_t                               m_current{};    //!< the segment being written
+	boost::beast::file_posix                    m_index_file;
+
+	// The background thread waits for new segments to compact the old ones
+	std::atomic<bool>           m_stopping{false};
+	bool                        m_compact_pending{false};
+	std::mutex                  m_worker_mutex;
+	std::condition_variable     m_wake;
+	boost::asio::thread_pool    m_thread{1};
+};
+
+} // end of namespace hrb
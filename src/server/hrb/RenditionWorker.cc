@@ -0,0 +1,206 @@
+/*
+	Copyright © 2018 Wan Wai Ho <me@nestal.net>
+
+	This file is subject to the terms and conditions of the GNU General Public
+	License.  See the file COPYING in the main directory of the hearty_rabbit
+	distribution for more details.
+*/
+
+//
+// Created by nestal on 26/10/18.
+//
+
+#include "RenditionWorker.hh"
+
+#include "util/Configuration.hh"
+#include "util/Escape.hh"
+#include "util/Log.hh"
+
+#include <boost/asio/post.hpp>
+
+#include <algorithm>
+#include <cassert>
+
+#include <opencv2/core.hpp>
+
+namespace hrb {
+
+RenditionWorker::RenditionWorker(const Configuration& cfg) :
+	m_cfg{cfg},
+	m_pool{cfg.rendition_threads()}
+{
+	// Each thread in the pool generates one rendition at a time. Without limiting the
+	// threads of OpenCV, each of them would use all cores.
+	cv::setNumThreads(cfg.opencv_threads());
+}
+
+RenditionWorker::~RenditionWorker()
+{
+	// Abandon the renditions that are waiting to be generated, but let the threads
+	// finish the ones they are generating.
+	m_pool.stop();
+	m_pool.join();
+}
+
+void RenditionWorker::generate(const BlobFile& blob, std::string_view rendition, Completion&& complete)
+{
+	auto rend = std::string{BlobFile::rendition_name(rendition, m_cfg.renditions())};
+
+	{
+		std::unique_lock lock{m_mutex};
+		if (m_undecodable.contains(blob.ID()))
+		{
+			lock.unlock();
+			return complete(std::make_error_code(std::errc::io_error));
+		}
+
+		auto [it, first] = m_waiting.try_emplace(key(blob, rend));
+		it->second.push_back(std::move(complete));
+
+		// The rendition is already being generated. The completion routine will be called
+		// when it is done.
+		if (!first)
+			return;
+
+		m_backlog++;
+	}
+
+	boost::asio::post(m_pool, [this, blob, rend=std::move(rend)]
+	{
+		run(blob, {rend});
+	});
+}
+
+void RenditionWorker::generate_all(const BlobFile& blob, const std::vector<std::string>& renditions)
+{
+	std::vector<std::string> rends;
+	{
+		std::unique_lock lock{m_mutex};
+		if (m_backlog >= m_cfg.rendition_backlog())
+		{
+			Log(LOG_NOTICE, "rendition backlog is full (%1% jobs). Renditions of %2% will be generated on demand.", m_backlog, to_hex(blob.ID()));
+			return;
+		}
+		if (m_undecodable.contains(blob.ID()))
+			return;
+
+		// Skip the renditions that are already being generated.
+		for (auto&& rendition : renditions)
+		{
+			auto rend = std::string{BlobFile::rendition_name(rendition, m_cfg.renditions())};
+			if (m_waiting.try_emplace(key(blob, rend)).second)
+				rends.push_back(std::move(rend));
+		}
+		if (rends.empty())
+			return;
+
+		m_backlog++;
+	}
+
+	boost::asio::post(m_pool, [this, blob, rends=std::move(rends)]() mutable
+	{
+		run(blob, std::move(rends));
+	});
+}
+
+void RenditionWorker::run(const BlobFile& blob, std::vector<std::string> renditions)
+{
+	{
+		std::unique_lock lock{m_mutex};
+		m_backlog--;
+	}
+
+	// Keys of the renditions that are not generated yet. They must be completed even if
+	// OpenCV throws, otherwise the requests waiting for them will never be answered.
+	std::vector<std::string> keys;
+	for (auto&& rendition : renditions)
+		keys.push_back(key(blob, rendition));
+
+	try
+	{
+		blob.generate_renditions(std::move(renditions), m_cfg.renditions(), m_cfg.haar_path(), [this, &blob, &keys](auto rendition, auto ec)
+		{
+			if (ec)
+				Log(LOG_WARNING, "cannot generate rendition %1% of %2% (%3% %4%)", rendition, to_hex(blob.ID()), ec, ec.message());
+			if (ec == std::errc::io_error)
+				set_undecodable(blob.ID());
+
+			// No one waits for a rendition that is not in keys, e.g. one that is reported twice
+			// or normalized differently by generate_renditions()
+			auto k = key(blob, rendition);
+			if (auto it = std::find(keys.begin(), keys.end(), k); it != keys.end())
+			{
+				keys.erase(it);
+				complete(k, ec);
+			}
+			else
+				Log(LOG_WARNING, "unexpected rendition %1% of %2% is generated", rendition, to_hex(blob.ID()));
+		});
+	}
+	catch (std::exception& e)
+	{
+		Log(LOG_WARNING, "exception when generating renditions of %1%: %2%", to_hex(blob.ID()), e.what());
+		set_undecodable(blob.ID());
+	}
+
+	for (auto&& k : keys)
+		complete(k, std::make_error_code(std::errc::io_error));
+}
+
+void RenditionWorker::complete(const std::string& key, std::error_code ec)
+{
+	// Requests that come after this point will find the rendition in the file system,
+	// or generate it again if it failed.
+	std::vector<Completion> waiting;
+	{
+		std::unique_lock lock{m_mutex};
+		auto node = m_waiting.extract(key);
+		assert(node);
+		waiting = std::move(node.mapped());
+	}
+
+	for (auto&& complete : waiting)
+		complete(ec);
+}
+
+void RenditionWorker::set_undecodable(const ObjectID& blob)
+{
+	// Enough for the few broken images in a large collection
+	const std::size_t max_undecodable = 10000;
+
+	std::unique_lock lock{m_mutex};
+	if (!m_undecodable.insert(blob).second)
+		return;
+
+	m_undecodable_order.push_back(blob);
+	if (m_undecodable_order.size() > max_undecodable)
+	{
+		m_undecodable.erase(m_undecodable_order.front());
+		m_undecodable_order.pop_front();
+	}
+}
+
+bool RenditionWorker::is_undecodable(const ObjectID& blob) const
+{
+	std::unique_lock lock{m_mutex};
+	return m_undecodable.contains(blob);
+}
+
+std::string RenditionWorker::key(const BlobFile& blob, std::string_view rendition)
+{
+	return to_hex(blob.ID()) + "/" + std::string{rendition};
+}
+
+std::size_t RenditionWorker::pending() const
+{
+	std::unique_lock lock{m_mutex};
+	return m_waiting.size();
+}
+
+std::size_t RenditionWorker::backlog() const
+{
+	std::unique_lock lock{m_mutex};
+	return m_backlog;
+}
+
+} // end of namespace hrb
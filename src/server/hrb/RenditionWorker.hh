@@ -0,0 +1,96 @@
+/*
+	Copyright © 2018 Wan Wai Ho <me@nestal.net>
+
+	This file is subject to the terms and conditions of the GNU General Public
+	License.  See the file COPYING in the main directory of the hearty_rabbit
+	distribution for more details.
+*/
+
+//
+// Created by nestal on 26/10/18.
+//
+
+#pragma once
+
+#include "BlobFile.hh"
+
+#include "util/InlineFunction.hh"
+
+#include <boost/asio/thread_pool.hpp>
+
+#include <deque>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace hrb {
+
+class Configuration;
+
+/// \brief Thread pool that generates renditions
+/// Generating a rendition, i.e. decoding, resizing, detecting faces and encoding the
+/// image, takes hundreds of milliseconds. It is done by a fixed number of threads
+/// separated from the threads that serve the network, so that they are not blocked.
+///
+/// Requests for a rendition that is being generated are merged: the rendition is only
+/// generated once and all of them are completed when it is done.
+///
+/// Blobs whose master cannot be decoded are remembered, so that their renditions are
+/// not generated again. Requests for them fail immediately.
+class RenditionWorker
+{
+public:
+	/// Called by one of the threads in the pool after the rendition is generated.
+	using Completion = InlineFunction<void(std::error_code)>;
+
+public:
+	explicit RenditionWorker(const Configuration& cfg);
+	RenditionWorker(const RenditionWorker&) = delete;
+	RenditionWorker& operator=(const RenditionWorker&) = delete;
+	~RenditionWorker();
+
+	void generate(const BlobFile& blob, std::string_view rendition, Completion&& complete);
+
+	/// Generate \a renditions of a newly uploaded blob in the background. The master rendition
+	/// is only decoded once for all of them. Nothing is done if the backlog is full. The
+	/// renditions will be generated when they are requested in that case.
+	void generate_all(const BlobFile& blob, const std::vector<std::string>& renditions);
+
+	/// Whether the master of the blob cannot be decoded when generating its renditions
+	[[nodiscard]] bool is_undecodable(const ObjectID& blob) const;
+
+	/// Number of renditions that are being generated or waiting to be generated.
+	[[nodiscard]] std::size_t pending() const;
+
+	/// Number of jobs waiting for a thread, i.e. calls to generate() and generate_all()
+	/// that are not merged with others.
+	[[nodiscard]] std::size_t backlog() const;
+
+private:
+	[[nodiscard]] static std::string key(const BlobFile& blob, std::string_view rendition);
+	void run(const BlobFile& blob, std::vector<std::string> renditions);
+	void complete(const std::string& key, std::error_code ec);
+	void set_undecodable(const ObjectID& blob);
+
+private:
+	const Configuration&    m_cfg;
+
+	mutable std::mutex      m_mutex;
+
+	// Completion routines of the requests waiting for each rendition, keyed by the blob
+	// ID and the rendition name.
+	std::unordered_map<std::string, std::vector<Completion>>    m_waiting;
+	std::size_t m_backlog{};
+
+	// Oldest first. The oldest ones are forgotten when there are too many.
+	std::unordered_set<ObjectID>    m_undecodable;
+	std::deque<ObjectID>            m_undecodable_order;
+
+	// Destroyed first to make sure no thread refers to the other members.
+	boost::asio::thread_pool    m_pool;
+};
+
+} // end of namespace hrb
@@ -12,6 +12,7 @@
 
 #include "Server.hh"
 
+#include "RedisKeys.hh"
 #include "SessionHandler.hh"
 #include "net/Listener.hh"
 
@@ -21,10 +22,14 @@
 #include "util/Error.hh"
 #include "util/Configuration.hh"
 #include "util/Exception.hh"
+#include "util/Log.hh"
 
 #include <boost/exception/errinfo_api_function.hpp>
 #include <boost/exception/info.hpp>
 
+#include <openssl/ssl.h>
+
+#include <cassert>
 #include <utility>
 
 namespace hrb {
@@ -32,7 +37,26 @@ namespace hrb {
 Server::Server(const Configuration& cfg) :
 	m_cfg{cfg},
 	m_ioc{static_cast<int>(std::max(1UL, cfg.thread_count()))},
-	m_db{m_ioc, cfg.redis()},
+	m_db{m_ioc, cfg.redis_shards(), redis::PoolSettings{
+		.min_size           = cfg.redis_min_connections(),
+		.max_size           = cfg.redis_max_connections(),
+		.max_batch          = cfg.redis_max_batch(),
+		.connect_timeout    = cfg.redis_connect_timeout(),
+		.health_check       = cfg.redis_health_check(),
+		.idle_timeout       = cfg.redis_idle_timeout(),
+		.threads            = std::max(1UL, cfg.thread_count()),
+
+		// Blob inodes, collections and sessions are read by almost every request,
+		// but seldom changed.
+		.cache_prefixes     = cfg.redis_client_cache() ?
+			std::vector<std::string>{"blob-inodes:", "colls:", "coll:", "session:"} :
+			std::vector<std::string>{},
+		.cache_max_age      = cfg.redis_cache_max_age(),
+		.cache_max_entries  = cfg.redis_cache_max_entries()
+	}, redis::ReplicaSettings{
+		.endpoints          = cfg.redis_replicas(),
+		.read_your_writes   = cfg.redis_read_your_writes()
+	}},
 	m_lib{cfg.web_root()},
 	m_blob_db{cfg}
 {
@@ -47,16 +71,35 @@ void Server::listen()
 	m_ssl.use_certificate_chain_file(m_cfg.cert_chain().string());
 	m_ssl.use_private_key_file(m_cfg.private_key().string(), boost::asio::ssl::context::pem);
 
+	// OpenSSL hands the connections to the kernel after the handshake if the kernel
+	// supports the cipher. The sessions will use KTLSStream to let it do so.
+	// Configuration does not accept "ktls" without OpenSSL 3.
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	if (m_cfg.ktls())
+		::SSL_CTX_set_options(m_ssl.native_handle(), SSL_OP_ENABLE_KTLS);
+#endif
+
+	// Keep the redis connections healthy while the server is running
+	m_db.start();
+
+	// Delete the blobs that are not owned by anyone every gc_interval_hours
+	if (m_blob_db.collector())
+		collect_garbage();
+
+	// Log the read latency of the volumes and the cache hit rates every stats_interval_minutes
+	if (m_cfg.stats_interval().count() > 0)
+		log_stats();
+
 	// Create and launch a listening port for HTTP and HTTPS
 	std::make_shared<Listener>(
 		m_ioc,
-		[this](){return start_session();},
+		[this](auto&& executor){return start_session(executor);},
 		nullptr,
 		m_cfg
 	)->run();
 	std::make_shared<Listener>(
 		m_ioc,
-		[this](){return start_session();},
+		[this](auto&& executor){return start_session(executor);},
 		&m_ssl,
 		m_cfg
 	)->run();
@@ -89,7 +132,7 @@ void Server::drop_privileges() const
 void Server::add_user(const Configuration& cfg, std::string_view username, Password&& password, std::function<void(std::error_code)> complete)
 {
 	boost::asio::io_context ioc;
-	redis::Pool db{ioc, cfg.redis()};
+	redis::ShardedPool db{ioc, cfg.redis_shards()};
 	Authentication::add_user(username, std::move(password), *db.alloc(), [&complete](std::error_code&& ec)
 	{
 		complete(std::move(ec));
@@ -97,6 +140,129 @@ void Server::add_user(const Configuration& cfg, std::string_view username, Passw
 	ioc.run();
 }
 
+Detached Server::log_stats()
+{
+	while (true)
+	{
+		m_stats_timer.expires_after(m_cfg.stats_interval());
+		auto ec = co_await await_callback<boost::system::error_code>([this](auto&& complete)
+		{
+			m_stats_timer.async_wait(std::forward<decltype(complete)>(complete));
+		});
+		if (ec)
+			co_return;
+
+		m_blob_db.log_stats();
+	}
+}
+
+// Mark the blobs in the blob-owners:* keys of all shards, and let BlobCollector sweep the
+// others. Nothing is deleted if any shard cannot be read, because the owned blobs in that
+// shard would not be marked.
+Detached Server::collect_garbage()
+{
+	auto collector = m_blob_db.collector();
+	assert(collector);
+
+	for (auto first = true; ; first = false)
+	{
+		if (!first)
+		{
+			m_gc_timer.expires_after(m_cfg.gc_interval());
+			auto ec = co_await await_callback<boost::system::error_code>([this](auto&& complete)
+			{
+				m_gc_timer.async_wait(std::forward<decltype(complete)>(complete));
+			});
+			if (ec)
+				co_return;
+		}
+
+		auto marked = fs::file_time_type::clock::now();
+		auto db = m_db.alloc();
+
+		// The LiveSet is sized by the number of keys, which is more than the owned blobs
+		std::size_t keys = 0;
+		std::error_code ec;
+		for (std::size_t i = 0; i < db->size() && !ec; i++)
+		{
+			auto [reply, err] = co_await db->shard(i).async_command("DBSIZE");
+			keys += static_cast<std::size_t>(std::max(0L, reply.as_int()));
+			ec = err;
+		}
+
+		BlobCollector::LiveSet live{keys};
+		const std::string_view prefix{"blob-owners:"};
+		for (std::size_t i = 0; i < db->size() && !ec; i++)
+		{
+			// The replicas are scanned if there are any. The candidates are checked in the
+			// primaries again before they are deleted.
+			std::string cursor{"0"};
+			do
+			{
+				auto [reply, err] = co_await db->read_shard(i).async_command(
+					"SCAN %b MATCH blob-owners:* COUNT 1000", cursor.data(), cursor.size()
+				);
+				auto [cursor_reply, keys_reply] = reply.as_tuple<2>(err);
+				if ((ec = err))
+					break;
+
+				cursor = cursor_reply.as_string();
+				for (auto&& key : keys_reply)
+				{
+					auto raw = key.as_string();
+					if (raw.starts_with(prefix))
+						if (auto id = ObjectID::from_raw(raw.substr(prefix.size())); id)
+							live.insert(*id);
+				}
+			} while (cursor != "0");
+		}
+		if (ec)
+		{
+			Log(LOG_WARNING, "cannot mark owned blobs for garbage collection (%1% %2%)", ec, ec.message());
+			continue;
+		}
+
+		auto owned_blobs = live.size();
+		auto candidates = co_await await_callback<std::vector<BlobCollector::Candidate>>([&](auto&& complete)
+		{
+			collector->async_sweep(std::move(live), marked, db->get_executor(), std::forward<decltype(complete)>(complete));
+		});
+
+		// The LiveSet does not have the blobs owned after they are scanned
+		std::vector<BlobCollector::Candidate> garbage;
+		for (auto&& blob : candidates)
+		{
+			auto key = key::blob_owners(blob.id);
+			auto owned = false;
+			for (std::size_t i = 0; i < db->size() && !owned && !ec; i++)
+			{
+				auto [reply, err] = co_await db->shard(i).async_command("EXISTS %b", key.data(), key.size());
+				owned = reply.as_int() != 0;
+				ec = err;
+			}
+			if (ec)
+				break;
+			if (!owned)
+				garbage.push_back(std::move(blob));
+		}
+		if (ec)
+		{
+			Log(LOG_WARNING, "cannot check unowned blobs for garbage collection (%1% %2%)", ec, ec.message());
+			continue;
+		}
+
+		auto count = garbage.size();
+		auto deleted = co_await await_callback<std::size_t>([&](auto&& complete)
+		{
+			collector->async_remove(std::move(garbage), marked, db->get_executor(), std::forward<decltype(complete)>(complete));
+		});
+		Log(
+			LOG_INFO, "%1% blobs are owned. %2% of %3% unowned blobs are %4%.",
+			owned_blobs, deleted, count, collector->dry_run() ? "found in dry run" : "deleted"
+		);
+	}
+}
+
 boost::asio::io_context& Server::get_io_context()
 {
 	return m_ioc;
@@ -107,5 +273,10 @@ SessionHandler Server::start_session()
 	return {m_db.alloc(), m_lib, m_blob_db, m_cfg};
 }
 
+SessionHandler Server::start_session(const boost::asio::any_io_executor& executor)
+{
+	return {m_db.alloc(executor), m_lib, m_blob_db, m_cfg};
+}
+
 
 } // end of namespace
@@ -15,10 +15,12 @@
 #include "BlobDatabase.hh"
 #include "WebResources.hh"
 
-#include "net/Redis.hh"
+#include "net/ShardedPool.hh"
+#include "util/Coroutine.hh"
 
 #include <boost/asio/io_context.hpp>
 #include <boost/asio/ssl/context.hpp>
+#include <boost/asio/steady_timer.hpp>
 
 #include <system_error>
 #include <functional>
@@ -41,6 +43,7 @@ public:
 	boost::asio::io_context& get_io_context();
 
 	SessionHandler start_session();
+	SessionHandler start_session(const boost::asio::any_io_executor& executor);
 
 	// Administrative commands and configurations
 	static void add_user(
@@ -52,14 +55,20 @@ public:
 
 	void drop_privileges() const;
 
+private:
+	Detached collect_garbage();
+	Detached log_stats();
+
 private:
 	const Configuration&        m_cfg;
 	boost::asio::ssl::context   m_ssl{boost::asio::ssl::context::sslv23};
 	boost::asio::io_context     m_ioc;
 
-	redis::Pool     m_db;
+	redis::ShardedPool  m_db;
 	WebResources    m_lib;
 	BlobDatabase    m_blob_db;
+	boost::asio::steady_timer   m_gc_timer{m_ioc};
+	boost::asio::steady_timer   m_stats_timer{m_ioc};
 };
 
 } // end of namespace
@@ -45,7 +45,7 @@
 namespace hrb {
 
 SessionHandler::SessionHandler(
-	std::shared_ptr<redis::Connection>&& db,
+	std::shared_ptr<redis::ShardedConnection>&& db,
 	WebResources& lib,
 	BlobDatabase& blob_db,
 	const Configuration& cfg
@@ -137,7 +137,7 @@ void SessionHandler::unlink(BlobRequest&& req, EmptyResponseSender&& send)
 
 	// remove from user's container
 	Ownership{req.owner()}.unlink_blob(
-		*m_db, req.collection(), *req.blob(),
+		m_db->at(req.owner()), req.collection(), *req.blob(),
 		[send = std::move(send), version = req.version()](auto ec)
 		{
 			auto status = http::status::no_content;
@@ -175,7 +175,7 @@ void SessionHandler::post_blob(BlobRequest&& req, EmptyResponseSender&& send)
 
 	if (!perm_str.empty())
 		Ownership{req.owner()}.set_permission(
-			*m_db,
+			m_db->at(req.owner()),
 			*req.blob(),
 			Permission::from_description(perm_str),
 			std::move(on_complete)
@@ -183,7 +183,7 @@ void SessionHandler::post_blob(BlobRequest&& req, EmptyResponseSender&& send)
 
 	else if (!move_destination.empty())
 		Ownership{req.owner()}.move_blob(
-			*m_db,
+			m_db->at(req.owner()),
 			req.collection(),
 			move_destination,
 			*req.blob(),
@@ -218,10 +218,13 @@ void SessionHandler::on_upload(UploadRequest&& req, EmptyResponseSender&& send)
 	if (ec)
 		return send(http::response<http::empty_body>{http::status::internal_server_error, req.version()});
 
+	// Generate the renditions that will soon be requested, e.g. thumbnails, in the background
+	m_blob_db.generate_renditions(blob);
+
 	// Store the phash of the blob in database
 	if (blob.phash().has_value())
 	{
-		PHashDb pdb{*m_db};
+		PHashDb pdb{m_db->global()};
 		pdb.add(blob.ID(), *blob.phash());
 /*		pdb.exact_match(phash=*blob.phash(), [blob=blob.ID()](auto&& matches, auto err)
 		{
@@ -231,13 +234,18 @@ void SessionHandler::on_upload(UploadRequest&& req, EmptyResponseSender&& send)
 		});*/
 	}
 
+	link_upload(path_url, blob, req.version(), std::move(send));
+}
+
+void SessionHandler::link_upload(const URLIntent& path_url, const BlobFile& blob, unsigned version, EmptyResponseSender&& send)
+{
 	BlobInode entry{Permission::private_(), std::string{path_url.filename()}, std::string{blob.mime()}, blob.original_datetime()};
 
 	// Add the newly created blob to the user's ownership table.
 	// The user's ownership table contains all the blobs that is owned by the user.
 	// It will be used for authorizing the user's request on these blob later.
 	Ownership{m_auth.username()}.link_blob(
-		*m_db, path_url.collection(), blob.ID(), entry, [
+		m_db->at(m_auth.username()), path_url.collection(), blob.ID(), entry, [
 			location = URLIntent{
 				URLIntent::Action::api,
 				m_auth.username(),
@@ -245,7 +253,7 @@ void SessionHandler::on_upload(UploadRequest&& req, EmptyResponseSender&& send)
 				to_hex(blob.ID())
 			}.str(),
 			send = std::move(send),
-			version = req.version()
+			version
 		](auto ec)
 		{
 			http::response<http::empty_body> res{
@@ -260,6 +268,14 @@ void SessionHandler::on_upload(UploadRequest&& req, EmptyResponseSender&& send)
 	);
 }
 
+http::response<http::empty_body> SessionHandler::early_response()
+{
+	assert(m_early_response.has_value());
+	auto res = std::move(*m_early_response);
+	m_early_response.reset();
+	return res;
+}
+
 http::response<http::string_body> SessionHandler::bad_request(std::string_view why, unsigned version)
 {
 	http::response<http::string_body> res{
@@ -325,7 +341,7 @@ void SessionHandler::validate_collection(Collection& coll)
 			new_entry.timestamp = blob_file.original_datetime();
 			coll.update_timestamp(id, new_entry.timestamp);
 
-			Ownership{m_auth.username()}.update_blob(*m_db, id, new_entry);
+			Ownership{m_auth.username()}.update_blob(m_db->at(m_auth.username()), id, new_entry);
 		}
 	}
 }
@@ -13,8 +13,9 @@
 #pragma once
 
 #include "hrb/UserID.hh"
-#include "net/Redis.hh"
+#include "net/ShardedPool.hh"
 #include "net/Request.hh"
+#include "util/Coroutine.hh"
 
 // JSON library
 #include <nlohmann/json.hpp>
@@ -30,6 +31,7 @@ namespace hrb {
 
 class Authentication;
 class BlobDatabase;
+class BlobFile;
 class BlobRequest;
 class Collection;
 class Configuration;
@@ -42,11 +44,13 @@ class WebResources;
 class SessionHandler
 {
 public:
-	enum class RequestBodyType {string, upload, empty};
+	// "none" means the request is answered before reading its body. Send early_response()
+	// and close the connection.
+	enum class RequestBodyType {string, upload, empty, none};
 
 public:
 	SessionHandler(
-		std::shared_ptr<redis::Connection>&& db,
+		std::shared_ptr<redis::ShardedConnection>&& db,
 		WebResources& lib,
 		BlobDatabase& blob_db,
 		const Configuration& cfg
@@ -83,6 +87,7 @@ public:
 	[[nodiscard]] std::chrono::seconds session_length() const;
 
 	[[nodiscard]] const UserID& auth() const {return m_auth;}
+	[[nodiscard]] http::response<http::empty_body> early_response();
 	[[nodiscard]] bool renewed_auth() const;
 
 private:
@@ -99,6 +104,10 @@ private:
 	void on_login(const StringRequest& req, EmptyResponseSender&& send);
 	void on_logout(const EmptyRequest& req, EmptyResponseSender&& send);
 	void on_upload(UploadRequest&& req, EmptyResponseSender&& send);
+	void link_upload(const URLIntent& path_url, const BlobFile& blob, unsigned version, EmptyResponseSender&& send);
+
+	template <class Complete>
+	void on_upload_header(URLIntent&& intent, const RequestHeader& header, Complete&& complete);
 	void unlink(BlobRequest&& req, EmptyResponseSender&& send);
 	void post_blob(BlobRequest&& req, EmptyResponseSender&& send);
 
@@ -115,7 +124,7 @@ private:
 	void on_request_api(Request&& req, URLIntent&& intent, Send&& send);
 
 	template <class Send>
-	void get_blob(const BlobRequest& req, Send&& send);
+	Detached get_blob(BlobRequest req, Send send);
 
 	template <class Send>
 	void on_query(const BlobRequest& req, Send&& send);
@@ -133,9 +142,10 @@ private:
 	void validate_collection(Collection& json);
 
 private:
-	std::shared_ptr<redis::Connection>              m_db;
+	std::shared_ptr<redis::ShardedConnection>       m_db;
 	std::optional<UserID::SessionID>                m_request_session_id;
 	std::chrono::high_resolution_clock::time_point  m_on_header;
+	std::optional<http::response<http::empty_body>> m_early_response;
 
 	UserID                  m_auth;
 	WebResources&           m_lib;
@@ -16,6 +16,7 @@
 
 #include "BlobRequest.hh"
 #include "BlobDatabase.hh"
+#include "BlobFile.hh"
 #include "Ownership.ipp"
 #include "UploadFile.hh"
 #include "WebResources.hh"
@@ -25,6 +26,7 @@
 #include "crypto/Authentication.hh"
 #include "crypto/Authentication.ipp"
 #include "net/MMapResponseBody.hh"
+#include "util/Configuration.hh"
 #include "util/Log.hh"
 #include "util/Cookie.hh"
 
@@ -38,6 +40,9 @@
 #include <boost/beast/http/message.hpp>
 #include <boost/beast/http/empty_body.hpp>
 #include <boost/beast/version.hpp>
+#include <boost/beast/core/string.hpp>
+
+#include <charconv>
 
 namespace hrb {
 
@@ -210,18 +215,27 @@ void SessionHandler::on_request_header(
 		session_length(),
 		[
 			this,
-			action=intent.action(),
-			method=header.method(),
+			&header,
+			intent,
 			complete=std::forward<Complete>(complete)
 		](std::error_code ec, const UserID& auth) mutable
 		{
 			m_auth = auth;
 
 			auto body_type = RequestBodyType::empty;
+			auto action = intent.action();
+			auto method = header.method();
 
 			// Use a UploadRequestParse to parser upload requests, only when the session is authenticated.
 			if (!ec && action == URLIntent::Action::upload && method == http::verb::put)
+			{
+				// The client is waiting for "100 Continue" before sending the upload.
+				// It may not need to be sent at all.
+				if (boost::beast::iequals(header[http::field::expect], "100-continue"))
+					return on_upload_header(std::move(intent), header, std::move(complete));
+
 				body_type = RequestBodyType::upload;
+			}
 
 			// blobs support post request
 			else if (!ec && action == URLIntent::Action::api && method == http::verb::post)
@@ -235,6 +249,59 @@ void SessionHandler::on_request_header(
 	);
 }
 
+/// Called before reading the body of an upload request, if the client waits for
+/// "100 Continue". Answers the request without the body if the upload is going to be
+/// rejected anyway, or if the client sends the ID of a blob that the user already owns
+/// in the "X-HRB-Blob-ID" header. In that case the blob is linked to the collection as
+/// if it was uploaded again.
+template <class Complete>
+void SessionHandler::on_upload_header(URLIntent&& intent, const RequestHeader& header, Complete&& complete)
+{
+	auto version = header.version();
+	auto reject = [this, &complete, version](http::status status)
+	{
+		m_early_response.emplace(status, version);
+		complete(RequestBodyType::none, std::error_code{});
+	};
+
+	if (m_auth.username() != intent.user())
+		return reject(http::status::forbidden);
+
+	auto length_field = header[http::field::content_length];
+	std::size_t length{};
+	if (std::from_chars(length_field.data(), length_field.data() + length_field.size(), length).ec == std::errc{} &&
+		length > m_cfg.upload_limit())
+		return reject(http::status::payload_too_large);
+
+	auto blob_field = header["X-HRB-Blob-ID"];
+	auto blob = ObjectID::from_hex({blob_field.data(), blob_field.size()});
+	if (!blob || !m_blob_db.find(*blob).has_master())
+		return complete(RequestBodyType::upload, std::error_code{});
+
+	// Only blobs owned by the user can be linked without uploading them. Otherwise anyone
+	// who knows the ID of a blob can add it to their collections.
+	Ownership{m_auth.username()}.get_blob(
+		m_db->at(m_auth.username()), Authentication{m_auth}, *blob,
+		[
+			this,
+			intent=std::move(intent),
+			blob=*blob,
+			version,
+			complete=std::forward<Complete>(complete)
+		](BlobInodeDB, std::error_code ec) mutable
+		{
+			if (ec)
+				return complete(RequestBodyType::upload, std::error_code{});
+
+			link_upload(intent, m_blob_db.find(blob), version, [this, complete=std::move(complete)](auto&& res) mutable
+			{
+				m_early_response.emplace(std::move(res));
+				complete(RequestBodyType::none, std::error_code{});
+			});
+		}
+	);
+}
+
 template <class Request, class Send>
 void SessionHandler::on_request_body(Request&& req, Send&& send)
 {
@@ -270,7 +337,7 @@ void SessionHandler::on_request_body(Request&& req, Send&& send)
 		if (intent.action() == URLIntent::Action::home)
 			return m_auth.valid() ?
 				Ownership{m_auth.username()}.scan_all_collections(
-					*m_db,
+					m_db->read(m_auth.username()),
 					SendJSON{std::forward<Send>(send), req.version(), std::nullopt, *this, &m_lib}
 				) :
 				list_public_blobs(false, "", req.version(), std::forward<Send>(send));
@@ -304,10 +371,13 @@ void SessionHandler::on_request_api(Request&& req, URLIntent&& intent, Send&& se
 	else if (req.method() == http::verb::get)
 	{
 		if (breq.blob())
-			return get_blob(std::move(breq), std::forward<Send>(send));
+		{
+			get_blob(std::move(breq), std::forward<Send>(send));
+			return;
+		}
 		else
 			return Ownership{breq.owner()}.get_collection(
-				*m_db,
+				m_db->read(breq.owner()),
 				m_auth,
 				breq.collection(),
 				[
@@ -341,7 +411,7 @@ void SessionHandler::on_request_view(Request&& req, URLIntent&& intent, Send&& s
 	{
 		// view request always sends HTML: pass &m_lib to SendJSON
 		return Ownership{breq.owner()}.get_collection(
-			*m_db,
+			m_db->read(breq.owner()),
 			m_auth,
 			breq.collection(),
 			SendJSON{std::forward<Send>(send), breq.version(), breq.blob(), *this, &m_lib}
@@ -355,60 +425,66 @@ void SessionHandler::on_request_view(Request&& req, URLIntent&& intent, Send&& s
 }
 
 template <class Send>
-void SessionHandler::get_blob(const BlobRequest& req, Send&& send)
+Detached SessionHandler::get_blob(BlobRequest req, Send send)
 {
 	assert(req.blob());
 
-	// Return 304 if the etag is the same as the blob ID.
+	// Return 304 if the etag is the same as the blob ID, or the ID and the format of a
+	// rendition in another format.
 	// No need to check permission because we don't need to provide anything.
-	if (req.etag() == to_quoted_hex(*req.blob()))
+	if (BlobDatabase::is_etag_of(req.etag(), *req.blob()))
 	{
 		http::response<http::empty_body> res{http::status::not_modified, req.version()};
 		res.set(http::field::cache_control, "private, max-age=31536000, immutable");
-		res.set(http::field::etag, to_quoted_hex(*req.blob()));
-		return send(std::move(res));
+		res.set(http::field::etag, req.etag());
+		if (req.etag() != to_quoted_hex(*req.blob()))
+			res.set(http::field::vary, "Accept");
+		send(std::move(res));
+		co_return;
 	}
 
-	// Check if the user can access the blob
-	// Note: do not move-construct "req" to the lambda because the arguments of find() uses it.
-	// Otherwise, "req" will become dangled.
-	Ownership{req.owner()}.get_blob(
-		*m_db, req.collection(), *req.blob(),
-		[
-			req, this,
-			send = std::forward<Send>(send)
-		](BlobInodeDB entry, auto filename, auto ec) mutable
-		{
-			// Only allow the owner to know whether an object exists or not.
-			// Always reply forbidden for everyone else.
-			if (ec == Error::object_not_exist)
-				return send(
-					http::response<http::empty_body>{
-						req.request_by_owner(m_auth) ? http::status::not_found : http::status::forbidden,
-						req.version()
-					}
-				);
+	// Check if the user can access the blob. "req" and "send" are kept in the coroutine
+	// frame until the response is sent.
+	auto [entry, filename, ec] = co_await Ownership{req.owner()}.async_get_blob(
+		m_db->read(req.owner()), req.collection(), *req.blob()
+	);
 
-			if (ec)
-				return send(http::response<http::empty_body>{http::status::internal_server_error, req.version()});
+	// Only allow the owner to know whether an object exists or not.
+	// Always reply forbidden for everyone else.
+	if (ec == Error::object_not_exist)
+		send(
+			http::response<http::empty_body>{
+				req.request_by_owner(m_auth) ? http::status::not_found : http::status::forbidden,
+				req.version()
+			}
+		);
 
-			if (!entry.permission().allow(m_auth, req.owner()))
-				return send(http::response<http::empty_body>{http::status::forbidden, req.version()});
+	else if (ec)
+		send(http::response<http::empty_body>{http::status::internal_server_error, req.version()});
 
-			if (auto[json] = urlform.find_optional(req.option(), "json"); json)
-			{
-				return send(m_blob_db.meta(*req.blob(), req.version()));
-			}
-			else
-			{
-				auto[rendition] = urlform.find(req.option(), "rendition");
-				auto response = m_blob_db.response(*req.blob(), req.version(), req.etag(), rendition);
-				response.set(http::field::content_disposition, "inline; filename=" + url_encode(filename));
-				response.set(http::field::last_modified, entry.timestamp().http_format());
-				return send(std::move(response));
-			}
-		}
-	);
+	else if (!entry.permission().allow(m_auth, req.owner()))
+		send(http::response<http::empty_body>{http::status::forbidden, req.version()});
+
+	else if (auto[json] = urlform.find_optional(req.option(), "json"); json)
+		send(m_blob_db.meta(*req.blob(), req.version()));
+
+	else
+	{
+		// Generating the rendition may take a while. The coroutine is resumed by the
+		// executor of the session when it is done.
+		auto[rendition] = urlform.find(req.option(), "rendition");
+		auto response = co_await await_callback<BlobDatabase::BlobResponse>([&](auto&& complete)
+		{
+			m_blob_db.response(
+				*req.blob(), req.version(), rendition, req.accept(), m_db->get_executor(),
+				std::forward<decltype(complete)>(complete)
+			);
+		});
+		response.set(http::field::content_disposition, "inline; filename=" + url_encode(filename));
+		response.set(http::field::last_modified, entry.timestamp().http_format());
+		select_ranges(response, req.range(), req.if_range());
+		send(std::move(response));
+	}
 }
 
 template <class Send>
@@ -443,7 +519,7 @@ void SessionHandler::scan_collection(const URLIntent& intent, unsigned version,
 		return send(http::response<http::string_body>{http::status::forbidden, version});
 
 	Ownership{*user}.scan_all_collections(
-		*m_db,
+		m_db->read(*user),
 		SendJSON{std::forward<Send>(send), version, std::nullopt, *this, json.has_value() ? nullptr : &m_lib}
 	);
 }
@@ -460,7 +536,7 @@ void SessionHandler::query_blob(const BlobRequest& req, Send&& send)
 		owner = m_auth.username();
 
 	Ownership{owner}.get_blob(
-		*m_db,
+		m_db->read(owner),
 		m_auth,
 		*blob,
 		[
@@ -474,10 +550,16 @@ void SessionHandler::query_blob(const BlobRequest& req, Send&& send)
 			else if (ec)
 				return send(server_error("internal server error", req.version()));
 
-			auto response = m_blob_db.response(blobid, req.version(), req.etag(), rendition);
-			response.set(http::field::content_disposition, "inline; filename=" + url_encode(entry.filename()));
-			response.set(http::field::last_modified, entry.timestamp().http_format());
-			return send(std::move(response));
+			m_blob_db.response(
+				blobid, req.version(), rendition, req.accept(), m_db->get_executor(),
+				[send, req, filename=std::string{entry.filename()}, timestamp=entry.timestamp()](auto&& response) mutable
+				{
+					response.set(http::field::content_disposition, "inline; filename=" + url_encode(filename));
+					response.set(http::field::last_modified, timestamp.http_format());
+					select_ranges(response, req.range(), req.if_range());
+					send(std::move(response));
+				}
+			);
 		}
 	);
 }
@@ -494,7 +576,7 @@ void SessionHandler::query_blob_set(const URLIntent& intent, unsigned version, S
 	else if (dup_coll.has_value())
 	{
 		Ownership{m_auth.username()}.get_collection(
-			*m_db,
+			m_db->read(m_auth.username()),
 			m_auth,
 			*dup_coll,
 			[
@@ -545,7 +627,7 @@ void SessionHandler::post_view(BlobRequest&& req, Send&& send)
 
 	if (auto cover_blob = ObjectID::from_hex(cover); cover_blob)
 		return Ownership{req.owner()}.set_cover(
-			*m_db,
+			m_db->at(req.owner()),
 			req.collection(),
 			*cover_blob,
 			[send=std::move(send), version=req.version()](bool ok, auto ec)
@@ -1,6 +1,6 @@
 /*
 	Copyright © 2018 Wan Wai Ho <me@nestal.net>
-    
+
 	This file is subject to the terms and conditions of the GNU General Public
 	License.  See the file COPYING in the main directory of the hearty_rabbit
 	distribution for more details.
@@ -12,10 +12,59 @@
 
 #include "UploadFile.hh"
 
+#include "util/Log.hh"
+
+#include <boost/asio/post.hpp>
+
+#include <atomic>
+#include <cassert>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 namespace hrb {
 
+namespace {
+
+// Cleared when O_TMPFILE or linkat() does not work, e.g. in samba mounts. Later uploads
+// will use mkstemp()/rename() instead.
+std::atomic<bool> use_tmpfile{true};
+
+// Copy the whole file to a new one. Only used when linkat() fails.
+void copy_to(int src, const fs::path& dest, std::error_code& ec)
+{
+	struct stat st{};
+	if (::fstat(src, &st) != 0)
+		return ec.assign(errno, std::generic_category());
+
+	auto fd = ::open(dest.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return ec.assign(errno, std::generic_category());
+
+	off_t offset = 0;
+	while (offset < st.st_size)
+	{
+		if (::sendfile(fd, src, &offset, static_cast<std::size_t>(st.st_size - offset)) <= 0)
+		{
+			ec.assign(errno ? errno : EIO, std::generic_category());
+			break;
+		}
+	}
+	::close(fd);
+}
+
+} // end of local namespace
+
 UploadFile::~UploadFile()
 {
+	// Don't throw if the hasher is gone
+	if (m_hashing.valid())
+		m_hashing.wait();
+
 	if (!m_tmp_path.empty() && fs::exists(m_tmp_path))
 		fs::remove(m_tmp_path);
 }
@@ -30,20 +79,46 @@ void UploadFile::close(boost::system::error_code& ec)
 	m_file.close(ec);
 }
 
-void UploadFile::open(const fs::path& parent_directory, boost::system::error_code& ec)
+void UploadFile::open(const fs::path& parent_directory, boost::system::error_code& ec, boost::asio::thread_pool *hasher)
 {
-	// The code used to call open(O_TMPFILE)/linkat(/proc/self/fd/) when the kernel supports
-	// it, but it doesn't work when the parent_directory is a samba mount. Therefore we use
-	// the old mkstemp()/rename() which should work everywhere.
+	m_hasher = hasher;
+	m_tmp_path.clear();
+
+	// open(O_TMPFILE) does not work in samba mounts and some older file systems. In that
+	// case we use the old mkstemp()/rename() which should work everywhere.
+	if (use_tmpfile)
+	{
+		auto fd = ::open(parent_directory.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+		if (fd >= 0)
+			return m_file.native_handle(fd);
+
+		if (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL)
+			return ec.assign(errno, boost::system::generic_category());
+
+		Log(LOG_NOTICE, "O_TMPFILE is not supported in %1%. Using mkstemp() instead.", parent_directory);
+		use_tmpfile = false;
+	}
+
 	m_tmp_path = (parent_directory / "blob-XXXXXX").string();
 	int fd = ::mkstemp(&m_tmp_path[0]);
 
 	if (fd < 0)
+	{
+		m_tmp_path.clear();
 		ec.assign(errno, boost::system::generic_category());
+	}
 	else
 		m_file.native_handle(fd);
 }
 
+void UploadFile::reserve(std::uint64_t size)
+{
+	// Keep the size of the file, so it is still the number of bytes written if the
+	// upload is incomplete.
+	if (size > 0)
+		::fallocate(m_file.native_handle(), FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(size));
+}
+
 std::uint64_t UploadFile::size(boost::system::error_code& ec) const
 {
 	return m_file.size(ec);
@@ -66,14 +141,78 @@ std::size_t UploadFile::read(void *buffer, std::size_t n, boost::system::error_c
 
 std::size_t UploadFile::write(void const *buffer, std::size_t n, boost::system::error_code& ec)
 {
-	m_hash.update(buffer, n);
-	return m_file.write(buffer, n, ec);
+	auto src = static_cast<const char*>(buffer);
+	std::size_t written = 0;
+	while (written < n)
+	{
+		auto& block = m_blocks[m_current];
+		if (block.capacity() < block_size)
+			block.reserve(block_size);
+
+		auto count = std::min(n - written, block_size - block.size());
+		block.insert(block.end(), src + written, src + written + count);
+		written += count;
+
+		if (block.size() == block_size)
+		{
+			write_block(ec);
+			if (ec)
+				break;
+		}
+	}
+	return written;
 }
 
-/// Get the object ID (blake2 hash) of the file.
+void UploadFile::flush(boost::system::error_code& ec)
+{
+	if (!m_blocks[m_current].empty())
+		write_block(ec);
+	wait_hash();
+}
+
+// Hash the current block by the other thread and write it to the file. The other block
+// is filled at the same time.
+void UploadFile::write_block(boost::system::error_code& ec)
+{
+	auto& block = m_blocks[m_current];
+
+	// The other block is still being hashed. It must be hashed before this one.
+	wait_hash();
+	hash(block);
+
+	for (std::size_t offset = 0; offset < block.size() && !ec; )
+		offset += m_file.write(block.data() + offset, block.size() - offset, ec);
+
+	// The other block has been hashed, so it can be filled now.
+	m_current = 1 - m_current;
+	m_blocks[m_current].clear();
+}
+
+void UploadFile::hash(const std::vector<char>& block)
+{
+	if (!m_hasher)
+		return m_hash->update(block.data(), block.size());
+
+	std::packaged_task<void()> task{[hash=m_hash.get(), data=block.data(), size=block.size()]
+	{
+		hash->update(data, size);
+	}};
+	m_hashing = task.get_future();
+	boost::asio::post(*m_hasher, std::move(task));
+}
+
+void UploadFile::wait_hash()
+{
+	if (m_hashing.valid())
+		m_hashing.get();
+}
+
+/// Get the object ID (blake2 hash) of the file. flush() must be called before.
 ObjectID UploadFile::ID() const
 {
-	return ObjectID{Blake2{m_hash}.finalize()};
+	assert(!m_hashing.valid());
+	assert(m_blocks[m_current].empty());
+	return ObjectID{Blake2{*m_hash}.finalize()};
 }
 
 UploadFile::native_handle_type UploadFile::native_handle() const
@@ -83,17 +222,52 @@ UploadFile::native_handle_type UploadFile::native_handle() const
 
 void UploadFile::move(const fs::path& dest, std::error_code& ec)
 {
-	assert(!m_tmp_path.empty());
+	if (!m_file.is_open())
+		return ec.assign(ENOENT, std::generic_category());
+
+	std::error_code ignore;
+	auto tmp  = dest.string() + "." + std::to_string(::getpid()) + "-" + std::to_string(m_file.native_handle());
 
-	// Note that linkat() does not work in samba mount drive.
 	if (!m_tmp_path.empty())
 	{
 		// try moving the file instead of linking
 		rename(m_tmp_path, dest, ec);
-		m_tmp_path.clear();
+		if (ec != std::errc::cross_device_link)
+		{
+			m_tmp_path.clear();
+			return;
+		}
+
+		// The blob is placed in another volume. The destructor will remove m_tmp_path.
+		ec.clear();
 	}
 	else
-		ec.assign(ENOENT, std::generic_category());
+	{
+		// Give a name to the file created by O_TMPFILE. Link it to a temporary name first,
+		// because linkat() does not replace an existing file like rename().
+		auto proc = "/proc/self/fd/" + std::to_string(m_file.native_handle());
+		if (::linkat(AT_FDCWD, proc.c_str(), AT_FDCWD, tmp.c_str(), AT_SYMLINK_FOLLOW) == 0)
+		{
+			rename(tmp, dest, ec);
+			if (ec)
+				fs::remove(tmp, ignore);
+			return;
+		}
+
+		// linkat() does not work in samba mounts. Copy the file instead, and don't use
+		// O_TMPFILE anymore. It also fails if the blob is placed in another volume.
+		if (errno != EXDEV)
+		{
+			Log(LOG_NOTICE, "cannot link uploaded file to %1% (%2%). Using mkstemp() instead.", dest, std::strerror(errno));
+			use_tmpfile = false;
+		}
+	}
+
+	copy_to(m_file.native_handle(), tmp, ec);
+	if (!ec)
+		rename(tmp, dest, ec);
+	if (ec)
+		fs::remove(tmp, ignore);
 }
 
 std::size_t UploadFile::pread(void *buffer, std::size_t n, std::streamoff pos, std::error_code& ec) const
@@ -104,10 +278,13 @@ std::size_t UploadFile::pread(void *buffer, std::size_t n, std::streamoff pos, s
 	return static_cast<std::size_t>(r);
 }
 
-void UploadRequestBody::reader::init(const boost::optional<std::uint64_t>&, boost::system::error_code& ec)
+void UploadRequestBody::reader::init(const boost::optional<std::uint64_t>& content_length, boost::system::error_code& ec)
 {
 	if (!m_body.is_open())
 		ec.assign(EBADF, boost::system::generic_category());
+
+	else if (content_length)
+		m_body.reserve(*content_length);
 }
 
 } // end of namespace hrb
@@ -16,16 +16,33 @@
 #include "util/FS.hh"
 #include "net/Request.hh"
 
+#include <boost/asio/thread_pool.hpp>
 #include <boost/beast/core/file_posix.hpp>
+
+#include <array>
+#include <future>
+#include <memory>
 #include <system_error>
+#include <vector>
 
 namespace hrb {
 
+/// \brief Temporary file that stores an uploading blob
+/// The data written to it are buffered and written to the file in large blocks. They
+/// are hashed by another thread while the next block is being received, so the hash is
+/// ready when the upload finishes. Call flush() before reading the file or its ID().
+///
+/// The file is created by O_TMPFILE if the file system supports it, so that no half
+/// uploaded file is left in the blob directory if the server crashes.
 class UploadFile
 {
 public:
 	using native_handle_type = boost::beast::file_posix::native_handle_type ;
 
+	/// Size of the blocks written to the file. Both the offsets and the sizes of the
+	/// writes are multiples of it, except the last one.
+	static const std::size_t block_size = 1024 * 1024;
+
 public:
 	UploadFile() = default;
 	UploadFile(const UploadFile&) = delete;
@@ -41,8 +58,13 @@ public:
 	/// Close the file if open
 	void close(boost::system::error_code& ec);
 
-	/// Open a file at the given path with the specified mode
-	void open(const fs::path& parent_directory, boost::system::error_code& ec);
+	/// Create a temporary file in \a parent_directory. The data will be hashed by
+	/// \a hasher, or by the calling thread if it is null.
+	void open(const fs::path& parent_directory, boost::system::error_code& ec, boost::asio::thread_pool *hasher = nullptr);
+
+	/// Allocate the disk space of the file before writing, e.g. by the Content-Length
+	/// of the upload request. Failures are ignored because it is only an optimization.
+	void reserve(std::uint64_t size);
 
 	/// Return the size of the open file
 	std::uint64_t size(boost::system::error_code& ec) const;
@@ -61,6 +83,9 @@ public:
 	/// Write to the open file
 	std::size_t write(void const* buffer, std::size_t n, boost::system::error_code& ec);
 
+	/// Write the buffered data to the file and wait for them to be hashed
+	void flush(boost::system::error_code& ec);
+
 	[[nodiscard]] ObjectID ID() const;
 
 	[[nodiscard]] native_handle_type native_handle() const;
@@ -69,10 +94,22 @@ public:
 
 	[[nodiscard]] const std::string& path() const {return m_tmp_path;}
 
+private:
+	void write_block(boost::system::error_code& ec);
+	void hash(const std::vector<char>& block);
+	void wait_hash();
+
 private:
 	boost::beast::file_posix m_file{};
-	std::string m_tmp_path{};
-	Blake2      m_hash{};
+	std::string m_tmp_path{};       //!< empty if the file is created by O_TMPFILE
+
+	// Allocated on heap because the hashing thread refers to them even if we are moved.
+	std::unique_ptr<Blake2>             m_hash{std::make_unique<Blake2>()};
+	std::array<std::vector<char>, 2>    m_blocks;
+	std::size_t                         m_current{};    //!< the block being filled
+
+	boost::asio::thread_pool    *m_hasher{};
+	std::future<void>           m_hashing;      //!< hashing the other block
 };
 
 class UploadRequestBody
@@ -88,7 +125,7 @@ public:
 		{
 		}
 
-		void init(const boost::optional<std::uint64_t>&, boost::system::error_code& ec);
+		void init(const boost::optional<std::uint64_t>& content_length, boost::system::error_code& ec);
 
 		template<class ConstBufferSequence>
 		std::size_t put(const ConstBufferSequence& buffers, boost::system::error_code& ec)
@@ -106,8 +143,9 @@ public:
 			return total;
 		}
 
-		void finish(boost::system::error_code&)
+		void finish(boost::system::error_code& ec)
 		{
+			m_body.flush(ec);
 		}
 
 	private:
@@ -0,0 +1,138 @@
+/*
+	Copyright © 2018 Wan Wai Ho <me@nestal.net>
+
+	This file is subject to the terms and conditions of the GNU General Public
+	License.  See the file COPYING in the main directory of the hearty_rabbit
+	distribution for more details.
+*/
+
+//
+// Created by nestal on 30/10/18.
+//
+
+#include "AsyncFileReader.hh"
+
+#include <boost/asio/error.hpp>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+
+namespace hrb {
+
+namespace {
+
+// Let the kernel read ahead a larger window, because the files are read from the start
+// to the end.
+void advise_sequential(int fd)
+{
+	::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+}
+
+} // end of local namespace
+
+#if defined(BOOST_ASIO_HAS_FILE)
+
+AsyncFileReader::AsyncFileReader(std::size_t)
+{
+}
+
+AsyncFileReader::~AsyncFileReader() = default;
+
+std::shared_ptr<AsyncFileReader::File> AsyncFileReader::open(
+	const boost::asio::any_io_executor& executor,
+	const fs::path& path,
+	boost::system::error_code& ec
+)
+{
+	boost::asio::random_access_file file{executor};
+	file.open(path.string(), boost::asio::file_base::read_only, ec);
+	if (ec)
+		return {};
+
+	advise_sequential(file.native_handle());
+	return std::make_shared<File>(std::move(file));
+}
+
+bool AsyncFileReader::io_uring()
+{
+	return true;
+}
+
+AsyncFileReader::File::File(boost::asio::random_access_file&& file) :
+	m_file{std::move(file)},
+	m_size{m_file.size()}
+{
+}
+
+#else
+
+AsyncFileReader::AsyncFileReader(std::size_t threads) :
+	m_pool{std::max<std::size_t>(threads, 1)}
+{
+}
+
+AsyncFileReader::~AsyncFileReader()
+{
+	m_pool.join();
+}
+
+std::shared_ptr<AsyncFileReader::File> AsyncFileReader::open(
+	const boost::asio::any_io_executor& executor,
+	const fs::path& path,
+	boost::system::error_code& ec
+)
+{
+	boost::beast::file_posix file;
+	file.open(path.string().c_str(), boost::beast::file_mode::read, ec);
+	if (ec)
+		return {};
+
+	advise_sequential(file.native_handle());
+	return std::make_shared<File>(std::move(file), executor, m_pool);
+}
+
+bool AsyncFileReader::io_uring()
+{
+	return false;
+}
+
+AsyncFileReader::File::File(boost::beast::file_posix&& file, boost::asio::any_io_executor executor, boost::asio::thread_pool& pool) :
+	m_file{std::move(file)},
+	m_executor{std::move(executor)},
+	m_pool{pool}
+{
+	boost::system::error_code ec;
+	m_size = m_file.size(ec);
+}
+
+std::size_t AsyncFileReader::File::read_at(std::uint64_t offset, boost::asio::mutable_buffer buf, boost::system::error_code& ec)
+{
+	ssize_t result;
+	do
+	{
+		result = ::pread(m_file.native_handle(), buf.data(), buf.size(), static_cast<off_t>(offset));
+	} while (result < 0 && errno == EINTR);
+
+	if (result < 0)
+	{
+		ec.assign(errno, boost::system::system_category());
+		return 0;
+	}
+	if (result == 0 && buf.size() > 0)
+	{
+		ec = boost::asio::error::eof;
+		return 0;
+	}
+
+	// Start reading the next chunk while the caller is sending this one.
+	auto next = offset + static_cast<std::uint64_t>(result);
+	::posix_fadvise(m_file.native_handle(), static_cast<off_t>(next), static_cast<off_t>(buf.size()), POSIX_FADV_WILLNEED);
+	return static_cast<std::size_t>(result);
+}
+
+#endif
+
+} // end of namespace hrb
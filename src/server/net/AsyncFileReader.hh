@@ -0,0 +1,119 @@
+/*
+	Copyright © 2018 Wan Wai Ho <me@nestal.net>
+
+	This file is subject to the terms and conditions of the GNU General Public
+	License.  See the file COPYING in the main directory of the hearty_rabbit
+	distribution for more details.
+*/
+
+//
+// Created by nestal on 30/10/18.
+//
+
+#pragma once
+
+#include "util/FS.hh"
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/detail/config.hpp>
+#include <boost/asio/execution/outstanding_work.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/system/error_code.hpp>
+
+// Boost.Asio supports files with io_uring since 1.78, if BOOST_ASIO_HAS_IO_URING is defined.
+#if defined(BOOST_ASIO_HAS_FILE)
+#include <boost/asio/random_access_file.hpp>
+#else
+#include <boost/asio/thread_pool.hpp>
+#include <boost/beast/core/file_posix.hpp>
+#endif
+
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+namespace hrb {
+
+/// \brief Reads files without blocking the calling thread
+/// Sending a memory mapping blocks the thread in page faults when the file is not in the
+/// page cache, e.g. on spinning disks or NFS. AsyncFileReader reads the files by io_uring
+/// instead, or by pread() in its own threads if Boost.Asio does not support io_uring.
+class AsyncFileReader
+{
+public:
+	class File;
+
+public:
+	/// \a threads is the number of threads that call pread(). It is not used with io_uring.
+	explicit AsyncFileReader(std::size_t threads);
+	AsyncFileReader(AsyncFileReader&&) = delete;
+	AsyncFileReader(const AsyncFileReader&) = delete;
+	~AsyncFileReader();
+	AsyncFileReader& operator=(AsyncFileReader&&) = delete;
+	AsyncFileReader& operator=(const AsyncFileReader&) = delete;
+
+	/// Open \a path for reading. The completion routines of File::async_read_at() will
+	/// be called by \a executor.
+	[[nodiscard]] std::shared_ptr<File> open(
+		const boost::asio::any_io_executor& executor,
+		const fs::path& path,
+		boost::system::error_code& ec
+	);
+
+	[[nodiscard]] static bool io_uring();
+
+private:
+#if !defined(BOOST_ASIO_HAS_FILE)
+	boost::asio::thread_pool    m_pool;
+#endif
+};
+
+class AsyncFileReader::File
+{
+public:
+#if defined(BOOST_ASIO_HAS_FILE)
+	explicit File(boost::asio::random_access_file&& file);
+#else
+	File(boost::beast::file_posix&& file, boost::asio::any_io_executor executor, boost::asio::thread_pool& pool);
+#endif
+
+	[[nodiscard]] std::uint64_t size() const {return m_size;}
+
+	/// Read at most buffer_size(\a buf) bytes at \a offset. \a handler is called with
+	/// (boost::system::error_code, std::size_t) as boost::asio::random_access_file does.
+	/// The file must not be destroyed before the handler is called.
+	template <typename Handler>
+	void async_read_at(std::uint64_t offset, boost::asio::mutable_buffer buf, Handler&& handler)
+	{
+#if defined(BOOST_ASIO_HAS_FILE)
+		m_file.async_read_some_at(offset, buf, std::forward<Handler>(handler));
+#else
+		// The executor must not run out of work while the file is being read.
+		auto executor = boost::asio::prefer(m_executor, boost::asio::execution::outstanding_work.tracked);
+		boost::asio::post(m_pool, [this, offset, buf, executor, handler=std::forward<Handler>(handler)]() mutable
+		{
+			boost::system::error_code ec;
+			auto bytes = read_at(offset, buf, ec);
+			boost::asio::post(executor, [ec, bytes, handler=std::move(handler)]() mutable
+			{
+				handler(ec, bytes);
+			});
+		});
+#endif
+	}
+
+private:
+#if defined(BOOST_ASIO_HAS_FILE)
+	boost::asio::random_access_file     m_file;
+#else
+	std::size_t read_at(std::uint64_t offset, boost::asio::mutable_buffer buf, boost::system::error_code& ec);
+
+	boost::beast::file_posix            m_file;
+	boost::asio::any_io_executor        m_executor;
+	boost::asio::thread_pool&           m_pool;
+#endif
+	std::uint64_t                       m_size{};
+};
+
+} // end of namespace hrb
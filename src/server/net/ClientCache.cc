@@ -0,0 +1,347 @@
+/*
+	Copyright © 2018 Wan Wai Ho <me@nestal.net>
+    
+    This file is subject to the terms and conditions of the GNU General Public
+    License.  See the file COPYING in the main directory of the hearty_rabbit
+    distribution for more details.
+*/
+
+//
+// Created by nestal on 17/10/18.
+//
+
+#include "ClientCache.hh"
+
+#include "util/Log.hh"
+
+#include <boost/asio/bind_executor.hpp>
+#include <boost/asio/post.hpp>
+
+#include <algorithm>
+
+namespace hrb::redis {
+
+namespace {
+
+const std::string_view invalidate_channel{"__redis__:invalidate"};
+
+// The connections of the cache are not shared with other users, so they do not need a pool.
+class Unpooled : public PoolBase
+{
+public:
+	void dealloc(boost::asio::ip::tcp::socket) override {}
+	[[nodiscard]] std::size_t max_batch() const override {return 64;}
+	void on_write_batch(std::size_t) override {}
+};
+
+Unpooled& unpooled()
+{
+	static Unpooled pool;
+	return pool;
+}
+
+const std::chrono::milliseconds min_retry{100};
+const std::chrono::milliseconds max_retry{30000};
+
+} // end of local namespace
+
+ClientCache::ClientCache(
+	boost::asio::io_context& ioc,
+	const boost::asio::ip::tcp::endpoint& remote,
+	std::vector<std::string> prefixes,
+	std::chrono::seconds max_age,
+	std::size_t max_entries
+) :
+	m_strand{boost::asio::make_strand(ioc)},
+	m_remote{remote},
+	m_prefixes{std::move(prefixes)},
+	m_max_age{max_age},
+	m_max_entries{std::max<std::size_t>(max_entries, 1)},
+	m_retry{min_retry},
+	m_timer{m_strand}
+{
+}
+
+void ClientCache::start()
+{
+	m_stopped = false;
+	boost::asio::post(m_strand, [self=shared_from_this()]
+	{
+		if (!self->m_subscriber)
+			self->connect();
+	});
+}
+
+void ClientCache::stop()
+{
+	m_stopped = true;
+	boost::asio::post(m_strand, [self=shared_from_this()]
+	{
+		self->m_timer.cancel();
+		self->reset({});
+	});
+}
+
+template <typename Handler>
+auto ClientCache::guard(Handler&& handler)
+{
+	return [weak=weak_from_this(), gen=m_generation, handler=std::forward<Handler>(handler)](auto&&... args) mutable
+	{
+		if (auto self = weak.lock(); self && self->m_generation == gen)
+			handler(*self, std::forward<decltype(args)>(args)...);
+	};
+}
+
+template <typename Handler>
+void ClientCache::open(Handler&& handler)
+{
+	auto socket = std::make_shared<boost::asio::ip::tcp::socket>(m_strand);
+	socket->async_connect(m_remote, boost::asio::bind_executor(m_strand,
+		[socket, handler=guard(std::forward<Handler>(handler))](auto ec) mutable
+		{
+			handler(std::move(*socket), std::error_code{ec.value(), ec.category()});
+		}
+	));
+}
+
+void ClientCache::connect()
+{
+	open([](ClientCache& self, boost::asio::ip::tcp::socket&& socket, std::error_code ec)
+	{
+		if (ec)
+			return self.reset(ec);
+
+		self.m_subscriber = std::make_shared<Connection>(unpooled(), std::move(socket), self.m_strand);
+		self.m_subscriber->command(self.guard([](ClientCache& self, Reply&& reply, std::error_code ec)
+		{
+			if (!ec && reply.type() == REDIS_REPLY_INTEGER)
+				self.subscribe(reply.as_int());
+			else
+				self.reset(ec ? ec : Error::command_error);
+		}), "CLIENT ID");
+	});
+}
+
+void ClientCache::subscribe(long long client_id)
+{
+	m_subscriber->set_message_handler(guard([](ClientCache& self, Reply&& message, std::error_code ec)
+	{
+		if (ec)
+			self.reset(ec);
+		else
+			self.on_message(message);
+	}));
+
+	m_subscriber->command(guard([client_id](ClientCache& self, Reply&& reply, std::error_code ec)
+	{
+		if (ec || reply.array_size() != 3)
+			return self.reset(ec ? ec : Error::command_error);
+
+		self.open([client_id](ClientCache& self, boost::asio::ip::tcp::socket&& socket, std::error_code ec)
+		{
+			if (ec)
+				self.reset(ec);
+			else
+				self.track(client_id, std::move(socket));
+		});
+	}), "SUBSCRIBE %b", invalidate_channel.data(), invalidate_channel.size());
+}
+
+void ClientCache::track(long long client_id, boost::asio::ip::tcp::socket socket)
+{
+	m_tracker = std::make_shared<Connection>(unpooled(), std::move(socket), m_strand);
+
+	// Nothing is expected from the tracking connection. Keep reading from it to find
+	// out when it is disconnected, which stops the invalidation messages.
+	m_tracker->set_message_handler(guard([](ClientCache& self, Reply&&, std::error_code ec)
+	{
+		if (ec)
+			self.reset(ec);
+	}));
+
+	auto id = std::to_string(client_id);
+	std::vector<std::string_view> args{"TRACKING", "on", "REDIRECT", id, "BCAST"};
+	for (auto&& prefix : m_prefixes)
+	{
+		args.emplace_back("PREFIX");
+		args.emplace_back(prefix);
+	}
+
+	m_tracker->command(guard([](ClientCache& self, Reply&& reply, std::error_code ec)
+	{
+		if (!ec && reply.as_status() == "OK")
+			return self.enable();
+
+		// Redis before 6.0 does not support CLIENT TRACKING. No need to try again.
+		if (!ec)
+		{
+			Log(LOG_WARNING, "redis does not support client side caching: %1%", reply.as_error());
+			self.m_stopped = true;
+		}
+		self.reset(ec ? ec : Error::command_error);
+	}), CommandString{"CLIENT", args});
+}
+
+void ClientCache::enable()
+{
+	std::unique_lock lock{m_mx};
+	clear();
+	m_tracking = true;
+	m_retry = min_retry;
+	Log(LOG_NOTICE, "redis client side caching enabled for %1% key prefixes", m_prefixes.size());
+}
+
+void ClientCache::reset(std::error_code ec)
+{
+	{
+		std::unique_lock lock{m_mx};
+		if (m_tracking)
+			Log(LOG_WARNING, "redis client side caching disabled: %1% (%2%)", ec, ec.message());
+		m_tracking = false;
+		clear();
+	}
+
+	// The handlers called by disconnect() will be ignored by guard()
+	m_generation++;
+	for (auto conn : {std::exchange(m_subscriber, {}), std::exchange(m_tracker, {})})
+		if (conn)
+			conn->disconnect(ec);
+
+	if (!m_stopped)
+	{
+		m_timer.expires_after(m_retry);
+		m_timer.async_wait(guard([](ClientCache& self, boost::system::error_code ec)
+		{
+			if (!ec && !self.m_stopped)
+				self.connect();
+		}));
+		m_retry = std::min(m_retry * 2, max_retry);
+	}
+}
+
+void ClientCache::on_message(const Reply& message)
+{
+	// The keys are the last element of both the pub/sub message (RESP2) and the push frame
+	// (RESP3). A nil instead of the keys means redis is flushed.
+	if (message.is_push() ? message[0].as_string() != "invalidate" : message[1].as_string() != invalidate_channel)
+		return;
+
+	auto keys = message[message.array_size() - 1];
+	if (keys.is_nil())
+		flush();
+
+	for (auto&& key : keys)
+		invalidate(key.as_string());
+}
+
+std::optional<Reply> ClientCache::find(std::string_view request)
+{
+	std::shared_lock lock{m_mx};
+	if (m_tracking)
+	{
+		if (auto it = m_entries.find(std::string{request}); it != m_entries.end() && it->second.stored + m_max_age > Clock::now())
+		{
+			m_hits++;
+			return it->second.reply;
+		}
+	}
+	m_misses++;
+	return std::nullopt;
+}
+
+std::optional<std::uint64_t> ClientCache::version() const
+{
+	std::shared_lock lock{m_mx};
+	return m_tracking ? std::optional<std::uint64_t>{m_version} : std::nullopt;
+}
+
+void ClientCache::store(std::uint64_t version, std::string_view request, std::vector<std::string>&& keys, Reply reply)
+{
+	if (!std::all_of(keys.begin(), keys.end(), [this](auto&& key){return is_tracked(key);}))
+		return;
+
+	std::unique_lock lock{m_mx};
+	if (!m_tracking || version < m_flushed)
+		return;
+
+	for (auto&& key : keys)
+		if (auto it = m_changed.find(key); it != m_changed.end() && it->second > version)
+			return;
+
+	// Replies that are stored again leave stale entries in m_readers. Start over
+	// when there are too many of them.
+	if (m_entries.size() >= m_max_entries || m_readers_size >= m_max_entries * 4)
+		clear();
+
+	std::string req{request};
+	for (auto&& key : keys)
+		m_readers[std::move(key)].push_back(req);
+	m_readers_size += keys.size();
+
+	m_entries.insert_or_assign(std::move(req), Entry{std::move(reply), Clock::now()});
+}
+
+void ClientCache::invalidate(std::string_view key)
+{
+	std::unique_lock lock{m_mx};
+	m_invalidations++;
+
+	// Remember the changed key only for the replies in flight, i.e. since the oldest
+	// version that can be stored. Start over if there are too many of them.
+	if (m_changed.size() >= m_max_entries)
+	{
+		m_changed.clear();
+		m_flushed = m_version + 1;
+	}
+	m_changed.insert_or_assign(std::string{key}, ++m_version);
+
+	if (auto it = m_readers.find(std::string{key}); it != m_readers.end())
+	{
+		for (auto&& request : it->second)
+			m_entries.erase(request);
+		m_readers_size -= it->second.size();
+		m_readers.erase(it);
+	}
+}
+
+void ClientCache::flush()
+{
+	std::unique_lock lock{m_mx};
+	clear();
+}
+
+void ClientCache::clear()
+{
+	m_entries.clear();
+	m_readers.clear();
+	m_readers_size = 0;
+	m_changed.clear();
+	m_flushed = ++m_version;
+}
+
+bool ClientCache::tracking() const
+{
+	std::shared_lock lock{m_mx};
+	return m_tracking;
+}
+
+bool ClientCache::is_tracked(std::string_view key) const
+{
+	return std::any_of(m_prefixes.begin(), m_prefixes.end(), [key](auto&& prefix)
+	{
+		return key.starts_with(prefix);
+	});
+}
+
+std::size_t ClientCache::size() const
+{
+	std::shared_lock lock{m_mx};
+	return m_entries.size();
+}
+
+ClientCache::Stats ClientCache::stats() const
+{
+	return {m_hits, m_misses, m_invalidations};
+}
+
+} // end of namespace
@@ -0,0 +1,154 @@
+/*
+	Copyright © 2018 Wan Wai Ho <me@nestal.net>
+    
+    This file is subject to the terms and conditions of the GNU General Public
+    License.  See the file COPYING in the main directory of the hearty_rabbit
+    distribution for more details.
+*/
+
+//
+// Created by nestal on 17/10/18.
+//
+
+#pragma once
+
+#include "Redis.hh"
+
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/strand.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace hrb::redis {
+
+/// \brief In-process cache of redis replies kept coherent by server-assisted invalidation
+/// The cache opens two connections of its own to redis. One of them subscribes to the
+/// `__redis__:invalidate` channel. The other one enables `CLIENT TRACKING` in broadcasting
+/// mode for the tracked key prefixes, and redirects the invalidation messages to the
+/// first one. After that, redis publishes the name of every key with these prefixes
+/// that is modified, and the cache drops the replies that read them.
+///
+/// Redirecting the messages to a subscriber works with RESP2, so the other connections
+/// do not need to switch to RESP3. RESP3 push frames are handled in the same way.
+///
+/// Nothing is cached while the connections are not ready. If either of them is
+/// disconnected, the cache will be flushed and the connections will be opened again.
+class ClientCache : public std::enable_shared_from_this<ClientCache>
+{
+public:
+	ClientCache(
+		boost::asio::io_context& ioc,
+		const boost::asio::ip::tcp::endpoint& remote,
+		std::vector<std::string> prefixes,
+		std::chrono::seconds max_age,
+		std::size_t max_entries
+	);
+	ClientCache(ClientCache&&) = delete;
+	ClientCache(const ClientCache&) = delete;
+	~ClientCache() = default;
+	ClientCache& operator=(ClientCache&&) = delete;
+	ClientCache& operator=(const ClientCache&) = delete;
+
+	/// Connect to redis and start tracking.
+	void start();
+
+	/// Close the connections and stop caching.
+	void stop();
+
+	/// Return the cached reply of \a request, i.e. the formatted command, if any.
+	std::optional<Reply> find(std::string_view request);
+
+	/// Return the current version of the cache, or nullopt if it is not tracking. Get
+	/// the version before sending the command and pass it to store() with its reply, so
+	/// that the reply will be dropped if its keys are changed in between.
+	[[nodiscard]] std::optional<std::uint64_t> version() const;
+
+	/// Store the reply of \a request, which reads the redis \a keys. All of them must
+	/// match the tracked prefixes, or the reply will not be stored.
+	void store(std::uint64_t version, std::string_view request, std::vector<std::string>&& keys, Reply reply);
+
+	/// Drop all replies that read \a key.
+	void invalidate(std::string_view key);
+
+	/// Drop all cached replies.
+	void flush();
+
+	[[nodiscard]] bool tracking() const;
+	[[nodiscard]] bool is_tracked(std::string_view key) const;
+	[[nodiscard]] std::size_t size() const;
+
+	struct Stats
+	{
+		std::uint64_t   hits;
+		std::uint64_t   misses;
+		std::uint64_t   invalidations;  //!< number of keys invalidated
+	};
+	[[nodiscard]] Stats stats() const;
+
+private:
+	using Clock = std::chrono::steady_clock;
+	struct Entry
+	{
+		Reply               reply;
+		Clock::time_point   stored;
+	};
+
+	// These functions are called by the strand
+	void connect();
+	void subscribe(long long client_id);
+	void track(long long client_id, boost::asio::ip::tcp::socket socket);
+	void enable();
+	void reset(std::error_code ec);
+	void on_message(const Reply& message);
+
+	template <typename Handler>
+	void open(Handler&& handler);
+
+	// Wrap the handler to be called only if the cache is still alive and the connections
+	// are not reset since the handler was created.
+	template <typename Handler>
+	auto guard(Handler&& handler);
+
+	// must be called with m_mx locked exclusively
+	void clear();
+
+private:
+	boost::asio::strand<boost::asio::io_context::executor_type> m_strand;
+	boost::asio::ip::tcp::endpoint  m_remote;
+	const std::vector<std::string>  m_prefixes;
+	const std::chrono::seconds      m_max_age;
+	const std::size_t               m_max_entries;
+
+	// Only accessed by the strand
+	std::shared_ptr<Connection> m_subscriber, m_tracker;
+	std::uint64_t               m_generation{};
+	std::chrono::milliseconds   m_retry{};
+	boost::asio::steady_timer   m_timer;
+	std::atomic<bool>           m_stopped{false};
+
+	mutable std::shared_mutex   m_mx;
+	bool                        m_tracking{false};
+	std::unordered_map<std::string, Entry>                      m_entries;  //!< by formatted command
+	std::unordered_map<std::string, std::vector<std::string>>   m_readers;  //!< commands reading the key
+	std::size_t                 m_readers_size{};
+
+	// Changed keys since the replies in flight are requested. The replies will not be
+	// stored if any of their keys is changed after their version.
+	std::uint64_t               m_version{};
+	std::uint64_t               m_flushed{};
+	std::unordered_map<std::string, std::uint64_t>  m_changed;
+
+	std::atomic<std::uint64_t>  m_hits{}, m_misses{}, m_invalidations{};
+};
+
+} // end of namespace
@@ -0,0 +1,85 @@
+/*
+	Copyright © 2018 Wan Wai Ho <me@nestal.net>
+
+	This file is subject to the terms and conditions of the GNU General Public
+	License.  See the file COPYING in the main directory of the hearty_rabbit
+	distribution for more details.
+*/
+
+//
+// Created by nestal on 29/10/18.
+//
+
+#include "KTLSStream.hh"
+
+#include <boost/asio/ssl/error.hpp>
+
+#include <cerrno>
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+
+namespace hrb {
+
+KTLSStream::KTLSStream(boost::asio::ip::tcp::socket& socket, boost::asio::ssl::context& ctx) :
+	m_socket{socket},
+	m_ssl{::SSL_new(ctx.native_handle())}
+{
+	if (!m_ssl)
+		throw boost::system::system_error{
+			static_cast<int>(::ERR_get_error()), boost::asio::error::get_ssl_category()
+		};
+
+	// OpenSSL must not block the thread when it reads or writes the socket
+	m_socket.non_blocking(true);
+	::SSL_set_fd(m_ssl.get(), m_socket.native_handle());
+	::SSL_set_accept_state(m_ssl.get());
+
+	// Same as boost::asio::ssl::stream, so that async_write_some() behaves the same
+	::SSL_set_mode(m_ssl.get(), SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+}
+
+bool KTLSStream::ktls_send() const
+{
+	return BIO_get_ktls_send(::SSL_get_wbio(m_ssl.get()));
+}
+
+KTLSStream::Want KTLSStream::check(int result, boost::system::error_code& ec) const
+{
+	switch (::SSL_get_error(m_ssl.get(), result))
+	{
+	case SSL_ERROR_NONE:
+		ec.clear();
+		return Want::none;
+
+	case SSL_ERROR_WANT_READ:
+		return Want::read;
+
+	case SSL_ERROR_WANT_WRITE:
+		return Want::write;
+
+	case SSL_ERROR_ZERO_RETURN:
+		ec = boost::asio::error::eof;
+		return Want::none;
+
+	case SSL_ERROR_SYSCALL:
+		if (auto err = ::ERR_get_error(); err != 0)
+			ec.assign(static_cast<int>(err), boost::asio::error::get_ssl_category());
+		else if (errno != 0)
+			ec.assign(errno, boost::system::system_category());
+		else
+			ec = boost::asio::ssl::error::stream_truncated;
+		return Want::none;
+
+	default:
+		// OpenSSL 3 reports a connection closed without close_notify as an SSL error
+		if (auto err = ::ERR_peek_last_error(); ERR_GET_REASON(err) == SSL_R_UNEXPECTED_EOF_WHILE_READING)
+			ec = boost::asio::ssl::error::stream_truncated;
+		else
+			ec.assign(static_cast<int>(::ERR_get_error()), boost::asio::error::get_ssl_category());
+		return Want::none;
+	}
+}
+
+} // end of namespace hrb
+
+#endif
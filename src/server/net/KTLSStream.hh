@@ -0,0 +1,230 @@
+/*
+	Copyright © 2018 Wan Wai Ho <me@nestal.net>
+
+	This file is subject to the terms and conditions of the GNU General Public
+	License.  See the file COPYING in the main directory of the hearty_rabbit
+	distribution for more details.
+*/
+
+//
+// Created by nestal on 29/10/18.
+//
+
+#pragma once
+
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/compose.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/ssl/context.hpp>
+
+#include <openssl/err.h>
+#include <openssl/opensslv.h>
+#include <openssl/ssl.h>
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <system_error>
+#include <utility>
+
+#include <sys/types.h>
+
+// SSL_sendfile() and BIO_get_ktls_send() are only available since OpenSSL 3
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+
+namespace hrb {
+
+/// \brief TLS stream that lets OpenSSL read and write the socket directly
+/// boost::asio::ssl::stream feeds OpenSSL by a memory BIO, so OpenSSL can never hand the
+/// connection over to kernel TLS (kTLS). This stream gives the file descriptor of the
+/// socket to OpenSSL instead, and waits for the socket to become ready when OpenSSL
+/// would block.
+///
+/// If SSL_OP_ENABLE_KTLS is set in the SSL context and the kernel supports the cipher,
+/// the records are encrypted by the kernel after the handshake. Files can then be sent
+/// by async_sendfile() without copying them to user space.
+///
+/// It satisfies the AsyncReadStream and AsyncWriteStream requirements of Beast. Like
+/// boost::asio::ssl::stream, only one read and one write can be outstanding at a time.
+class KTLSStream
+{
+public:
+	using executor_type = boost::asio::ip::tcp::socket::executor_type;
+
+public:
+	KTLSStream(boost::asio::ip::tcp::socket& socket, boost::asio::ssl::context& ctx);
+
+	executor_type get_executor() {return m_socket.get_executor();}
+
+	/// Whether the kernel encrypts the records we send. Only meaningful after the handshake.
+	[[nodiscard]] bool ktls_send() const;
+
+	template <typename Handler>
+	auto async_handshake(Handler&& handler)
+	{
+		return async_op<false>([](SSL *ssl, std::size_t&)
+		{
+			return ::SSL_do_handshake(ssl);
+		}, std::forward<Handler>(handler));
+	}
+
+	template <typename MutableBufferSequence, typename Handler>
+	auto async_read_some(const MutableBufferSequence& buffers, Handler&& handler)
+	{
+		// OpenSSL does not support scatter/gather I/O. Beast will call us again with the
+		// remaining buffers.
+		boost::asio::mutable_buffer buf;
+		for (auto it = boost::asio::buffer_sequence_begin(buffers); it != boost::asio::buffer_sequence_end(buffers) && buf.size() == 0; ++it)
+			buf = *it;
+
+		return async_op<true>([buf](SSL *ssl, std::size_t& bytes)
+		{
+			return buf.size() == 0 ? 1 : ::SSL_read_ex(ssl, buf.data(), buf.size(), &bytes);
+		}, std::forward<Handler>(handler));
+	}
+
+	template <typename ConstBufferSequence, typename Handler>
+	auto async_write_some(const ConstBufferSequence& buffers, Handler&& handler)
+	{
+		return async_op<true>([data=gather(buffers)](SSL *ssl, std::size_t& bytes)
+		{
+			auto buf = data.second.empty() ? data.first : boost::asio::buffer(data.second);
+			return buf.size() == 0 ? 1 : ::SSL_write_ex(ssl, buf.data(), buf.size(), &bytes);
+		}, std::forward<Handler>(handler));
+	}
+
+	/// Send \a size bytes of the file \a fd starting from \a offset. It can only be used
+	/// if ktls_send() is true. The handler is called after all bytes are sent.
+	template <typename Handler>
+	auto async_sendfile(int fd, off_t offset, std::size_t size, Handler&& handler)
+	{
+		return async_op<true>([fd, offset, size, sent=std::size_t{}](SSL *ssl, std::size_t& bytes) mutable
+		{
+			while (sent < size)
+			{
+				auto result = ::SSL_sendfile(ssl, fd, offset + static_cast<off_t>(sent), size - sent, 0);
+				if (result <= 0)
+					return static_cast<int>(result);
+				sent += static_cast<std::size_t>(result);
+			}
+			bytes = sent;
+			return 1;
+		}, std::forward<Handler>(handler));
+	}
+
+	/// Send close_notify to the peer. It does not wait for the close_notify from the peer.
+	template <typename Handler>
+	auto async_shutdown(Handler&& handler)
+	{
+		return async_op<false>([](SSL *ssl, std::size_t&)
+		{
+			auto result = ::SSL_shutdown(ssl);
+			return result < 0 ? result : 1;
+		}, std::forward<Handler>(handler));
+	}
+
+private:
+	enum class Want {none, read, write};
+	Want check(int result, boost::system::error_code& ec) const;
+
+	// OpenSSL does not support scatter/gather I/O. Small buffers, e.g. the fields of an
+	// HTTP header, are copied to fill one TLS record. Otherwise there will be one record
+	// for each of them. Big buffers are written without copying, and Beast will call us
+	// again with the remaining buffers.
+	template <typename ConstBufferSequence>
+	static std::pair<boost::asio::const_buffer, std::string> gather(const ConstBufferSequence& buffers)
+	{
+		const std::size_t max_record = 16 * 1024;
+
+		std::string copy;
+		for (auto it = boost::asio::buffer_sequence_begin(buffers); it != boost::asio::buffer_sequence_end(buffers); ++it)
+		{
+			boost::asio::const_buffer buf = *it;
+			if (copy.size() + buf.size() > max_record)
+			{
+				if (copy.empty())
+					return {buf, {}};
+				break;
+			}
+			copy.append(static_cast<const char*>(buf.data()), buf.size());
+		}
+		return {{}, std::move(copy)};
+	}
+
+	// Calls the OpenSSL function until it completes, and waits for the socket when it
+	// would block.
+	template <bool with_bytes, typename Op>
+	struct Operation
+	{
+		KTLSStream& stream;
+		Op          op;
+		bool        waited{false};
+		std::optional<std::pair<boost::system::error_code, std::size_t>> result{};
+
+		template <typename Self>
+		void operator()(Self& self, boost::system::error_code ec = {})
+		{
+			if (!result && !ec)
+			{
+				::ERR_clear_error();
+
+				std::size_t bytes{};
+				switch (stream.check(op(stream.m_ssl.get(), bytes), ec))
+				{
+				case Want::read:
+					waited = true;
+					return stream.m_socket.async_wait(boost::asio::ip::tcp::socket::wait_read, std::move(self));
+
+				case Want::write:
+					waited = true;
+					return stream.m_socket.async_wait(boost::asio::ip::tcp::socket::wait_write, std::move(self));
+
+				case Want::none:
+					break;
+				}
+				result.emplace(ec, ec ? 0 : bytes);
+			}
+			else if (!result)
+				result.emplace(ec, 0);
+
+			// The handler must not be called inside the initiating function
+			if (!waited)
+			{
+				waited = true;
+				return boost::asio::post(stream.get_executor(), std::move(self));
+			}
+
+			if constexpr (with_bytes)
+				self.complete(result->first, result->second);
+			else
+				self.complete(result->first);
+		}
+	};
+
+	template <bool with_bytes, typename Op, typename Handler>
+	auto async_op(Op&& op, Handler&& handler)
+	{
+		using Signature = std::conditional_t<with_bytes,
+			void(boost::system::error_code, std::size_t),
+			void(boost::system::error_code)
+		>;
+		return boost::asio::async_compose<Handler, Signature>(
+			Operation<with_bytes, std::decay_t<Op>>{*this, std::forward<Op>(op)},
+			handler, m_socket
+		);
+	}
+
+private:
+	boost::asio::ip::tcp::socket&   m_socket;
+
+	struct SSLDeleter
+	{
+		void operator()(SSL *ssl) const {::SSL_free(ssl);}
+	};
+	std::unique_ptr<SSL, SSLDeleter>    m_ssl;
+};
+
+} // end of namespace hrb
+
+#endif
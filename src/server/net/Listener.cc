@@ -23,7 +23,7 @@ namespace hrb {
 
 Listener::Listener(
 	boost::asio::io_context &ioc,
-	std::function<SessionHandler()> session_factory,
+	std::function<SessionHandler(const boost::asio::any_io_executor&)> session_factory,
 	boost::asio::ssl::context *ssl_ctx,
 	const Configuration& cfg
 ) :
@@ -82,7 +82,7 @@ void Listener::on_accept(boost::system::error_code ec, boost::asio::ip::tcp::soc
 		// Create the session and run it
 		std::make_shared<Session>(
 			m_session_factory, std::move(socket),
-			*m_ssl_ctx, m_session_count,
+			*m_ssl_ctx, m_cfg.ktls(), m_session_count,
 			m_cfg.session_length(), m_cfg.upload_limit()
 		)->run();
 		m_session_count++;
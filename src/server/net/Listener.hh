@@ -30,7 +30,7 @@ class Listener : public std::enable_shared_from_this<Listener>
 public:
 	Listener(
 		boost::asio::io_context &ioc,
-		std::function<SessionHandler()> factory,
+		std::function<SessionHandler(const boost::asio::any_io_executor&)> factory,
 		boost::asio::ssl::context *ssl_ctx,
 		const Configuration& m_cfg
 	);
@@ -46,7 +46,7 @@ private:
 	boost::asio::ip::tcp::acceptor  m_acceptor;
 	boost::asio::ssl::context       *m_ssl_ctx{};
 
-	std::function<SessionHandler()> m_session_factory;
+	std::function<SessionHandler(const boost::asio::any_io_executor&)> m_session_factory;
 
 	// configurations
 	const Configuration&    m_cfg;
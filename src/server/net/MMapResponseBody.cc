@@ -12,11 +12,33 @@
 
 #include "MMapResponseBody.hh"
 
+#include <boost/beast/http/field.hpp>
+#include <boost/beast/http/status.hpp>
+
 namespace hrb {
 
+namespace http = boost::beast::http;
+
+namespace {
+
+std::string content_range(const ByteRange& range, std::uint64_t size)
+{
+	return "bytes " + std::to_string(range.offset) + "-" + std::to_string(range.last()) + "/" + std::to_string(size);
+}
+
+} // end of local namespace
+
 std::uint64_t MMapResponseBody::size(const value_type& body)
 {
-    return body.size();
+    if (!body.mmap)
+        return 0;
+    if (body.parts.empty())
+        return body.mmap->size();
+
+    auto result = body.trailer.size();
+    for (auto&& part : body.parts)
+        result += part.header.size() + part.range.length;
+    return result;
 }
 
 void MMapResponseBody::writer::init(boost::system::error_code& ec)
@@ -29,9 +51,83 @@ MMapResponseBody::writer::get(boost::system::error_code& ec)
 {
     ec.assign(0, ec.category());
 
-    return {
-        {m_body.blob(), false} // pair
-    }; // optional
+    if (!m_body.mmap)
+        return boost::none;
+
+    if (m_body.parts.empty())
+        return {
+            {m_body.mmap->blob(), false} // pair
+        }; // optional
+
+    // The header and the slice of each part, and then the trailer. Empty ones are skipped.
+    auto count = m_body.parts.size() * 2 + 1;
+    while (m_next < count)
+    {
+        auto index = m_next++;
+        const_buffers_type buf;
+        if (index == count - 1)
+            buf = boost::asio::buffer(m_body.trailer);
+        else if (auto& part = m_body.parts[index / 2]; index % 2 == 0)
+            buf = boost::asio::buffer(part.header);
+        else
+            buf = boost::asio::buffer(m_body.mmap->blob() + part.range.offset, part.range.length);
+
+        if (buf.size() > 0)
+            return {{buf, m_next < count}};
+    }
+    return boost::none;
+}
+
+void select_ranges(http::response<MMapResponseBody>& res, std::string_view range, std::string_view if_range)
+{
+	if (res.result() != http::status::ok || !res.body().mmap)
+		return;
+
+	res.set(http::field::accept_ranges, "bytes");
+	if (range.empty())
+		return;
+
+	// The ETag is the blob ID, which is a strong validator
+	if (!if_range.empty() && if_range != res[http::field::etag] && if_range != res[http::field::last_modified])
+		return;
+
+	auto size = res.body().mmap->size();
+	auto ranges = parse_byte_ranges(range, size);
+	if (!ranges)
+		return;
+
+	if (ranges->empty())
+	{
+		res.result(http::status::range_not_satisfiable);
+		res.set(http::field::content_range, "bytes */" + std::to_string(size));
+		res.body() = {};
+		return;
+	}
+
+	res.result(http::status::partial_content);
+	if (ranges->size() == 1)
+	{
+		res.set(http::field::content_range, content_range(ranges->front(), size));
+		res.body().parts.push_back({{}, ranges->front()});
+		return;
+	}
+
+	// The blob may contain anything, but it is very unlikely to contain its own hash.
+	auto etag = res[http::field::etag];
+	auto boundary = "hrb" + std::string{etag.substr(etag.empty() ? 0 : 1, etag.size() > 2 ? etag.size() - 2 : 0)};
+
+	auto type = std::string{res[http::field::content_type]};
+	for (auto&& r : *ranges)
+	{
+		res.body().parts.push_back({
+			"\r\n--" + boundary + "\r\n"
+			"Content-Type: " + type + "\r\n"
+			"Content-Range: " + content_range(r, size) + "\r\n\r\n",
+			r
+		});
+	}
+	res.body().trailer = "\r\n--" + boundary + "--\r\n";
+	res.set(http::field::content_type, "multipart/byteranges; boundary=" + boundary);
 }
 
 } // end of namespace hrb
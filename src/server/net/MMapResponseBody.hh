@@ -12,16 +12,51 @@
 
 #pragma once
 
+#include "util/ByteRange.hh"
+#include "util/FS.hh"
 #include "util/MMap.hh"
 
 #include <boost/beast/http/message.hpp>
 
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
 namespace hrb {
 
+class AsyncFileReader;
+
+/// \brief Beast body type that sends a memory mapped file
+/// The MMap is shared so that the same mapping can be sent in many responses at the same
+/// time, e.g. by the MMapCache. A null pointer is an empty body.
 class MMapResponseBody
 {
 public:
-	using value_type = MMap;
+	/// A slice of the mapping, and the data sent before it.
+	struct Part
+	{
+		std::string header;     //!< e.g. the boundary of multipart/byteranges
+		ByteRange   range;
+	};
+
+	struct value_type
+	{
+		std::shared_ptr<const MMap> mmap;
+
+		/// The mapped file. Session sends it by sendfile() instead of the mapping if
+		/// kernel TLS is enabled. Empty if the mapping is not a file.
+		fs::path    path;
+
+		/// The slices of the mapping to send, followed by \a trailer. The whole mapping is
+		/// sent if it is empty.
+		std::vector<Part>   parts;
+		std::string         trailer;
+
+		/// Session reads \a path by it instead of sending the mapping, so that page faults
+		/// do not block the io threads. Null to send the mapping.
+		AsyncFileReader     *reader{};
+	};
 
 	static std::uint64_t size(const value_type& body);
 
@@ -32,7 +67,7 @@ public:
 
         template<bool isRequest, class Fields>
         explicit
-        writer(boost::beast::http::header<isRequest, Fields> const&, value_type& body)
+        writer(boost::beast::http::header<isRequest, Fields> const&, const value_type& body)
             : m_body(body)
         {
         }
@@ -44,7 +79,19 @@ public:
 
 	private:
 		const value_type& m_body;
+		std::size_t m_next{};   //!< the header or the slice of a part to be sent next
 	};
 };
 
+/// Reply only the byte ranges of \a res requested by the Range header, i.e. 206 Partial
+/// Content, or 416 Range Not Satisfiable if none of them is in the body. More than one
+/// ranges are sent as multipart/byteranges. The full response is kept if the Range header
+/// is invalid, or \a if_range does not match the ETag or Last-Modified of \a res.
+/// See RFC7233.
+void select_ranges(
+	boost::beast::http::response<MMapResponseBody>& res,
+	std::string_view range,
+	std::string_view if_range = {}
+);
+
 } // end of namespace hrb
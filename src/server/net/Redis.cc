@@ -12,18 +12,26 @@
 
 
 #include "Redis.hh"
+#include "ClientCache.hh"
 
 #include "util/Backtrace.hh"
 #include "util/Log.hh"
 
 #include "util/Error.hh"
 
+#include <boost/algorithm/hex.hpp>
 #include <boost/asio/strand.hpp>
 #include <boost/exception/info.hpp>
 #include <boost/exception/errinfo_api_function.hpp>
 #include <boost/system/error_code.hpp>
 
+#include <openssl/sha.h>
+
+#include <algorithm>
 #include <cassert>
+#include <cstdint>
+#include <cstdlib>
+#include <unordered_map>
 
 namespace hrb {
 namespace redis {
@@ -52,20 +60,65 @@ std::shared_ptr<Connection> connect(
 
 Connection::Connection(
 	PoolBase& parent,
-	boost::asio::ip::tcp::socket socket
+	boost::asio::ip::tcp::socket socket,
+	const boost::asio::any_io_executor& executor
 ) :
 	m_socket{std::move(socket)},
+	m_executor{executor},
 	m_parent{parent}
 {
 }
 
+Connection::Connection(PoolBase& parent, const boost::asio::any_io_executor& executor) :
+	m_socket{executor},
+	m_executor{executor},
+	m_parent{parent},
+	m_pending{true},
+	m_attached{false}
+{
+}
+
 Connection::~Connection()
 {
-	// no point to reuse a closed socket
-	if (m_socket.is_open())
+	// Return the socket to the pool even if it is closed, so that the pool knows
+	// the connection is gone.
+	if (m_attached)
 		m_parent.dealloc(std::move(m_socket));
 }
 
+void Connection::attach(boost::asio::ip::tcp::socket socket, bool fresh)
+{
+	assert(m_pending);
+	assert(m_write_queue.size() == m_callbacks.size());
+
+	m_socket = std::move(socket);
+	m_attached = true;
+
+	// Load the scripts before any EVALSHA commands already queued. Redis executes
+	// commands in order.
+	if (fresh)
+	{
+		auto queued = static_cast<std::ptrdiff_t>(m_write_queue.size());
+		load_scripts();
+		std::rotate(m_write_queue.begin(), m_write_queue.begin() + queued, m_write_queue.end());
+		std::rotate(m_callbacks.begin(),   m_callbacks.begin()   + queued, m_callbacks.end());
+	}
+
+	m_pending = false;
+	if (!m_write_queue.empty())
+		flush();
+	if (!m_callbacks.empty())
+		do_read();
+}
+
+void Connection::fail(std::error_code ec)
+{
+	assert(m_pending);
+	m_pending = false;
+	m_write_queue.clear();
+	disconnect(ec);
+}
+
 void Connection::do_write(CommandString&& cmd, Completion&& completion)
 {
 	// In some cases, the redis reply will be received before the async_write() callback
@@ -76,35 +129,156 @@ void Connection::do_write(CommandString&& cmd, Completion&& completion)
 	// In order to avoid this, we have to en-queue the completion routine before sending
 	// the command to redis. It is impossible to receive a reply before the command is
 	// sent.
-	m_callbacks.push_back(std::move(completion));
-	if (m_callbacks.size() == 1)
+	if (cmd.script())
+	{
+		// Keep the EVALSHA command until redis replies. If redis does not have the script,
+		// complete() will send it again.
+		auto evalsha = std::make_shared<const CommandString>(std::move(cmd));
+		send({std::move(completion), evalsha}, {CommandString{}, evalsha});
+	}
+	else
+		send({std::move(completion), {}}, {std::move(cmd), {}});
+}
+
+void Connection::send(Callback&& callback, PendingCommand&& cmd)
+{
+	m_callbacks.push_back(std::move(callback));
+	m_write_queue.push_back(std::move(cmd));
+
+	// If the connection is still waiting for a socket, or there is a write in progress,
+	// the command will be sent with the other queued commands later.
+	// A connection with a message handler is always reading.
+	if (!m_pending)
+	{
+		if (m_callbacks.size() == 1 && !m_message_handler)
+			do_read();
+		if (m_writing.empty())
+			flush();
+	}
+}
+
+void Connection::do_cached(CommandString&& cmd, std::vector<std::string>&& keys, Completion&& completion)
+{
+	auto cache = m_parent.cache();
+	if (!cache)
+		return do_write(std::move(cmd), std::move(completion));
+
+	// Do not call the completion routine directly. The caller may not expect it.
+	if (auto hit = cache->find(cmd.str()))
+		return boost::asio::post(m_executor, [reply=std::move(*hit), completion=std::move(completion)]() mutable
+		{
+			completion(std::move(reply), std::error_code{});
+		});
+
+	auto version = cache->version();
+	if (!version)
+		return do_write(std::move(cmd), std::move(completion));
+
+	std::string request{cmd.str()};
+	do_write(std::move(cmd), [
+		cache=std::move(cache), version=*version, request=std::move(request),
+		keys=std::move(keys), completion=std::move(completion)
+	](Reply&& reply, std::error_code ec) mutable
+	{
+		if (!ec && reply)
+			cache->store(version, request, std::move(keys), reply);
+		completion(std::move(reply), ec);
+	});
+}
+
+void Connection::invalidate(std::string_view key)
+{
+	m_last_write = std::chrono::steady_clock::now();
+	if (auto cache = m_parent.cache())
+		cache->invalidate(key);
+}
+
+void Connection::set_message_handler(MessageHandler&& handler)
+{
+	// Start reading if there is no outstanding command, otherwise we are already reading.
+	auto idle = !m_message_handler && m_callbacks.empty();
+	m_message_handler = std::move(handler);
+	if (idle && !m_pending && m_socket.is_open())
 		do_read();
+}
+
+bool Connection::is_message(const Reply& reply) const
+{
+	// Only subscribed connections receive pub/sub messages. Check the message handler
+	// to avoid mistaking a reply that looks like a message for one.
+	return m_message_handler && (
+		reply.is_push() ||
+		(reply.array_size() == 3 && reply[0].as_string() == "message")
+	);
+}
+
+void Connection::flush()
+{
+	assert(m_writing.empty());
+	assert(!m_write_queue.empty());
+
+	// Send as many queued commands as allowed in one gather write
+	auto batch = std::min(m_write_queue.size(), std::max<std::size_t>(m_parent.max_batch(), 1));
+	if (batch == m_write_queue.size())
+		m_writing.swap(m_write_queue);
+	else
+	{
+		auto end = m_write_queue.begin() + static_cast<std::ptrdiff_t>(batch);
+		m_writing.assign(std::make_move_iterator(m_write_queue.begin()), std::make_move_iterator(end));
+		m_write_queue.erase(m_write_queue.begin(), end);
+	}
+
+	std::vector<boost::asio::const_buffer> buffers;
+	buffers.reserve(m_writing.size());
+	for (auto&& pending : m_writing)
+		buffers.push_back(pending.buffer());
+
+	m_parent.on_write_batch(m_writing.size());
 
-	auto buffer = cmd.buffer();
 	async_write(
 		m_socket,
-		buffer,
-		[this, cmd=std::move(cmd), self=shared_from_this()](auto ec, std::size_t bytes)
+		buffers,
+		boost::asio::bind_executor(m_executor, [this, self=shared_from_this()](auto ec, std::size_t)
 		{
+			m_writing.clear();
 			if (ec)
 			{
 				Log(LOG_WARNING, "redis write error %1% %2%", ec, ec.message());
+				m_write_queue.clear();
 				disconnect(Error::protocol);
 			}
-		}
+			else if (!m_write_queue.empty())
+				flush();
+		})
 	);
 }
 
+void Connection::load_scripts()
+{
+	for (auto script : Script::all())
+		command(
+			[script](Reply&& reply, std::error_code ec)
+			{
+				if (ec || !reply)
+					Log(LOG_WARNING, "cannot load script %1% into redis: %2% %3%", script->sha1(), reply.as_error(), ec);
+			},
+			"SCRIPT LOAD %b", script->source().data(), script->source().size()
+		);
+}
+
 void Connection::do_read()
 {
 	m_socket.async_read_some(
 		boost::asio::buffer(m_read_buf),
-		[this, self=shared_from_this()](auto ec, auto read){ on_read(ec, read); }
+		boost::asio::bind_executor(m_executor, [this, self=shared_from_this()](auto ec, auto read)
+		{
+			on_read(ec, read);
+		})
 	);
 }
 void Connection::on_read(boost::system::error_code ec, std::size_t bytes)
 {
-	assert(!m_callbacks.empty());
+	assert(!m_callbacks.empty() || m_message_handler);
 	if (!ec)
 	{
 		m_reader.feed(&m_read_buf[0], bytes);
@@ -112,24 +286,34 @@ void Connection::on_read(boost::system::error_code ec, std::size_t bytes)
 		auto [reply, result] = m_reader.get();
 
 		// Extract all replies from the
-		while (!m_callbacks.empty() && result == ReplyReader::Result::ok)
+		while (result == ReplyReader::Result::ok)
 		{
-			// When we are in the middle of a transaction, the commands will be queued
-			// by redis. These queued commands will be executed when the "EXEC" command
-			// is sent. We cannot call the callbacks for these queued commands. Instead,
-			// we move them to m_queued_callback so that they will be executed when "EXEC".
-			if (reply.as_status() == "QUEUED")
-				m_queued_callbacks.push_back(std::move(m_callbacks.front()));
-
-			// reply is not QUEUED but inside a transaction, that means the transaction
-			// is just executed.
-			else if (!m_queued_callbacks.empty())
-				on_exec_transaction(std::move(reply), std::error_code{ec.value(), ec.category()});
+			// Messages are not replies of any commands
+			if (is_message(reply))
+				m_message_handler(std::move(reply), std::error_code{});
 
-			else
-				m_callbacks.front()(std::move(reply), std::error_code{ec.value(), ec.category()});
+			else if (m_callbacks.empty())
+				break;
 
-			m_callbacks.pop_front();
+			else
+			{
+				// When we are in the middle of a transaction, the commands will be queued
+				// by redis. These queued commands will be executed when the "EXEC" command
+				// is sent. We cannot call the callbacks for these queued commands. Instead,
+				// we move them to m_queued_callback so that they will be executed when "EXEC".
+				if (reply.as_status() == "QUEUED")
+					m_queued_callbacks.push_back(std::move(m_callbacks.front()));
+
+				// reply is not QUEUED but inside a transaction, that means the transaction
+				// is just executed.
+				else if (!m_queued_callbacks.empty())
+					on_exec_transaction(std::move(reply), std::error_code{ec.value(), ec.category()});
+
+				else
+					complete(std::move(m_callbacks.front()), std::move(reply), std::error_code{ec.value(), ec.category()});
+
+				m_callbacks.pop_front();
+			}
 
 			std::tie(reply, result) = m_reader.get();
 		}
@@ -146,7 +330,7 @@ void Connection::on_read(boost::system::error_code ec, std::size_t bytes)
 		// Report parse error as protocol errors in the callbacks
 		while (result == ReplyReader::Result::error && !m_callbacks.empty())
 		{
-			m_callbacks.front()(Reply{}, std::error_code{Error::protocol});
+			complete(std::move(m_callbacks.front()), Reply{}, std::error_code{Error::protocol});
 			m_callbacks.pop_front();
 		}
 
@@ -158,7 +342,7 @@ void Connection::on_read(boost::system::error_code ec, std::size_t bytes)
 
 		// Keep reading until all outstanding commands are finished.
 		// This will keep the io_context::run() from returning.
-		else if (!m_callbacks.empty())
+		else if (!m_callbacks.empty() || m_message_handler)
 			do_read();
 	}
 	else
@@ -173,16 +357,46 @@ void Connection::disconnect(std::error_code ec)
 	// clean up all outstanding callbacks
 	// must not call this function inside any of these callbacks!!
 	for (auto&& cb : m_queued_callbacks)
-		cb(Reply{}, ec ? ec : std::error_code{Error::io});
+		complete(std::move(cb), Reply{}, ec ? ec : std::error_code{Error::io});
 	m_queued_callbacks.clear();
 
-	for (auto&& cb : m_callbacks)
-		cb(Reply{}, ec ? ec : std::error_code{Error::io});
-	m_callbacks.clear();
+	// The completion routines may send other commands to m_callbacks.
+	auto callbacks = std::move(m_callbacks);
+	for (auto&& cb : callbacks)
+		complete(std::move(cb), Reply{}, ec ? ec : std::error_code{Error::io});
+
+	if (auto handler = std::move(m_message_handler); handler)
+	{
+		m_message_handler = nullptr;
+		handler(Reply{}, ec ? ec : std::error_code{Error::io});
+	}
 
 	m_socket.close();
 }
 
+void Connection::complete(Callback callback, Reply&& reply, std::error_code ec, bool queued)
+{
+	// If redis does not have the script (e.g. someone runs SCRIPT FLUSH, or fails over to
+	// a replica without it), load all scripts again. The SCRIPT LOAD commands are sent
+	// before the EVALSHA command is sent again.
+	if (callback.evalsha && !ec && reply.as_error().starts_with("NOSCRIPT"))
+	{
+		Log(LOG_NOTICE, "redis does not have script %1%. Loading it again.", callback.evalsha->script()->sha1());
+		load_scripts();
+
+		if (!queued && !callback.resent)
+		{
+			auto evalsha = callback.evalsha;
+			callback.resent = true;
+			return send(std::move(callback), {CommandString{}, std::move(evalsha)});
+		}
+		ec = Error::noscript;
+	}
+
+	if (callback.completion)
+		callback.completion(std::move(reply), ec);
+}
+
 void Connection::on_exec_transaction(Reply&& reply, std::error_code ec)
 {
 	assert(!m_queued_callbacks.empty());
@@ -191,8 +405,7 @@ void Connection::on_exec_transaction(Reply&& reply, std::error_code ec)
 	if (reply.is_nil() || reply.as_status() == "OK")
 	{
 		for (auto&& callback : m_queued_callbacks)
-			if (callback)
-				callback(Reply{reply}, hrb::Error::redis_transaction_aborted);
+			complete(std::move(callback), Reply{reply}, hrb::Error::redis_transaction_aborted);
 	}
 
 	// transaction executed
@@ -204,8 +417,7 @@ void Connection::on_exec_transaction(Reply&& reply, std::error_code ec)
 			assert(!m_queued_callbacks.empty());
 			assert(callback != m_queued_callbacks.end());
 
-			if (*callback)
-				(*callback)(Reply{transaction_reply}, ec);
+			complete(std::move(*callback), Reply{transaction_reply}, ec, true);
 			callback++;
 		}
 	}
@@ -219,53 +431,51 @@ void Connection::on_exec_transaction(Reply&& reply, std::error_code ec)
 
 	// run the callback for the "EXEC" command
 	assert(!m_callbacks.empty());
-	m_callbacks.front()(std::move(reply), ec);
+	complete(std::move(m_callbacks.front()), std::move(reply), ec);
 
 	m_queued_callbacks.clear();
 }
 
-Reply::Reply(::redisReply *r) noexcept :
-	m_reply{r, [](::redisReply *r){::freeReplyObject(r);}}
+void Reply::swap(Reply& other) noexcept
 {
-	// Special handling for arrays
-	for (std::size_t i = 0 ; m_reply && m_reply->type == REDIS_REPLY_ARRAY && i < m_reply->elements; i++)
-	{
-		// Steal the element pointer and assign it to the shared_ptr of
-		// our vector. Basically takes the ownership of the array element.
-		m_array.emplace_back(m_reply->element[i]);
-		m_reply->element[i] = nullptr;
-	}
+	m_arena.swap(other.m_arena);
+	std::swap(m_index, other.m_index);
 }
 
-void Reply::swap(Reply& other) noexcept
+bool Reply::is_array() const noexcept
+{
+	return type() == REDIS_REPLY_ARRAY || is_push();
+}
+
+bool Reply::is_push() const noexcept
 {
-	m_reply.swap(other.m_reply);
-	m_array.swap(other.m_array);
+#ifdef REDIS_REPLY_PUSH
+	return type() == REDIS_REPLY_PUSH;
+#else
+	return false;
+#endif
 }
 
 std::string_view Reply::as_string() const noexcept
 {
-	return (m_reply && m_reply->type == REDIS_REPLY_STRING) ? as_any_string() : std::string_view{};
+	return type() == REDIS_REPLY_STRING ? as_any_string() : std::string_view{};
 }
 
 std::string_view Reply::as_status() const noexcept
 {
-	return (m_reply && m_reply->type == REDIS_REPLY_STATUS) ? as_any_string() : std::string_view{};
+	return type() == REDIS_REPLY_STATUS ? as_any_string() : std::string_view{};
 }
 
 std::string_view Reply::as_error() const noexcept
 {
-	return (m_reply && m_reply->type == REDIS_REPLY_ERROR) ? as_any_string() : std::string_view{};
+	return type() == REDIS_REPLY_ERROR ? as_any_string() : std::string_view{};
 }
 
 std::string_view Reply::as_any_string() const noexcept
 {
-	return (m_reply && (
-		m_reply->type == REDIS_REPLY_STRING ||
-		m_reply->type == REDIS_REPLY_STATUS ||
-		m_reply->type == REDIS_REPLY_ERROR
-	)) ?
-		std::string_view{m_reply->str, static_cast<std::size_t>(m_reply->len)} : std::string_view{};
+	auto t = type();
+	return (t == REDIS_REPLY_STRING || t == REDIS_REPLY_STATUS || t == REDIS_REPLY_ERROR) ?
+		std::string_view{m_arena->strings}.substr(node().offset, node().size) : std::string_view{};
 }
 
 boost::asio::const_buffer Reply::as_buffer() const noexcept
@@ -276,19 +486,18 @@ boost::asio::const_buffer Reply::as_buffer() const noexcept
 
 Reply Reply::as_array(std::size_t i) const noexcept
 {
-	return m_reply && m_reply->type == REDIS_REPLY_ARRAY && i < m_array.size() ?
-		m_array[i] : Reply{};
+	return is_array() && i < node().size ? Reply{m_arena, node().offset + i} : Reply{};
 }
 
 Reply Reply::as_array(std::size_t i, std::error_code& ec) const noexcept
 {
 	// If there is already an error, do nothing and because we can't report error.
-	if (ec || !m_reply)
+	if (ec || !m_arena)
 		return Reply{};
 
-	if (m_reply->type == REDIS_REPLY_ARRAY && i < m_array.size())
+	if (is_array() && i < node().size)
 	{
-		return m_array[i];
+		return Reply{m_arena, node().offset + i};
 	}
 	else
 	{
@@ -299,12 +508,12 @@ Reply Reply::as_array(std::size_t i, std::error_code& ec) const noexcept
 
 Reply::iterator Reply::begin() const
 {
-	return m_array.begin();
+	return {this, is_array() ? node().offset : 0};
 }
 
 Reply::iterator Reply::end() const
 {
-	return m_array.end();
+	return {this, is_array() ? node().offset + node().size : 0};
 }
 
 Reply Reply::operator[](std::size_t i) const noexcept
@@ -314,17 +523,17 @@ Reply Reply::operator[](std::size_t i) const noexcept
 
 std::size_t Reply::array_size() const noexcept
 {
-	return m_reply && m_reply->type == REDIS_REPLY_ARRAY ? m_array.size() : 0ULL;
+	return is_array() ? node().size : 0ULL;
 }
 
 long Reply::as_int() const noexcept
 {
-	return m_reply && m_reply->type == REDIS_REPLY_INTEGER ? m_reply->integer : 0;
+	return type() == REDIS_REPLY_INTEGER ? node().integer : 0;
 }
 
 Reply::operator bool() const noexcept
 {
-	return m_reply && m_reply->type != REDIS_REPLY_ERROR;
+	return m_arena && type() != REDIS_REPLY_ERROR;
 }
 
 long Reply::to_int() const noexcept
@@ -333,14 +542,9 @@ long Reply::to_int() const noexcept
 	return s.empty() ? 0 : std::stol(std::string{s});
 }
 
-char* Reply::as_mutable_string()
-{
-	return m_reply && m_reply->type == REDIS_REPLY_STRING ? m_reply->str : nullptr;
-}
-
 std::size_t Reply::length() const
 {
-	return m_reply && m_reply->type == REDIS_REPLY_STRING ? static_cast<std::size_t>(m_reply->len) : 0;
+	return type() == REDIS_REPLY_STRING ? node().size : 0;
 }
 
 const std::error_category& redis_error_category()
@@ -361,6 +565,8 @@ const std::error_category& redis_error_category()
 				case Error::other: return "other error";
 				case Error::command_error: return "command error";
 				case Error::field_not_found: return "field not found";
+				case Error::timeout: return "timeout";
+				case Error::noscript: return "script not loaded";
 				default: return "unknown error";
 			}
 		}
@@ -395,6 +601,244 @@ void CommandString::swap(CommandString& other) noexcept
 {
 	std::swap(m_cmd, other.m_cmd);
 	std::swap(m_length, other.m_length);
+	std::swap(m_script, other.m_script);
+}
+
+void CommandString::assign_script(const Script& script, char *args, int length)
+{
+	assert(args);
+	std::string_view formatted{args, static_cast<std::size_t>(length)};
+
+	// The formatted arguments start with "*<argc>\r\n"
+	auto header_end = formatted.find("\r\n");
+	assert(!formatted.empty() && formatted.front() == '*' && header_end != formatted.npos);
+
+	m_script = &script;
+	assign(
+		"EVALSHA", script.sha1(),
+		std::stoul(std::string{formatted.substr(1, header_end-1)}),
+		formatted.substr(header_end + 2)
+	);
+	::redisFreeCommand(args);
+}
+
+void CommandString::assign_argv(std::string_view cmd, const std::vector<std::string_view>& args)
+{
+	std::vector<const char*> argv{cmd.data()};
+	std::vector<std::size_t> argvlen{cmd.size()};
+	for (auto&& arg : args)
+	{
+		argv.push_back(arg.data());
+		argvlen.push_back(arg.size());
+	}
+
+	char *formatted{};
+	auto length = ::redisFormatCommandArgv(&formatted, static_cast<int>(argv.size()), argv.data(), argvlen.data());
+	if (length < 0)
+		throw std::logic_error("invalid command string");
+
+	::redisFreeCommand(m_cmd);
+	m_cmd    = formatted;
+	m_length = static_cast<int>(length);
+}
+
+CommandString::CommandString(const Script& script, std::size_t keys, const std::vector<std::string_view>& args)
+{
+	assert(keys <= args.size());
+
+	// Format the number of keys, the keys and the arguments as if they were a command,
+	// like the format strings of the other constructor
+	auto numkeys = std::to_string(keys);
+	assign_argv(numkeys, args);
+
+	auto formatted = std::exchange(m_cmd, nullptr);
+	assign_script(script, formatted, std::exchange(m_length, 0));
+}
+
+// Construct the command string "<verb> <first> <args...>" in redis protocol.
+// The resultant string will be freed by redisFreeCommand(), so it must be allocated by malloc().
+void CommandString::assign(std::string_view verb, std::string_view first, std::size_t argc, std::string_view args)
+{
+	auto header = (boost::format{"*%1%\r\n$%2%\r\n%3%\r\n$%4%\r\n"} % (argc+2) % verb.size() % verb % first.size()).str();
+	auto length = header.size() + first.size() + 2 + args.size();
+
+	auto cmd = static_cast<char*>(std::malloc(length));
+	if (!cmd)
+		throw std::bad_alloc{};
+
+	auto out = std::copy(header.begin(), header.end(), cmd);
+	out = std::copy(first.begin(), first.end(), out);
+	*out++ = '\r';
+	*out++ = '\n';
+	std::copy(args.begin(), args.end(), out);
+
+	::redisFreeCommand(m_cmd);
+	m_cmd    = cmd;
+	m_length = static_cast<int>(length);
+}
+
+Script::Script(std::string_view lua) : m_lua{lua}
+{
+	std::array<unsigned char, SHA_DIGEST_LENGTH> digest{};
+	::SHA1(reinterpret_cast<const unsigned char*>(lua.data()), lua.size(), digest.data());
+	boost::algorithm::hex_lower(digest.begin(), digest.end(), m_sha1.begin());
+
+	registry().push_back(this);
+}
+
+std::vector<const Script*>& Script::registry()
+{
+	static std::vector<const Script*> scripts;
+	return scripts;
+}
+
+const std::vector<const Script*>& Script::all()
+{
+	return registry();
+}
+
+/// Called by hiredis to build the nodes of a Reply in its arena. hiredis passes the
+/// objects returned by these functions back to us as the parent of the nested elements,
+/// so we return the index of the node (plus one, because hiredis treats null as out of
+/// memory) instead of a pointer.
+class ReplyReader::Builder
+{
+public:
+	static void* string(const ::redisReadTask *task, const char *str, std::size_t len)
+	{
+		auto& arena = self(task).m_arena;
+		auto index = self(task).slot(task);
+		arena->nodes[index] = {task->type, arena->strings.size(), len, 0};
+		arena->strings.append(str, len);
+		return to_object(index);
+	}
+
+	static void* array(const ::redisReadTask *task, std::size_t count)
+	{
+		auto& arena = self(task).m_arena;
+		auto index = self(task).slot(task);
+		auto first = arena->nodes.size();
+
+		// Reserve the slots for the elements so they are contiguous
+		arena->nodes.resize(first + count);
+		arena->nodes[index] = {task->type, first, count, 0};
+		return to_object(index);
+	}
+
+	static void* integer(const ::redisReadTask *task, long long value)
+	{
+		auto index = self(task).slot(task);
+		self(task).m_arena->nodes[index] = {task->type, 0, 0, value};
+		return to_object(index);
+	}
+
+	static void* nil(const ::redisReadTask *task)
+	{
+		auto index = self(task).slot(task);
+		self(task).m_arena->nodes[index] = {REDIS_REPLY_NIL, 0, 0, 0};
+		return to_object(index);
+	}
+
+	// The arena owns all the nodes, so there is nothing to free.
+	static void free_object(void*) {}
+
+	Reply release()
+	{
+		Reply result{std::move(m_arena), 0};
+		m_arena = std::make_shared<Reply::Arena>();
+		return result;
+	}
+
+private:
+	static Builder& self(const ::redisReadTask *task)
+	{
+		assert(task->privdata);
+		return *static_cast<Builder*>(task->privdata);
+	}
+
+	static void* to_object(std::size_t index)
+	{
+		return reinterpret_cast<void*>(index + 1);
+	}
+
+	static std::size_t to_index(const void *object)
+	{
+		return reinterpret_cast<std::uintptr_t>(object) - 1;
+	}
+
+	// Return the index of the node for the element parsed by the task
+	std::size_t slot(const ::redisReadTask *task)
+	{
+		// The root element is always the first node in the arena.
+		if (!task->parent)
+		{
+			assert(m_arena->nodes.empty());
+			m_arena->nodes.emplace_back();
+			return 0;
+		}
+
+		auto& parent = m_arena->nodes[to_index(task->parent->obj)];
+		assert(static_cast<std::size_t>(task->idx) < parent.size);
+		return parent.offset + task->idx;
+	}
+
+private:
+	std::shared_ptr<Reply::Arena> m_arena{std::make_shared<Reply::Arena>()};
+};
+
+ReplyReader::ReplyReader() :
+	m_builder{std::make_unique<Builder>()},
+	m_reader{create(m_builder.get())}
+{
+}
+
+ReplyReader::ReplyReader(ReplyReader&&) noexcept = default;
+ReplyReader::~ReplyReader() = default;
+ReplyReader& ReplyReader::operator=(ReplyReader&&) noexcept = default;
+
+::redisReader* ReplyReader::create(Builder *builder)
+{
+	// The signatures of these functions are a bit different in hiredis 0.x and 1.x,
+	// so let the compiler deduce the parameter types.
+	static auto functions = []
+	{
+		::redisReplyObjectFunctions fn{};
+		fn.createString = [](const ::redisReadTask *task, char *str, auto len) -> void*
+		{
+			return Builder::string(task, str, static_cast<std::size_t>(len));
+		};
+		fn.createArray = [](const ::redisReadTask *task, auto count) -> void*
+		{
+			return Builder::array(task, static_cast<std::size_t>(count));
+		};
+		fn.createInteger = [](const ::redisReadTask *task, long long value) -> void*
+		{
+			return Builder::integer(task, value);
+		};
+#if HIREDIS_MAJOR >= 1
+		fn.createDouble = [](const ::redisReadTask *task, double, char *str, std::size_t len) -> void*
+		{
+			return Builder::string(task, str, len);
+		};
+		fn.createBool = [](const ::redisReadTask *task, int value) -> void*
+		{
+			return Builder::integer(task, value);
+		};
+#endif
+		fn.createNil = [](const ::redisReadTask *task) -> void*
+		{
+			return Builder::nil(task);
+		};
+		fn.freeObject = &Builder::free_object;
+		return fn;
+	}();
+
+	auto reader = ::redisReaderCreateWithFunctions(&functions);
+	if (!reader)
+		throw std::bad_alloc{};
+
+	reader->privdata = builder;
+	return reader;
 }
 
 void ReplyReader::feed(const char *data, std::size_t size)
@@ -404,12 +848,13 @@ void ReplyReader::feed(const char *data, std::size_t size)
 
 std::tuple<Reply, ReplyReader::Result> ReplyReader::get()
 {
-	::redisReply *reply{};
-	auto result = ::redisReaderGetReply(m_reader.get(), (void**)&reply);
-	return std::make_tuple(
-		Reply{reply},
-		result == REDIS_OK ? (reply ? Result::ok : Result::not_ready) : Result::error
-	);
+	void *reply{};
+	if (::redisReaderGetReply(m_reader.get(), &reply) != REDIS_OK)
+		return std::make_tuple(Reply{}, Result::error);
+
+	return reply ?
+		std::make_tuple(m_builder->release(), Result::ok) :
+		std::make_tuple(Reply{}, Result::not_ready);
 }
 
 void ReplyReader::Deleter::operator()(::redisReader *reader) const noexcept
@@ -417,40 +862,451 @@ void ReplyReader::Deleter::operator()(::redisReader *reader) const noexcept
 	::redisReaderFree(reader);
 }
 
-Pool::Pool(boost::asio::io_context& ioc, const boost::asio::ip::tcp::endpoint& remote) :
+Pool::Pool(
+	boost::asio::io_context& ioc,
+	const boost::asio::ip::tcp::endpoint& remote,
+	const PoolSettings& settings
+) :
 	m_ioc{ioc},
-	m_remote{remote}
+	m_remote{remote},
+	m_settings{settings},
+	m_serial{next_serial()},
+	m_timer{boost::asio::make_strand(ioc)}
 {
+	if (!settings.cache_prefixes.empty())
+		m_cache = std::make_shared<ClientCache>(
+			ioc, remote, settings.cache_prefixes,
+			settings.cache_max_age, settings.cache_max_entries
+		);
 }
 
-boost::asio::ip::tcp::socket Pool::get_sock()
+Pool::~Pool()
 {
-	if (!m_socks.empty())
+	// Wait for the completion handlers that are running, and stop the others from
+	// calling the pool.
 	{
-		std::unique_lock<std::mutex> lock{m_mx};
-		if (!m_socks.empty())
-		{
-			auto sock = std::move(m_socks.back());
-			m_socks.pop_back();
-			return sock;
-		}
+		std::unique_lock lock{m_lifetime->mx};
+		m_lifetime->pool = nullptr;
 	}
 
-	boost::asio::ip::tcp::socket sock{boost::asio::make_strand(m_ioc)};
-	sock.connect(m_remote);
+	if (m_cache)
+		m_cache->stop();
+
+	std::unique_lock lock{m_mx};
+	m_timer.cancel();
+}
+
+void Pool::start()
+{
+	if (m_cache)
+		m_cache->start();
 
-	return sock;
+	std::unique_lock lock{m_mx};
+	m_started = true;
+	m_next_maintenance = Clock::now() + m_settings.health_check;
+	dispatch();
 }
 
 std::shared_ptr<Connection> Pool::alloc()
 {
-	return std::make_shared<Connection>(*this, get_sock());
+	return alloc(boost::asio::make_strand(m_ioc));
+}
+
+std::shared_ptr<Connection> Pool::alloc(const boost::asio::any_io_executor& executor)
+{
+	// Try the idle sockets cached by this thread first. Its lock is only contended
+	// during maintenance.
+	std::optional<IdleSocket> cached;
+	if (auto cache = thread_cache())
+	{
+		std::unique_lock lock{cache->mx};
+		if (!cache->sockets.empty())
+		{
+			cached.emplace(std::move(cache->sockets.back()));
+			cache->sockets.pop_back();
+		}
+	}
+	if (cached)
+	{
+		auto idle = std::move(*cached);
+		if (idle.since + m_settings.health_check > Clock::now())
+			return std::make_shared<Connection>(*this, std::move(idle.socket), executor);
+
+		// Sockets that are not used for a while may be broken. Check them before
+		// giving them to the pool again, and use another socket now.
+		health_check(std::move(idle));
+	}
+
+	std::unique_lock lock{m_mx};
+	if (!m_idle.empty())
+	{
+		auto idle = std::move(m_idle.back());
+		m_idle.pop_back();
+		lock.unlock();
+
+		auto conn = std::make_shared<Connection>(*this, std::move(idle.socket), executor);
+
+		// Redis may have been restarted and lost all its scripts since the last time
+		// we connected, so load them again for every new connection. Redis executes
+		// commands in order, so the scripts will be loaded before any EVALSHA commands
+		// sent on this connection.
+		if (idle.fresh)
+			conn->load_scripts();
+		return conn;
+	}
+
+	// No idle socket. The connection will wait for a socket to be connected or returned.
+	auto conn = std::make_shared<Connection>(*this, executor);
+	m_waiters.push_back({conn, Clock::now() + m_settings.connect_timeout});
+	dispatch();
+	return conn;
 }
 
 void Pool::dealloc(boost::asio::ip::tcp::socket socket)
 {
-	std::unique_lock<std::mutex> lock{m_mx};
-	m_socks.push_back(std::move(socket));
+	// Keep the socket in the cache of this thread if no one is waiting for it.
+	if (auto cache = socket.is_open() && m_waiting == 0 ? thread_cache() : nullptr)
+	{
+		std::unique_lock lock{cache->mx};
+		if (cache->sockets.size() < m_settings.thread_cache)
+		{
+			cache->sockets.push_back({std::move(socket), Clock::now(), false});
+			return;
+		}
+	}
+
+	std::unique_lock lock{m_mx};
+
+	// no point to reuse a closed socket
+	if (socket.is_open())
+		give({std::move(socket), Clock::now(), false});
+	else
+	{
+		assert(m_size > 0);
+		m_size--;
+	}
+	dispatch();
+}
+
+std::uint64_t Pool::next_serial()
+{
+	static std::atomic<std::uint64_t> serial{};
+	return serial++;
+}
+
+Pool::ThreadCache* Pool::thread_cache()
+{
+	// The cache of this thread in each pool it has used, or nullptr if the pool has
+	// given all caches to other threads. The entries of destroyed pools are never
+	// looked up again.
+	thread_local std::unordered_map<std::uint64_t, ThreadCache*> caches;
+
+	auto [it, inserted] = caches.try_emplace(m_serial, nullptr);
+	if (inserted)
+	{
+		std::unique_lock lock{m_mx};
+		if (m_thread_caches.size() < m_settings.threads)
+			it->second = &m_thread_caches.emplace_back();
+	}
+	return it->second;
+}
+
+std::size_t Pool::size() const
+{
+	std::unique_lock lock{m_mx};
+	return m_size;
+}
+
+std::size_t Pool::idle() const
+{
+	std::unique_lock lock{m_mx};
+	return m_idle.size();
+}
+
+std::size_t Pool::thread_cached()
+{
+	auto cache = thread_cache();
+	if (!cache)
+		return 0;
+
+	std::unique_lock lock{cache->mx};
+	return cache->sockets.size();
+}
+
+void Pool::dispatch()
+{
+	auto now = Clock::now();
+
+	// Drop the waiters that are destroyed, and fail the ones that waited for too long.
+	for (auto it = m_waiters.begin(); it != m_waiters.end(); )
+	{
+		if (auto conn = it->conn.lock(); conn && it->deadline <= now)
+		{
+			Log(LOG_WARNING, "timeout waiting for redis connection");
+			boost::asio::post(conn->get_executor(), [conn]{conn->fail(Error::timeout);});
+			it = m_waiters.erase(it);
+		}
+		else if (!conn)
+			it = m_waiters.erase(it);
+		else
+			++it;
+	}
+
+	// After failures, only try one socket at a time until it is connected.
+	if (now >= m_retry)
+	{
+		auto max_connecting = m_failures > 0 ? std::min<std::size_t>(m_waiters.size(), 1) : m_waiters.size();
+
+		// Open new sockets for the waiters that will not get one from the sockets being connected
+		while (m_size < m_settings.max_size && m_connecting < max_connecting)
+			connect();
+
+		// Keep at least min_size sockets opened after start()
+		while (m_started && m_size < m_settings.min_size && m_connecting < (m_failures > 0 ? 1U : m_settings.min_size))
+			connect();
+	}
+
+	m_waiting = m_waiters.size();
+	schedule();
+}
+
+void Pool::connect()
+{
+	m_size++;
+	m_connecting++;
+
+	// The socket is not bound to any strand, so that its completion handlers can run on
+	// the executors of the connections that use it.
+	// The timer closes the socket when it is expired, and async_connect() will be
+	// aborted. Both of them use the same strand.
+	auto strand = boost::asio::make_strand(m_ioc);
+	auto socket = std::make_shared<boost::asio::ip::tcp::socket>(m_ioc);
+	auto timer  = std::make_shared<boost::asio::steady_timer>(strand, m_settings.connect_timeout);
+	timer->async_wait([socket](auto ec)
+	{
+		if (!ec)
+			socket->close();
+	});
+	socket->async_connect(m_remote, boost::asio::bind_executor(strand, [lifetime=m_lifetime, socket, timer](auto ec)
+	{
+		timer->cancel();
+		lifetime->run([&](Pool& pool){pool.on_connect(std::move(*socket), ec);});
+	}));
+}
+
+void Pool::on_connect(boost::asio::ip::tcp::socket socket, boost::system::error_code ec)
+{
+	std::unique_lock lock{m_mx};
+	assert(m_connecting > 0);
+	m_connecting--;
+
+	if (ec)
+	{
+		m_size--;
+
+		// Exponential backoff: 100ms, 200ms, 400ms... up to max_backoff
+		using namespace std::chrono_literals;
+		auto backoff = std::min<Clock::duration>(100ms * (1U << std::min(m_failures, 16U)), m_settings.max_backoff);
+		m_failures++;
+		m_retry = Clock::now() + backoff;
+		Log(LOG_WARNING, "cannot connect to redis: %1% (%2%). Retry after %3% ms",
+			ec, ec.message(), std::chrono::duration_cast<std::chrono::milliseconds>(backoff).count()
+		);
+
+		// Fail all waiters immediately if there is no other connection. Redis is probably down.
+		if (m_size == 0)
+			fail_waiters(ec);
+	}
+	else
+	{
+		m_failures = 0;
+		give({std::move(socket), Clock::now(), true});
+	}
+	dispatch();
+}
+
+void Pool::give(IdleSocket&& idle)
+{
+	// Give the socket to the first waiter that still exists
+	while (!m_waiters.empty())
+	{
+		auto conn = m_waiters.front().conn.lock();
+		m_waiters.pop_front();
+		if (conn)
+		{
+			boost::asio::post(conn->get_executor(), [conn, idle=std::move(idle)]() mutable
+			{
+				conn->attach(std::move(idle.socket), idle.fresh);
+			});
+			return;
+		}
+	}
+	m_idle.push_back(std::move(idle));
+}
+
+void Pool::fail_waiters(std::error_code ec)
+{
+	for (auto&& waiter : m_waiters)
+		if (auto conn = waiter.conn.lock())
+			boost::asio::post(conn->get_executor(), [conn, ec]{conn->fail(ec);});
+	m_waiters.clear();
+}
+
+void Pool::schedule()
+{
+	auto expiry = m_next_maintenance;
+	if (!m_waiters.empty())
+		expiry = std::min(expiry, m_waiters.front().deadline);
+	if (m_retry > Clock::now() && (!m_waiters.empty() || (m_started && m_size < m_settings.min_size)))
+		expiry = std::min(expiry, m_retry);
+
+	if (expiry == m_timer_expiry)
+		return;
+
+	// Don't keep the timer running when there is nothing to do, otherwise io_context::run()
+	// will not return.
+	if (expiry == Clock::time_point::max())
+	{
+		m_timer_expiry = expiry;
+		m_timer.cancel();
+		return;
+	}
+
+	// Re-arming the timer cancels the previous wait
+	m_timer_expiry = expiry;
+	m_timer.expires_at(expiry);
+	m_timer.async_wait([lifetime=m_lifetime](auto ec)
+	{
+		if (ec != boost::asio::error::operation_aborted)
+			lifetime->run([](Pool& pool){pool.on_timer();});
+	});
+}
+
+void Pool::on_timer()
+{
+	std::vector<IdleSocket> check;
+	{
+		std::unique_lock lock{m_mx};
+		m_timer_expiry = Clock::time_point::max();
+		if (Clock::now() >= m_next_maintenance)
+			maintain(check);
+		dispatch();
+	}
+
+	// Don't hold the lock when starting the health checks
+	for (auto&& idle : check)
+		health_check(std::move(idle));
+}
+
+void Pool::maintain(std::vector<IdleSocket>& check)
+{
+	auto now = Clock::now();
+	m_next_maintenance = now + m_settings.health_check;
+
+	// Take the sockets that are not used since the last health check from the thread
+	// caches, so that they are checked or closed like the others.
+	for (auto&& cache : m_thread_caches)
+	{
+		std::unique_lock lock{cache.mx};
+		auto stale = std::partition(cache.sockets.begin(), cache.sockets.end(), [&](auto& idle)
+		{
+			return idle.since + m_settings.health_check > now;
+		});
+		m_idle.insert(m_idle.end(), std::make_move_iterator(stale), std::make_move_iterator(cache.sockets.end()));
+		cache.sockets.erase(stale, cache.sockets.end());
+	}
+
+	// Close the sockets that are idle for too long, oldest first, but keep at least min_size
+	std::sort(m_idle.begin(), m_idle.end(), [](auto& a, auto& b){return a.since < b.since;});
+	auto reap = m_idle.begin();
+	while (reap != m_idle.end() && m_size > m_settings.min_size && reap->since + m_settings.idle_timeout <= now)
+	{
+		reap->socket.close();
+		m_size--;
+		++reap;
+	}
+	m_idle.erase(m_idle.begin(), reap);
+
+	// PING the remaining sockets that are not used since the last health check
+	auto stale = std::partition(m_idle.begin(), m_idle.end(), [&](auto& idle)
+	{
+		return idle.since + m_settings.health_check > now;
+	});
+	check.assign(std::make_move_iterator(stale), std::make_move_iterator(m_idle.end()));
+	m_idle.erase(stale, m_idle.end());
+}
+
+void Pool::health_check(IdleSocket&& idle)
+{
+	struct Check
+	{
+		IdleSocket                  idle;
+		std::string                 reply;
+		boost::asio::steady_timer   timer;
+	};
+	auto strand = boost::asio::make_strand(m_ioc);
+	auto check = std::make_shared<Check>(Check{std::move(idle), {}, boost::asio::steady_timer{strand}});
+
+	check->timer.expires_after(m_settings.connect_timeout);
+	check->timer.async_wait([check](auto ec)
+	{
+		if (!ec)
+			check->idle.socket.close();
+	});
+
+	static const char ping[] = "*1\r\n$4\r\nPING\r\n";
+	async_write(check->idle.socket, boost::asio::buffer(ping, sizeof(ping)-1), boost::asio::bind_executor(strand, [lifetime=m_lifetime, strand, check](auto ec, auto)
+	{
+		if (ec)
+		{
+			check->timer.cancel();
+			return lifetime->run([&](Pool& pool){pool.on_health_check(std::move(check->idle), ec);});
+		}
+
+		async_read_until(check->idle.socket, boost::asio::dynamic_buffer(check->reply), "\r\n", boost::asio::bind_executor(strand, [lifetime, check](auto ec, auto)
+		{
+			check->timer.cancel();
+			lifetime->run([&](Pool& pool)
+			{
+				pool.on_health_check(
+					std::move(check->idle),
+					ec ? std::error_code{ec.value(), ec.category()} :
+					check->reply == "+PONG\r\n" ? std::error_code{} :
+					std::error_code{Error::protocol}
+				);
+			});
+		}));
+	}));
+}
+
+void Pool::on_health_check(IdleSocket&& idle, std::error_code ec)
+{
+	std::unique_lock lock{m_mx};
+	if (ec)
+	{
+		Log(LOG_WARNING, "redis health check failed: %1% (%2%). Closing connection.", ec, ec.message());
+		idle.socket.close();
+		m_size--;
+	}
+	else
+		give(std::move(idle));
+
+	dispatch();
+}
+
+void Pool::on_write_batch(std::size_t commands)
+{
+	m_writes++;
+	m_commands += commands;
+
+	auto largest = m_largest_batch.load();
+	while (commands > largest && !m_largest_batch.compare_exchange_weak(largest, commands))
+		;
+}
+
+Pool::WriteStats Pool::write_stats() const
+{
+	return {m_writes.load(), m_commands.load(), m_largest_batch.load()};
 }
 
 }} // end of namespace
@@ -12,19 +12,31 @@
 
 #pragma once
 
+#include "util/InlineFunction.hh"
 #include "util/RepeatingTuple.hh"
+#include "util/RingBuffer.hh"
 
 #include <boost/asio.hpp>
 #include <boost/iterator/iterator_adaptor.hpp>
+#include <boost/iterator/iterator_facade.hpp>
 #include <boost/range/iterator_range.hpp>
 
 #include <hiredis/hiredis.h>
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
 #include <deque>
+#include <functional>
 #include <memory>
+#include <optional>
 #include <string>
+#include <tuple>
 #include <type_traits>
 #include <mutex>
+#include <vector>
 
 namespace hrb {
 namespace redis {
@@ -41,7 +53,9 @@ enum class Error
 
 	// other logical errors
 	command_error = 1000,
-	field_not_found
+	field_not_found,
+	timeout,
+	noscript        //!< redis does not have the script of an EVALSHA command even after loading it again, or in a transaction
 };
 
 std::error_code make_error_code(Error err);
@@ -56,10 +70,37 @@ namespace std
 namespace hrb {
 namespace redis {
 
+class ReplyIterator;
+class ReplyKeyValue;
+class ReplyKVIterator;
+
+/// \brief Reply from redis
+/// All elements of a reply, including the nested elements in arrays, are stored in one
+/// arena shared by the root reply and all its elements. The arena contains a table of
+/// nodes and a buffer of all the strings in the reply. The child elements of an array are
+/// stored contiguously in the node table, so they can be accessed by index. Copying a
+/// Reply or getting an element from an array only increases the reference count of the
+/// arena. No memory allocation is required.
 class Reply
 {
+private:
+	struct Node
+	{
+		int         type{};
+		std::size_t offset{};   //!< Offset to the string buffer, or index of the first child node
+		std::size_t size{};     //!< Length of the string, or number of child nodes
+		long long   integer{};
+	};
+	struct Arena
+	{
+		std::vector<Node>   nodes;
+		std::string         strings;
+	};
+	friend class ReplyReader;
+	friend class ReplyIterator;
+
 public:
-	explicit Reply(redisReply *r = nullptr) noexcept;
+	Reply() = default;
 	Reply(const Reply&) = default;
 	Reply(Reply&& other) = default ;
 	~Reply() = default;
@@ -68,21 +109,26 @@ public:
 	Reply& operator=(Reply&& other) = default ;
 	void swap(Reply& other) noexcept ;
 
-	using reference = std::vector<Reply>::reference;
-	using iterator = std::vector<Reply>::const_iterator;
-	using const_iterator = std::vector<Reply>::const_iterator;
+	using iterator = ReplyIterator;
+	using reference = Reply;
+	using const_iterator = iterator;
 	[[nodiscard]] iterator begin() const;
 	[[nodiscard]] iterator end() const;
 
-	[[nodiscard]] bool is_string() const {return m_reply->type == REDIS_REPLY_STRING;}
-	[[nodiscard]] bool is_nil() const {return m_reply->type == REDIS_REPLY_NIL;}
+	[[nodiscard]] bool is_string() const {return type() == REDIS_REPLY_STRING;}
+	[[nodiscard]] bool is_nil() const {return type() == REDIS_REPLY_NIL;}
+
+	/// RESP3 push frames, e.g. invalidation messages from CLIENT TRACKING. Always false
+	/// with hiredis versions that do not understand RESP3. Their elements can be
+	/// accessed in the same way as arrays.
+	[[nodiscard]] bool is_push() const noexcept;
 
 	[[nodiscard]] std::string_view as_string() const noexcept;
 	[[nodiscard]] std::string_view as_status() const noexcept;
 	[[nodiscard]] std::string_view as_error() const noexcept;
 	[[nodiscard]] std::string_view as_any_string() const noexcept;
 	[[nodiscard]] boost::asio::const_buffer as_buffer() const noexcept;
-	[[nodiscard]] auto type() const {return m_reply->type;}
+	[[nodiscard]] int type() const noexcept {return m_arena ? node().type : 0;}
 	[[nodiscard]] std::size_t length() const;
 
 	explicit operator bool() const noexcept ;
@@ -95,49 +141,9 @@ public:
 	[[nodiscard]] Reply operator[](std::size_t i) const noexcept;
 	[[nodiscard]] std::size_t array_size() const noexcept;
 
-	class KeyValue
-	{
-	public:
-		explicit KeyValue(iterator current) : m_current{current} {}
-
-		[[nodiscard]] auto key() const {return m_current->as_string();}
-		[[nodiscard]] auto value() const {auto i = m_current; return *++i;}
-
-	private:
-		iterator m_current;
-	};
-	class kv_iterator : public boost::iterator_adaptor<
-	    kv_iterator,
-		iterator,
-		KeyValue,
-		boost::random_access_traversal_tag,
-		KeyValue
-	>
-	{
-	public:
-		kv_iterator() = default;
-		explicit kv_iterator(iterator it) : kv_iterator::iterator_adaptor_{it} {}
-	private:
-		friend class boost::iterator_core_access;
-		void increment() {this->base_reference() += 2;}
-		[[nodiscard]] auto dereference() const {return KeyValue{this->base()};}
-		[[nodiscard]] auto distance_to(kv_iterator other) const
-		{
-			return (other.base() - base()) / 2;
-		}
-		void advance(typename iterator_adaptor::difference_type n)
-		{
-			this->base_reference() += n*2;
-		}
-	};
-
-	[[nodiscard]] auto kv_pairs() const
-	{
-		return boost::iterator_range<kv_iterator>{
-			kv_iterator{begin()},
-			kv_iterator{end()}
-		};
-	}
+	using KeyValue = ReplyKeyValue;
+	using kv_iterator = ReplyKVIterator;
+	[[nodiscard]] boost::iterator_range<kv_iterator> kv_pairs() const;
 
 	// Return a tuple of replies, one for each field in the parameter list
 	template <typename... Field>
@@ -156,42 +162,153 @@ public:
 		return as_tuple_impl(ec, std::make_index_sequence<count>{});
 	}
 
-	char* as_mutable_string();
-
 private:
+	Reply(std::shared_ptr<const Arena> arena, std::size_t index) noexcept :
+		m_arena{std::move(arena)}, m_index{index}
+	{
+	}
+
 	template <std::size_t... index>
 	auto as_tuple_impl(std::error_code& ec, std::index_sequence<index...>) const
 	{
 		return std::make_tuple(as_array(index, ec)...);
 	}
 
+	[[nodiscard]] const Node& node() const noexcept {return m_arena->nodes[m_index];}
+	[[nodiscard]] bool is_array() const noexcept;
+
 private:
-	std::shared_ptr<::redisReply> m_reply;
+	std::shared_ptr<const Arena>    m_arena;
+	std::size_t                     m_index{};  //!< index to the node table in m_arena
+};
 
-	// If m_reply represents an array, each element in the "element" array in redisReply
-	// will be moved to m_array.
-	std::vector<Reply> m_array;
+/// Random access iterator to the elements of an array Reply. Dereferencing it returns
+/// a Reply by value, which refers to the same arena as the array.
+class ReplyIterator : public boost::iterator_facade<
+	ReplyIterator,
+	Reply,
+	boost::random_access_traversal_tag,
+	Reply
+>
+{
+public:
+	ReplyIterator() = default;
+	ReplyIterator(const Reply *parent, std::size_t index) : m_parent{parent}, m_index{index} {}
+
+private:
+	friend class boost::iterator_core_access;
+	[[nodiscard]] Reply dereference() const {return Reply{m_parent->m_arena, m_index};}
+	[[nodiscard]] bool equal(const ReplyIterator& other) const {return m_index == other.m_index;}
+	void increment() {m_index++;}
+	void decrement() {m_index--;}
+	void advance(difference_type n) {m_index += n;}
+	[[nodiscard]] difference_type distance_to(const ReplyIterator& other) const
+	{
+		return static_cast<difference_type>(other.m_index) - static_cast<difference_type>(m_index);
+	}
+
+private:
+	const Reply *m_parent{};
+	std::size_t m_index{};  //!< index to the node table in the arena
+};
+
+class ReplyKeyValue
+{
+public:
+	explicit ReplyKeyValue(ReplyIterator current) : m_current{current} {}
+
+	[[nodiscard]] auto key() const {return m_current->as_string();}
+	[[nodiscard]] auto value() const {auto i = m_current; return *++i;}
+
+private:
+	ReplyIterator m_current;
 };
 
+class ReplyKVIterator : public boost::iterator_adaptor<
+	ReplyKVIterator,
+	ReplyIterator,
+	ReplyKeyValue,
+	boost::random_access_traversal_tag,
+	ReplyKeyValue
+>
+{
+public:
+	ReplyKVIterator() = default;
+	explicit ReplyKVIterator(ReplyIterator it) : ReplyKVIterator::iterator_adaptor_{it} {}
+private:
+	friend class boost::iterator_core_access;
+	void increment() {this->base_reference() += 2;}
+	[[nodiscard]] auto dereference() const {return ReplyKeyValue{this->base()};}
+	[[nodiscard]] auto distance_to(ReplyKVIterator other) const
+	{
+		return (other.base() - base()) / 2;
+	}
+	void advance(typename iterator_adaptor::difference_type n)
+	{
+		this->base_reference() += n*2;
+	}
+};
+
+inline boost::iterator_range<Reply::kv_iterator> Reply::kv_pairs() const
+{
+	return {kv_iterator{begin()}, kv_iterator{end()}};
+}
+
 class ReplyReader
 {
 public:
 	enum class Result {ok, error, not_ready};
 
 public:
-	ReplyReader() = default;
-	ReplyReader(ReplyReader&&) = default;
+	ReplyReader();
+	ReplyReader(ReplyReader&&) noexcept;
 	ReplyReader(const ReplyReader&) = delete;
-	~ReplyReader() = default;
-	ReplyReader& operator=(ReplyReader&&) = default;
+	~ReplyReader();
+	ReplyReader& operator=(ReplyReader&&) noexcept;
 	ReplyReader& operator=(const ReplyReader&) = delete;
 
 	void feed(const char *data, std::size_t size);
 	std::tuple<Reply, Result> get();
 
+private:
+	// Build the arena of the Reply when hiredis parses the reply.
+	class Builder;
+	static ::redisReader* create(Builder *builder);
+
 private:
 	struct Deleter {void operator()(::redisReader*) const noexcept; };
-	std::unique_ptr<::redisReader, Deleter> m_reader{::redisReaderCreate()};
+
+	// The builder is referred by the redisReader, so it must not be moved.
+	std::unique_ptr<Builder> m_builder;
+	std::unique_ptr<::redisReader, Deleter> m_reader;
+};
+
+/// \brief A Lua script to be executed by EVALSHA.
+/// All scripts are registered in a global list when they are constructed. Pool sends
+/// SCRIPT LOAD for all of them to redis for every new connection. After that, only the
+/// SHA1 digest of the script needs to be sent to redis for each command. Therefore, scripts
+/// must have static storage duration, i.e. they should be defined in namespace scope.
+class Script
+{
+public:
+	explicit Script(std::string_view lua);
+	Script(Script&&) = delete;
+	Script(const Script&) = delete;
+	~Script() = default;
+	Script& operator=(Script&&) = delete;
+	Script& operator=(const Script&) = delete;
+
+	[[nodiscard]] std::string_view source() const {return m_lua;}
+	[[nodiscard]] std::string_view sha1() const {return {m_sha1.data(), m_sha1.size()};}
+
+	[[nodiscard]] static const std::vector<const Script*>& all();
+
+private:
+	static std::vector<const Script*>& registry();
+
+private:
+	std::string_view        m_lua;
+	std::array<char, 40>    m_sha1{};   //!< SHA1 of the script in lowercase hex, same as redis
 };
 
 class CommandString
@@ -210,6 +327,33 @@ public:
 		if (m_length < 0)
 			throw std::logic_error("invalid command string");
 	}
+
+	/// Format an EVALSHA command to run \a script. \a args is the format string of the
+	/// arguments after the SHA1 digest, i.e. the number of keys, followed by the keys and
+	/// the arguments of the script, e.g. "2 %b %b %b".
+	template <std::size_t N, typename... Args>
+	CommandString(const Script& script, const char (&args)[N], Args... arg_values)
+	{
+		char *formatted{};
+		auto length = ::redisFormatCommand(&formatted, args, arg_values...);
+		if (length < 0)
+			throw std::logic_error("invalid command string");
+
+		assign_script(script, formatted, length);
+	}
+
+	/// Format a command with a variable number of arguments, e.g. CLIENT TRACKING
+	/// with a list of prefixes. Like above, the command must be a string literal.
+	/// The arguments are binary safe.
+	template <std::size_t N>
+	CommandString(const char (&cmd)[N], const std::vector<std::string_view>& args)
+	{
+		assign_argv(std::string_view{cmd, N-1}, args);
+	}
+
+	/// Format an EVALSHA command to run \a script with a variable number of keys, e.g.
+	/// one for each blob. The first \a keys elements of \a args are the keys.
+	CommandString(const Script& script, std::size_t keys, const std::vector<std::string_view>& args);
 	CommandString(CommandString&& other) noexcept ;
 	CommandString(const CommandString&) = delete;
 	~CommandString();
@@ -223,9 +367,19 @@ public:
 	[[nodiscard]] auto buffer() const {return boost::asio::buffer(m_cmd, length());}
 	[[nodiscard]] std::string_view str() const {return {m_cmd, length()};}
 
+	/// The script executed by this command, or nullptr if it is not an EVALSHA command.
+	[[nodiscard]] const Script* script() const {return m_script;}
+
+private:
+	void assign_script(const Script& script, char *args, int length);
+	void assign_argv(std::string_view cmd, const std::vector<std::string_view>& args);
+	void assign(std::string_view verb, std::string_view first, std::size_t argc, std::string_view args);
+
 private:
 	char    *m_cmd{};
 	int     m_length{};
+
+	const Script    *m_script{};    //!< for EVALSHA commands only
 };
 
 class Connection;
@@ -238,23 +392,54 @@ std::shared_ptr<Connection> connect(
 );
 
 class Pool;
+class ClientCache;
 class PoolBase
 {
 public:
 	virtual void dealloc(boost::asio::ip::tcp::socket socket) = 0;
+
+	/// Maximum number of commands to be sent in one write.
+	[[nodiscard]] virtual std::size_t max_batch() const = 0;
+
+	/// Called by the connections after sending a batch of \a commands in one write.
+	virtual void on_write_batch(std::size_t commands) = 0;
+
+	/// The cache used by Connection::cached(), or nullptr if there is none.
+	[[nodiscard]] virtual std::shared_ptr<ClientCache> cache() const {return {};}
 };
 
+/// Default transform of CommandAwaiter: co_await returns the reply and the error code.
+struct ReplyAndError
+{
+	std::tuple<Reply, std::error_code> operator()(Reply&& reply, std::error_code ec) const
+	{
+		return {std::move(reply), ec};
+	}
+};
+
+template <typename Transform>
+class CommandAwaiter;
+
 class Connection : public std::enable_shared_from_this<Connection>
 {
 public:
-	using Completion = std::function<void(Reply, std::error_code)>;
+	/// Completion routines of the commands. Most of the lambdas used as completion
+	/// routines are stored inline without allocating memory.
+	using Completion = InlineFunction<void(Reply, std::error_code), 128>;
+	using MessageHandler = std::function<void(Reply, std::error_code)>;
 
 public:
-	explicit Connection(
+	/// The completion routines of the commands will be called by \a executor.
+	Connection(
 		PoolBase& parent,
-		boost::asio::ip::tcp::socket socket
+		boost::asio::ip::tcp::socket socket,
+		const boost::asio::any_io_executor& executor
 	);
 
+	// A connection waiting for a socket from the pool. Commands sent to it will be
+	// queued until the pool calls attach() or fail().
+	Connection(PoolBase& parent, const boost::asio::any_io_executor& executor);
+
 	Connection(Connection&&) = delete;
 	Connection(const Connection&) = delete;
 	~Connection();
@@ -262,56 +447,50 @@ public:
 	Connection& operator=(Connection&&) = delete;
 	Connection& operator=(const Connection&) = delete;
 
+	[[nodiscard]] const boost::asio::any_io_executor& get_executor() const {return m_executor;}
+
 	template <
 		typename Callback,
 		std::size_t N,
 		typename... Args
 	>
-	typename std::enable_if_t<
-		std::is_invocable<Callback, Reply, std::error_code>::value &&
-		std::is_copy_constructible<Callback>::value
-	>
+	typename std::enable_if_t<std::is_invocable_v<Callback, Reply, std::error_code>>
 	command(Callback&& callback, const char (&cmd)[N], Args... args)
 	{
+		CommandString command;
 		try
 		{
-			command(std::forward<Callback>(callback), CommandString{cmd, args...});
+			command = CommandString{cmd, args...};
 		}
 		catch (std::logic_error&)
 		{
 			callback(Reply{}, std::error_code{Error::protocol});
+			return;
 		}
+		this->command(std::forward<Callback>(callback), std::move(command));
 	}
 
-	// Only enable this template if Callback is a copy-constructible
-	// function-like type that takes two argument: Reply, std::error_code.
-	// If Callback is copy-constructible, we can copy it to the lambda
-	// capture directly. The other overload, which uses a shared_ptr to
-	// store the callback, does not require the callback to be copy-
-	// constructible, but will have more overhead from the shared_ptr.
+	// Only enable this template if Callback is a function-like type that takes two
+	// argument: Reply, std::error_code. The callback does not need to be copyable.
+	// It is stored inline in the Completion unless it is larger than Completion's
+	// buffer, together with a reference to the connection.
 	template <typename Callback>
-	typename std::enable_if_t<
-		std::is_invocable_v<Callback, Reply, std::error_code> &&
-		std::is_copy_constructible_v<Callback>
-	>
+	typename std::enable_if_t<std::is_invocable_v<Callback, Reply, std::error_code>>
 	command(Callback&& callback, CommandString&& command)
 	{
 		do_write(std::move(command),
 			[
 				callback=std::forward<Callback>(callback),
 				self=shared_from_this()
-			](auto&& r, auto ec) mutable
+			](Reply&& r, std::error_code ec) mutable
 			{
-				callback(std::forward<decltype(r)>(r), std::move(ec));
+				callback(std::move(r), ec);
 			}
 		);
 	}
 
 	template <typename Callback>
-	typename std::enable_if_t<
-		std::is_invocable_v<Callback, Reply, std::error_code> &&
-		std::is_copy_constructible_v<Callback>
-	>
+	typename std::enable_if_t<std::is_invocable_v<Callback, Reply, std::error_code>>
 	command(Callback&& callback, std::vector<CommandString>&& commands)
 	{
 		for (auto&& cmd : commands)
@@ -323,42 +502,6 @@ public:
 		}
 	}
 
-	template <
-		typename Callback,
-		std::size_t N,
-		typename... Args
-	>
-
-	// Only enable this template if Callback is a move-constructible
-	// function-like type that takes two argument: Reply, std::error_code.
-	// This function will move the passed callback into a shared_ptr,
-	// which will be stored in a lambda capture.
-	typename std::enable_if_t<
-		std::is_invocable_v<Callback, Reply, std::error_code> &&
-		std::is_move_constructible_v<Callback> &&
-		!std::is_copy_constructible_v<Callback>
-	>
-	command(Callback&& callback, const char (&cmd)[N], Args... args)
-	{
-		try
-		{
-			do_write(
-				CommandString{cmd, args...},
-				[
-					cb=std::make_shared<std::remove_reference_t<Callback>>(std::forward<Callback>(callback)),
-					self=shared_from_this()
-				](auto&& r, auto ec) mutable
-				{
-					(*cb)(std::forward<decltype(r)>(r), std::move(ec));
-				}
-			);
-		}
-		catch (std::logic_error&)
-		{
-			callback(Reply{}, std::error_code{Error::protocol});
-		}
-	}
-
 	template <std::size_t N, typename... Args>
 	void command(const char (&cmd)[N], Args... args)
 	{
@@ -371,9 +514,68 @@ public:
 		}
 	}
 
+	/// Send a command that only reads the redis \a keys, or complete it with the reply
+	/// cached by the pool if none of the keys is changed since the reply was received.
+	/// The callback will be called by the executor of the connection in both cases.
+	template <typename Callback>
+	typename std::enable_if_t<std::is_invocable_v<Callback, Reply, std::error_code>>
+	cached(Callback&& callback, std::vector<std::string>&& keys, CommandString&& command)
+	{
+		do_cached(std::move(command), std::move(keys), std::forward<Callback>(callback));
+	}
+
+	/// Drop the cached replies that read \a key. Call it before changing the key to
+	/// make sure the following reads by this process will not get the old value,
+	/// even if the invalidation message from redis has not arrived yet. It also
+	/// records the time of the last write, see last_write().
+	void invalidate(std::string_view key);
+
+	/// The last time invalidate() is called. ShardedConnection reads from the primary
+	/// instead of the replicas for a while after that, so that the caller can read
+	/// what it has just written.
+	[[nodiscard]] std::chrono::steady_clock::time_point last_write() const {return m_last_write;}
+
+	/// Awaitable version of command() for coroutines, e.g.
+	/// \code auto [reply, ec] = co_await conn.async_command("GET %b", key.data(), key.size()); \endcode
+	/// The result of co_await is the return value of \a transform, which is called with
+	/// the reply and the error code. See CommandAwaiter.
+	template <std::size_t N, typename... Args>
+	CommandAwaiter<ReplyAndError> async_command(const char (&cmd)[N], Args... args);
+
+	template <typename Transform = ReplyAndError>
+	CommandAwaiter<std::decay_t<Transform>> async_command(CommandString&& command, Transform&& transform = {});
+
+	/// Awaitable version of cached().
+	template <typename Transform = ReplyAndError>
+	CommandAwaiter<std::decay_t<Transform>> async_cached(
+		std::vector<std::string>&& keys,
+		CommandString&& command,
+		Transform&& transform = {}
+	);
+
 	void do_write(CommandString&& cmd, Completion&& completion);
+	void do_cached(CommandString&& cmd, std::vector<std::string>&& keys, Completion&& completion);
+
+	/// Pass pub/sub messages and RESP3 push frames to \a handler instead of matching them
+	/// with the commands. The connection will keep reading until it is disconnected,
+	/// after which \a handler will be called with the error.
+	void set_message_handler(MessageHandler&& handler);
+
+	// Send SCRIPT LOAD for all registered scripts
+	void load_scripts();
 
 private:
+	friend class Pool;
+	friend class ClientCache;
+
+	// Called by the pool when a socket is available for a waiting connection.
+	// If the socket is newly connected, the scripts will be loaded before sending
+	// the queued commands.
+	void attach(boost::asio::ip::tcp::socket socket, bool fresh);
+
+	// Called by the pool when it cannot provide a socket for a waiting connection.
+	void fail(std::error_code ec);
+
 	// must not call disconnect() inside the callbacks in m_callbacks
 	void disconnect(std::error_code ec) ;
 
@@ -381,36 +583,344 @@ private:
 	void do_read();
 	void on_read(boost::system::error_code ec, std::size_t bytes);
 	void on_exec_transaction(Reply&& reply, std::error_code ec);
+	void flush();
+	[[nodiscard]] bool is_message(const Reply& reply) const;
+
+	// A command waiting to be sent. EVALSHA commands are shared with their completion
+	// routines, which need them to send the command again on NOSCRIPT errors.
+	struct PendingCommand
+	{
+		CommandString                           cmd;
+		std::shared_ptr<const CommandString>    shared;
+
+		[[nodiscard]] auto buffer() const {return shared ? shared->buffer() : cmd.buffer();}
+	};
+
+	// The completion routine of a command sent to redis, and the command itself if it
+	// is an EVALSHA command.
+	struct Callback
+	{
+		Completion                              completion;
+		std::shared_ptr<const CommandString>    evalsha;
+		bool                                    resent{false};
+	};
+
+	void send(Callback&& callback, PendingCommand&& cmd);
+
+	// Call the completion routine. If redis does not have the script of an EVALSHA command,
+	// the scripts are loaded again and the command is sent again after them, once. Commands
+	// in a transaction (\a queued) fail with Error::noscript instead, because sending them
+	// again would run them outside of the transaction.
+	// The callback is passed by value because it must be moved out of m_callbacks before
+	// calling it: the completion routine may send other commands, which reallocates m_callbacks.
+	void complete(Callback callback, Reply&& reply, std::error_code ec, bool queued = false);
 
 private:
 	boost::asio::ip::tcp::socket m_socket;
 
+	// All completion handlers of the socket are bound to this executor, which is usually
+	// the strand of the session using this connection.
+	boost::asio::any_io_executor m_executor;
+
 	char m_read_buf[8*1024];
 
-	std::deque<Completion> m_callbacks;
-	std::vector<Completion> m_queued_callbacks;
+	RingBuffer<Callback>    m_callbacks;
+	std::vector<Callback>   m_queued_callbacks;
+
+	// Commands queued while a write is in progress. They will be sent together in
+	// one gather write after the current write finishes.
+	std::vector<PendingCommand> m_write_queue;
+
+	// Commands being written. They must be kept alive until the write finishes.
+	std::vector<PendingCommand> m_writing;
 
 	ReplyReader m_reader;
 	PoolBase&   m_parent;
+
+	MessageHandler m_message_handler;
+	std::chrono::steady_clock::time_point m_last_write{};
+
+	bool m_pending{false};      //!< waiting for a socket from the pool
+	bool m_attached{true};      //!< m_socket is owned by the pool
 };
 
+/// \brief Awaiter of a redis command in a coroutine
+/// The awaiter is stored in the coroutine frame of the caller. The completion routine
+/// passed to the connection only refers to the awaiter by a pointer, so waiting for the
+/// reply does not allocate memory for the completion routine. The coroutine is resumed
+/// by the executor of the connection. \a Transform converts the reply to the result of
+/// co_await. It runs in the coroutine, so it can keep references to the reply.
+template <typename Transform>
+class CommandAwaiter
+{
+public:
+	CommandAwaiter(Connection& conn, CommandString&& cmd, Transform&& transform) :
+		m_conn{conn.shared_from_this()},
+		m_cmd{std::move(cmd)},
+		m_transform{std::move(transform)}
+	{
+	}
+
+	// For Connection::async_cached()
+	CommandAwaiter(Connection& conn, CommandString&& cmd, std::vector<std::string>&& keys, Transform&& transform) :
+		m_conn{conn.shared_from_this()},
+		m_cmd{std::move(cmd)},
+		m_keys{std::move(keys)},
+		m_transform{std::move(transform)},
+		m_cached{true}
+	{
+	}
+
+	// Complete without sending anything, e.g. when the command cannot be formatted.
+	CommandAwaiter(std::error_code ec, Transform&& transform) :
+		m_transform{std::move(transform)},
+		m_ec{ec}
+	{
+	}
+
+	[[nodiscard]] bool await_ready() const noexcept {return !m_conn;}
+
+	void await_suspend(std::coroutine_handle<> coro)
+	{
+		m_coro = coro;
+
+		Connection::Completion completion{[this](Reply&& reply, std::error_code ec)
+		{
+			m_reply = std::move(reply);
+			m_ec    = ec;
+			m_coro.resume();
+		}};
+
+		if (m_cached)
+			m_conn->do_cached(std::move(m_cmd), std::move(m_keys), std::move(completion));
+		else
+			m_conn->do_write(std::move(m_cmd), std::move(completion));
+	}
+
+	auto await_resume()
+	{
+		return std::invoke(m_transform, std::move(m_reply), m_ec);
+	}
+
+private:
+	std::shared_ptr<Connection> m_conn;
+	CommandString               m_cmd;
+	std::vector<std::string>    m_keys;     //!< keys read by the command, for cached commands only
+	Transform                   m_transform;
+	bool                        m_cached{false};
+
+	std::coroutine_handle<>     m_coro;
+	Reply                       m_reply;
+	std::error_code             m_ec;
+};
+
+template <std::size_t N, typename... Args>
+CommandAwaiter<ReplyAndError> Connection::async_command(const char (&cmd)[N], Args... args)
+{
+	try
+	{
+		return async_command(CommandString{cmd, args...});
+	}
+	catch (std::logic_error&)
+	{
+		return {std::error_code{Error::protocol}, ReplyAndError{}};
+	}
+}
+
+template <typename Transform>
+CommandAwaiter<std::decay_t<Transform>> Connection::async_command(CommandString&& command, Transform&& transform)
+{
+	return {*this, std::move(command), std::decay_t<Transform>{std::forward<Transform>(transform)}};
+}
+
+template <typename Transform>
+CommandAwaiter<std::decay_t<Transform>> Connection::async_cached(
+	std::vector<std::string>&& keys,
+	CommandString&& command,
+	Transform&& transform
+)
+{
+	return {*this, std::move(command), std::move(keys), std::decay_t<Transform>{std::forward<Transform>(transform)}};
+}
+
+/// Settings of the connection pool
+struct PoolSettings
+{
+	std::size_t min_size{1};    //!< number of connections to keep open after Pool::start()
+	std::size_t max_size{64};   //!< maximum number of connections, including the ones in use
+
+	// asio sends at most 64 buffers in one writev() call
+	std::size_t max_batch{64};  //!< maximum number of commands sent in one write
+
+	std::chrono::milliseconds   connect_timeout{3000};
+	std::chrono::seconds        health_check{30};   //!< interval to PING idle connections
+	std::chrono::seconds        idle_timeout{300};  //!< close idle connections above min_size after that
+	std::chrono::milliseconds   max_backoff{30000}; //!< maximum delay to reconnect after failures
+
+	std::size_t threads{1};         //!< number of threads that keep their own idle connections
+	std::size_t thread_cache{2};    //!< maximum number of idle connections kept by each thread
+
+	/// Prefixes of the keys to be cached by Connection::cached(). The pool will track
+	/// them with CLIENT TRACKING after start(). No reply will be cached if it is empty.
+	std::vector<std::string>    cache_prefixes;
+	std::chrono::seconds        cache_max_age{60};      //!< maximum age of cached replies
+	std::size_t                 cache_max_entries{65536};
+};
+
+/// \brief Pool of redis connections
+/// alloc() never blocks. If there is no idle connection, the pool connects to redis
+/// asynchronously, or the connection waits for one of the connections in use to be
+/// returned if there are already max_size of them. Commands sent to the connection
+/// are queued until then. If redis cannot be connected, the pool will retry with
+/// exponential backoff, and the waiting connections will fail with an error.
+///
+/// The first PoolSettings::threads threads that use the pool have their own small
+/// cache of idle sockets. Allocating and releasing connections in these threads
+/// do not need to lock the pool most of the time. The cached sockets are checked and
+/// reaped like the other idle sockets. The sockets are not bound to any strand. The
+/// completion routines of the connections run on the executors passed to alloc().
 class Pool : public PoolBase
 {
 public:
-	Pool(boost::asio::io_context& ioc, const boost::asio::ip::tcp::endpoint& remote);
+	Pool(
+		boost::asio::io_context& ioc,
+		const boost::asio::ip::tcp::endpoint& remote,
+		const PoolSettings& settings = {}
+	);
+	~Pool();
+
+	/// Open min_size connections and start the periodic health checks and idle
+	/// connection reaping. Without calling start(), the pool only connects to redis
+	/// on demand and keeps no timer running, so that io_context::run() will return
+	/// after all commands are finished.
+	void start();
 
+	/// Allocate a connection. Its completion routines will be called by \a executor,
+	/// e.g. the strand of the caller, so that they will not be posted to another strand.
+	std::shared_ptr<Connection> alloc(const boost::asio::any_io_executor& executor);
+
+	/// Allocate a connection with its own strand.
 	std::shared_ptr<Connection> alloc();
+
 	void dealloc(boost::asio::ip::tcp::socket socket) override;
 
+	[[nodiscard]] std::size_t max_batch() const override {return m_settings.max_batch;}
+	[[nodiscard]] std::shared_ptr<ClientCache> cache() const override {return m_cache;}
+
+	/// Counters of the number of commands sent in each write
+	struct WriteStats
+	{
+		std::uint64_t   writes;     //!< number of writes to redis
+		std::uint64_t   commands;   //!< number of commands sent in these writes
+		std::uint64_t   max_batch;  //!< largest number of commands sent in one write
+	};
+	[[nodiscard]] WriteStats write_stats() const;
+	void on_write_batch(std::size_t commands) override;
+
+	/// Number of connections opened by the pool, including those in use and connecting.
+	[[nodiscard]] std::size_t size() const;
+
+	/// Number of idle connections, excluding the ones cached by the threads.
+	[[nodiscard]] std::size_t idle() const;
+
+	/// Number of idle connections cached by the calling thread.
+	[[nodiscard]] std::size_t thread_cached();
+
 private:
-	boost::asio::ip::tcp::socket get_sock();
+	using Clock = std::chrono::steady_clock;
+	struct IdleSocket
+	{
+		boost::asio::ip::tcp::socket    socket;
+		Clock::time_point               since;  //!< idle since this time
+		bool                            fresh;  //!< newly connected and scripts are not loaded
+	};
+	struct Waiter
+	{
+		std::weak_ptr<Connection>   conn;
+		Clock::time_point           deadline;
+	};
+
+	// All these functions must be called with m_mx locked
+	void dispatch();
+	void connect();
+	void give(IdleSocket&& idle);
+	void fail_waiters(std::error_code ec);
+	void maintain(std::vector<IdleSocket>& check);
+	void schedule();
+
+	void on_connect(boost::asio::ip::tcp::socket socket, boost::system::error_code ec);
+	void on_timer();
+	void health_check(IdleSocket&& idle);
+	void on_health_check(IdleSocket&& idle, std::error_code ec);
+
+	// Idle sockets cached by a thread. Only used by that thread, except by maintain().
+	struct alignas(64) ThreadCache
+	{
+		std::mutex              mx;
+		std::vector<IdleSocket> sockets;
+	};
+
+	// Return the cache of the calling thread, or nullptr if it has none
+	ThreadCache* thread_cache();
+	static std::uint64_t next_serial();
+
+	// The completion handlers of the sockets and the timer may run after the pool is
+	// destroyed. They only call the pool by run(), which does nothing after ~Pool()
+	// clears the pointer, and blocks ~Pool() until they return.
+	struct Lifetime
+	{
+		std::mutex  mx;
+		Pool        *pool;
+
+		explicit Lifetime(Pool *pool) : pool{pool} {}
+
+		template <typename Func>
+		void run(Func&& func)
+		{
+			std::unique_lock lock{mx};
+			if (pool)
+				func(*pool);
+		}
+	};
 
 private:
-	boost::asio::io_context&                    m_ioc;
-	boost::asio::ip::tcp::endpoint              m_remote;
-	std::vector<boost::asio::ip::tcp::socket>   m_socks;
+	boost::asio::io_context&        m_ioc;
+	boost::asio::ip::tcp::endpoint  m_remote;
+	const PoolSettings              m_settings;
+
+	mutable std::mutex      m_mx;
+	std::vector<IdleSocket> m_idle;
+	std::deque<Waiter>      m_waiters;
+
+	// Size of m_waiters. Read without locking to check if any connection is waiting.
+	std::atomic<std::size_t>    m_waiting{};
+
+	// Caches of the threads that use this pool. A deque, so that adding one does not
+	// move the others.
+	std::deque<ThreadCache>     m_thread_caches;
+
+	// Identifies the pool in the thread caches. Unlike its address, it is not reused
+	// after the pool is destroyed.
+	const std::uint64_t         m_serial;
+
+	std::size_t m_size{};           //!< number of sockets opened, including idle, in use and connecting
+	std::size_t m_connecting{};     //!< number of sockets connecting
+
+	// reconnect with exponential backoff after failures
+	unsigned            m_failures{};
+	Clock::time_point   m_retry{};
+
+	// only one timer for waiter timeouts, retries and maintenance
+	boost::asio::steady_timer   m_timer;
+	Clock::time_point           m_timer_expiry{Clock::time_point::max()};
+
+	bool                m_started{false};
+	Clock::time_point   m_next_maintenance{Clock::time_point::max()};
+
+	std::atomic<std::uint64_t>  m_writes{}, m_commands{}, m_largest_batch{};
 
-	std::mutex  m_mx;
+	std::shared_ptr<ClientCache>    m_cache;
+	std::shared_ptr<Lifetime>       m_lifetime{std::make_shared<Lifetime>(this)};
 };
 
 }} // end of namespace
@@ -19,22 +19,45 @@
 #include "util/Log.hh"
 
 #include <boost/asio/bind_executor.hpp>
+#include <boost/beast/core/file_posix.hpp>
+
+#include <type_traits>
 
 namespace hrb {
 
 using tcp = boost::asio::ip::tcp;       // from <boost/asio/ip/tcp.hpp>
 namespace http = boost::beast::http;    // from <boost/beast/http.hpp>
 
+namespace {
+
+// Smaller blobs, e.g. thumbnails, are sent from the mapping, which is cached. Opening the
+// file again for sendfile() costs more than copying them.
+const std::size_t sendfile_threshold = 64 * 1024;
+
+// Size of the chunks read by AsyncFileReader. The kernel reads the next chunk ahead while
+// the current one is being sent.
+const std::size_t read_chunk_size = 256 * 1024;
+
+} // end of local namespace
+
 Session::Session(
-	std::function<SessionHandler()> factory,
+	std::function<SessionHandler(const boost::asio::any_io_executor&)> factory,
 	boost::asio::ip::tcp::socket socket,
 	boost::asio::ssl::context&  ssl_ctx,
+	[[maybe_unused]] bool   ktls,
 	std::size_t             nth,
 	std::chrono::seconds    login_session,
 	std::size_t             upload_limit
 ) :
 	m_socket{std::move(socket)},
-	m_stream{m_socket, ssl_ctx},
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	m_stream{ktls ?
+		decltype(m_stream){std::in_place_type<KTLSStream>, m_socket, ssl_ctx} :
+		decltype(m_stream){std::in_place_type<boost::asio::ssl::stream<tcp::socket&>>, m_socket, ssl_ctx}
+	},
+#else
+	m_stream{std::in_place_type<boost::asio::ssl::stream<tcp::socket&>>, m_socket, ssl_ctx},
+#endif
 	m_factory{std::move(factory)},
 	m_nth_session{nth},
 	m_login_session{login_session},
@@ -46,10 +69,16 @@ Session::Session(
 void Session::run()
 {
 	// Perform the SSL handshake
-	m_stream.async_handshake(
-		boost::asio::ssl::stream_base::server,
-		[self = shared_from_this()](auto ec){self->on_handshake(ec);}
-	);
+	std::visit([self = shared_from_this()](auto& stream)
+	{
+		auto handler = [self](auto ec){self->on_handshake(ec);};
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		if constexpr (std::is_same_v<std::decay_t<decltype(stream)>, KTLSStream>)
+			stream.async_handshake(std::move(handler));
+		else
+#endif
+			stream.async_handshake(boost::asio::ssl::stream_base::server, std::move(handler));
+	}, m_stream);
 }
 
 void Session::on_handshake(boost::system::error_code ec)
@@ -66,14 +95,18 @@ void Session::do_read()
 	// Destroy and re-construct the parser for a new HTTP transaction
 	m_parser.emplace();
 
-	m_handler.emplace(m_factory());
+	// The redis connection of the handler will call its completion routines in our strand
+	m_handler.emplace(m_factory(m_socket.get_executor()));
 	m_parser->body_limit(m_upload_size_limit);
 
 	// Read the header of a request
-	async_read_header(
-		m_stream, m_buffer, *m_parser,
-		[self=shared_from_this()](auto ec, auto bytes) {self->on_read_header(ec, bytes);}
-	);
+	std::visit([this](auto& stream)
+	{
+		async_read_header(
+			stream, m_buffer, *m_parser,
+			[self=shared_from_this()](auto ec, auto bytes) {self->on_read_header(ec, bytes);}
+		);
+	}, m_stream);
 }
 
 
@@ -96,6 +129,20 @@ void Session::on_read_header(boost::system::error_code ec, std::size_t)
 			header,
 			[self=shared_from_this(), this](SessionHandler::RequestBodyType body_type, std::error_code ec)
 			{
+				// The request is answered without its body, so the connection cannot be used
+				// for another request.
+				if (body_type == SessionHandler::RequestBodyType::none)
+				{
+					m_keep_alive = false;
+					auto response = m_handler->early_response();
+					if (m_handler->renewed_auth())
+						response.set(http::field::set_cookie, m_handler->auth().set_cookie(m_login_session).str());
+					return send_response(std::move(response));
+				}
+
+				auto version = m_parser->get().version();
+				auto expect_continue = boost::beast::iequals(m_parser->get()[http::field::expect], "100-continue");
+
 				init_request_body(body_type, ec);
 				if (ec)
 				{
@@ -103,19 +150,41 @@ void Session::on_read_header(boost::system::error_code ec, std::size_t)
 					return send_response(m_handler->server_error("internal server error", 11));
 				}
 
-				// Call async_read() using the chosen parser to read and parse the request body.
-				std::visit([this, self](auto&& parser)
-				{
-					boost::beast::http::async_read(
-						m_stream, m_buffer, parser,
-						[self](auto ec, auto bytes){ self->on_read(ec, bytes); }
-					);
-				}, m_body);
+				if (expect_continue && body_type != SessionHandler::RequestBodyType::empty)
+					return send_continue(version);
+
+				read_body();
 			}
 		);
 	}
 }
 
+void Session::send_continue(unsigned version)
+{
+	auto res = std::make_shared<http::response<http::empty_body>>(http::status::continue_, version);
+	std::visit([this, res](auto& stream)
+	{
+		async_write(stream, *res, [self=shared_from_this(), res](auto&& ec, auto bytes)
+		{
+			if (ec)
+				return self->on_write(ec, bytes, true);
+			self->read_body();
+		});
+	}, m_stream);
+}
+
+void Session::read_body()
+{
+	// Call async_read() using the chosen parser to read and parse the request body.
+	std::visit([this, self=shared_from_this()](auto&& parser, auto& stream)
+	{
+		boost::beast::http::async_read(
+			stream, m_buffer, parser,
+			[self](auto ec, auto bytes){ self->on_read(ec, bytes); }
+		);
+	}, m_body, m_stream);
+}
+
 
 void Session::on_read(boost::system::error_code ec, std::size_t)
 {
@@ -196,13 +265,153 @@ void Session::send_response(Response&& response)
 	sp->keep_alive(m_keep_alive);
 	sp->prepare_payload();
 
-	async_write(
-		m_stream, *sp,
-		[self=shared_from_this(), sp](auto&& ec, auto bytes)
+	// Large blobs are sent by sendfile() if the kernel encrypts the records. Multiple
+	// ranges are not, because their headers need to be sent between them.
+	if constexpr (std::is_same_v<std::remove_cvref_t<Response>, http::response<MMapResponseBody>>)
+	{
+		auto& body = sp->body();
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		auto ktls = std::get_if<KTLSStream>(&m_stream);
+		if (ktls && ktls->ktls_send() && !body.path.empty() && body.parts.size() <= 1 &&
+			MMapResponseBody::size(body) >= sendfile_threshold)
+			return send_file(std::move(sp), *ktls);
+#endif
+
+		if (body.reader && !body.path.empty() && MMapResponseBody::size(body) >= sendfile_threshold)
+		{
+			read_file(std::move(sp));
+			return;
+		}
+	}
+
+	std::visit([this, sp](auto& stream)
+	{
+		async_write(
+			stream, *sp,
+			[self=shared_from_this(), sp](auto&& ec, auto bytes)
+			{
+				self->on_write(ec, bytes, sp->need_eof());
+			}
+		);
+	}, m_stream);
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+void Session::send_file(std::shared_ptr<http::response<MMapResponseBody>> response, KTLSStream& stream)
+{
+	// The file may have been replaced, e.g. by regenerating the rendition, after it was
+	// mapped. Send the mapping if it does not look like the same file.
+	boost::system::error_code ec;
+	auto file = std::make_shared<boost::beast::file_posix>();
+	file->open(response->body().path.string().c_str(), boost::beast::file_mode::read, ec);
+	if (ec || file->size(ec) != response->body().mmap->size() || ec)
+	{
+		return async_write(stream, *response, [self=shared_from_this(), response](auto&& ec, auto bytes)
+		{
+			self->on_write(ec, bytes, response->need_eof());
+		});
+	}
+
+	// Only the header goes through the serializer. The body, or the requested range of
+	// it, is sent by the kernel.
+	auto& parts = response->body().parts;
+	auto offset = parts.empty() ? 0 : parts.front().range.offset;
+	auto size   = MMapResponseBody::size(response->body());
+	auto sr = std::make_shared<http::response_serializer<MMapResponseBody>>(*response);
+	http::async_write_header(stream, *sr, [self=shared_from_this(), &stream, response, sr, file, offset, size](auto&& ec, auto header_bytes)
+	{
+		if (ec)
+			return self->on_write(ec, header_bytes, response->need_eof());
+
+		stream.async_sendfile(file->native_handle(), static_cast<off_t>(offset), size, [self, response, file, header_bytes](auto&& ec, auto bytes)
+		{
+			self->on_write(ec, header_bytes + bytes, response->need_eof());
+		});
+	});
+}
+#endif
+
+Detached Session::read_file(std::shared_ptr<http::response<MMapResponseBody>> response)
+{
+	auto self = shared_from_this();
+	auto& body = response->body();
+
+	// Same as send_file(), send the mapping if it does not look like the same file.
+	boost::system::error_code ec;
+	auto file = body.reader->open(m_socket.get_executor(), body.path, ec);
+	if (ec || file->size() != body.mmap->size())
+	{
+		std::visit([this, response](auto& stream)
+		{
+			async_write(stream, *response, [self=shared_from_this(), response](auto&& ec, auto bytes)
+			{
+				self->on_write(ec, bytes, response->need_eof());
+			});
+		}, m_stream);
+		co_return;
+	}
+
+	auto write = [this](boost::asio::const_buffer buf)
+	{
+		return await_callback<boost::system::error_code, std::size_t>([this, buf](auto&& complete)
+		{
+			std::visit([&](auto& stream)
+			{
+				boost::asio::async_write(stream, buf, std::move(complete));
+			}, m_stream);
+		});
+	};
+
+	// Only the header goes through the serializer. The body is read by AsyncFileReader
+	// chunk by chunk, so the io threads never wait for the disk.
+	std::size_t total{}, bytes{};
+	http::response_serializer<MMapResponseBody> sr{*response};
+	std::tie(ec, total) = co_await await_callback<boost::system::error_code, std::size_t>([this, &sr](auto&& complete)
+	{
+		std::visit([&](auto& stream)
+		{
+			http::async_write_header(stream, sr, std::move(complete));
+		}, m_stream);
+	});
+
+	std::vector<MMapResponseBody::Part> whole{{{}, {0, file->size()}}};
+	auto& parts = body.parts.empty() ? whole : body.parts;
+	std::vector<char> chunk(std::min<std::uint64_t>(read_chunk_size, MMapResponseBody::size(body)));
+	for (auto it = parts.begin(); it != parts.end() && !ec; ++it)
+	{
+		if (!it->header.empty())
+		{
+			std::tie(ec, bytes) = co_await write(boost::asio::buffer(it->header));
+			total += bytes;
+		}
+
+		for (auto offset = it->range.offset, end = it->range.offset + it->range.length; offset < end && !ec; )
 		{
-			self->on_write(ec, bytes, sp->need_eof());
+			auto size = static_cast<std::size_t>(std::min<std::uint64_t>(chunk.size(), end - offset));
+			std::tie(ec, bytes) = co_await await_callback<boost::system::error_code, std::size_t>([&](auto&& complete)
+			{
+				file->async_read_at(offset, boost::asio::buffer(chunk.data(), size), std::move(complete));
+			});
+			if (ec)
+			{
+				Log(LOG_WARNING, "cannot read %1%: %2% (%3%)", body.path, ec.message(), ec);
+				break;
+			}
+
+			offset += bytes;
+			std::tie(ec, bytes) = co_await write(boost::asio::buffer(chunk.data(), bytes));
+			total += bytes;
 		}
-	);
+	}
+
+	if (!ec && !body.trailer.empty())
+	{
+		std::tie(ec, bytes) = co_await write(boost::asio::buffer(body.trailer));
+		total += bytes;
+	}
+
+	// The body is incomplete if there is an error, so the connection cannot be used anymore.
+	on_write(ec, total, ec || response->need_eof());
 }
 
 void Session::handle_read_error(std::string_view where, boost::system::error_code ec)
@@ -239,9 +448,10 @@ void Session::do_close()
 {
 	// Send a TCP shutdown
 	boost::system::error_code ec;
-	m_stream.async_shutdown(
-		[self=shared_from_this()](auto ec){self->on_shutdown(ec);}
-	);
+	std::visit([self=shared_from_this()](auto& stream)
+	{
+		stream.async_shutdown([self](auto ec){self->on_shutdown(ec);});
+	}, m_stream);
 }
 
 void Session::on_shutdown(boost::system::error_code)
@@ -262,11 +472,17 @@ void Session::init_request_body(SessionHandler::RequestBodyType body_type, std::
 		break;
 
 	case SessionHandler::RequestBodyType::upload:
+	{
 		auto& parser = m_body.emplace<UploadRequestParser>(std::move(*m_parser));
 		m_handler->prepare_upload(parser.get().body(), ec);
 		break;
 	}
 
+	case SessionHandler::RequestBodyType::none:
+		assert(false);
+		break;
+	}
+
 }
 
 } // end of namespace
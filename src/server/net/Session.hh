@@ -12,6 +12,8 @@
 
 #pragma once
 
+#include "AsyncFileReader.hh"
+#include "KTLSStream.hh"
 #include "Request.hh"
 
 #include "hrb/URLIntent.hh"
@@ -27,12 +29,14 @@
 #include <boost/asio/ssl/stream.hpp>
 
 #include <optional>
+#include <variant>
 
 namespace hrb {
 
 class Server;
 class SessionHandler;
 class Authentication;
+class MMapResponseBody;
 
 // Handles an HTTP server connection
 class Session : public std::enable_shared_from_this<Session>
@@ -40,9 +44,10 @@ class Session : public std::enable_shared_from_this<Session>
 public:
 	// Take ownership of the socket
 	Session(
-		std::function<SessionHandler()> factory,
+		std::function<SessionHandler(const boost::asio::any_io_executor&)> factory,
 		boost::asio::ip::tcp::socket    socket,
 		boost::asio::ssl::context&      ssl_ctx,
+		bool                            ktls,
 		std::size_t                     nth,
 		std::chrono::seconds            login_session,
 		std::size_t                     upload_limit
@@ -53,6 +58,8 @@ public:
 	void on_handshake(boost::system::error_code ec);
 	void do_read();
 	void on_read_header(boost::system::error_code ec, std::size_t bytes_transferred);
+	void send_continue(unsigned version);
+	void read_body();
 	void on_read(boost::system::error_code ec, std::size_t bytes_transferred);
 	void on_write(boost::system::error_code ec, std::size_t bytes_transferred, bool close);
 	void do_close();
@@ -68,13 +75,24 @@ private:
 
 	template <class Response>
 	void send_response(Response&& response);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	void send_file(std::shared_ptr<http::response<MMapResponseBody>> response, KTLSStream& stream);
+#endif
+	Detached read_file(std::shared_ptr<http::response<MMapResponseBody>> response);
 
 	void handle_read_error(std::string_view where, boost::system::error_code ec);
 	void init_request_body(SessionHandler::RequestBodyType body_type, std::error_code& ec);
 
 private:
 	tcp::socket		                        m_socket;
-	boost::asio::ssl::stream<tcp::socket&>  m_stream;
+
+	// KTLSStream is used if kernel TLS is enabled, and boost::asio::ssl::stream otherwise.
+	// It needs OpenSSL 3.
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	std::variant<boost::asio::ssl::stream<tcp::socket&>, KTLSStream>   m_stream;
+#else
+	std::variant<boost::asio::ssl::stream<tcp::socket&>>   m_stream;
+#endif
 	boost::beast::flat_buffer               m_buffer;
 
 	bool m_keep_alive{false};
@@ -84,7 +102,7 @@ private:
 	std::optional<HeaderRequestParser> m_parser;
 	std::variant<EmptyRequestParser, StringRequestParser, UploadRequestParser> m_body;
 
-	std::function<SessionHandler()> m_factory;
+	std::function<SessionHandler(const boost::asio::any_io_executor&)> m_factory;
 	std::optional<SessionHandler>   m_handler;
 
 	// configurations
@@ -0,0 +1,164 @@
+/*
+	Copyright © 2018 Wan Wai Ho <me@nestal.net>
+
+    This file is subject to the terms and conditions of the GNU General Public
+    License.  See the file COPYING in the main directory of the hearty_rabbit
+    distribution for more details.
+*/
+
+//
+// Created by nestal on 17/10/18.
+//
+
+#include "ShardedPool.hh"
+
+#include <algorithm>
+#include <cassert>
+#include <stdexcept>
+#include <string>
+
+namespace hrb::redis {
+
+HashRing::HashRing(std::size_t shards, std::size_t points_per_shard) : m_shards{std::max<std::size_t>(shards, 1)}
+{
+	m_points.reserve(m_shards * points_per_shard);
+	for (auto shard = 0U; shard < m_shards; shard++)
+		for (auto point = 0U; point < points_per_shard; point++)
+			m_points.emplace_back(hash("shard-" + std::to_string(shard) + "-" + std::to_string(point)), shard);
+
+	std::sort(m_points.begin(), m_points.end());
+}
+
+std::size_t HashRing::find(std::string_view routing_key) const
+{
+	if (m_shards == 1)
+		return 0;
+
+	auto it = std::upper_bound(
+		m_points.begin(), m_points.end(), hash(routing_key),
+		[](std::uint64_t h, auto&& point){return h < point.first;}
+	);
+	return it != m_points.end() ? it->second : m_points.front().second;
+}
+
+std::uint64_t HashRing::hash(std::string_view str)
+{
+	// FNV-1a followed by the splitmix64 finalizer to spread similar strings,
+	// e.g. the points of the same shard, across the ring.
+	std::uint64_t h = 14695981039346656037ULL;
+	for (unsigned char c : str)
+	{
+		h ^= c;
+		h *= 1099511628211ULL;
+	}
+
+	h ^= h >> 30;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111ebULL;
+	h ^= h >> 31;
+	return h;
+}
+
+ShardedConnection::ShardedConnection(ShardedPool& parent, const boost::asio::any_io_executor& executor) :
+	m_parent{&parent},
+	m_executor{executor},
+	m_shards(parent.size()),
+	m_replicas(parent.size())
+{
+}
+
+ShardedConnection::ShardedConnection(std::shared_ptr<Connection> conn) :
+	m_executor{conn->get_executor()},
+	m_shards{std::move(conn)},
+	m_replicas(1)
+{
+}
+
+Connection& ShardedConnection::shard(std::size_t index)
+{
+	auto& conn = m_shards.at(index);
+	if (!conn)
+	{
+		assert(m_parent);
+		conn = m_parent->shard(index).alloc(m_executor);
+	}
+	return *conn;
+}
+
+Connection& ShardedConnection::read_shard(std::size_t index)
+{
+	auto& primary = m_shards.at(index);
+	if (!m_parent || (primary && primary->last_write() + m_parent->read_your_writes() > std::chrono::steady_clock::now()))
+		return shard(index);
+
+	auto& replica = m_replicas.at(index);
+	if (!replica)
+	{
+		if (auto pool = m_parent->next_replica(index))
+			replica = pool->alloc(m_executor);
+		else
+			return shard(index);
+	}
+	return *replica;
+}
+
+std::size_t ShardedConnection::find(std::string_view routing_key) const
+{
+	return m_parent ? m_parent->ring().find(routing_key) : 0;
+}
+
+ShardedPool::ShardedPool(
+	boost::asio::io_context& ioc,
+	const std::vector<boost::asio::ip::tcp::endpoint>& remotes,
+	const PoolSettings& settings,
+	const ReplicaSettings& replicas
+) :
+	m_ioc{ioc},
+	m_ring{remotes.size()},
+	m_read_your_writes{replicas.read_your_writes}
+{
+	if (remotes.empty())
+		throw std::invalid_argument("no redis shard");
+	if (replicas.endpoints.size() > remotes.size())
+		throw std::invalid_argument("more redis replicas than shards");
+
+	for (auto i = 0U; i < remotes.size(); i++)
+	{
+		auto& shard = m_shards.emplace_back();
+		shard.primary = std::make_unique<Pool>(ioc, remotes[i], settings);
+		if (i < replicas.endpoints.size())
+			for (auto&& replica : replicas.endpoints[i])
+				shard.replicas.push_back(std::make_unique<Pool>(ioc, replica, settings));
+	}
+}
+
+void ShardedPool::start()
+{
+	for (auto&& shard : m_shards)
+	{
+		shard.primary->start();
+		for (auto&& replica : shard.replicas)
+			replica->start();
+	}
+}
+
+Pool* ShardedPool::next_replica(std::size_t index)
+{
+	auto& shard = m_shards.at(index);
+	return shard.replicas.empty() ?
+		nullptr :
+		shard.replicas[shard.next++ % shard.replicas.size()].get();
+}
+
+std::shared_ptr<ShardedConnection> ShardedPool::alloc(const boost::asio::any_io_executor& executor)
+{
+	return std::make_shared<ShardedConnection>(*this, executor);
+}
+
+std::shared_ptr<ShardedConnection> ShardedPool::alloc()
+{
+	return alloc(boost::asio::make_strand(m_ioc));
+}
+
+} // end of namespace
@@ -0,0 +1,158 @@
+/*
+	Copyright © 2018 Wan Wai Ho <me@nestal.net>
+
+    This file is subject to the terms and conditions of the GNU General Public
+    License.  See the file COPYING in the main directory of the hearty_rabbit
+    distribution for more details.
+*/
+
+//
+// Created by nestal on 17/10/18.
+//
+
+#pragma once
+
+#include "Redis.hh"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace hrb::redis {
+
+/// \brief Consistent hash ring that maps routing keys to shards
+/// Each shard is placed at a number of points on the ring, and a routing key belongs
+/// to the shard of the first point after its hash. The points of a shard only depend
+/// on its index, so appending a shard only moves about 1/N of the routing keys to the
+/// new shard and leaves the rest where they are.
+class HashRing
+{
+public:
+	explicit HashRing(std::size_t shards, std::size_t points_per_shard = 128);
+
+	[[nodiscard]] std::size_t find(std::string_view routing_key) const;
+	[[nodiscard]] std::size_t size() const {return m_shards;}
+
+	/// 64-bit hash that is stable across builds and platforms, unlike std::hash.
+	static std::uint64_t hash(std::string_view str);
+
+private:
+	std::size_t m_shards;
+	std::vector<std::pair<std::uint64_t, std::size_t>> m_points;    //!< sorted by hash
+};
+
+/// \brief Read-only replicas of the shards
+struct ReplicaSettings
+{
+	/// Replicas of each shard, in the same order as the shards. Shards without any
+	/// replica are read from their primaries.
+	std::vector<std::vector<boost::asio::ip::tcp::endpoint>>    endpoints;
+
+	/// Read from the primary for this long after writing to it. Zero to disable.
+	std::chrono::milliseconds   read_your_writes{1000};
+};
+
+class ShardedPool;
+
+/// \brief One connection to each shard
+/// A session allocates one of these instead of a single Connection, and sends the
+/// commands of a user to the shard of the user. The connection to a shard is allocated
+/// from its pool when it is first used.
+///
+/// Read-only commands can be sent to a replica of the shard with read() instead of at().
+/// Each sharded connection reads from one of the replicas, chosen by round-robin. After
+/// writing to the primary, i.e. Connection::invalidate(), it reads from the primary for
+/// a while to make sure it can read its own writes.
+class ShardedConnection : public std::enable_shared_from_this<ShardedConnection>
+{
+public:
+	ShardedConnection(ShardedPool& parent, const boost::asio::any_io_executor& executor);
+
+	/// Route all routing keys to \a conn.
+	explicit ShardedConnection(std::shared_ptr<Connection> conn);
+
+	ShardedConnection(ShardedConnection&&) = delete;
+	ShardedConnection(const ShardedConnection&) = delete;
+	~ShardedConnection() = default;
+	ShardedConnection& operator=(ShardedConnection&&) = delete;
+	ShardedConnection& operator=(const ShardedConnection&) = delete;
+
+	/// The connection to the shard that stores the keys of \a routing_key, e.g. a user name.
+	Connection& at(std::string_view routing_key) {return shard(find(routing_key));}
+
+	/// The connection to the shard that stores data that does not belong to any user,
+	/// e.g. the phash index. It is always the first one.
+	Connection& global() {return shard(0);}
+
+	Connection& shard(std::size_t index);
+
+	/// The connection to a replica of the shard of \a routing_key for read-only commands,
+	/// or the primary if the shard has no replica or it has just been written.
+	Connection& read(std::string_view routing_key) {return read_shard(find(routing_key));}
+	Connection& read_shard(std::size_t index);
+
+	[[nodiscard]] std::size_t find(std::string_view routing_key) const;
+	[[nodiscard]] std::size_t size() const {return m_shards.size();}
+
+	/// The executor that calls the completion routines of all connections.
+	[[nodiscard]] const boost::asio::any_io_executor& get_executor() const {return m_executor;}
+
+private:
+	ShardedPool                                 *m_parent{};
+	boost::asio::any_io_executor                m_executor;
+	std::vector<std::shared_ptr<Connection>>    m_shards;
+	std::vector<std::shared_ptr<Connection>>    m_replicas;
+};
+
+/// \brief Connection pools of a number of redis instances
+/// The keys of each user are stored in one of the redis instances, i.e. the shards.
+/// Users are assigned to shards by consistent hashing of their names. New shards must
+/// be appended after the existing ones.
+class ShardedPool
+{
+public:
+	ShardedPool(
+		boost::asio::io_context& ioc,
+		const std::vector<boost::asio::ip::tcp::endpoint>& remotes,
+		const PoolSettings& settings = {},
+		const ReplicaSettings& replicas = {}
+	);
+
+	/// Call Pool::start() of all shards and replicas.
+	void start();
+
+	/// Allocate a sharded connection. The completion routines of the connections to
+	/// all shards will be called by \a executor.
+	std::shared_ptr<ShardedConnection> alloc(const boost::asio::any_io_executor& executor);
+
+	/// Allocate a sharded connection with its own strand.
+	std::shared_ptr<ShardedConnection> alloc();
+
+	[[nodiscard]] Pool& shard(std::size_t index) {return *m_shards.at(index).primary;}
+	[[nodiscard]] const HashRing& ring() const {return m_ring;}
+	[[nodiscard]] std::size_t size() const {return m_shards.size();}
+
+	/// The pool of the next replica of the shard, or nullptr if it has none.
+	[[nodiscard]] Pool* next_replica(std::size_t index);
+	[[nodiscard]] std::chrono::milliseconds read_your_writes() const {return m_read_your_writes;}
+
+private:
+	struct Shard
+	{
+		std::unique_ptr<Pool>               primary;
+		std::vector<std::unique_ptr<Pool>>  replicas;
+		std::atomic<std::size_t>            next{};     //!< round-robin index of replicas
+	};
+
+	boost::asio::io_context&    m_ioc;
+	std::deque<Shard>           m_shards;
+	HashRing                    m_ring;
+	std::chrono::milliseconds   m_read_your_writes;
+};
+
+} // end of namespace
@@ -13,12 +13,18 @@
 #include "Configuration.hh"
 
 #include "config.hh"
+#include "util/Escape.hh"
 
 #include <nlohmann/json.hpp>
 
 #include <boost/program_options.hpp>
+#include <boost/algorithm/string/predicate.hpp>
 #include <boost/exception/info.hpp>
 
+#include <openssl/opensslv.h>
+
+#include <algorithm>
+#include <cstdlib>
 #include <fstream>
 
 namespace po = boost::program_options;
@@ -35,6 +41,39 @@ ip::tcp::endpoint parse_endpoint(const nlohmann::json& json)
 	};
 }
 
+std::vector<ip::tcp::endpoint> parse_endpoints(const nlohmann::json& json)
+{
+	std::vector<ip::tcp::endpoint> result;
+	for (auto&& endpoint : json)
+		result.push_back(parse_endpoint(endpoint));
+	return result;
+}
+
+// The q value of \a mime in the Accept header. Only the types listed explicitly are
+// counted. Wildcards like "image/*" are ignored, because browsers send them without
+// supporting the newer formats.
+double accept_quality(std::string_view accept, std::string_view mime)
+{
+	while (!accept.empty())
+	{
+		auto [range, comma] = split_left(accept, ",");
+		auto [type, semicolon] = split_left(range, ";");
+		if (!boost::iequals(trim(type), mime))
+			continue;
+
+		// Parameters other than the q value are ignored
+		auto quality = 1.0;
+		while (!range.empty())
+		{
+			auto [param, sep] = split_left(range, ";");
+			if (param = trim(param); param.starts_with("q="))
+				quality = std::strtod(std::string{param.substr(2)}.c_str(), nullptr);
+		}
+		return quality;
+	}
+	return 0.0;
+}
+
 } // end of local namespace
 
 Configuration::Configuration(int argc, const char *const *argv, const char *env)
@@ -87,12 +126,47 @@ void Configuration::load_config(const fs::path& config_file)
 		m_private_key   = (config_file.parent_path() / json.at(jptr{"/private_key"})).lexically_normal();
 		m_root          = (config_file.parent_path() / json.at(jptr{"/web_root"})).lexically_normal();
 		m_blob_path     = (config_file.parent_path() / json.at(jptr{"/blob_path"})).lexically_normal();
+		for (auto&& volume : json.value(jptr{"/blob_volumes"}, nlohmann::json::array_t{}))
+		{
+			auto weight = volume.value("weight", 1.0);
+			if (weight <= 0)
+				BOOST_THROW_EXCEPTION(Error() << Message{"weight of blob volumes must be positive"});
+
+			m_blob_volumes.push_back(BlobVolume{
+				(config_file.parent_path() / volume.at("path").get<std::string>()).lexically_normal(),
+				weight
+			});
+		}
+		m_rebalance_volumes = json.value(jptr{"/rebalance_volumes"}, m_rebalance_volumes);
 		m_haar_path     = (config_file.parent_path() /
 			json.value(jptr{"/haar_path"}, std::string{constants::haarcascades_path})
 		).lexically_normal();
 
 		m_server_name   = json.at(jptr{"/server_name"});
 		m_thread_count  = json.value(jptr{"/thread_count"}, m_thread_count);
+		m_rendition_threads = json.value(jptr{"/rendition_threads"}, m_rendition_threads);
+		m_opencv_threads    = json.value(jptr{"/opencv_threads"}, m_opencv_threads);
+		m_rendition_backlog = json.value(jptr{"/rendition_backlog"}, m_rendition_backlog);
+		m_meta_cache_entries = json.value(jptr{"/meta_cache_entries"}, m_meta_cache_entries);
+		m_mmap_cache_mb     = json.value(jptr{"/mmap_cache_mb"}, m_mmap_cache_mb);
+		m_ktls              = json.value(jptr{"/ktls"}, m_ktls);
+#if OPENSSL_VERSION_NUMBER < 0x30000000L
+		if (m_ktls)
+			BOOST_THROW_EXCEPTION(Error() << Message{"ktls needs OpenSSL 3"});
+#endif
+		m_async_blob_read   = json.value(jptr{"/async_blob_read"}, m_async_blob_read);
+		m_blob_read_threads = json.value(jptr{"/blob_read_threads"}, m_blob_read_threads);
+		m_pack_threshold_kb = json.value(jptr{"/pack_threshold_kb"}, m_pack_threshold_kb);
+		m_scrub_rate_mb     = json.value(jptr{"/scrub_rate_mb"}, m_scrub_rate_mb);
+		m_scrub_interval    = std::chrono::hours{json.value(jptr{"/scrub_interval_hours"}, m_scrub_interval.count())};
+		m_scrub_quarantine  = json.value(jptr{"/scrub_quarantine"}, m_scrub_quarantine);
+		m_gc_interval       = std::chrono::hours{json.value(jptr{"/gc_interval_hours"}, m_gc_interval.count())};
+		m_gc_grace          = std::chrono::hours{json.value(jptr{"/gc_grace_hours"}, m_gc_grace.count())};
+		m_gc_rate           = json.value(jptr{"/gc_rate"}, m_gc_rate);
+		m_gc_dry_run        = json.value(jptr{"/gc_dry_run"}, m_gc_dry_run);
+		m_stats_interval    = std::chrono::minutes{json.value(jptr{"/stats_interval_minutes"}, m_stats_interval.count())};
+		if (m_rendition_threads == 0)
+			BOOST_THROW_EXCEPTION(Error() << Message{"rendition_threads must be at least 1"});
 		m_rendition.default_rendition(
 			json.value(jptr{"/default_rendition"}, m_rendition.default_rendition())
 		);
@@ -107,9 +181,19 @@ void Configuration::load_config(const fs::path& config_file)
 				auto height = rend.value().value("height", 0);
 				auto quality = rend.value().value("quality", 70);
 				auto square_crop = rend.value().value("square_crop", false);
+				auto eager = rend.value().value("eager", false);
+
+				std::vector<ImageFormat> formats;
+				for (auto&& name : rend.value().value("formats", std::vector<std::string>{}))
+				{
+					if (auto format = RenditionSetting::parse_format(name))
+						formats.push_back(*format);
+					else
+						BOOST_THROW_EXCEPTION(Error() << Message{"unknown rendition format: " + name});
+				}
 
 				if (width > 0 && height > 0)
-					m_rendition.add(rend.key(), {width, height}, quality, square_crop);
+					m_rendition.add(rend.key(), {width, height}, quality, square_crop, eager, std::move(formats));
 			}
 		}
 		m_session_length = std::chrono::seconds{json.value(jptr{"/session_length_in_sec"}, 3600L)};
@@ -124,6 +208,28 @@ void Configuration::load_config(const fs::path& config_file)
 
 		if (auto redis = json.value(jptr{"/redis"}, nlohmann::json::object_t{}); !redis.empty())
 			m_redis = parse_endpoint(redis);
+		m_redis_replicas.push_back(parse_endpoints(json.value(jptr{"/redis/replicas"}, nlohmann::json::array_t{})));
+		for (auto&& shard : json.value(jptr{"/redis/shards"}, nlohmann::json::array_t{}))
+		{
+			m_redis_shards.push_back(parse_endpoint(shard));
+			m_redis_replicas.push_back(parse_endpoints(shard.value("replicas", nlohmann::json::array_t{})));
+		}
+		m_redis_read_your_writes = std::chrono::milliseconds{
+			json.value(jptr{"/redis/read_your_writes_ms"}, m_redis_read_your_writes.count())
+		};
+		m_redis_max_batch       = json.value(jptr{"/redis/max_batch"}, m_redis_max_batch);
+		m_redis_min_connections = json.value(jptr{"/redis/min_connections"}, m_redis_min_connections);
+		m_redis_max_connections = json.value(jptr{"/redis/max_connections"}, m_redis_max_connections);
+		m_redis_connect_timeout = std::chrono::milliseconds{
+			json.value(jptr{"/redis/connect_timeout_ms"}, m_redis_connect_timeout.count())
+		};
+		m_redis_health_check    = std::chrono::seconds{json.value(jptr{"/redis/health_check_sec"}, m_redis_health_check.count())};
+		m_redis_idle_timeout    = std::chrono::seconds{json.value(jptr{"/redis/idle_timeout_sec"}, m_redis_idle_timeout.count())};
+		m_redis_client_cache    = json.value(jptr{"/redis/client_cache"}, m_redis_client_cache);
+		m_redis_cache_max_age   = std::chrono::seconds{json.value(jptr{"/redis/cache_max_age_sec"}, m_redis_cache_max_age.count())};
+		m_redis_cache_max_entries = json.value(jptr{"/redis/cache_max_entries"}, m_redis_cache_max_entries);
+		if (m_redis_max_connections == 0 || m_redis_min_connections > m_redis_max_connections)
+			BOOST_THROW_EXCEPTION(Error() << Message{"invalid redis connection limits"});
 	}
 	catch (nlohmann::json::exception& e)
 	{
@@ -140,6 +246,15 @@ void Configuration::load_config(const fs::path& config_file)
 	}
 }
 
+std::vector<boost::asio::ip::tcp::endpoint> Configuration::redis_shards() const
+{
+	// The first shard is always the "redis" endpoint, which keeps the data that does
+	// not belong to any user.
+	std::vector<boost::asio::ip::tcp::endpoint> shards{m_redis};
+	shards.insert(shards.end(), m_redis_shards.begin(), m_redis_shards.end());
+	return shards;
+}
+
 std::string Configuration::https_root() const
 {
 	using namespace std::literals;
@@ -153,10 +268,11 @@ void Configuration::change_listen_ports(std::uint16_t https, std::uint16_t http)
 	m_listen_http.port(http);
 }
 
-const JPEGRenditionSetting& RenditionSetting::find(std::string_view rend) const
+const ImageRenditionSetting& RenditionSetting::find(std::string_view rend) const
 {
 	assert(m_renditions.find(std::string{m_default}) != m_renditions.end());
 
+	rend = split(rend).first;
 	if (rend.empty())
 		rend = m_default;
 
@@ -176,12 +292,107 @@ int RenditionSetting::quality(std::string_view rend) const
 
 bool RenditionSetting::valid(std::string_view rend) const
 {
-	return m_renditions.find(std::string{rend}) != m_renditions.end();
+	auto [name, format] = split(rend);
+	auto it = m_renditions.find(std::string{name});
+	if (it == m_renditions.end())
+		return false;
+
+	// The file name must be one of the formats of the rendition, if it has an extension
+	auto& formats = it->second.formats;
+	return name.size() == rend.size() ||
+		(format && std::find(formats.begin(), formats.end(), *format) != formats.end());
+}
+
+void RenditionSetting::add(
+	std::string_view rend, Size2D dim, int quality, bool square_crop, bool eager,
+	std::vector<ImageFormat> formats
+)
+{
+	m_renditions.insert_or_assign(
+		std::string{rend},
+		ImageRenditionSetting{dim, quality, square_crop, eager, std::move(formats)}
+	);
+}
+
+std::vector<std::string> RenditionSetting::eager_renditions() const
+{
+	std::vector<std::string> result;
+	for (auto&& [name, setting] : m_renditions)
+	{
+		if (setting.eager)
+		{
+			result.push_back(name);
+			for (auto format : setting.formats)
+				result.push_back(file_name(name, format));
+		}
+	}
+	return result;
+}
+
+// The formats with the same q value are chosen in the order of the configuration
+std::optional<ImageFormat> RenditionSetting::negotiate(std::string_view rend, std::string_view accept) const
+{
+	std::optional<ImageFormat> result;
+	double best = 0.0;
+	for (auto format : find(rend).formats)
+	{
+		if (auto quality = accept_quality(accept, mime(format)); quality > best)
+		{
+			best   = quality;
+			result = format;
+		}
+	}
+	return result;
+}
+
+std::string RenditionSetting::file_name(std::string_view rend, std::optional<ImageFormat> format)
+{
+	std::string result{rend};
+	if (format)
+		(result += '.') += extension(*format);
+	return result;
 }
 
-void RenditionSetting::add(std::string_view rend, Size2D dim, int quality, bool square_crop)
+std::pair<std::string_view, std::optional<ImageFormat>> RenditionSetting::split(std::string_view file)
 {
-	m_renditions.insert_or_assign(std::string{rend}, JPEGRenditionSetting{dim, quality, square_crop});
+	auto dot = file.find('.');
+	return dot == file.npos ?
+		std::make_pair(file, std::optional<ImageFormat>{}) :
+		std::make_pair(file.substr(0, dot), parse_format(file.substr(dot + 1)));
+}
+
+std::optional<ImageFormat> RenditionSetting::parse_format(std::string_view name)
+{
+	if (name == "jpeg" || name == "jpg")
+		return ImageFormat::jpeg;
+	else if (name == "webp")
+		return ImageFormat::webp;
+	else if (name == "avif")
+		return ImageFormat::avif;
+	else
+		return std::nullopt;
+}
+
+std::string_view RenditionSetting::extension(ImageFormat format)
+{
+	switch (format)
+	{
+		case ImageFormat::jpeg: return "jpg";
+		case ImageFormat::webp: return "webp";
+		case ImageFormat::avif: return "avif";
+	}
+	return {};
+}
+
+std::string_view RenditionSetting::mime(ImageFormat format)
+{
+	switch (format)
+	{
+		case ImageFormat::jpeg: return "image/jpeg";
+		case ImageFormat::webp: return "image/webp";
+		case ImageFormat::avif: return "image/avif";
+	}
+	return {};
 }
 
 } // end of namespace
@@ -24,14 +24,25 @@
 
 #include <chrono>
 #include <iosfwd>
+#include <optional>
+#include <string_view>
+#include <utility>
+#include <vector>
 
 namespace hrb {
 
-struct JPEGRenditionSetting
+/// Renditions are encoded in JPEG, or PNG if the master is PNG. They can also be encoded
+/// in these formats for the clients that accept them. Each format is stored in a separate
+/// file named by the rendition and the extension of the format, e.g. "thumbnail.webp".
+enum class ImageFormat {jpeg, webp, avif};
+
+struct ImageRenditionSetting
 {
 	Size2D  dim;
 	int     quality{70};
 	bool    square_crop{false};
+	bool    eager{false};       //!< generated when the blob is uploaded instead of the first time it's requested
+	std::vector<ImageFormat> formats{}; //!< other formats in the order of preference
 };
 
 class RenditionSetting
@@ -42,21 +53,46 @@ public:
 	Size2D dimension(std::string_view rend = {}) const;
 	int quality(std::string_view rend = {}) const;
 
-	const JPEGRenditionSetting& find(std::string_view rend) const;
+	// \a rend can be the name of a rendition or a file returned by file_name()
+	const ImageRenditionSetting& find(std::string_view rend) const;
 
 	bool valid(std::string_view rend) const;
 	const std::string& default_rendition() const {return m_default;}
 	void default_rendition(std::string_view rend) {m_default = rend;}
 
-	void add(std::string_view rend, Size2D dim, int quality=70, bool square_crop=false);
+	void add(
+		std::string_view rend, Size2D dim, int quality=70, bool square_crop=false, bool eager=false,
+		std::vector<ImageFormat> formats={}
+	);
+
+	// names of the rendition files that are generated when the blob is uploaded, in all formats
+	std::vector<std::string> eager_renditions() const;
+
+	// the format of \a rend that the client prefers according to the Accept header, or
+	// nullopt if it does not accept any of them explicitly
+	std::optional<ImageFormat> negotiate(std::string_view rend, std::string_view accept) const;
+
+	// the file that stores \a rend in \a format, and the other way round
+	static std::string file_name(std::string_view rend, std::optional<ImageFormat> format);
+	static std::pair<std::string_view, std::optional<ImageFormat>> split(std::string_view file);
+
+	static std::optional<ImageFormat> parse_format(std::string_view name);
+	static std::string_view extension(ImageFormat format);
+	static std::string_view mime(ImageFormat format);
 
 private:
 	std::string m_default{"2048x2048"};
-	std::unordered_map<std::string, JPEGRenditionSetting> m_renditions{
-		{m_default, JPEGRenditionSetting{{2048, 2048}, 70, false}}
+	std::unordered_map<std::string, ImageRenditionSetting> m_renditions{
+		{m_default, ImageRenditionSetting{{2048, 2048}, 70, false}}
 	};
 };
 
+struct BlobVolume
+{
+	fs::path    path;
+	double      weight{1.0};    //!< relative to other volumes
+};
+
 /// \brief  Parsing command line options and configuration file
 class Configuration
 {
@@ -76,14 +112,45 @@ public:
 	boost::asio::ip::tcp::endpoint listen_http() const { return m_listen_http;}
 	boost::asio::ip::tcp::endpoint listen_https() const { return m_listen_https;}
 	boost::asio::ip::tcp::endpoint redis() const {return m_redis;}
+	std::vector<boost::asio::ip::tcp::endpoint> redis_shards() const;
+	auto& redis_replicas() const {return m_redis_replicas;}
+	std::chrono::milliseconds redis_read_your_writes() const {return m_redis_read_your_writes;}
+	std::size_t redis_max_batch() const {return m_redis_max_batch;}
+	std::size_t redis_min_connections() const {return m_redis_min_connections;}
+	std::size_t redis_max_connections() const {return m_redis_max_connections;}
+	std::chrono::milliseconds redis_connect_timeout() const {return m_redis_connect_timeout;}
+	std::chrono::seconds redis_health_check() const {return m_redis_health_check;}
+	std::chrono::seconds redis_idle_timeout() const {return m_redis_idle_timeout;}
+	bool redis_client_cache() const {return m_redis_client_cache;}
+	std::chrono::seconds redis_cache_max_age() const {return m_redis_cache_max_age;}
+	std::size_t redis_cache_max_entries() const {return m_redis_cache_max_entries;}
 
 	auto& cert_chain() const {return m_cert_chain;}
 	auto& private_key() const {return m_private_key;}
 	auto& web_root() const {return m_root;}
 	auto& blob_path() const {return m_blob_path;}
+	auto& blob_volumes() const {return m_blob_volumes;}
+	bool rebalance_volumes() const {return m_rebalance_volumes;}
 	auto& haar_path() const {return m_haar_path;}
 
 	std::size_t thread_count() const {return m_thread_count;}
+	std::size_t rendition_threads() const {return m_rendition_threads;}
+	int opencv_threads() const {return m_opencv_threads;}
+	std::size_t rendition_backlog() const {return m_rendition_backlog;}
+	std::size_t meta_cache_entries() const {return m_meta_cache_entries;}
+	std::size_t mmap_cache_bytes() const {return m_mmap_cache_mb * 1024 * 1024;}
+	bool ktls() const {return m_ktls;}
+	bool async_blob_read() const {return m_async_blob_read;}
+	std::size_t blob_read_threads() const {return m_blob_read_threads;}
+	std::size_t pack_threshold() const {return m_pack_threshold_kb * 1024;}
+	std::size_t scrub_rate() const {return m_scrub_rate_mb * 1024 * 1024;}
+	std::chrono::hours scrub_interval() const {return m_scrub_interval;}
+	bool scrub_quarantine() const {return m_scrub_quarantine;}
+	std::chrono::hours gc_interval() const {return m_gc_interval;}
+	std::chrono::hours gc_grace() const {return m_gc_grace;}
+	std::size_t gc_rate() const {return m_gc_rate;}
+	bool gc_dry_run() const {return m_gc_dry_run;}
+	std::chrono::minutes stats_interval() const {return m_stats_interval;}
 	std::size_t upload_limit() const {return m_upload_limit;}
 	uid_t user_id() const {return m_user_id;}
 	gid_t group_id() const {return m_group_id;}
@@ -113,6 +180,7 @@ public:
 
 	// for unit tests
 	void blob_path(fs::path path) {m_blob_path = std::move(path);}
+	void blob_volumes(std::vector<BlobVolume> volumes) {m_blob_volumes = std::move(volumes);}
 	void change_listen_ports(std::uint16_t https, std::uint16_t http);
 
 private:
@@ -127,11 +195,40 @@ private:
 		boost::asio::ip::make_address("127.0.0.1"),
 		6379
 	};
+	std::vector<boost::asio::ip::tcp::endpoint> m_redis_shards;    //!< in addition to m_redis
+	std::vector<std::vector<boost::asio::ip::tcp::endpoint>> m_redis_replicas;   //!< of each shard, including m_redis
+	std::chrono::milliseconds m_redis_read_your_writes{1000};
+	std::size_t m_redis_max_batch{64};
+	std::size_t m_redis_min_connections{1}, m_redis_max_connections{64};
+	std::chrono::milliseconds m_redis_connect_timeout{3000};
+	std::chrono::seconds m_redis_health_check{30}, m_redis_idle_timeout{300};
+	bool m_redis_client_cache{true};
+	std::chrono::seconds m_redis_cache_max_age{60};
+	std::size_t m_redis_cache_max_entries{65536};
 
 	fs::path m_cert_chain, m_private_key;
 	fs::path m_root, m_blob_path, m_haar_path;
+	std::vector<BlobVolume> m_blob_volumes;     //!< only blob_path if empty
+	bool m_rebalance_volumes{false};
 	std::string m_server_name;
 	std::size_t m_thread_count{1};
+	std::size_t m_rendition_threads{2};
+	int m_opencv_threads{1};        //!< passed to cv::setNumThreads()
+	std::size_t m_rendition_backlog{256};
+	std::size_t m_meta_cache_entries{65536};
+	std::size_t m_mmap_cache_mb{256};
+	bool m_ktls{false};
+	bool m_async_blob_read{false};
+	std::size_t m_blob_read_threads{4};
+	std::size_t m_pack_threshold_kb{0};     //!< 0 means PackStore is disabled
+	std::size_t m_scrub_rate_mb{0};         //!< per second. 0 means BlobScrubber is disabled
+	std::chrono::hours m_scrub_interval{168};
+	bool m_scrub_quarantine{false};
+	std::chrono::hours m_gc_interval{0};    //!< 0 means BlobCollector is disabled
+	std::chrono::hours m_gc_grace{24};
+	std::size_t m_gc_rate{10};              //!< blobs deleted per second
+	bool m_gc_dry_run{false};
+	std::chrono::minutes m_stats_interval{60}; //!< 0 means the stats are not logged
 	std::size_t m_upload_limit{10 * 1024 * 1024};
 
 	RenditionSetting m_rendition;
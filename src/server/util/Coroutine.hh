@@ -0,0 +1,103 @@
+/*
+	Copyright © 2018 Wan Wai Ho <me@nestal.net>
+
+    This file is subject to the terms and conditions of the GNU General Public
+    License.  See the file COPYING in the main directory of the hearty_rabbit
+    distribution for more details.
+*/
+
+//
+// Created by nestal on 24/10/18.
+//
+
+#pragma once
+
+#include "util/Log.hh"
+
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+namespace hrb {
+
+/// \brief Return type of coroutines that nobody waits for, e.g. request handlers
+/// The coroutine starts running when it is called, and its frame is destroyed after it
+/// returns. It must report its result by itself, e.g. by sending the response. A request
+/// handler written as one coroutine only allocates one frame for the whole request,
+/// instead of one completion routine for each step.
+struct Detached
+{
+	struct promise_type
+	{
+		Detached get_return_object() const noexcept {return {};}
+		std::suspend_never initial_suspend() const noexcept {return {};}
+		std::suspend_never final_suspend() const noexcept {return {};}
+		void return_void() const noexcept {}
+
+		void unhandled_exception() const noexcept
+		{
+			try
+			{
+				throw;
+			}
+			catch (std::exception& e)
+			{
+				Log(LOG_CRIT, "unhandled exception in coroutine: %1%", e.what());
+			}
+			catch (...)
+			{
+				Log(LOG_CRIT, "unhandled exception in coroutine");
+			}
+		}
+	};
+};
+
+/// \brief Awaiter of functions that take a completion routine
+/// \a Initiate is called with a completion routine that takes \a Results. Like
+/// redis::CommandAwaiter, the completion routine only refers to the awaiter by a pointer.
+/// The result of co_await is the argument of the completion routine, or a tuple of them
+/// if there is more than one.
+template <typename Initiate, typename... Results>
+class CallbackAwaiter
+{
+public:
+	explicit CallbackAwaiter(Initiate&& initiate) : m_initiate{std::move(initiate)} {}
+
+	[[nodiscard]] bool await_ready() const noexcept {return false;}
+
+	void await_suspend(std::coroutine_handle<> coro)
+	{
+		m_coro = coro;
+		std::invoke(m_initiate, [this](Results... results)
+		{
+			m_results.emplace(std::move(results)...);
+			m_coro.resume();
+		});
+	}
+
+	auto await_resume()
+	{
+		if constexpr (sizeof...(Results) == 1)
+			return std::get<0>(std::move(*m_results));
+		else
+			return std::move(*m_results);
+	}
+
+private:
+	Initiate                                m_initiate;
+	std::coroutine_handle<>                 m_coro;
+	std::optional<std::tuple<Results...>>   m_results;
+};
+
+template <typename... Results, typename Initiate>
+auto await_callback(Initiate&& initiate)
+{
+	using Awaiter = CallbackAwaiter<std::decay_t<Initiate>, Results...>;
+	return Awaiter{std::decay_t<Initiate>{std::forward<Initiate>(initiate)}};
+}
+
+} // end of namespace hrb
@@ -0,0 +1,183 @@
+/*
+	Copyright © 2018 Wan Wai Ho <me@nestal.net>
+
+    This file is subject to the terms and conditions of the GNU General Public
+    License.  See the file COPYING in the main directory of the hearty_rabbit
+    distribution for more details.
+*/
+
+//
+// Created by nestal on 25/10/18.
+//
+
+#define CATCH_CONFIG_ENABLE_BENCHMARKING
+#include <catch2/catch.hpp>
+
+#include "net/Redis.hh"
+
+#include <boost/asio/io_context.hpp>
+
+#include <atomic>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <new>
+#include <string>
+
+using namespace hrb::redis;
+
+namespace {
+
+// Number of calls to operator new in this process
+std::atomic<std::size_t> allocations{};
+
+// Callback similar to the completion routines in Ownership and SessionHandler: a name,
+// a shared object, a pointer to the handler and a move-only completion routine.
+auto make_callback(std::size_t& done)
+{
+	return [
+		user=std::string{"a user name longer than SSO"},
+		blob=std::make_shared<int>(0),
+		done=&done,
+		send=std::make_unique<int>(0)
+	](Reply, std::error_code)
+	{
+		++*done;
+	};
+}
+
+// The old completion queue: std::function in a std::deque. Move-only callbacks are
+// stored in a shared_ptr because std::function requires them to be copyable. Kept
+// here as a baseline for comparison.
+class LegacyQueue
+{
+public:
+	template <typename Callback>
+	void push(Callback&& callback)
+	{
+		m_callbacks.push_back([cb=std::make_shared<Callback>(std::forward<Callback>(callback))](auto&& r, auto ec)
+		{
+			(*cb)(std::forward<decltype(r)>(r), ec);
+		});
+	}
+
+	void pop()
+	{
+		m_callbacks.front()(Reply{}, std::error_code{});
+		m_callbacks.pop_front();
+	}
+
+private:
+	std::deque<std::function<void(Reply, std::error_code)>> m_callbacks;
+};
+
+class InlineQueue
+{
+public:
+	template <typename Callback>
+	void push(Callback&& callback)
+	{
+		m_callbacks.push_back(std::forward<Callback>(callback));
+	}
+
+	void pop()
+	{
+		auto cb = std::move(m_callbacks.front());
+		cb(Reply{}, std::error_code{});
+		m_callbacks.pop_front();
+	}
+
+private:
+	hrb::RingBuffer<Connection::Completion> m_callbacks;
+};
+
+// Push and pop the callbacks of \a commands commands, with at most 16 of them queued
+// at a time, and return the number of allocations per command. Both queues include
+// the 3 allocations of make_callback() itself.
+template <typename Queue>
+double allocations_per_command(Queue& queue, std::size_t commands)
+{
+	std::size_t done = 0;
+
+	auto before = allocations.load();
+	for (auto i = 0U; i < commands; i += 16)
+	{
+		for (auto j = 0U; j < 16; j++)
+			queue.push(make_callback(done));
+		for (auto j = 0U; j < 16; j++)
+			queue.pop();
+	}
+	return static_cast<double>(allocations.load() - before) / static_cast<double>(done);
+}
+
+} // end of local namespace
+
+void* operator new(std::size_t size)
+{
+	allocations++;
+	if (auto p = std::malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc{};
+}
+
+void operator delete(void *ptr) noexcept
+{
+	std::free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t) noexcept
+{
+	std::free(ptr);
+}
+
+TEST_CASE("completion queue allocations", "[benchmark]")
+{
+	// The first round grows the queues to their working size
+	LegacyQueue legacy;
+	allocations_per_command(legacy, 1024);
+	WARN("std::function in std::deque: " << allocations_per_command(legacy, 16384) << " allocations per command");
+
+	InlineQueue inline_queue;
+	allocations_per_command(inline_queue, 1024);
+	WARN("InlineFunction in RingBuffer: " << allocations_per_command(inline_queue, 16384) << " allocations per command");
+
+	BENCHMARK("std::function in std::deque")
+	{
+		return allocations_per_command(legacy, 1024);
+	};
+
+	BENCHMARK("InlineFunction in RingBuffer")
+	{
+		return allocations_per_command(inline_queue, 1024);
+	};
+}
+
+// Requires redis at localhost:6379, like the unit tests.
+TEST_CASE("redis command allocations", "[benchmark]")
+{
+	boost::asio::io_context ioc;
+	auto redis = connect(ioc);
+
+	const auto commands = 10000U;
+	std::size_t done = 0;
+
+	// warm up the connection, e.g. the callback queue and the buffers
+	for (auto i = 0U; i < 100; i++)
+		redis->command(make_callback(done), "PING");
+	ioc.run();
+	ioc.restart();
+
+	done = 0;
+	auto before = allocations.load();
+	for (auto i = 0U; i < commands; i++)
+		redis->command(make_callback(done), "PING");
+	ioc.run();
+
+	REQUIRE(done == commands);
+
+	// Including the allocations of the callback itself, i.e. the string and the
+	// shared_ptr, and the Reply. CommandString is allocated by hiredis with malloc()
+	// and not counted.
+	WARN("redis::Connection: " << static_cast<double>(allocations.load() - before) / commands << " allocations per command");
+}
@@ -0,0 +1,131 @@
+/*
+	Copyright © 2018 Wan Wai Ho <me@nestal.net>
+    
+    This file is subject to the terms and conditions of the GNU General Public
+    License.  See the file COPYING in the main directory of the hearty_rabbit
+    distribution for more details.
+*/
+
+//
+// Created by nestal on 1/11/18.
+//
+
+#define CATCH_CONFIG_MAIN
+#define CATCH_CONFIG_ENABLE_BENCHMARKING
+#include <catch2/catch.hpp>
+
+#include "net/Redis.hh"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace hrb::redis;
+
+namespace {
+
+// The old representation of redis::Reply: one heap-allocated redisReply for each element,
+// and a vector of child Replies for arrays. Kept here as a baseline for comparison.
+class LegacyReply
+{
+public:
+	explicit LegacyReply(redisReply *r = nullptr) :
+		m_reply{r, [](::redisReply *r){::freeReplyObject(r);}}
+	{
+		for (std::size_t i = 0 ; m_reply && m_reply->type == REDIS_REPLY_ARRAY && i < m_reply->elements; i++)
+		{
+			m_array.emplace_back(m_reply->element[i]);
+			m_reply->element[i] = nullptr;
+		}
+	}
+
+	[[nodiscard]] std::size_t array_size() const {return m_array.size();}
+	[[nodiscard]] const LegacyReply& operator[](std::size_t i) const {return m_array[i];}
+	[[nodiscard]] std::string_view as_string() const
+	{
+		return {m_reply->str, static_cast<std::size_t>(m_reply->len)};
+	}
+
+private:
+	std::shared_ptr<::redisReply>   m_reply;
+	std::vector<LegacyReply>        m_array;
+};
+
+// Similar to the reply of the scan_collection script: a cursor followed by
+// an array of blob ID, permission and metadata triplets.
+std::string make_collection_reply(std::size_t blobs)
+{
+	auto bulk = [](std::string_view s)
+	{
+		return "$" + std::to_string(s.size()) + "\r\n" + std::string{s} + "\r\n";
+	};
+
+	std::string meta(200, 'm');
+
+	std::string result = "*2\r\n" + bulk("0") + "*" + std::to_string(blobs*3) + "\r\n";
+	for (auto i = 0U ; i < blobs ; i++)
+	{
+		std::string blob(20, 'a');
+		blob.replace(0, std::to_string(i).size(), std::to_string(i));
+		result += bulk(blob);
+		result += ":1\r\n";
+		result += bulk(meta);
+	}
+	return result;
+}
+
+} // end of local namespace
+
+TEST_CASE("parse large redis reply", "[benchmark]")
+{
+	auto raw = make_collection_reply(20000);
+
+	BENCHMARK("arena Reply")
+	{
+		ReplyReader reader;
+		reader.feed(raw.data(), raw.size());
+		auto [reply, result] = reader.get();
+
+		std::size_t total = 0;
+		for (auto&& item : reply[1])
+			total += item.as_string().size();
+		return total;
+	};
+
+	BENCHMARK("legacy Reply")
+	{
+		std::unique_ptr<::redisReader, void(*)(::redisReader*)> reader{::redisReaderCreate(), &::redisReaderFree};
+		::redisReaderFeed(reader.get(), raw.data(), raw.size());
+
+		void *r{};
+		::redisReaderGetReply(reader.get(), &r);
+		LegacyReply reply{static_cast<::redisReply*>(r)};
+
+		std::size_t total = 0;
+		for (auto i = 0U ; i < reply[1].array_size() ; i++)
+			total += reply[1][i].as_string().size();
+		return total;
+	};
+}
+
+TEST_CASE("parse small redis reply", "[benchmark]")
+{
+	auto raw = make_collection_reply(3);
+
+	BENCHMARK("arena Reply")
+	{
+		ReplyReader reader;
+		reader.feed(raw.data(), raw.size());
+		return std::get<0>(reader.get()).as_array(1).array_size();
+	};
+
+	BENCHMARK("legacy Reply")
+	{
+		std::unique_ptr<::redisReader, void(*)(::redisReader*)> reader{::redisReaderCreate(), &::redisReaderFree};
+		::redisReaderFeed(reader.get(), raw.data(), raw.size());
+
+		void *r{};
+		::redisReaderGetReply(reader.get(), &r);
+		return LegacyReply{static_cast<::redisReply*>(r)}[1].array_size();
+	};
+}
@@ -0,0 +1,57 @@
+/*
+	Copyright © 2018 Wan Wai Ho <me@nestal.net>
+
+    This file is subject to the terms and conditions of the GNU General Public
+    License.  See the file COPYING in the main directory of the hearty_rabbit
+    distribution for more details.
+*/
+
+//
+// Created by nestal on 3/12/18.
+//
+
+#pragma once
+
+#include "hrb/ObjectID.hh"
+#include "util/BufferView.hh"
+
+#include <random>
+#include <string_view>
+#include <vector>
+
+namespace hrb::test {
+
+/// An ID with only the first and last bytes set. IDs with the same last byte are stored
+/// in the same shard of the caches.
+inline ObjectID make_id(unsigned char first, unsigned char last = 0)
+{
+	ObjectID id{};
+	id.front() = first;
+	id.back()  = last;
+	return id;
+}
+
+/// The same \a seed gives the same IDs.
+inline std::vector<ObjectID> random_ids(std::size_t count, unsigned seed = 100)
+{
+	std::mt19937 gen{seed};
+	std::uniform_int_distribution<unsigned> dist{0, 255};
+
+	std::vector<ObjectID> result(count);
+	for (auto&& id : result)
+		for (auto&& byte : id)
+			byte = static_cast<unsigned char>(dist(gen));
+	return result;
+}
+
+inline BufferView view(const std::vector<unsigned char>& data)
+{
+	return {data.data(), data.size()};
+}
+
+inline BufferView view(std::string_view str)
+{
+	return {reinterpret_cast<const unsigned char*>(str.data()), str.size()};
+}
+
+} // end of namespace hrb::test
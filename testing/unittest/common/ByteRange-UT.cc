@@ -0,0 +1,73 @@
+/*
+	Copyright © 2018 Wan Wai Ho <me@nestal.net>
+
+    This file is subject to the terms and conditions of the GNU General Public
+    License.  See the file COPYING in the main directory of the hearty_rabbit
+    distribution for more details.
+*/
+
+//
+// Created by nestal on 30/10/18.
+//
+
+#include <catch2/catch.hpp>
+
+#include "util/ByteRange.hh"
+
+using namespace hrb;
+
+TEST_CASE("parse single byte range", "[normal]")
+{
+	using Ranges = std::vector<ByteRange>;
+
+	REQUIRE(parse_byte_ranges("bytes=0-499", 10000) == Ranges{{0, 500}});
+	REQUIRE(parse_byte_ranges("bytes=500-999", 10000) == Ranges{{500, 500}});
+	REQUIRE(parse_byte_ranges("bytes=9500-", 10000) == Ranges{{9500, 500}});
+	REQUIRE(parse_byte_ranges("bytes=-500", 10000) == Ranges{{9500, 500}});
+
+	// clipped to the end of the resource
+	REQUIRE(parse_byte_ranges("bytes=9500-20000", 10000) == Ranges{{9500, 500}});
+	REQUIRE(parse_byte_ranges("bytes=-20000", 10000) == Ranges{{0, 10000}});
+}
+
+TEST_CASE("parse multiple byte ranges", "[normal]")
+{
+	using Ranges = std::vector<ByteRange>;
+
+	REQUIRE(parse_byte_ranges("bytes=500-600, 0-99", 10000) == Ranges{{0, 100}, {500, 101}});
+	REQUIRE(parse_byte_ranges("bytes=0-0,-1", 10000) == Ranges{{0, 1}, {9999, 1}});
+
+	// overlapping and adjacent ranges are merged
+	REQUIRE(parse_byte_ranges("bytes=500-700,601-999", 10000) == Ranges{{500, 500}});
+	REQUIRE(parse_byte_ranges("bytes=0-99,100-199", 10000) == Ranges{{0, 200}});
+	REQUIRE(parse_byte_ranges("bytes=0-,100-199", 10000) == Ranges{{0, 10000}});
+}
+
+TEST_CASE("unsatisfiable byte ranges", "[normal]")
+{
+	using Ranges = std::vector<ByteRange>;
+
+	REQUIRE(parse_byte_ranges("bytes=10000-", 10000) == Ranges{});
+	REQUIRE(parse_byte_ranges("bytes=-0", 10000) == Ranges{});
+	REQUIRE(parse_byte_ranges("bytes=0-", 0) == Ranges{});
+
+	// only the satisfiable ones are kept
+	REQUIRE(parse_byte_ranges("bytes=20000-30000,0-9", 10000) == Ranges{{0, 10}});
+}
+
+TEST_CASE("invalid Range headers are ignored", "[normal]")
+{
+	REQUIRE_FALSE(parse_byte_ranges("", 10000));
+	REQUIRE_FALSE(parse_byte_ranges("bytes=", 10000));
+	REQUIRE_FALSE(parse_byte_ranges("items=0-1", 10000));
+	REQUIRE_FALSE(parse_byte_ranges("bytes=1-0", 10000));
+	REQUIRE_FALSE(parse_byte_ranges("bytes=a-b", 10000));
+	REQUIRE_FALSE(parse_byte_ranges("bytes=0-1-2", 10000));
+	REQUIRE_FALSE(parse_byte_ranges("bytes=10", 10000));
+
+	// too many ranges
+	std::string many{"bytes=0-0"};
+	for (int i = 1; i < 20; i++)
+		many += "," + std::to_string(i*2) + "-" + std::to_string(i*2);
+	REQUIRE_FALSE(parse_byte_ranges(many, 10000));
+}
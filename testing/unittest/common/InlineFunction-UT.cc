@@ -0,0 +1,56 @@
+/*
+	Copyright © 2018 Wan Wai Ho <me@nestal.net>
+
+    This file is subject to the terms and conditions of the GNU General Public
+    License.  See the file COPYING in the main directory of the hearty_rabbit
+    distribution for more details.
+*/
+
+//
+// Created by nestal on 25/10/18.
+//
+
+#include <catch2/catch.hpp>
+
+#include "util/InlineFunction.hh"
+
+#include <array>
+#include <memory>
+#include <string>
+
+using namespace hrb;
+
+TEST_CASE("move-only lambdas are stored inline", "[normal]")
+{
+	auto ptr = std::make_unique<int>(100);
+	InlineFunction<int(int)> subject{[ptr=std::move(ptr)](int n){return *ptr + n;}};
+	REQUIRE(subject);
+	REQUIRE(subject.is_inline());
+	REQUIRE(subject(1) == 101);
+
+	auto moved = std::move(subject);
+	REQUIRE_FALSE(subject);
+	REQUIRE(moved.is_inline());
+	REQUIRE(moved(2) == 102);
+
+	moved = nullptr;
+	REQUIRE_FALSE(moved);
+}
+
+TEST_CASE("large lambdas are allocated in the heap", "[normal]")
+{
+	auto counter = std::make_shared<int>(0);
+	std::array<char, 256> large{};
+
+	InlineFunction<void()> subject{[counter, large]{++*counter;}};
+	REQUIRE_FALSE(subject.is_inline());
+	REQUIRE(counter.use_count() == 2);
+
+	InlineFunction<void()> other;
+	other = std::move(subject);
+	other();
+	REQUIRE(*counter == 1);
+
+	other = nullptr;
+	REQUIRE(counter.use_count() == 1);
+}
@@ -0,0 +1,57 @@
+/*
+	Copyright © 2018 Wan Wai Ho <me@nestal.net>
+
+    This file is subject to the terms and conditions of the GNU General Public
+    License.  See the file COPYING in the main directory of the hearty_rabbit
+    distribution for more details.
+*/
+
+//
+// Created by nestal on 25/10/18.
+//
+
+#include <catch2/catch.hpp>
+
+#include "util/RingBuffer.hh"
+
+#include <algorithm>
+#include <string>
+
+using namespace hrb;
+
+TEST_CASE("ring buffer is a FIFO queue", "[normal]")
+{
+	RingBuffer<std::string> subject;
+	REQUIRE(subject.empty());
+
+	// wrap around a few times without growing
+	for (int i = 0; i < 100; i++)
+	{
+		subject.push_back(std::to_string(i));
+		subject.push_back(std::to_string(i+1));
+		REQUIRE(subject.front() == std::to_string(i));
+		subject.pop_front();
+		REQUIRE(subject.front() == std::to_string(i+1));
+		subject.pop_front();
+	}
+	REQUIRE(subject.empty());
+	REQUIRE(subject.capacity() == 8);
+
+	// growing keeps the order of the elements after wrapping around
+	for (int i = 0; i < 20; i++)
+		subject.push_back(std::to_string(i));
+	REQUIRE(subject.size() == 20);
+	REQUIRE(subject.capacity() == 32);
+
+	auto i = 0;
+	for (auto&& s : subject)
+		REQUIRE(s == std::to_string(i++));
+
+	std::rotate(subject.begin(), subject.begin() + 15, subject.end());
+	REQUIRE(subject.front() == "15");
+	REQUIRE(subject.back() == "14");
+
+	auto moved = std::move(subject);
+	REQUIRE(subject.empty());
+	REQUIRE(moved.size() == 20);
+}
@@ -13,6 +13,7 @@
 #include <catch2/catch.hpp>
 
 #include "net/Redis.hh"
+#include "net/ShardedPool.hh"
 #include "util/Cookie.hh"
 #include "util/Error.hh"
 #include "crypto/Authentication.hh"
@@ -53,7 +54,7 @@ TEST_CASE("Test normal user login", "[normal]")
 {
 	using namespace std::chrono_literals;
 	boost::asio::io_context ioc;
-	auto redis = redis::connect(ioc);
+	auto redis = std::make_shared<redis::ShardedConnection>(redis::connect(ioc));
 
 	bool tested = false;
 
@@ -171,7 +172,7 @@ TEST_CASE("Sharing resource to guest", "[normal]")
 {
 	using namespace std::chrono_literals;
 	boost::asio::io_context ioc;
-	auto redis = redis::connect(ioc);
+	auto redis = std::make_shared<redis::ShardedConnection>(redis::connect(ioc));
 
 	auto tested = 0;
 	Authentication::share_resource("sumsum", "dir:", 3600s, *redis, [&tested, redis](auto&& auth, auto ec)
@@ -0,0 +1,140 @@
+/*
+	Copyright © 2018 Wan Wai Ho <me@nestal.net>
+
+    This file is subject to the terms and conditions of the GNU General Public
+    License.  See the file COPYING in the main directory of the hearty_rabbit
+    distribution for more details.
+*/
+
+//
+// Created by nestal on 2/12/18.
+//
+
+#include <catch2/catch.hpp>
+
+#include "hrb/BlobCollector.hh"
+#include "hrb/BlobVolumes.hh"
+#include "hrb/PackStore.hh"
+#include "util/Configuration.hh"
+#include "TestBlobs.hh"
+
+#include <algorithm>
+#include <fstream>
+
+using namespace hrb;
+using namespace hrb::test;
+using namespace std::chrono_literals;
+
+namespace {
+
+const fs::path root = "/tmp/BlobCollector-UT";
+
+void create_blob(const BlobVolumes& volumes, const ObjectID& id, fs::file_time_type modified)
+{
+	auto dir = volumes.dest(id);
+	create_directories(dir);
+	std::ofstream{dir/"master"} << "master";
+	std::ofstream{dir/"thumbnail"} << "thumbnail";
+	last_write_time(dir/"master", modified);
+	last_write_time(dir/"thumbnail", modified);
+	last_write_time(dir, modified);
+}
+
+} // end of local namespace
+
+TEST_CASE("LiveSet has no false negative", "[normal]")
+{
+	auto ids = random_ids(10000);
+	BlobCollector::LiveSet subject{ids.size()};
+	REQUIRE(subject.bits() >= ids.size() * 10);
+
+	for (auto&& id : ids)
+		subject.insert(id);
+	REQUIRE(subject.size() == ids.size());
+
+	for (auto&& id : ids)
+		REQUIRE(subject.may_contain(id));
+
+	std::size_t false_positives = 0;
+	for (auto&& id : random_ids(10000, 200))
+		if (subject.may_contain(id))
+			false_positives++;
+	REQUIRE(false_positives < 300);
+
+	BlobCollector::LiveSet empty{0};
+	REQUIRE_FALSE(empty.may_contain(ids.front()));
+}
+
+TEST_CASE("BlobCollector deletes old unowned blobs", "[normal]")
+{
+	fs::remove_all(root);
+	BlobVolumes volumes{{{root/"a", 1}, {root/"b", 1}}, root};
+	PackStore pack{root/"pack", 1024};
+
+	auto now = fs::file_time_type::clock::now();
+	auto ids = random_ids(30);
+	for (std::size_t i = 0; i < ids.size(); i++)
+		create_blob(volumes, ids[i], i < 25 ? now - 48h : now);
+
+	std::error_code ec;
+	const unsigned char thumbnail[] = "thumbnail";
+	pack.store(ids[0], "thumbnail", {thumbnail, sizeof(thumbnail)}, ec);
+	pack.store(ids[10], "thumbnail", {thumbnail, sizeof(thumbnail)}, ec);
+	REQUIRE(!ec);
+
+	// The first 10 blobs are owned, and the last 5 are uploaded recently
+	BlobCollector::LiveSet live{ids.size()};
+	for (std::size_t i = 0; i < 10; i++)
+		live.insert(ids[i]);
+
+	SECTION("dry run")
+	{
+		BlobCollector subject{volumes, &pack, 24h, 0, true};
+		auto candidates = subject.sweep(live, now);
+		REQUIRE(subject.remove(candidates, now) == candidates.size());
+
+		for (auto&& id : ids)
+			REQUIRE(exists(volumes.dest(id)/"master"));
+		REQUIRE(pack.contains(ids[10], "thumbnail"));
+	}
+
+	SECTION("delete")
+	{
+		BlobCollector subject{volumes, &pack, 24h, 1000, false};
+		auto candidates = subject.sweep(live, now);
+
+		// A few unowned blobs may be in the LiveSet by chance
+		REQUIRE(candidates.size() <= 15);
+		REQUIRE(candidates.size() >= 14);
+		for (auto&& blob : candidates)
+		{
+			auto it = std::find(ids.begin(), ids.end(), blob.id);
+			REQUIRE(it >= ids.begin() + 10);
+			REQUIRE(it < ids.begin() + 25);
+			REQUIRE(blob.dir == volumes.dest(blob.id));
+			REQUIRE(blob.size == 15);
+		}
+
+		// Upload one of them again after sweeping
+		std::ofstream{candidates.front().dir/"master"} << "master";
+		REQUIRE(subject.remove(candidates, now) == candidates.size() - 1);
+
+		REQUIRE(exists(candidates.front().dir/"master"));
+		for (auto it = candidates.begin() + 1; it != candidates.end(); ++it)
+			REQUIRE_FALSE(exists(it->dir));
+		for (std::size_t i = 0; i < 10; i++)
+			REQUIRE(exists(volumes.dest(ids[i])/"master"));
+		for (std::size_t i = 25; i < ids.size(); i++)
+			REQUIRE(exists(volumes.dest(ids[i])/"master"));
+
+		REQUIRE(pack.contains(ids[0], "thumbnail"));
+		auto deleted = std::any_of(candidates.begin() + 1, candidates.end(), [&ids](auto& blob){return blob.id == ids[10];});
+		REQUIRE(pack.contains(ids[10], "thumbnail") != deleted);
+
+		auto stats = subject.stats();
+		REQUIRE(stats.passes == 1);
+		REQUIRE(stats.scanned == ids.size());
+		REQUIRE(stats.candidates == candidates.size());
+		REQUIRE(stats.deleted == candidates.size() - 1);
+	}
+}
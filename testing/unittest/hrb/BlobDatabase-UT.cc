@@ -16,13 +16,42 @@
 
 #include "hrb/BlobDatabase.hh"
 #include "hrb/BlobFile.hh"
+#include "hrb/RenditionWorker.hh"
 #include "hrb/UploadFile.hh"
 #include "net/MMapResponseBody.hh"
 #include "util/Configuration.hh"
+#include "util/Escape.hh"
 #include "util/Magic.hh"
 
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/io_context.hpp>
+
+#include <future>
+
 using namespace hrb;
 
+namespace {
+
+// Wait for BlobDatabase::response(), which may generate the rendition in the rendition worker
+BlobDatabase::BlobResponse wait_response(BlobDatabase& db, const ObjectID& id, std::string_view rendition = {})
+{
+	boost::asio::io_context ioc;
+	auto work = boost::asio::make_work_guard(ioc);
+
+	std::optional<BlobDatabase::BlobResponse> result;
+	db.response(id, 11, rendition, "", ioc.get_executor(), [&result, &work](auto&& res)
+	{
+		result.emplace(std::move(res));
+		work.reset();
+	});
+	ioc.run();
+
+	REQUIRE(result);
+	return std::move(*result);
+}
+
+} // end of local namespace
+
 TEST_CASE("Open temp file", "[normal]")
 {
 	Configuration cfg;
@@ -42,6 +71,10 @@ TEST_CASE("Open temp file", "[normal]")
 	REQUIRE(count == sizeof(test));
 	REQUIRE(ec == boost::system::error_code{});
 
+	// write the buffered data to the file
+	tmp.flush(ec);
+	REQUIRE(ec == boost::system::error_code{});
+
 	// seek to begin in order to read back the data
 	tmp.seek(0, ec);
 	REQUIRE(ec == boost::system::error_code{});
@@ -62,7 +95,7 @@ TEST_CASE("Open temp file", "[normal]")
 	REQUIRE(exists(dest/"master"));
 	REQUIRE(file_size(dest/"master") == sizeof(test));
 
-	auto res = subject.response(tmpid, 11, "image/jpeg", "");
+	auto res = wait_response(subject, tmpid);
 	REQUIRE(res.result() == http::status::ok);
 	REQUIRE(res[http::field::etag] != std::string_view{});
 }
@@ -84,9 +117,136 @@ TEST_CASE("Upload JPEG file to BlobDatabase", "[normal]")
 	boost::system::error_code bec;
 	tmp.write(black.data(), black.size(), bec);
 	REQUIRE(!bec);
+	tmp.flush(bec);
+	REQUIRE(!bec);
 
 	auto up_id = tmp.ID();
 	auto bb_id = subject.save(std::move(tmp), ec).ID();
 	REQUIRE(!ec);
 	REQUIRE(bb_id == up_id);
 }
+
+TEST_CASE("Generate rendition by rendition worker", "[normal]")
+{
+	std::error_code ec;
+	auto image = MMap::open(test::images / "up_f_upright.jpg", ec);
+	REQUIRE(!ec);
+
+	Configuration cfg;
+	cfg.blob_path("/tmp/BlobDatabase-UT-rendition");
+	fs::remove_all(cfg.blob_path());
+
+	BlobDatabase subject{cfg};
+	UploadFile tmp;
+	subject.prepare_upload(tmp, ec);
+	REQUIRE(!ec);
+
+	boost::system::error_code bec;
+	tmp.write(image.data(), image.size(), bec);
+	REQUIRE(!bec);
+
+	auto id = subject.save(std::move(tmp), ec).ID();
+	REQUIRE(!ec);
+
+	boost::asio::io_context ioc;
+	auto work = boost::asio::make_work_guard(ioc);
+
+	// All requests wait for the same rendition, and they are completed by the executor
+	std::vector<BlobDatabase::BlobResponse> responses;
+	auto complete = [&responses, &work](auto&& res)
+	{
+		responses.push_back(std::move(res));
+		if (responses.size() == 3)
+			work.reset();
+	};
+	subject.response(id, 11, "", "", ioc.get_executor(), complete);
+	REQUIRE(responses.empty());
+
+	subject.response(id, 11, "", "", ioc.get_executor(), complete);
+	subject.response(id, 11, cfg.renditions().default_rendition(), "", ioc.get_executor(), complete);
+	ioc.run();
+
+	REQUIRE(responses.size() == 3);
+	for (auto&& res : responses)
+	{
+		REQUIRE(res.result() == http::status::ok);
+		REQUIRE(res[http::field::content_type] == "image/jpeg");
+	}
+
+	// No temp file is left behind: master, meta.bin, meta.json and the rendition
+	auto dir = subject.dest(id);
+	REQUIRE(std::distance(fs::directory_iterator{dir}, fs::directory_iterator{}) == 4);
+	REQUIRE(exists(dir/cfg.renditions().default_rendition()));
+
+	// The rendition is sent from the cache without opening the file again
+	auto hits = subject.mmap_cache_stats().hits;
+	fs::remove(dir/cfg.renditions().default_rendition());
+
+	auto cached = wait_response(subject, id);
+	REQUIRE(cached.result() == http::status::ok);
+	REQUIRE(cached[http::field::content_type] == "image/jpeg");
+	REQUIRE(cached.body().mmap == responses.front().body().mmap);
+	REQUIRE(cached.body().path == dir/cfg.renditions().default_rendition());
+	REQUIRE(subject.mmap_cache_stats().hits == hits + 1);
+}
+
+TEST_CASE("Renditions of masters that cannot be decoded are not generated again", "[error]")
+{
+	std::error_code ec;
+	auto image = MMap::open(test::images / "up_f_upright.jpg", ec);
+	REQUIRE(!ec);
+
+	Configuration cfg;
+	cfg.blob_path("/tmp/BlobDatabase-UT-undecodable");
+	fs::remove_all(cfg.blob_path());
+
+	// Only the header of the JPEG file, so it is still an image/jpeg
+	BlobDatabase db{cfg};
+	UploadFile tmp;
+	db.prepare_upload(tmp, ec);
+	REQUIRE(!ec);
+
+	boost::system::error_code bec;
+	tmp.write(image.data(), 200, bec);
+	REQUIRE(!bec);
+
+	auto blob = db.save(std::move(tmp), ec);
+	REQUIRE(!ec);
+	REQUIRE(blob.need_generate(cfg.renditions().default_rendition(), cfg.renditions()));
+
+	RenditionWorker subject{cfg};
+	std::promise<std::error_code> generated;
+	subject.generate(blob, cfg.renditions().default_rendition(), [&generated](std::error_code ec)
+	{
+		generated.set_value(ec);
+	});
+	REQUIRE(generated.get_future().get() == std::errc::io_error);
+	REQUIRE(subject.is_undecodable(blob.ID()));
+
+	// Fails without decoding the master again
+	std::optional<std::error_code> again;
+	subject.generate(blob, cfg.renditions().default_rendition(), [&again](std::error_code ec)
+	{
+		again = ec;
+	});
+	REQUIRE(again == std::errc::io_error);
+	REQUIRE(subject.pending() == 0);
+
+	// The master is sent instead
+	auto res = wait_response(db, blob.ID());
+	REQUIRE(res.result() == http::status::ok);
+	REQUIRE(res.body().path == db.dest(blob.ID())/"master");
+}
+
+TEST_CASE("ETag of renditions in other formats", "[normal]")
+{
+	auto id = *ObjectID::from_hex("0123456789abcdef0123456789abcdef01234567");
+	REQUIRE(BlobDatabase::etag(id) == to_quoted_hex(id));
+	REQUIRE(BlobDatabase::etag(id, ImageFormat::webp) == "\"0123456789abcdef0123456789abcdef01234567.webp\"");
+
+	REQUIRE(BlobDatabase::is_etag_of(BlobDatabase::etag(id), id));
+	REQUIRE(BlobDatabase::is_etag_of(BlobDatabase::etag(id, ImageFormat::avif), id));
+	REQUIRE_FALSE(BlobDatabase::is_etag_of("\"0123456789abcdef0123456789abcdef01234567.gif\"", id));
+	REQUIRE_FALSE(BlobDatabase::is_etag_of("\"0123456789abcdef0123456789abcdef01234567.\"", id));
+	REQUIRE_FALSE(BlobDatabase::is_etag_of("", id));
+}
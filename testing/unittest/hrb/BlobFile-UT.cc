@@ -13,6 +13,7 @@
 #include <catch2/catch.hpp>
 
 #include "hrb/BlobFile.hh"
+#include "hrb/BlobMetaCache.hh"
 #include "hrb/BlobInodeDB.hh"
 #include "hrb/UploadFile.hh"
 
@@ -24,6 +25,7 @@
 #include "TestImages.hh"
 
 #include <config.hh>
+#include <fstream>
 #include <iostream>
 
 using namespace hrb;
@@ -85,6 +87,7 @@ TEST_CASE_METHOD(BlobFileUTFixture, "upload non-image BlobFile", "[normal]")
 		std::error_code read_ec;
 		BlobFile subject2{m_blob_path, subject.ID()};
 
+		REQUIRE(subject2.has_master());
 		REQUIRE(out.buffer() == subject2.load_master(read_ec).buffer());
 		REQUIRE(!read_ec);
 		REQUIRE(subject2.mime() == "text/x-c++");
@@ -92,6 +95,11 @@ TEST_CASE_METHOD(BlobFileUTFixture, "upload non-image BlobFile", "[normal]")
 		REQUIRE_FALSE(subject2.is_image());
 		REQUIRE(subject2.original_datetime() != Timestamp{});
 	}
+	SECTION("blob in another directory does not exist")
+	{
+		BlobFile subject2{m_blob_path/"not_exist", subject.ID()};
+		REQUIRE_FALSE(subject2.has_master());
+	}
 	SECTION("read another rendition, but got the original")
 	{
 		std::error_code read_ec;
@@ -168,6 +176,37 @@ TEST_CASE_METHOD(BlobFileUTFixture, "upload big upright image as BlobFile", "[no
 	REQUIRE(gen_jpeg.rows <= 64);
 }
 
+TEST_CASE_METHOD(BlobFileUTFixture, "generate rendition in WebP", "[normal]")
+{
+	auto [tmp, src] = upload(m_image_path/"up_f_upright.jpg");
+
+	std::error_code ec;
+	BlobFile subject{std::move(tmp), m_blob_path, ec};
+	REQUIRE(subject.is_image());
+
+	RenditionSetting cfg;
+	cfg.add("thumbnail", {64, 64}, 70, false, false, {ImageFormat::webp});
+	REQUIRE(cfg.valid("thumbnail.webp"));
+	REQUIRE(subject.need_generate("thumbnail.webp", cfg));
+
+	auto webp = subject.rendition("thumbnail.webp", cfg, std::string{constants::haarcascades_path}, ec);
+	if (!BlobFile::can_encode(ImageFormat::webp))
+	{
+		// The master is sent instead
+		REQUIRE(webp.buffer() == src.buffer());
+		return;
+	}
+
+	REQUIRE(!ec);
+	REQUIRE(fs::exists(m_blob_path/"thumbnail.webp"));
+	REQUIRE_FALSE(fs::exists(m_blob_path/"thumbnail"));
+	REQUIRE(Magic::instance().mime(webp.blob()) == "image/webp");
+
+	auto image = load_image(webp.buffer());
+	REQUIRE(image.cols <= 64);
+	REQUIRE(image.rows <= 64);
+}
+
 TEST_CASE_METHOD(BlobFileUTFixture, "upload big rot90 image as BlobFile", "[normal]")
 {
 	auto [tmp, src] = upload(m_image_path/"up_f_rot90.jpg");
@@ -256,3 +295,84 @@ TEST_CASE("ObjectID::from_hex() error cases", "[error]")
 	REQUIRE(!ObjectID::from_hex("xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx"));
 	REQUIRE(!ObjectID::from_hex("0123456789012345678901234567890123456789AAAAAA"));
 }
+
+TEST_CASE_METHOD(BlobFileUTFixture, "generate all renditions from one decoded image", "[normal]")
+{
+	auto [tmp, src] = upload(m_image_path/"up_f_upright.jpg");
+
+	std::error_code ec;
+	BlobFile subject{std::move(tmp), m_blob_path, ec};
+	REQUIRE(!ec);
+
+	RenditionSetting cfg;
+	cfg.add("64x64",     {64, 64});
+	cfg.add("128x128",   {128, 128});
+	cfg.add("thumbnail", {96, 96}, 40, true);
+
+	std::vector<std::string> done;
+	subject.generate_renditions({"thumbnail", "64x64", "128x128"}, cfg, std::string{constants::haarcascades_path}, [&done](auto rend, auto ec)
+	{
+		REQUIRE(!ec);
+		done.emplace_back(rend);
+	});
+
+	// bigger renditions are generated first
+	REQUIRE(done == std::vector<std::string>{"128x128", "thumbnail", "64x64"});
+
+	for (auto&& rend : done)
+	{
+		REQUIRE_FALSE(subject.need_generate(rend, cfg));
+
+		auto mat = load_image(subject.load_rendition(rend, cfg, ec).buffer());
+		REQUIRE(!ec);
+		if (cfg.find(rend).square_crop)
+			REQUIRE(mat.cols == mat.rows);
+		else
+			REQUIRE(std::max(mat.cols, mat.rows) == cfg.dimension(rend).width());
+	}
+}
+
+TEST_CASE_METHOD(BlobFileUTFixture, "meta data is loaded without the master", "[normal]")
+{
+	auto [tmp, src] = upload(m_image_path/"up_f_upright.jpg");
+
+	std::error_code ec;
+	BlobMetaCache cache{16};
+	BlobFile subject{std::move(tmp), m_blob_path, ec, &cache};
+	REQUIRE(!ec);
+	REQUIRE(fs::exists(m_blob_path/"meta.bin"));
+	REQUIRE(cache.size() == 1);
+
+	// Read from the sidecar file
+	fs::remove(m_blob_path/"master");
+	BlobFile sidecar{m_blob_path, subject.ID()};
+	REQUIRE(sidecar.mime() == "image/jpeg");
+	REQUIRE(sidecar.phash() == subject.phash());
+
+	// Read from the cache
+	fs::remove(m_blob_path/"meta.bin");
+	BlobFile cached{m_blob_path, subject.ID(), &cache};
+	REQUIRE(cached.mime() == "image/jpeg");
+	REQUIRE(cached.phash() == subject.phash());
+	REQUIRE(cache.stats().hits == 1);
+	REQUIRE_FALSE(fs::exists(m_blob_path/"meta.bin"));
+}
+
+TEST_CASE_METHOD(BlobFileUTFixture, "meta data missing in the meta.json of older versions is deduced", "[normal]")
+{
+	auto [tmp, src] = upload(m_image_path/"up_f_upright.jpg");
+
+	std::error_code ec;
+	BlobFile subject{std::move(tmp), m_blob_path, ec};
+	REQUIRE(!ec);
+	REQUIRE(subject.phash().has_value());
+
+	// Older versions did not write phash
+	fs::remove(m_blob_path/"meta.bin");
+	std::ofstream{m_blob_path/"meta.json"} << R"({"mime": "image/jpeg"})";
+
+	BlobFile legacy{m_blob_path, subject.ID()};
+	REQUIRE(legacy.mime() == "image/jpeg");
+	REQUIRE(legacy.phash() == subject.phash());
+	REQUIRE(fs::exists(m_blob_path/"meta.bin"));
+}
@@ -0,0 +1,69 @@
+/*
+	Copyright © 2018 Wan Wai Ho <me@nestal.net>
+
+    This file is subject to the terms and conditions of the GNU General Public
+    License.  See the file COPYING in the main directory of the hearty_rabbit
+    distribution for more details.
+*/
+
+//
+// Created by nestal on 27/10/18.
+//
+
+#include <catch2/catch.hpp>
+
+#include "hrb/BlobMetaCache.hh"
+#include "TestBlobs.hh"
+
+using namespace hrb;
+using namespace hrb::test;
+
+TEST_CASE("BlobMetaCache evicts least recently used entries", "[normal]")
+{
+	// 2 entries per shard
+	BlobMetaCache subject{32};
+
+	auto a = make_id(1), b = make_id(2), c = make_id(3), other_shard = make_id(4, 1);
+	subject.store(a, ImageMeta{});
+	subject.store(b, ImageMeta{});
+	subject.store(other_shard, ImageMeta{});
+	REQUIRE(subject.size() == 3);
+
+	// a becomes the most recently used one, so b will be evicted
+	REQUIRE(subject.find(a).has_value());
+	subject.store(c, ImageMeta{});
+
+	REQUIRE(subject.size() == 3);
+	REQUIRE(subject.find(a).has_value());
+	REQUIRE_FALSE(subject.find(b).has_value());
+	REQUIRE(subject.find(c).has_value());
+	REQUIRE(subject.find(other_shard).has_value());
+
+	auto stats = subject.stats();
+	REQUIRE(stats.hits == 4);
+	REQUIRE(stats.misses == 1);
+}
+
+TEST_CASE("BlobMetaCache stores at least one entry per shard", "[normal]")
+{
+	BlobMetaCache subject{0};
+	subject.store(make_id(1), ImageMeta{});
+	REQUIRE(subject.find(make_id(1)).has_value());
+
+	subject.store(make_id(2), ImageMeta{});
+	REQUIRE_FALSE(subject.find(make_id(1)).has_value());
+	REQUIRE(subject.size() == 1);
+}
+
+TEST_CASE("BlobMetaCache forgets invalidated entries", "[normal]")
+{
+	BlobMetaCache subject{32};
+	subject.store(make_id(1), ImageMeta{});
+	subject.store(make_id(2), ImageMeta{});
+
+	subject.invalidate(make_id(1));
+	subject.invalidate(make_id(3));
+	REQUIRE_FALSE(subject.find(make_id(1)).has_value());
+	REQUIRE(subject.find(make_id(2)).has_value());
+	REQUIRE(subject.size() == 1);
+}
@@ -0,0 +1,141 @@
+/*
+	Copyright © 2018 Wan Wai Ho <me@nestal.net>
+
+    This file is subject to the terms and conditions of the GNU General Public
+    License.  See the file COPYING in the main directory of the hearty_rabbit
+    distribution for more details.
+*/
+
+//
+// Created by nestal on 2/11/18.
+//
+
+#include <catch2/catch.hpp>
+
+#include "hrb/BlobScrubber.hh"
+#include "hrb/BlobVolumes.hh"
+#include "crypto/Blake2.hh"
+#include "util/Configuration.hh"
+#include "util/Escape.hh"
+#include "TestBlobs.hh"
+
+#include <algorithm>
+#include <fstream>
+#include <thread>
+
+using namespace hrb;
+using namespace hrb::test;
+
+namespace {
+
+const fs::path root = "/tmp/BlobScrubber-UT";
+
+ObjectID write_blob(const BlobVolumes& volumes, std::string_view master)
+{
+	Blake2 hash;
+	hash.update(master.data(), master.size());
+	ObjectID id{hash.finalize()};
+
+	create_directories(volumes.dest(id));
+	std::ofstream{volumes.dest(id)/"master"} << master;
+	std::ofstream{volumes.dest(id)/"meta.json"} << R"({"mime": "text/plain"})";
+	return id;
+}
+
+} // end of local namespace
+
+TEST_CASE("BlobScrubber finds corrupted blobs", "[normal]")
+{
+	fs::remove_all(root);
+	BlobVolumes volumes{{{root/"a", 1}, {root/"b", 1}}, root};
+
+	std::vector<ObjectID> ids;
+	for (int i = 0; i < 10; i++)
+		ids.push_back(write_blob(volumes, "blob content " + std::to_string(i)));
+
+	// master of the first one is corrupted
+	std::ofstream{volumes.dest(ids[0])/"master"} << "corrupted";
+
+	// meta.json and rendition of the second one
+	std::ofstream{volumes.dest(ids[1])/"meta.json"} << R"({"mime": "te)";
+	std::ofstream{volumes.dest(ids[1])/"thumbnail"} << "\xFF\xD8\xFF\xE0 truncated";
+	std::ofstream{volumes.dest(ids[2])/"thumbnail"} << "\xFF\xD8\xFF\xE0 complete \xFF\xD9";
+
+	std::vector<std::pair<ObjectID, std::string>> invalidated;
+	BlobScrubber subject{volumes, root/"cursor", 0, std::chrono::hours{24}, true, [&](auto& id, auto file)
+	{
+		invalidated.emplace_back(id, file);
+	}};
+	REQUIRE(subject.run_pass());
+
+	auto stats = subject.stats();
+	REQUIRE(stats.blobs == 10);
+	REQUIRE(stats.corrupted == 1);
+	REQUIRE(stats.repaired == 2);
+	REQUIRE(stats.passes == 1);
+
+	// The blob is quarantined in its own volume
+	REQUIRE_FALSE(exists(volumes.dest(ids[0])));
+	REQUIRE(exists(volumes.path(volumes.place(ids[0]))/"quarantine"/to_hex(ids[0])/"master"));
+	REQUIRE_FALSE(exists(volumes.dest(ids[1])/"meta.json"));
+	REQUIRE_FALSE(exists(volumes.dest(ids[1])/"thumbnail"));
+	REQUIRE(exists(volumes.dest(ids[2])/"thumbnail"));
+	REQUIRE(exists(volumes.dest(ids[3])/"meta.json"));
+
+	// The caches are told about the removed files
+	std::sort(invalidated.begin(), invalidated.end());
+	std::vector<std::pair<ObjectID, std::string>> expected{
+		{ids[0], ""}, {ids[1], "meta.json"}, {ids[1], "thumbnail"}
+	};
+	std::sort(expected.begin(), expected.end());
+	REQUIRE(invalidated == expected);
+
+	// The cursor is reset after a full pass
+	REQUIRE(subject.cursor() == "0:");
+	std::ifstream cursor{root/"cursor"};
+	std::string saved;
+	REQUIRE(std::getline(cursor, saved));
+	REQUIRE(saved == "0:");
+}
+
+TEST_CASE("BlobScrubber resumes from the saved cursor", "[normal]")
+{
+	fs::remove_all(root);
+	BlobVolumes volumes{{}, root};
+
+	std::vector<ObjectID> ids;
+	for (int i = 0; i < 10; i++)
+		ids.push_back(write_blob(volumes, "blob content " + std::to_string(i)));
+	std::sort(ids.begin(), ids.end());
+
+	std::ofstream{root/"cursor"} << "0:" << to_hex(ids[6]) << "\n";
+
+	BlobScrubber subject{volumes, root/"cursor", 1024 * 1024, std::chrono::hours{24}};
+	subject.start();
+	for (int i = 0; i < 500 && subject.stats().passes == 0; i++)
+		std::this_thread::sleep_for(std::chrono::milliseconds{10});
+
+	// Only the last 3 blobs are checked
+	REQUIRE(subject.stats().passes == 1);
+	REQUIRE(subject.stats().blobs == 3);
+}
+
+TEST_CASE("BlobScrubber checks JPEG, PNG, WebP and AVIF endings", "[normal]")
+{
+	REQUIRE(BlobScrubber::is_complete_image(view("\xFF\xD8 data \xFF\xD9")));
+	REQUIRE_FALSE(BlobScrubber::is_complete_image(view("\xFF\xD8 data")));
+	REQUIRE(BlobScrubber::is_complete_image(view(std::string_view{"\x89PNG\r\n\x1A\n data \0\0\0\0IEND\xAE\x42\x60\x82", 26})));
+	REQUIRE_FALSE(BlobScrubber::is_complete_image(view("\x89PNG\r\n\x1A\n data")));
+	REQUIRE(BlobScrubber::is_complete_image(view("other formats are not checked")));
+
+	// The size of the RIFF chunk excludes the RIFF tag and the size itself
+	std::string_view webp{"RIFF\x0C\0\0\0" "WEBPVP8 \0\0\0\0", 20};
+	REQUIRE(BlobScrubber::is_complete_image(view(webp)));
+	REQUIRE_FALSE(BlobScrubber::is_complete_image(view(webp.substr(0, 16))));
+
+	// ftyp box of 16 bytes and mdat box of 12 bytes
+	std::string_view avif{"\0\0\0\x10" "ftypavif\0\0\0\0" "\0\0\0\x0C" "mdat1234", 28};
+	REQUIRE(BlobScrubber::is_complete_image(view(avif)));
+	REQUIRE_FALSE(BlobScrubber::is_complete_image(view(avif.substr(0, 24))));
+	REQUIRE_FALSE(BlobScrubber::is_complete_image(view(avif.substr(0, 18))));
+}
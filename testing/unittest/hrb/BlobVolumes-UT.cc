@@ -0,0 +1,162 @@
+/*
+	Copyright © 2018 Wan Wai Ho <me@nestal.net>
+
+    This file is subject to the terms and conditions of the GNU General Public
+    License.  See the file COPYING in the main directory of the hearty_rabbit
+    distribution for more details.
+*/
+
+//
+// Created by nestal on 1/11/18.
+//
+
+#include <catch2/catch.hpp>
+
+#include "hrb/BlobVolumes.hh"
+#include "util/Configuration.hh"
+#include "util/Escape.hh"
+#include "TestBlobs.hh"
+
+#include <algorithm>
+#include <fstream>
+
+using namespace hrb;
+using namespace hrb::test;
+
+namespace {
+
+const fs::path root = "/tmp/BlobVolumes-UT";
+
+} // end of local namespace
+
+TEST_CASE("BlobVolumes places blobs by weight", "[normal]")
+{
+	fs::remove_all(root);
+	BlobVolumes subject{{{root/"a", 1}, {root/"b", 1}, {root/"c", 2}}, root};
+	REQUIRE(subject.size() == 3);
+
+	std::vector<std::size_t> count(3);
+	auto ids = random_ids(4000);
+	for (auto&& id : ids)
+	{
+		auto volume = subject.place(id);
+		REQUIRE(volume < 3);
+		REQUIRE(subject.place(id) == volume);
+		count[volume]++;
+	}
+
+	REQUIRE(count[0] > 800);
+	REQUIRE(count[1] > 800);
+	REQUIRE(count[2] > 1800);
+
+	// Adding a volume only moves the blobs to the new one
+	BlobVolumes more{{{root/"a", 1}, {root/"b", 1}, {root/"c", 2}, {root/"d", 1}}, root};
+	std::size_t moved = 0;
+	for (auto&& id : ids)
+	{
+		if (more.place(id) != subject.place(id))
+		{
+			REQUIRE(more.place(id) == 3);
+			moved++;
+		}
+	}
+	REQUIRE(moved > 600);
+	REQUIRE(moved < 1000);
+}
+
+TEST_CASE("BlobVolumes uses the default volume", "[normal]")
+{
+	fs::remove_all(root);
+	BlobVolumes subject{{}, root};
+	REQUIRE(subject.size() == 1);
+
+	auto id = random_ids(1).front();
+	REQUIRE(subject.dest(id).parent_path().parent_path() == root);
+	REQUIRE(subject.locate(id) == subject.dest(id));
+}
+
+TEST_CASE("BlobVolumes visits blobs in the order of their IDs", "[normal]")
+{
+	fs::remove_all(root);
+	BlobVolumes subject{{}, root};
+
+	auto ids = random_ids(100);
+	for (auto&& id : ids)
+		create_directories(subject.dest(id));
+
+	// These are not blobs
+	create_directories(root/"pack");
+	create_directories(fs::path{subject.dest(ids.front()).string() + ".gc"});
+	std::ofstream{root/"ab"} << "not a directory";
+
+	std::vector<std::string> visited;
+	std::error_code ec;
+	subject.for_each_blob(0, [&visited](auto& dir, auto& id)
+	{
+		REQUIRE(dir.filename() == to_hex(id));
+		visited.push_back(to_hex(id));
+		return true;
+	}, ec);
+	REQUIRE(!ec);
+
+	std::vector<std::string> expected;
+	for (auto&& id : ids)
+		expected.push_back(to_hex(id));
+	std::sort(expected.begin(), expected.end());
+	REQUIRE(visited == expected);
+
+	// Start after one of them, and stop after visiting 10
+	visited.clear();
+	subject.for_each_blob(0, [&visited](auto&, auto& id)
+	{
+		visited.push_back(to_hex(id));
+		return visited.size() < 10;
+	}, ec, expected[50]);
+	REQUIRE(!ec);
+	REQUIRE(visited == std::vector<std::string>{expected.begin() + 51, expected.begin() + 61});
+}
+
+TEST_CASE("BlobVolumes finds and moves misplaced blobs", "[normal]")
+{
+	fs::remove_all(root);
+
+	auto ids = random_ids(20);
+	{
+		BlobVolumes old{{{root/"a", 1}}, root};
+		for (auto&& id : ids)
+		{
+			create_directories(old.dest(id));
+			std::ofstream{old.dest(id)/"master"} << "master";
+		}
+	}
+
+	BlobVolumes subject{{{root/"a", 1}, {root/"b", 1}}, root};
+	auto misplaced = std::count_if(ids.begin(), ids.end(), [&subject](auto& id){return subject.place(id) == 1;});
+	REQUIRE(misplaced > 0);
+
+	// The blobs can still be found in the old volume
+	for (auto&& id : ids)
+		REQUIRE(exists(subject.locate(id)/"master"));
+
+	std::error_code ec;
+	REQUIRE(subject.rebalance(ec) == static_cast<std::size_t>(misplaced));
+	REQUIRE(!ec);
+
+	for (auto&& id : ids)
+	{
+		REQUIRE(subject.locate(id) == subject.dest(id));
+		REQUIRE(exists(subject.dest(id)/"master"));
+	}
+	REQUIRE(subject.rebalance(ec) == 0);
+
+	subject.record_read(subject.dest(ids.front())/"master", std::chrono::milliseconds{2});
+	subject.record_read(subject.dest(ids.front())/"master", std::chrono::milliseconds{4});
+	auto stats = subject.stats();
+	REQUIRE(stats.size() == 2);
+
+	auto& volume = stats[subject.place(ids.front())];
+	REQUIRE(volume.reads == 2);
+	REQUIRE(volume.average_latency == std::chrono::milliseconds{3});
+	REQUIRE(volume.max_latency == std::chrono::milliseconds{4});
+	REQUIRE(volume.capacity > 0);
+}
@@ -0,0 +1,102 @@
+/*
+	Copyright © 2018 Wan Wai Ho <me@nestal.net>
+
+    This file is subject to the terms and conditions of the GNU General Public
+    License.  See the file COPYING in the main directory of the hearty_rabbit
+    distribution for more details.
+*/
+
+//
+// Created by nestal on 28/10/18.
+//
+
+#include <catch2/catch.hpp>
+
+#include "hrb/MMapCache.hh"
+#include "TestBlobs.hh"
+
+using namespace hrb;
+using namespace hrb::test;
+
+namespace {
+
+MMapCache::Entry make_entry(std::size_t size)
+{
+	std::error_code ec;
+	auto mmap = MMap::allocate(size, ec);
+	REQUIRE(!ec);
+	return {std::make_shared<const MMap>(std::move(mmap)), "image/jpeg"};
+}
+
+} // end of local namespace
+
+TEST_CASE("MMapCache evicts least recently used renditions by size", "[normal]")
+{
+	// Each entry can use up to 1/16 of the limit
+	MMapCache subject{16 * 4096};
+
+	auto a = make_id(1), b = make_id(2);
+	for (unsigned char i = 0; i < 16; i++)
+		subject.store(make_id(i), "thumbnail", make_entry(4096));
+	REQUIRE(subject.size() == 16);
+	REQUIRE(subject.bytes() == 16 * 4096);
+
+	// a becomes the most recently used one, so the one with ID 0 will be evicted
+	auto hit = subject.find(a, "thumbnail");
+	REQUIRE(hit.has_value());
+	REQUIRE(hit->mime == "image/jpeg");
+	subject.store(b, "2048x2048", make_entry(4096));
+
+	REQUIRE(subject.size() == 16);
+	REQUIRE_FALSE(subject.find(make_id(0), "thumbnail").has_value());
+	REQUIRE(subject.find(a, "thumbnail").has_value());
+	REQUIRE(subject.find(b, "thumbnail").has_value());
+	REQUIRE(subject.find(b, "2048x2048").has_value());
+
+	auto stats = subject.stats();
+	REQUIRE(stats.hits == 4);
+	REQUIRE(stats.misses == 1);
+}
+
+TEST_CASE("MMapCache does not cache large renditions", "[normal]")
+{
+	MMapCache subject{16 * 4096};
+	subject.store(make_id(1), "master", make_entry(2 * 4096));
+	REQUIRE_FALSE(subject.find(make_id(1), "master").has_value());
+	REQUIRE(subject.size() == 0);
+
+	MMapCache disabled{0};
+	disabled.store(make_id(1), "thumbnail", make_entry(4096));
+	REQUIRE(disabled.size() == 0);
+}
+
+TEST_CASE("Invalidated renditions are still mapped until they are sent", "[normal]")
+{
+	MMapCache subject{16 * 4096};
+	subject.store(make_id(1), "thumbnail", make_entry(4096));
+
+	auto sending = subject.find(make_id(1), "thumbnail");
+	REQUIRE(sending.has_value());
+
+	subject.invalidate(make_id(1), "thumbnail");
+	REQUIRE_FALSE(subject.find(make_id(1), "thumbnail").has_value());
+	REQUIRE(subject.bytes() == 0);
+
+	REQUIRE(sending->mmap->is_opened());
+	REQUIRE(sending->mmap->size() == 4096);
+}
+
+TEST_CASE("MMapCache invalidates all renditions of a blob", "[normal]")
+{
+	MMapCache subject{16 * 4096};
+	subject.store(make_id(1), "thumbnail", make_entry(4096));
+	subject.store(make_id(1), "2048x2048", make_entry(4096));
+	subject.store(make_id(2), "thumbnail", make_entry(4096));
+
+	subject.invalidate(make_id(1));
+	REQUIRE_FALSE(subject.find(make_id(1), "thumbnail").has_value());
+	REQUIRE_FALSE(subject.find(make_id(1), "2048x2048").has_value());
+	REQUIRE(subject.find(make_id(2), "thumbnail").has_value());
+	REQUIRE(subject.size() == 1);
+	REQUIRE(subject.bytes() == 4096);
+}
@@ -18,6 +18,7 @@
 #include "hrb/UploadFile.hh"
 #include "hrb/Permission.hh"
 #include "crypto/Random.hh"
+#include "net/ShardedPool.hh"
 
 #include <boost/algorithm/string.hpp>
 
@@ -213,12 +214,18 @@ TEST_CASE("add blob to Ownership", "[normal]")
 
 	// verify that the newly added blob is in the public list
 	bool found = false;
-	subject.list_public_blobs(*redis, [&found, blobid](auto&& blobs, auto ec)
+	subject.list_public_blobs(*std::make_shared<redis::ShardedConnection>(redis), [&found, blobid](auto&& blobs, auto ec)
 	{
 		static_assert(std::is_same_v<std::decay_t<decltype(*blobs.begin())>, Blob>);
 		auto it = std::find_if(blobs.begin(), blobs.end(), [blobid](auto&& blob){return blob.id() == blobid;});
 		REQUIRE(it != blobs.end());
 		REQUIRE(it->collection() == "/");
+
+		// The public blobs of all shards are merged by their timestamps
+		REQUIRE(std::is_sorted(blobs.begin(), blobs.end(), [](auto&& a, auto&& b)
+		{
+			return a.info().timestamp < b.info().timestamp;
+		}));
 	});
 
 	REQUIRE(ioc.run_for(10s) > 0);
@@ -0,0 +1,197 @@
+/*
+	Copyright © 2018 Wan Wai Ho <me@nestal.net>
+
+    This file is subject to the terms and conditions of the GNU General Public
+    License.  See the file COPYING in the main directory of the hearty_rabbit
+    distribution for more details.
+*/
+
+//
+// Created by nestal on 31/10/18.
+//
+
+#include <catch2/catch.hpp>
+
+#include "hrb/PackStore.hh"
+#include "TestBlobs.hh"
+
+#include <chrono>
+#include <thread>
+#include <vector>
+
+using namespace hrb;
+using namespace hrb::test;
+
+namespace {
+
+std::vector<unsigned char> make_data(std::size_t size, unsigned char value)
+{
+	return std::vector<unsigned char>(size, value);
+}
+
+const fs::path pack_path = "/tmp/PackStore-UT";
+
+} // end of local namespace
+
+TEST_CASE("PackStore stores and loads small files", "[normal]")
+{
+	fs::remove_all(pack_path);
+	std::error_code ec;
+
+	auto a = make_data(100, 'a'), b = make_data(5000, 'b');
+	{
+		PackStore subject{pack_path, 64 * 1024};
+		REQUIRE(subject.accept("thumbnail", a.size()));
+		REQUIRE_FALSE(subject.accept("thumbnail", 64 * 1024));
+		REQUIRE_FALSE(subject.accept("thumbnail", 0));
+		REQUIRE_FALSE(subject.accept(std::string(28, 'x'), a.size()));
+
+		subject.store(make_id(1), "thumbnail", view(a), ec);
+		REQUIRE(!ec);
+		subject.store(make_id(1), "meta.json", view(b), ec);
+		REQUIRE(!ec);
+		subject.store(make_id(2), "thumbnail", view(b), ec);
+		REQUIRE(!ec);
+
+		auto mmap = subject.load(make_id(1), "thumbnail", ec);
+		REQUIRE(!ec);
+		REQUIRE(mmap.buffer() == view(a));
+
+		REQUIRE(subject.contains(make_id(2), "thumbnail"));
+		REQUIRE_FALSE(subject.contains(make_id(2), "meta.json"));
+		auto missing = subject.load(make_id(2), "meta.json", ec);
+		REQUIRE(ec == std::errc::no_such_file_or_directory);
+		ec.clear();
+
+		// replace and remove
+		subject.store(make_id(1), "thumbnail", view(b), ec);
+		REQUIRE(!ec);
+		subject.remove(make_id(2), "thumbnail", ec);
+		REQUIRE(!ec);
+		REQUIRE_FALSE(subject.contains(make_id(2), "thumbnail"));
+
+		auto stats = subject.stats();
+		REQUIRE(stats.segments == 1);
+		REQUIRE(stats.files == 2);
+		REQUIRE(stats.live_bytes == 2 * b.size());
+		REQUIRE(stats.garbage_bytes > 0);
+	}
+
+	// The index is loaded when opened again
+	PackStore subject{pack_path, 64 * 1024};
+	REQUIRE(subject.stats().files == 2);
+	REQUIRE_FALSE(subject.contains(make_id(2), "thumbnail"));
+
+	auto mmap = subject.load(make_id(1), "thumbnail", ec);
+	REQUIRE(!ec);
+	REQUIRE(mmap.buffer() == view(b));
+
+	mmap = subject.load(make_id(1), "meta.json", ec);
+	REQUIRE(!ec);
+	REQUIRE(mmap.buffer() == view(b));
+}
+
+TEST_CASE("PackStore compacts segments with garbage", "[normal]")
+{
+	fs::remove_all(pack_path);
+	std::error_code ec;
+
+	// Each segment can hold 4 files
+	auto page = MMap::page_size();
+	PackStore subject{pack_path, page, 4 * page};
+
+	for (unsigned char i = 0; i < 8; i++)
+	{
+		auto data = make_data(page - 1, i);
+		subject.store(make_id(i), "thumbnail", view(data), ec);
+		REQUIRE(!ec);
+	}
+	REQUIRE(subject.stats().segments == 2);
+
+	// Remove 3 of the files in the first segment
+	for (unsigned char i = 0; i < 3; i++)
+	{
+		subject.remove(make_id(i), "thumbnail", ec);
+		REQUIRE(!ec);
+	}
+
+	// The first segment will be compacted in the background when starting the third one
+	auto data = make_data(100, 100);
+	subject.store(make_id(100), "thumbnail", view(data), ec);
+	REQUIRE(!ec);
+
+	using namespace std::chrono_literals;
+	for (int i = 0; i < 500 && fs::exists(pack_path / "segment-00000000"); i++)
+		std::this_thread::sleep_for(10ms);
+
+	// Wait for the background compaction to rewrite the index
+	subject.compact(0.5, ec);
+	REQUIRE(!ec);
+
+	auto stats = subject.stats();
+	REQUIRE(stats.segments == 2);
+	REQUIRE(stats.files == 6);
+	REQUIRE(!fs::exists(pack_path / "segment-00000000"));
+
+	auto moved = subject.load(make_id(3), "thumbnail", ec);
+	REQUIRE(!ec);
+	REQUIRE(moved.buffer() == view(make_data(page - 1, 3)));
+
+	// The compacted index is loaded correctly
+	PackStore reopened{pack_path, page, 4 * page};
+	REQUIRE(reopened.stats().files == 6);
+	moved = reopened.load(make_id(3), "thumbnail", ec);
+	REQUIRE(!ec);
+	REQUIRE(moved.buffer() == view(make_data(page - 1, 3)));
+	REQUIRE_FALSE(reopened.contains(make_id(0), "thumbnail"));
+}
+
+TEST_CASE("PackStore keeps a consistent index when it cannot be rewritten", "[error]")
+{
+	fs::remove_all(pack_path);
+	std::error_code ec;
+
+	auto page = MMap::page_size();
+	PackStore subject{pack_path, page, 4 * page};
+	for (unsigned char i = 0; i < 4; i++)
+	{
+		auto data = make_data(page - 1, i);
+		subject.store(make_id(i), "thumbnail", view(data), ec);
+		REQUIRE(!ec);
+	}
+	for (unsigned char i = 0; i < 3; i++)
+	{
+		subject.remove(make_id(i), "thumbnail", ec);
+		REQUIRE(!ec);
+	}
+
+	// The new index file cannot be created
+	create_directories(pack_path/"index.tmp");
+
+	// Starting the second segment compacts the first one in the background
+	auto data = make_data(page - 1, 4);
+	subject.store(make_id(4), "thumbnail", view(data), ec);
+	REQUIRE(!ec);
+
+	using namespace std::chrono_literals;
+	for (int i = 0; i < 500 && fs::exists(pack_path / "segment-00000000"); i++)
+		std::this_thread::sleep_for(10ms);
+
+	// Wait for the background compaction to finish
+	subject.compact(0.5, ec);
+	REQUIRE(!ec);
+	REQUIRE_FALSE(fs::exists(pack_path / "segment-00000000"));
+	REQUIRE_FALSE(fs::exists(pack_path/"index.tmp"));
+
+	auto stats = subject.stats();
+	REQUIRE(stats.files == 2);
+	REQUIRE(stats.live_bytes == 2 * (page - 1));
+
+	// The files are still found after compaction, by the records appended to the old index
+	PackStore reopened{pack_path, page, 4 * page};
+	REQUIRE(reopened.stats().files == 2);
+	REQUIRE(reopened.stats().live_bytes == 2 * (page - 1));
+	auto moved = reopened.load(make_id(3), "thumbnail", ec);
+	REQUIRE(!ec);
+	REQUIRE(moved.buffer() == view(make_data(page - 1, 3)));
+}
@@ -19,15 +19,21 @@
 #include "hrb/SessionHandler.ipp"
 #include "hrb/Ownership.ipp"
 
+#include "net/Session.hh"
 #include "crypto/Random.hh"
 #include "crypto/Password.hh"
 #include "util/Configuration.hh"
 
+#include <boost/asio/ssl/stream.hpp>
+#include <boost/asio/write.hpp>
 #include <boost/beast/core/flat_buffer.hpp>
 #include <boost/beast/core/buffers_to_string.hpp>
+#include <boost/beast/http/read.hpp>
+#include <boost/beast/http/string_body.hpp>
 
 using namespace hrb;
 using namespace std::chrono_literals;
+using tcp = boost::asio::ip::tcp;
 
 namespace {
 
@@ -115,7 +121,7 @@ private:
 UserID create_session(std::string_view username, std::string_view password, const Configuration& cfg)
 {
 	boost::asio::io_context ioc;
-	auto db = redis::connect(ioc, cfg.redis());
+	auto db = std::make_shared<redis::ShardedConnection>(redis::connect(ioc, cfg.redis()));
 
 	std::promise<UserID> result;
 
@@ -348,3 +354,194 @@ TEST_CASE("General server tests", "[normal]")
 		}
 	}
 }
+
+TEST_CASE("Upload requests that expect 100-continue", "[normal]")
+{
+	auto local_json = (current_src / "../../../etc/hearty_rabbit/hearty_rabbit.json").string();
+
+	const char *argv[] = {"hearty_rabbit", "--cfg", local_json.c_str()};
+	Configuration cfg{sizeof(argv)/sizeof(argv[1]), argv, nullptr};
+
+	auto session = create_session("testuser", "password", cfg);
+
+	Server server{cfg};
+	auto subject = server.start_session();
+
+	// Upload this file normally to get the ID of a blob owned by testuser
+	UploadRequest upload;
+	upload.target("/upload/testuser/testdata");
+	upload.method(http::verb::put);
+	upload.version(11);
+	upload.set(http::field::cookie, session.set_cookie().str());
+
+	boost::system::error_code bec;
+	upload.body().open(cfg.blob_path(), bec);
+	REQUIRE(!bec);
+
+	std::error_code sec;
+	auto testdata = MMap::open(__FILE__, sec);
+	REQUIRE(!sec);
+	upload.body().write(testdata.data(), testdata.size(), bec);
+	REQUIRE(!bec);
+
+	GenericStatusChecker uploaded{http::status::created};
+	subject.handle_request(std::move(upload), std::ref(uploaded), session);
+	REQUIRE(server.get_io_context().run_for(10s) > 0);
+	REQUIRE(uploaded.tested());
+	std::string location{uploaded[http::field::location]};
+	auto blob_id = location.substr(location.find_last_of('/') + 1);
+	REQUIRE(ObjectID::from_hex(blob_id).has_value());
+	server.get_io_context().restart();
+
+	RequestHeader header;
+	header.version(11);
+	header.method(http::verb::put);
+	header.target("/upload/testuser/testdata");
+	header.set(http::field::cookie, session.set_cookie().str());
+	header.set(http::field::expect, "100-continue");
+	header.set(http::field::content_length, std::to_string(testdata.size()));
+
+	std::optional<SessionHandler::RequestBodyType> body_type;
+	auto on_header = [&body_type](SessionHandler::RequestBodyType type, std::error_code ec)
+	{
+		REQUIRE(!ec);
+		body_type = type;
+	};
+
+	SECTION("uploading to the collections of other users is forbidden")
+	{
+		header.target("/upload/otheruser/testdata");
+		subject.on_request_header(header, on_header);
+		REQUIRE(server.get_io_context().run_for(10s) > 0);
+		REQUIRE(body_type == SessionHandler::RequestBodyType::none);
+		REQUIRE(subject.early_response().result() == http::status::forbidden);
+	}
+	SECTION("uploads larger than the limit are rejected")
+	{
+		header.set(http::field::content_length, std::to_string(cfg.upload_limit() + 1));
+		subject.on_request_header(header, on_header);
+		REQUIRE(server.get_io_context().run_for(10s) > 0);
+		REQUIRE(body_type == SessionHandler::RequestBodyType::none);
+		REQUIRE(subject.early_response().result() == http::status::payload_too_large);
+	}
+	SECTION("blobs owned by the user are linked without uploading them again")
+	{
+		header.set("X-HRB-Blob-ID", blob_id);
+		subject.on_request_header(header, on_header);
+		REQUIRE(server.get_io_context().run_for(10s) > 0);
+		REQUIRE(body_type == SessionHandler::RequestBodyType::none);
+
+		auto res = subject.early_response();
+		REQUIRE(res.result() == http::status::created);
+		REQUIRE(res[http::field::location] == location);
+	}
+	SECTION("the body is read if the blob does not exist")
+	{
+		header.set("X-HRB-Blob-ID", to_hex(insecure_random<ObjectID>()));
+		subject.on_request_header(header, on_header);
+		REQUIRE(server.get_io_context().run_for(10s) > 0);
+		REQUIRE(body_type == SessionHandler::RequestBodyType::upload);
+	}
+}
+
+TEST_CASE("Sessions answer 100-continue before reading the upload", "[normal]")
+{
+	auto local_json = (current_src / "../../../etc/hearty_rabbit/hearty_rabbit.json").string();
+
+	const char *argv[] = {"hearty_rabbit", "--cfg", local_json.c_str()};
+	Configuration cfg{sizeof(argv)/sizeof(argv[1]), argv, nullptr};
+
+	auto session = create_session("testuser", "password", cfg);
+
+	Server server{cfg};
+	auto& ioc = server.get_io_context();
+
+	boost::asio::ssl::context server_ctx{boost::asio::ssl::context::tls_server};
+	server_ctx.use_certificate_chain_file(cfg.cert_chain().string());
+	server_ctx.use_private_key_file(cfg.private_key().string(), boost::asio::ssl::context::pem);
+
+	boost::asio::ssl::context client_ctx{boost::asio::ssl::context::tls_client};
+	client_ctx.set_verify_mode(boost::asio::ssl::verify_none);
+
+	tcp::acceptor acceptor{ioc, {boost::asio::ip::make_address("127.0.0.1"), 0}};
+	acceptor.async_accept([&](auto ec, tcp::socket socket)
+	{
+		REQUIRE(!ec);
+		std::make_shared<Session>(
+			[&server](auto&& executor){return server.start_session(executor);},
+			std::move(socket), server_ctx, false, 0, cfg.session_length(), cfg.upload_limit()
+		)->run();
+	});
+
+	// The connection is accepted by the kernel before the server calls accept()
+	boost::asio::ssl::stream<tcp::socket> client{ioc, client_ctx};
+	client.next_layer().connect(acceptor.local_endpoint());
+
+	bool handshaked = false;
+	client.async_handshake(boost::asio::ssl::stream_base::client, [&handshaked](auto ec)
+	{
+		REQUIRE(!ec);
+		handshaked = true;
+	});
+	REQUIRE(ioc.run_for(10s) > 0);
+	REQUIRE(handshaked);
+	ioc.restart();
+
+	// A new blob every time, so that it is not linked by ID
+	auto body = "upload request body " + to_hex(insecure_random<ObjectID>());
+	std::string header;
+	auto send_header = [&](std::string_view target)
+	{
+		header = "PUT " + std::string{target} + " HTTP/1.1\r\n"
+			"Host: localhost\r\n"
+			"Cookie: " + std::string{session.set_cookie().str()} + "\r\n"
+			"Expect: 100-continue\r\n"
+			"Content-Length: " + std::to_string(body.size()) + "\r\n"
+			"\r\n";
+		boost::asio::async_write(client, boost::asio::buffer(header), [](auto ec, auto){REQUIRE(!ec);});
+	};
+
+	boost::beast::flat_buffer buffer;
+	auto read_response = [&]
+	{
+		http::response<http::string_body> res;
+		boost::system::error_code result;
+		bool done = false;
+		http::async_read(client, buffer, res, [&](auto ec, auto)
+		{
+			result = ec;
+			done = true;
+		});
+		while (!done && ioc.run_for(10s) > 0)
+			;
+		ioc.restart();
+		REQUIRE(done);
+		return std::make_pair(result, std::move(res));
+	};
+
+	SECTION("the body is sent after 100 Continue")
+	{
+		send_header("/upload/testuser/testdata");
+		auto [ec, res] = read_response();
+		REQUIRE(!ec);
+		REQUIRE(res.result() == http::status::continue_);
+
+		boost::asio::async_write(client, boost::asio::buffer(body), [](auto ec, auto){REQUIRE(!ec);});
+		auto [ec2, created] = read_response();
+		REQUIRE(!ec2);
+		REQUIRE(created.result() == http::status::created);
+		REQUIRE(created.keep_alive());
+	}
+	SECTION("the connection is closed after answering without the body")
+	{
+		send_header("/upload/otheruser/testdata");
+		auto [ec, res] = read_response();
+		REQUIRE(!ec);
+		REQUIRE(res.result() == http::status::forbidden);
+		REQUIRE_FALSE(res.keep_alive());
+
+		// The body that the client may still send is not parsed as another request
+		auto [ec2, next] = read_response();
+		REQUIRE(ec2);
+	}
+}
@@ -14,6 +14,10 @@
 
 #include "hrb/UploadFile.hh"
 #include "util/FS.hh"
+#include "util/MMap.hh"
+
+#include <cstring>
+#include <vector>
 
 using namespace hrb;
 
@@ -30,3 +34,60 @@ TEST_CASE("UploadFile tests")
 //		subject.write()
 	}
 }
+
+TEST_CASE("UploadFile writes and hashes in blocks", "[normal]")
+{
+	const fs::path dir{"/tmp/UploadFile-UT"};
+	fs::remove_all(dir);
+	fs::create_directories(dir);
+
+	// Not a multiple of the block size, so the last block is partial
+	std::vector<char> data(UploadFile::block_size * 2 + 12345);
+	for (std::size_t i = 0; i < data.size(); i++)
+		data[i] = static_cast<char>(i * 7 + i / 4096);
+
+	Blake2 hash;
+	hash.update(data.data(), data.size());
+	auto expected = ObjectID{hash.finalize()};
+
+	boost::asio::thread_pool pool{1};
+	auto hasher = GENERATE_REF(static_cast<boost::asio::thread_pool*>(nullptr), &pool);
+
+	UploadFile subject;
+	boost::system::error_code ec;
+	subject.open(dir, ec, hasher);
+	REQUIRE(!ec);
+	subject.reserve(data.size());
+
+	// Write in small pieces like the HTTP parser does
+	for (std::size_t offset = 0; offset < data.size(); offset += 1000)
+	{
+		auto size = std::min<std::size_t>(1000, data.size() - offset);
+		REQUIRE(subject.write(&data[offset], size, ec) == size);
+		REQUIRE(!ec);
+	}
+	subject.flush(ec);
+	REQUIRE(!ec);
+	REQUIRE(subject.size(ec) == data.size());
+	REQUIRE(subject.ID() == expected);
+
+	std::error_code sec;
+	subject.move(dir/"master", sec);
+	REQUIRE(!sec);
+
+	auto master = MMap::open(dir/"master", sec);
+	REQUIRE(!sec);
+	REQUIRE(master.size() == data.size());
+	REQUIRE(std::memcmp(master.data(), data.data(), data.size()) == 0);
+
+	// Replace the existing file like rename()
+	UploadFile again;
+	again.open(dir, ec, hasher);
+	REQUIRE(!ec);
+	again.write("hello", 5, ec);
+	again.flush(ec);
+	REQUIRE(!ec);
+	again.move(dir/"master", sec);
+	REQUIRE(!sec);
+	REQUIRE(fs::file_size(dir/"master") == 5);
+}
@@ -17,6 +17,9 @@
 
 #include <catch2/catch.hpp>
 
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+
 using namespace hrb;
 
 TEST_CASE("JPEG image metadata", "[normal]")
@@ -30,3 +33,62 @@ TEST_CASE("JPEG image metadata", "[normal]")
 	REQUIRE(meta.original_timestamp().has_value());
 	REQUIRE(meta.original_timestamp()->time_since_epoch().count() > 0);
 }
+
+TEST_CASE("JPEG image size", "[normal]")
+{
+	std::error_code ec;
+	auto jpeg = MMap::open(test::images/"up_f_upright.jpg", ec);
+	REQUIRE(!ec);
+	REQUIRE(jpeg_size(jpeg.buffer()) == cv::Size{160, 192});
+
+	auto png = MMap::open(test::images/"lena.png", ec);
+	REQUIRE(!ec);
+	REQUIRE_FALSE(jpeg_size(png.buffer()).has_value());
+}
+
+TEST_CASE("Decode JPEG in reduced resolution", "[normal]")
+{
+	cv::Mat lena_4x;
+	cv::resize(test::random_lena(), lena_4x, {}, 4, 4);
+	REQUIRE(lena_4x.cols == 2048);
+
+	std::vector<unsigned char> jpeg;
+	cv::imencode(".jpg", lena_4x, jpeg);
+	BufferView buf{jpeg.data(), jpeg.size()};
+	REQUIRE(jpeg_size(buf) == cv::Size{2048, 2048});
+
+	// The largest scale factor that is still big enough
+	REQUIRE(load_image(buf, {256, 256}, cv::IMREAD_ANYCOLOR).cols == 256);
+	REQUIRE(load_image(buf, {300, 200}, cv::IMREAD_ANYCOLOR).cols == 256);
+	REQUIRE(load_image(buf, {300, 300}, cv::IMREAD_ANYCOLOR).cols == 512);
+	REQUIRE(load_image(buf, {600, 600}, cv::IMREAD_ANYCOLOR).cols == 1024);
+	REQUIRE(load_image(buf, {2048, 2048}, cv::IMREAD_ANYCOLOR).cols == 2048);
+
+	auto gray = load_image(buf, {32, 32}, cv::IMREAD_GRAYSCALE);
+	REQUIRE(gray.cols == 256);
+	REQUIRE(gray.channels() == 1);
+}
+
+TEST_CASE("Pack and unpack image metadata", "[normal]")
+{
+	std::error_code ec;
+	auto mmap = MMap::open(test::images/"up_f_upright.jpg", ec);
+	REQUIRE(!ec);
+
+	ImageMeta meta{mmap.buffer()};
+	auto packed = meta.pack();
+
+	auto unpacked = ImageMeta::unpack({packed.data(), packed.size()});
+	REQUIRE(unpacked.has_value());
+	REQUIRE(unpacked->mime() == meta.mime());
+	REQUIRE(unpacked->phash() == meta.phash());
+	REQUIRE(unpacked->original_timestamp() == meta.original_timestamp());
+	REQUIRE(unpacked->upload_timestamp() == meta.upload_timestamp());
+
+	// truncated
+	REQUIRE_FALSE(ImageMeta::unpack({packed.data(), packed.size() - 1}).has_value());
+
+	// from another version
+	packed[4]++;
+	REQUIRE_FALSE(ImageMeta::unpack({packed.data(), packed.size()}).has_value());
+}
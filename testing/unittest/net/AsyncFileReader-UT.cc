@@ -0,0 +1,74 @@
+/*
+	Copyright © 2018 Wan Wai Ho <me@nestal.net>
+
+	This file is subject to the terms and conditions of the GNU General Public
+	License.  See the file COPYING in the main directory of the hearty_rabbit
+	distribution for more details.
+*/
+
+//
+// Created by nestal on 30/10/18.
+//
+
+#include <catch2/catch.hpp>
+
+#include "net/AsyncFileReader.hh"
+#include "util/MMap.hh"
+
+#include <boost/asio/error.hpp>
+#include <boost/asio/io_context.hpp>
+
+#include <cstring>
+#include <functional>
+#include <vector>
+
+using namespace hrb;
+
+TEST_CASE("AsyncFileReader reads the whole file by chunks", "[normal]")
+{
+	boost::asio::io_context ioc;
+	AsyncFileReader subject{2};
+
+	std::error_code ec;
+	auto expected = MMap::open(__FILE__, ec);
+	REQUIRE(!ec);
+
+	boost::system::error_code bec;
+	auto file = subject.open(ioc.get_executor(), __FILE__, bec);
+	REQUIRE(!bec);
+	REQUIRE(file);
+	REQUIRE(file->size() == expected.size());
+
+	std::vector<char> content;
+	std::vector<char> chunk(100);
+
+	std::function<void(std::uint64_t)> read = [&](std::uint64_t offset)
+	{
+		file->async_read_at(offset, boost::asio::buffer(chunk), [&, offset](auto ec, auto bytes)
+		{
+			if (ec == boost::asio::error::eof)
+				return;
+
+			REQUIRE(!ec);
+			REQUIRE(bytes > 0);
+			content.insert(content.end(), chunk.begin(), chunk.begin() + static_cast<std::ptrdiff_t>(bytes));
+			read(offset + bytes);
+		});
+	};
+	read(0);
+	ioc.run();
+
+	REQUIRE(content.size() == expected.size());
+	REQUIRE(std::memcmp(content.data(), expected.data(), content.size()) == 0);
+}
+
+TEST_CASE("AsyncFileReader cannot open a file that does not exist", "[error]")
+{
+	boost::asio::io_context ioc;
+	AsyncFileReader subject{1};
+
+	boost::system::error_code ec;
+	auto file = subject.open(ioc.get_executor(), "/not/exist", ec);
+	REQUIRE(ec);
+	REQUIRE_FALSE(file);
+}
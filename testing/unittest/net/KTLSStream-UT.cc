@@ -0,0 +1,143 @@
+/*
+	Copyright © 2018 Wan Wai Ho <me@nestal.net>
+
+    This file is subject to the terms and conditions of the GNU General Public
+    License.  See the file COPYING in the main directory of the hearty_rabbit
+    distribution for more details.
+*/
+
+//
+// Created by nestal on 29/10/18.
+//
+
+#include <catch2/catch.hpp>
+
+#include "net/KTLSStream.hh"
+#include "util/FS.hh"
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/ssl/stream.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/beast/core/file_posix.hpp>
+
+#include <array>
+#include <optional>
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+
+using namespace hrb;
+using tcp = boost::asio::ip::tcp;
+
+namespace {
+
+const fs::path etc = fs::path{__FILE__}.parent_path() / "../../../etc/hearty_rabbit";
+
+} // end of local namespace
+
+TEST_CASE("KTLSStream talks to boost::asio::ssl::stream", "[normal]")
+{
+	boost::asio::io_context ioc;
+
+	boost::asio::ssl::context server_ctx{boost::asio::ssl::context::tls_server};
+	server_ctx.use_certificate_chain_file((etc/"certificate.pem").string());
+	server_ctx.use_private_key_file((etc/"key.pem").string(), boost::asio::ssl::context::pem);
+
+	// Kernel TLS is only used if the kernel supports it. Otherwise OpenSSL ignores the option.
+	auto ktls = GENERATE(false, true);
+	if (ktls)
+		::SSL_CTX_set_options(server_ctx.native_handle(), SSL_OP_ENABLE_KTLS);
+
+	boost::asio::ssl::context client_ctx{boost::asio::ssl::context::tls_client};
+	client_ctx.set_verify_mode(boost::asio::ssl::verify_none);
+
+	tcp::acceptor acceptor{ioc, {boost::asio::ip::make_address("127.0.0.1"), 0}};
+	tcp::socket server_socket{ioc};
+	std::optional<KTLSStream> server;
+
+	boost::asio::ssl::stream<tcp::socket> client{ioc, client_ctx};
+
+	std::string request(4, '\0'), response(100000, '\0');
+	std::string reply(response.size(), 'x');
+	bool server_done = false, client_done = false;
+
+	// Sent by sendfile() if the kernel encrypts the records
+	auto reply_path = fs::temp_directory_path() / "KTLSStream-UT.bin";
+	boost::system::error_code bec;
+	boost::beast::file_posix reply_file;
+	reply_file.open(reply_path.string().c_str(), boost::beast::file_mode::write, bec);
+	REQUIRE(!bec);
+	reply_file.write(reply.data(), reply.size(), bec);
+	REQUIRE(!bec);
+	reply_file.close(bec);
+	reply_file.open(reply_path.string().c_str(), boost::beast::file_mode::read, bec);
+	REQUIRE(!bec);
+
+	auto on_sent = [&](auto ec, auto bytes)
+	{
+		REQUIRE(!ec);
+		REQUIRE(bytes == reply.size());
+		server->async_shutdown([&](auto ec)
+		{
+			REQUIRE(!ec);
+			server_done = true;
+		});
+	};
+
+	acceptor.async_accept([&](auto ec, tcp::socket socket)
+	{
+		REQUIRE(!ec);
+		server_socket = std::move(socket);
+		server.emplace(server_socket, server_ctx);
+		server->async_handshake([&](auto ec)
+		{
+			REQUIRE(!ec);
+			boost::asio::async_read(*server, boost::asio::buffer(request), [&](auto ec, auto bytes)
+			{
+				REQUIRE(!ec);
+				REQUIRE(bytes == request.size());
+
+				// Big enough to be written in more than one record
+				if (server->ktls_send())
+					server->async_sendfile(reply_file.native_handle(), 0, reply.size(), on_sent);
+				else
+				{
+					// The small buffers are sent in the same record
+					std::array<boost::asio::const_buffer, 3> buffers{
+						boost::asio::buffer(reply.data(), 10),
+						boost::asio::buffer(reply.data() + 10, 10),
+						boost::asio::buffer(reply.data() + 20, reply.size() - 20)
+					};
+					boost::asio::async_write(*server, buffers, on_sent);
+				}
+			});
+		});
+	});
+
+	client.next_layer().async_connect(acceptor.local_endpoint(), [&](auto ec)
+	{
+		REQUIRE(!ec);
+		client.async_handshake(boost::asio::ssl::stream_base::client, [&](auto ec)
+		{
+			REQUIRE(!ec);
+			boost::asio::async_write(client, boost::asio::buffer(std::string_view{"ping"}), [&](auto ec, auto)
+			{
+				REQUIRE(!ec);
+				boost::asio::async_read(client, boost::asio::buffer(response), [&](auto ec, auto bytes)
+				{
+					REQUIRE(!ec);
+					REQUIRE(bytes == response.size());
+					client_done = true;
+				});
+			});
+		});
+	});
+
+	ioc.run();
+	REQUIRE(server_done);
+	REQUIRE(client_done);
+	REQUIRE(request == "ping");
+	REQUIRE(response == reply);
+}
+
+#endif
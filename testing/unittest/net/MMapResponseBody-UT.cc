@@ -0,0 +1,113 @@
+/*
+	Copyright © 2018 Wan Wai Ho <me@nestal.net>
+
+    This file is subject to the terms and conditions of the GNU General Public
+    License.  See the file COPYING in the main directory of the hearty_rabbit
+    distribution for more details.
+*/
+
+//
+// Created by nestal on 30/10/18.
+//
+
+#include <catch2/catch.hpp>
+
+#include "net/MMapResponseBody.hh"
+
+#include <boost/beast/http/string_body.hpp>
+#include <boost/beast/http/write.hpp>
+
+#include <cstring>
+#include <sstream>
+
+using namespace hrb;
+namespace http = boost::beast::http;
+
+namespace {
+
+http::response<MMapResponseBody> make_response(std::string_view content)
+{
+	std::error_code ec;
+	auto mmap = MMap::allocate(content.size(), ec);
+	REQUIRE(!ec);
+	std::memcpy(mmap.data(), content.data(), content.size());
+
+	http::response<MMapResponseBody> res{
+		std::piecewise_construct,
+		std::make_tuple(std::make_shared<const MMap>(std::move(mmap)), fs::path{}),
+		std::make_tuple(http::status::ok, 11)
+	};
+	res.set(http::field::content_type, "text/plain");
+	res.set(http::field::etag, "\"abcd\"");
+	res.set(http::field::last_modified, "Tue, 30 Oct 2018 00:00:00 GMT");
+	return res;
+}
+
+// the body as sent by Beast
+std::string body_of(http::response<MMapResponseBody>& res)
+{
+	res.prepare_payload();
+
+	std::ostringstream ss;
+	ss << res;
+	auto str = ss.str();
+	auto body = str.substr(str.find("\r\n\r\n") + 4);
+	REQUIRE(body.size() == MMapResponseBody::size(res.body()));
+	return body;
+}
+
+} // end of local namespace
+
+TEST_CASE("Send the whole body without Range", "[normal]")
+{
+	auto res = make_response("0123456789");
+	select_ranges(res, "");
+	REQUIRE(res.result() == http::status::ok);
+	REQUIRE(res[http::field::accept_ranges] == "bytes");
+	REQUIRE(body_of(res) == "0123456789");
+}
+
+TEST_CASE("Send a single byte range", "[normal]")
+{
+	auto res = make_response("0123456789");
+	select_ranges(res, "bytes=2-4", "\"abcd\"");
+	REQUIRE(res.result() == http::status::partial_content);
+	REQUIRE(res[http::field::content_range] == "bytes 2-4/10");
+	REQUIRE(res[http::field::content_type] == "text/plain");
+	REQUIRE(body_of(res) == "234");
+}
+
+TEST_CASE("Send multiple byte ranges", "[normal]")
+{
+	auto res = make_response("0123456789");
+	select_ranges(res, "bytes=-2,0-1", "Tue, 30 Oct 2018 00:00:00 GMT");
+	REQUIRE(res.result() == http::status::partial_content);
+	REQUIRE(res[http::field::content_type] == "multipart/byteranges; boundary=hrbabcd");
+	REQUIRE(body_of(res) ==
+		"\r\n--hrbabcd\r\nContent-Type: text/plain\r\nContent-Range: bytes 0-1/10\r\n\r\n01"
+		"\r\n--hrbabcd\r\nContent-Type: text/plain\r\nContent-Range: bytes 8-9/10\r\n\r\n89"
+		"\r\n--hrbabcd--\r\n"
+	);
+}
+
+TEST_CASE("Range not satisfiable", "[normal]")
+{
+	auto res = make_response("0123456789");
+	select_ranges(res, "bytes=10-");
+	REQUIRE(res.result() == http::status::range_not_satisfiable);
+	REQUIRE(res[http::field::content_range] == "bytes */10");
+	REQUIRE(body_of(res).empty());
+}
+
+TEST_CASE("Send the whole body if If-Range does not match", "[normal]")
+{
+	auto res = make_response("0123456789");
+	select_ranges(res, "bytes=2-4", "\"other\"");
+	REQUIRE(res.result() == http::status::ok);
+	REQUIRE(body_of(res) == "0123456789");
+
+	// invalid Range header is ignored
+	select_ranges(res, "bytes=4-2");
+	REQUIRE(res.result() == http::status::ok);
+	REQUIRE(body_of(res) == "0123456789");
+}
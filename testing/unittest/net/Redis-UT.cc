@@ -13,6 +13,8 @@
 #include <catch2/catch.hpp>
 
 #include "net/Redis.hh"
+#include "net/ClientCache.hh"
+#include "util/Coroutine.hh"
 #include "util/Error.hh"
 
 #include <boost/asio/io_context.hpp>
@@ -20,13 +22,25 @@
 
 #include <cassert>
 #include <chrono>
+#include <thread>
 
 using namespace hrb::redis;
 
 TEST_CASE("redis server not started", "[normal]")
 {
 	boost::asio::io_context ioc;
-	REQUIRE_THROWS(connect(ioc, {boost::asio::ip::make_address("127.0.0.1"), 1})); // assume no one listen to this port
+	auto redis = connect(ioc, {boost::asio::ip::make_address("127.0.0.1"), 1}); // assume no one listen to this port
+
+	bool tested = false;
+	redis->command([&tested](auto, std::error_code ec)
+	{
+		REQUIRE(ec);
+		tested = true;
+	}, "PING");
+
+	// io_context::run() should return after the command failed
+	ioc.run();
+	REQUIRE(tested);
 }
 
 TEST_CASE("redis command", "[normal]")
@@ -229,6 +243,66 @@ TEST_CASE("redis reply reader simple normal cases", "[normal]")
 	}
 }
 
+TEST_CASE("redis reply reader nested arrays", "[normal]")
+{
+	ReplyReader subject;
+
+	// array of: integer, nil, string, and an array of two strings and an empty array
+	std::string_view str{"*4\r\n:100\r\n$-1\r\n$3\r\nabc\r\n*3\r\n$2\r\nde\r\n+fg\r\n*0\r\n"};
+
+	SECTION("one pass")
+	{
+		subject.feed(str.data(), str.size());
+	}
+	SECTION("byte by byte")
+	{
+		for (auto i = 0U ; i+1 < str.size() ; i++)
+		{
+			subject.feed(&str[i], 1);
+			REQUIRE(std::get<1>(subject.get()) == ReplyReader::Result::not_ready);
+		}
+		subject.feed(&str.back(), 1);
+	}
+	SECTION("moved reader")
+	{
+		subject.feed(str.data(), 10);
+		auto moved = std::move(subject);
+		moved.feed(str.data()+10, str.size()-10);
+		subject = std::move(moved);
+	}
+
+	auto[reply, result] = subject.get();
+	REQUIRE(result == ReplyReader::Result::ok);
+	REQUIRE(reply.array_size() == 4);
+	REQUIRE(reply[0].as_int() == 100);
+	REQUIRE(reply[1].is_nil());
+	REQUIRE(reply[2].as_string() == "abc");
+	REQUIRE(reply[3].array_size() == 3);
+	REQUIRE(reply[3][0].as_string() == "de");
+	REQUIRE(reply[3][1].as_status() == "fg");
+	REQUIRE(reply[3][2].type() == REDIS_REPLY_ARRAY);
+	REQUIRE(reply[3][2].array_size() == 0);
+	REQUIRE(reply[4].type() == 0);
+	REQUIRE(reply[3].end() - reply[3].begin() == 3);
+
+	// elements are still valid after the array is destroyed
+	auto nested = reply[3];
+	reply = Reply{};
+	REQUIRE(nested[0].as_string() == "de");
+
+	std::vector<std::string> strings;
+	for (auto&& e : nested)
+		strings.emplace_back(e.as_any_string());
+	REQUIRE(strings == std::vector<std::string>{"de", "fg", ""});
+
+	// next reply is not affected by the previous one
+	subject.feed("$2\r\nhi\r\n", 8);
+	std::tie(reply, result) = subject.get();
+	REQUIRE(result == ReplyReader::Result::ok);
+	REQUIRE(reply.as_string() == "hi");
+	REQUIRE(nested[1].as_status() == "fg");
+}
+
 TEST_CASE("redis reply reader simple error cases", "[normal]")
 {
 	ReplyReader subject;
@@ -300,6 +374,38 @@ TEST_CASE("std::function() as callback", "[normal]")
 	REQUIRE(tested);
 }
 
+namespace {
+hrb::Detached set_and_get(Connection& redis, int& tested)
+{
+	auto [reply, ec] = co_await redis.async_command("SET coroutine %d", 100);
+	REQUIRE(!ec);
+	REQUIRE(reply.as_status() == "OK");
+
+	// the transform runs in the coroutine after the reply is received
+	auto value = co_await redis.async_command(CommandString{"GET coroutine"}, [](Reply&& reply, std::error_code ec)
+	{
+		REQUIRE(!ec);
+		return reply.to_int();
+	});
+	REQUIRE(value == 100);
+	tested++;
+}
+}
+
+TEST_CASE("co_await redis commands", "[normal]")
+{
+	boost::asio::io_context ioc;
+	auto redis = connect(ioc);
+
+	auto tested = 0;
+	set_and_get(*redis, tested);
+	set_and_get(*redis, tested);
+
+	using namespace std::chrono_literals;
+	REQUIRE(ioc.run_for(10s) > 0);
+	REQUIRE(tested == 2);
+}
+
 TEST_CASE("keep queuing")
 {
 	boost::asio::io_context ioc;
@@ -314,3 +420,325 @@ TEST_CASE("keep queuing")
 	using namespace std::chrono_literals;
 	REQUIRE(ioc.run_for(10s) > 0);
 }
+
+namespace {
+const Script test_script{"return {KEYS[1], ARGV[1]}"};
+}
+
+TEST_CASE("EVALSHA command string", "[normal]")
+{
+	// SHA1 of the script, as calculated by redis
+	REQUIRE(test_script.sha1().size() == 40);
+	REQUIRE(std::find(Script::all().begin(), Script::all().end(), &test_script) != Script::all().end());
+
+	std::string_view key{"key"}, arg{"arg"};
+	CommandString evalsha{test_script, "1 %b %b", key.data(), key.size(), arg.data(), arg.size()};
+	REQUIRE(evalsha.script() == &test_script);
+
+	std::string expect{"*5\r\n$7\r\nEVALSHA\r\n$40\r\n"};
+	expect.append(test_script.sha1());
+	expect.append("\r\n$1\r\n1\r\n$3\r\nkey\r\n$3\r\narg\r\n");
+	REQUIRE(evalsha.str() == expect);
+}
+
+TEST_CASE("run script by EVALSHA", "[normal]")
+{
+	boost::asio::io_context ioc;
+	auto redis = connect(ioc);
+
+	int tested = 0, expected = 1;
+	auto expect_reply = [&tested](Reply reply, std::error_code ec)
+	{
+		REQUIRE(!ec);
+		REQUIRE(reply.array_size() == 2);
+		REQUIRE(reply[0].as_string() == "key");
+		REQUIRE(reply[1].as_string() == "arg");
+		tested++;
+	};
+
+	SECTION("script loaded by the pool")
+	{
+		redis->command(expect_reply, CommandString{test_script, "1 key arg"});
+	}
+	SECTION("recover from NOSCRIPT error")
+	{
+		// the script is loaded again and the EVALSHA is sent again after it
+		redis->command("SCRIPT FLUSH");
+		redis->command(expect_reply, CommandString{test_script, "1 key arg"});
+		redis->command(expect_reply, CommandString{test_script, "1 key arg"});
+		expected++;
+	}
+
+	SECTION("NOSCRIPT error inside a transaction")
+	{
+		redis->command("SCRIPT FLUSH");
+		redis->command("MULTI");
+		redis->command([&tested](Reply, std::error_code ec)
+		{
+			REQUIRE(ec == Error::noscript);
+			tested++;
+		}, CommandString{test_script, "1 key arg"});
+		redis->command([&tested](Reply reply, std::error_code ec)
+		{
+			REQUIRE(!ec);
+			REQUIRE(reply.as_string() == "value");
+			tested++;
+		}, "ECHO value");
+		redis->command("EXEC");
+
+		// the EVALSHA above is not sent again after the transaction
+		redis->command(expect_reply, CommandString{test_script, "1 key arg"});
+		expected += 2;
+	}
+
+	using namespace std::chrono_literals;
+	REQUIRE(ioc.run_for(10s) > 0);
+	REQUIRE(tested == expected);
+}
+
+TEST_CASE("commands queued during a write are sent together", "[normal]")
+{
+	boost::asio::io_context ioc;
+	Pool pool{ioc, {boost::asio::ip::make_address("127.0.0.1"), 6379}, PoolSettings{.max_batch = 8}};
+
+	auto redis = pool.alloc();
+	auto before = pool.write_stats();
+
+	const int count = 100;
+	int tested = 0;
+	for (int i = 0 ; i < count ; i++)
+	{
+		redis->command([&tested, i](Reply reply, std::error_code ec)
+		{
+			REQUIRE(!ec);
+			REQUIRE(reply.as_string() == std::to_string(i));
+
+			// replies come back in the same order as the commands
+			REQUIRE(tested == i);
+			tested++;
+		}, "ECHO %d", i);
+	}
+
+	using namespace std::chrono_literals;
+	REQUIRE(ioc.run_for(10s) > 0);
+	REQUIRE(tested == count);
+
+	// SCRIPT LOAD commands sent by alloc() may be counted too
+	auto after = pool.write_stats();
+	REQUIRE(after.commands - before.commands >= count);
+	REQUIRE(after.max_batch == 8);
+
+	// only the first command is sent alone, the rest are batched
+	REQUIRE(after.writes - before.writes < count);
+	REQUIRE(after.writes - before.writes >= count / 8);
+}
+
+TEST_CASE("connection pool", "[normal]")
+{
+	using namespace std::chrono_literals;
+
+	boost::asio::io_context ioc;
+	Pool pool{ioc, {boost::asio::ip::make_address("127.0.0.1"), 6379}, PoolSettings{
+		.max_size = 2,
+		.connect_timeout = 1s
+	}};
+
+	int tested = 0;
+	auto expect_pong = [&tested](Reply reply, std::error_code ec)
+	{
+		REQUIRE(!ec);
+		REQUIRE(reply.as_status() == "PONG");
+		tested++;
+	};
+
+	SECTION("reuse idle connections")
+	{
+		pool.alloc()->command(expect_pong, "PING");
+		REQUIRE(ioc.run_for(10s) > 0);
+		REQUIRE(tested == 1);
+		REQUIRE(pool.size() == 1);
+		REQUIRE(pool.idle() + pool.thread_cached() == 1);
+
+		ioc.restart();
+		pool.alloc()->command(expect_pong, "PING");
+		REQUIRE(ioc.run_for(10s) > 0);
+		REQUIRE(tested == 2);
+		REQUIRE(pool.size() == 1);
+	}
+	SECTION("wait for connections when the pool is full")
+	{
+		std::vector<std::shared_ptr<Connection>> conns;
+		for (int i = 0 ; i < 3 ; i++)
+		{
+			conns.push_back(pool.alloc());
+			conns.back()->command(expect_pong, "PING");
+		}
+		REQUIRE(pool.size() == 2);
+
+		// The third connection gets its socket after the first one is released.
+		ioc.run_for(100ms);
+		REQUIRE(tested == 2);
+		conns.erase(conns.begin());
+
+		ioc.restart();
+		ioc.run_for(1s);
+		REQUIRE(tested == 3);
+		REQUIRE(pool.size() == 2);
+	}
+	SECTION("completion routines run in the strand of the caller")
+	{
+		auto strand = boost::asio::make_strand(ioc);
+		for (int i = 0 ; i < 2 ; i++)
+		{
+			pool.alloc(strand)->command([&tested, strand](Reply reply, std::error_code ec)
+			{
+				REQUIRE(!ec);
+				REQUIRE(strand.running_in_this_thread());
+				tested++;
+			}, "PING");
+
+			ioc.restart();
+			REQUIRE(ioc.run_for(10s) > 0);
+			REQUIRE(tested == i+1);
+		}
+
+		// the socket is kept in the cache of this thread
+		REQUIRE(pool.size() == 1);
+		REQUIRE(pool.thread_cached() == 1);
+	}
+	SECTION("each pool has its own thread caches")
+	{
+		Pool other{ioc, {boost::asio::ip::make_address("127.0.0.1"), 6379}};
+		pool.alloc()->command(expect_pong, "PING");
+		other.alloc()->command(expect_pong, "PING");
+		REQUIRE(ioc.run_for(10s) > 0);
+		REQUIRE(tested == 2);
+		REQUIRE(pool.thread_cached() == 1);
+		REQUIRE(other.thread_cached() == 1);
+
+		// only one thread has a cache by default
+		std::size_t cached_by_other_thread = 1;
+		std::thread{[&]{cached_by_other_thread = pool.thread_cached();}}.join();
+		REQUIRE(cached_by_other_thread == 0);
+	}
+	SECTION("waiting for too long")
+	{
+		auto c1 = pool.alloc(), c2 = pool.alloc(), c3 = pool.alloc();
+		c3->command([&tested](auto, std::error_code ec)
+		{
+			REQUIRE(ec == Error::timeout);
+			tested++;
+		}, "PING");
+
+		REQUIRE(ioc.run_for(10s) > 0);
+		REQUIRE(tested == 1);
+	}
+}
+
+TEST_CASE("destroy the pool before its sockets are connected", "[normal]")
+{
+	boost::asio::io_context ioc;
+
+	// The pool is destroyed with the connection, before async_connect() finishes.
+	// The socket connected afterwards is closed without touching the pool.
+	connect(ioc).reset();
+
+	using namespace std::chrono_literals;
+	ioc.run_for(10s);
+	REQUIRE(ioc.stopped());
+}
+
+TEST_CASE("sockets in thread caches are checked by maintenance", "[normal]")
+{
+	using namespace std::chrono_literals;
+
+	boost::asio::io_context ioc;
+	Pool pool{ioc, {boost::asio::ip::make_address("127.0.0.1"), 6379}, PoolSettings{
+		.health_check = 1s
+	}};
+	pool.start();
+
+	int tested = 0;
+	pool.alloc()->command([&tested](Reply reply, std::error_code ec)
+	{
+		REQUIRE(!ec);
+		tested++;
+	}, "PING");
+	while (tested == 0 && ioc.run_one_for(10s) > 0)
+		;
+	ioc.poll();
+	REQUIRE(tested == 1);
+	REQUIRE(pool.size() == 1);
+	REQUIRE(pool.thread_cached() == 1);
+
+	// The socket is not used for two health check intervals. It is taken out of the
+	// thread cache and checked by PING.
+	ioc.run_for(2500ms);
+	REQUIRE(pool.size() == 1);
+	REQUIRE(pool.thread_cached() == 0);
+	REQUIRE(pool.idle() == 1);
+}
+
+TEST_CASE("client side caching", "[normal]")
+{
+	using namespace std::chrono_literals;
+
+	boost::asio::io_context ioc;
+	Pool pool{ioc, {boost::asio::ip::make_address("127.0.0.1"), 6379}, PoolSettings{
+		.cache_prefixes = {"hrb-ut:"}
+	}};
+	pool.start();
+
+	auto cache = pool.cache();
+	REQUIRE(cache);
+	for (int i = 0 ; i < 100 && !cache->tracking() ; i++)
+		ioc.run_for(10ms);
+
+	// CLIENT TRACKING requires redis 6
+	if (!cache->tracking())
+		return;
+
+	std::string value;
+	auto get = [&value](Connection& db)
+	{
+		db.cached([&value](Reply reply, std::error_code ec)
+		{
+			REQUIRE(!ec);
+			value = reply.as_string();
+		}, {"hrb-ut:cached"}, CommandString{"GET hrb-ut:cached"});
+	};
+
+	auto db = pool.alloc();
+	db->command("SET hrb-ut:cached first");
+	get(*db);
+	ioc.run_for(100ms);
+	REQUIRE(value == "first");
+	REQUIRE(cache->size() == 1);
+
+	// served by the cache
+	auto hits = cache->stats().hits;
+	get(*db);
+	ioc.run_for(100ms);
+	REQUIRE(value == "first");
+	REQUIRE(cache->stats().hits == hits + 1);
+
+	// Change the key without invalidate(). The cached reply will be dropped
+	// when the invalidation message arrives.
+	auto other = connect(ioc, {boost::asio::ip::make_address("127.0.0.1"), 6379});
+	other->command("SET hrb-ut:cached second");
+	for (int i = 0 ; i < 100 && cache->size() > 0 ; i++)
+		ioc.run_for(10ms);
+	REQUIRE(cache->size() == 0);
+
+	get(*db);
+	ioc.run_for(100ms);
+	REQUIRE(value == "second");
+
+	// keys that are not tracked will not be cached
+	db->cached([](Reply, std::error_code){}, {"untracked"}, CommandString{"GET untracked"});
+	ioc.run_for(100ms);
+	REQUIRE(cache->size() == 1);
+
+	db->command("DEL hrb-ut:cached");
+	ioc.run_for(100ms);
+}
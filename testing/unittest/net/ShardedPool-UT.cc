@@ -0,0 +1,138 @@
+/*
+	Copyright © 2018 Wan Wai Ho <me@nestal.net>
+
+    This file is subject to the terms and conditions of the GNU General Public
+    License.  See the file COPYING in the main directory of the hearty_rabbit
+    distribution for more details.
+*/
+
+//
+// Created by nestal on 17/10/18.
+//
+
+#include <catch2/catch.hpp>
+
+#include "net/ShardedPool.hh"
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/address.hpp>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+using namespace hrb::redis;
+
+TEST_CASE("consistent hash ring", "[normal]")
+{
+	HashRing four{4}, five{5};
+	REQUIRE(four.size() == 4);
+
+	std::vector<int> count(four.size());
+	int moved = 0;
+	for (int i = 0 ; i < 10000 ; i++)
+	{
+		auto user = "user" + std::to_string(i);
+		auto shard = four.find(user);
+		REQUIRE(shard < four.size());
+		REQUIRE(four.find(user) == shard);
+		count[shard]++;
+
+		// Keys only move to the new shard
+		if (auto after = five.find(user); after != shard)
+		{
+			REQUIRE(after == 4);
+			moved++;
+		}
+	}
+
+	for (auto c : count)
+		REQUIRE(c > 1500);
+	REQUIRE(moved > 1000);
+	REQUIRE(moved < 3000);
+
+	REQUIRE(HashRing{1}.find("anything") == 0);
+}
+
+// Start another redis-server at port 6380 to run this test, e.g. "redis-server --port 6380"
+TEST_CASE("sharded pool", "[normal]")
+{
+	using namespace std::chrono_literals;
+
+	boost::asio::io_context ioc;
+	ShardedPool pool{ioc, {
+		{boost::asio::ip::make_address("127.0.0.1"), 6379},
+		{boost::asio::ip::make_address("127.0.0.1"), 6380}
+	}};
+	REQUIRE(pool.size() == 2);
+
+	auto db = pool.alloc();
+	REQUIRE(db->size() == 2);
+
+	// find users in both shards
+	std::vector<std::string> users;
+	for (int i = 0 ; users.size() < 2 ; i++)
+	{
+		auto user = "user" + std::to_string(i);
+		if (db->find(user) == users.size())
+			users.push_back(user);
+	}
+
+	int tested = 0;
+	for (auto&& user : users)
+	{
+		auto shard = db->find(user);
+		auto key = "shard-ut:" + user;
+		db->at(user).command("SET %b 1", key.data(), key.size());
+
+		// the key is only in the shard of the user
+		for (auto i = 0U ; i < db->size() ; i++)
+			db->shard(i).command([&tested, expected = (i == shard)](auto&& reply, std::error_code ec)
+			{
+				REQUIRE(!ec);
+				REQUIRE(reply.as_int() == (expected ? 1 : 0));
+				tested++;
+			}, "EXISTS %b", key.data(), key.size());
+
+		db->at(user).command("DEL %b", key.data(), key.size());
+	}
+
+	REQUIRE(ioc.run_for(10s) > 0);
+	REQUIRE(tested == 4);
+}
+
+TEST_CASE("read from replicas", "[normal]")
+{
+	using namespace std::chrono_literals;
+
+	// Use the primary as its own replica. Only the routing is tested here.
+	boost::asio::ip::tcp::endpoint local{boost::asio::ip::make_address("127.0.0.1"), 6379};
+	boost::asio::io_context ioc;
+	ShardedPool pool{ioc, {local}, {}, ReplicaSettings{
+		.endpoints = {{local, local}},
+		.read_your_writes = 1h
+	}};
+
+	auto db = pool.alloc();
+	REQUIRE(&db->read("sumsum") != &db->at("sumsum"));
+	REQUIRE(&db->read("sumsum") == &db->read("siuyung"));
+
+	// the next session reads from the other replica
+	auto next = pool.alloc();
+	REQUIRE(&next->read("sumsum") != &next->at("sumsum"));
+
+	// read your writes
+	db->at("sumsum").invalidate("coll:sumsum:");
+	REQUIRE(&db->read("sumsum") == &db->at("sumsum"));
+	REQUIRE(&next->read("sumsum") != &next->at("sumsum"));
+
+	int tested = 0;
+	next->read("sumsum").command([&tested](auto&& reply, std::error_code ec)
+	{
+		REQUIRE(!ec);
+		REQUIRE(reply.as_status() == "PONG");
+		tested++;
+	}, "PING");
+	REQUIRE(ioc.run_for(10s) > 0);
+	REQUIRE(tested == 1);
+}
@@ -16,6 +16,9 @@
 
 #include <nlohmann/json.hpp>
 
+#include <openssl/opensslv.h>
+
+#include <algorithm>
 #include <fstream>
 #include <config.hh>
 
@@ -51,6 +54,12 @@ TEST_CASE( "Load normal.json", "[normal]" )
 	REQUIRE(cfg.private_key() == (current_src/"key.pem").string());
 	REQUIRE(cfg.cert_chain()  == (current_src/"certificate.pem").string());
 	REQUIRE(cfg.web_root()    == "/usr/lib/hearty_rabbit");
+	REQUIRE(cfg.blob_volumes().size() == 2);
+	REQUIRE(cfg.blob_volumes()[0].path == "/var/hearty_rabbit");
+	REQUIRE(cfg.blob_volumes()[0].weight == 1.0);
+	REQUIRE(cfg.blob_volumes()[1].path == "/mnt/nvme/hearty_rabbit");
+	REQUIRE(cfg.blob_volumes()[1].weight == 2.5);
+	REQUIRE(cfg.rebalance_volumes());
 	REQUIRE(cfg.server_name() == "example.com");
 	REQUIRE(cfg.listen_https().address() == boost::asio::ip::make_address("0.0.0.0"));
 	REQUIRE(cfg.listen_http().address() == boost::asio::ip::make_address("0.0.0.0"));
@@ -58,6 +67,35 @@ TEST_CASE( "Load normal.json", "[normal]" )
 	REQUIRE(cfg.listen_http().port() == 8080);
 	REQUIRE(cfg.redis().address() == boost::asio::ip::make_address("192.168.1.1"));
 	REQUIRE(cfg.redis().port() == 9181);
+	REQUIRE(cfg.redis_shards().size() == 2);
+	REQUIRE(cfg.redis_shards().front() == cfg.redis());
+	REQUIRE(cfg.redis_shards().back().address() == boost::asio::ip::make_address("192.168.1.2"));
+	REQUIRE(cfg.redis_replicas().size() == 2);
+	REQUIRE(cfg.redis_replicas().front().size() == 2);
+	REQUIRE(cfg.redis_replicas().front().back().address() == boost::asio::ip::make_address("192.168.1.12"));
+	REQUIRE(cfg.redis_replicas().back().empty());
+	REQUIRE(cfg.redis_read_your_writes() == std::chrono::milliseconds{500});
+	REQUIRE(cfg.redis_max_batch() == 32);
+	REQUIRE(cfg.redis_min_connections() == 2);
+	REQUIRE(cfg.redis_max_connections() == 16);
+	REQUIRE(cfg.redis_connect_timeout() == std::chrono::milliseconds{500});
+	REQUIRE(cfg.redis_idle_timeout() == std::chrono::minutes{5});
+	REQUIRE_FALSE(cfg.redis_client_cache());
+	REQUIRE(cfg.redis_cache_max_age() == std::chrono::seconds{10});
+	REQUIRE(cfg.redis_cache_max_entries() == 65536);
+	REQUIRE(cfg.rendition_threads() == 4);
+	REQUIRE(cfg.opencv_threads() == 2);
+	REQUIRE(cfg.async_blob_read());
+	REQUIRE(cfg.blob_read_threads() == 8);
+	REQUIRE(cfg.pack_threshold() == 64 * 1024);
+	REQUIRE(cfg.scrub_rate() == 20 * 1024 * 1024);
+	REQUIRE(cfg.scrub_interval() == std::chrono::hours{24});
+	REQUIRE(cfg.scrub_quarantine());
+	REQUIRE(cfg.gc_interval() == std::chrono::hours{12});
+	REQUIRE(cfg.gc_grace() == std::chrono::hours{48});
+	REQUIRE(cfg.gc_rate() == 100);
+	REQUIRE(cfg.gc_dry_run());
+	REQUIRE(cfg.stats_interval() == std::chrono::minutes{5});
 	REQUIRE(cfg.upload_limit() == 10*1024*1024);
 	REQUIRE(cfg.session_length() == std::chrono::hours{1});
 	REQUIRE(cfg.user_id() == 65535);
@@ -90,6 +128,28 @@ TEST_CASE( "Web root is .", "[normal]" )
 	REQUIRE(equivalent(subject.web_root(), current_src));
 	REQUIRE(subject.redis().address() == boost::asio::ip::make_address("127.0.0.1"));
 	REQUIRE(subject.redis().port() == 6379);
+	REQUIRE(subject.redis_shards().size() == 1);
+	REQUIRE(subject.redis_max_batch() == 64);
+	REQUIRE(subject.redis_client_cache());
+	REQUIRE(subject.rendition_threads() == 2);
+	REQUIRE(subject.opencv_threads() == 1);
+	REQUIRE(subject.rendition_backlog() == 256);
+	REQUIRE(subject.meta_cache_entries() == 65536);
+	REQUIRE(subject.mmap_cache_bytes() == 256 * 1024 * 1024);
+	REQUIRE_FALSE(subject.ktls());
+	REQUIRE_FALSE(subject.async_blob_read());
+	REQUIRE(subject.blob_read_threads() == 4);
+	REQUIRE(subject.pack_threshold() == 0);
+	REQUIRE(subject.scrub_rate() == 0);
+	REQUIRE(subject.scrub_interval() == std::chrono::hours{168});
+	REQUIRE_FALSE(subject.scrub_quarantine());
+	REQUIRE(subject.gc_interval() == std::chrono::hours{0});
+	REQUIRE(subject.gc_grace() == std::chrono::hours{24});
+	REQUIRE(subject.gc_rate() == 10);
+	REQUIRE_FALSE(subject.gc_dry_run());
+	REQUIRE(subject.stats_interval() == std::chrono::minutes{60});
+	REQUIRE(subject.blob_volumes().empty());
+	REQUIRE_FALSE(subject.rebalance_volumes());
 }
 
 TEST_CASE( "Absolute path for certs", "[normal]" )
@@ -114,6 +174,19 @@ TEST_CASE( "Set upload limit to 1.5MB", "[normal]" )
 	REQUIRE(subject.group_id() == 955);
 }
 
+TEST_CASE( "Kernel TLS needs OpenSSL 3", "[normal]" )
+{
+	auto ktls_json = (current_src / "ktls.json").string();
+
+	const char *argv[] = {"hearty_rabbit", "--cfg", ktls_json.c_str()};
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	Configuration subject{sizeof(argv)/sizeof(argv[1]), argv, nullptr};
+	REQUIRE(subject.ktls());
+#else
+	REQUIRE_THROWS_AS(Configuration(sizeof(argv)/sizeof(argv[1]), argv, nullptr), Configuration::Error);
+#endif
+}
+
 TEST_CASE( "Multiple renditions", "[normal]" )
 {
 	auto file = (current_src / "rendition.json").string();
@@ -125,6 +198,33 @@ TEST_CASE( "Multiple renditions", "[normal]" )
 
 	auto thumbnail = subject.renditions().find("thumbnail");
 	REQUIRE(thumbnail.square_crop);
+	REQUIRE(thumbnail.eager);
+	REQUIRE_FALSE(def_rendition.eager);
+	REQUIRE(thumbnail.formats == std::vector<ImageFormat>{ImageFormat::webp, ImageFormat::avif});
+	REQUIRE(def_rendition.formats.empty());
+
+	auto eager = subject.renditions().eager_renditions();
+	std::sort(eager.begin(), eager.end());
+	REQUIRE(eager == std::vector<std::string>{"thumbnail", "thumbnail.avif", "thumbnail.webp"});
+
+	// Renditions in other formats are stored in separate files
+	REQUIRE(subject.renditions().valid("thumbnail.webp"));
+	REQUIRE_FALSE(subject.renditions().valid("thumbnail.jpg"));
+	REQUIRE_FALSE(subject.renditions().valid("default.webp"));
+	REQUIRE(subject.renditions().find("thumbnail.webp").square_crop);
+	REQUIRE(RenditionSetting::split("thumbnail.webp") == std::make_pair(std::string_view{"thumbnail"}, std::optional{ImageFormat::webp}));
+	REQUIRE(RenditionSetting::file_name("thumbnail", ImageFormat::avif) == "thumbnail.avif");
+	REQUIRE(RenditionSetting::file_name("thumbnail", std::nullopt) == "thumbnail");
+
+	// Only the formats listed explicitly in the Accept header are sent
+	auto& rend = subject.renditions();
+	REQUIRE(rend.negotiate("thumbnail", "image/avif,image/webp,image/apng,image/*,*/*;q=0.8") == ImageFormat::webp);
+	REQUIRE(rend.negotiate("thumbnail", "image/avif;q=0.9, image/webp;q=0.5") == ImageFormat::avif);
+	REQUIRE(rend.negotiate("thumbnail", "image/WebP") == ImageFormat::webp);
+	REQUIRE(rend.negotiate("thumbnail", "image/webp;q=0") == std::nullopt);
+	REQUIRE(rend.negotiate("thumbnail", "image/png,image/*;q=0.8,*/*;q=0.5") == std::nullopt);
+	REQUIRE(rend.negotiate("thumbnail", "") == std::nullopt);
+	REQUIRE(rend.negotiate("default", "image/webp") == std::nullopt);
 
 	REQUIRE(subject.listen_https().port() != 8964);
 	REQUIRE(subject.listen_http().port() != 6489);
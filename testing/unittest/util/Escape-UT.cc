@@ -42,6 +42,15 @@ TEST_CASE( "split left and right", "[normal]" )
 	std::string option_only{"?option"};
 }
 
+TEST_CASE("trim", "[normal]")
+{
+	REQUIRE(trim(" \tvalue \t") == "value");
+	REQUIRE(trim("two words ") == "two words");
+	REQUIRE(trim(" \t ").empty());
+	REQUIRE(trim("").empty());
+	REQUIRE(trim("//user/coll/", "/") == "user/coll");
+}
+
 TEST_CASE("get_fields_from_form_string", "[normal]")
 {
 	SECTION("simple 2 fields")